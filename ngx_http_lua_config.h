@@ -0,0 +1,117 @@
+
+/*
+ * Copyright (C) Hanada
+ */
+
+
+#ifndef _NGX_HTTP_LUA_CONFIG_H_INCLUDED_
+#define _NGX_HTTP_LUA_CONFIG_H_INCLUDED_
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include "ngx_lua_config_common.h"
+
+
+/*
+ * Read access to lua_config keys and lua_upstream blocks for other nginx
+ * modules.  Key handles are resolved once at configuration time, while
+ * the http block is parsed or in a postconfiguration handler; lookups
+ * through them do not hash the name and do not go through variables.
+ *
+ * The structures below are read-only for other modules.
+ */
+
+
+#define NGX_HTTP_LUA_CONFIG_API_VERSION  8
+
+
+typedef struct {
+    ngx_http_complex_value_t    source;
+    ngx_hash_combined_t         hash;        /* ngx_http_complex_value_t */
+    ngx_http_complex_value_t   *default_value;
+} ngx_http_lua_config_map_t;
+
+
+typedef struct {
+    ngx_http_complex_value_t   *value;       /* complex value */
+    ngx_http_complex_value_t   *filter;      /* filter complex value */
+    ngx_http_lua_config_map_t  *map;         /* lua_config_map, no value */
+    ngx_uint_t                  negative;    /* negative filter */
+    ngx_uint_t                  index;       /* interned slot, 0 if dynamic */
+    uint32_t                    crc;         /* running crc32 of the
+                                                directive's arguments */
+    u_char                     *file;        /* where the directive is */
+    ngx_uint_t                  line;
+#if (NGX_PCRE)
+    ngx_http_regex_t           *regex;       /* matched against filter */
+    ngx_uint_t                  regex_index; /* per request result slot */
+#endif
+} ngx_http_lua_config_cmd_t;
+
+
+typedef ngx_lua_config_keyval_t  ngx_http_lua_config_keyval_t;
+
+
+typedef struct {
+    ngx_str_node_t              sn;        /* name, crc32 as the tree key */
+    ngx_uint_t                  hash;      /* ngx_hash_key() of name */
+    ngx_uint_t                  defined;   /* by a lua_config directive */
+} ngx_http_lua_config_key_t;
+
+
+typedef ngx_lua_config_server_t  ngx_http_lua_upstream_server_t;
+
+
+typedef struct {
+    ngx_str_t                   name;
+    ngx_array_t                *servers;   /* array of
+                                              ngx_http_lua_upstream_server_t */
+    ngx_array_t                *keys;      /* array of
+                                              ngx_http_lua_config_keyval_t */
+    ngx_hash_t                  hash;      /* keys by name */
+
+    uint32_t                    crc_servers; /* running crc32 of name and
+                                                servers, not finalized */
+    uint32_t                    crc;       /* final crc32 unless dynamic */
+    ngx_uint_t                  dynamic;   /* keys depend on the request */
+
+    ngx_lua_config_fingerprint_t  fp_servers; /* running fingerprint of
+                                                 name and servers */
+    uint64_t                    fingerprint; /* final value unless dynamic */
+
+    ngx_http_upstream_srv_conf_t  *upstream; /* export=upstream, or NULL */
+
+    ngx_uint_t                  inflight;  /* first in-flight counter,
+                                              see lua_upstream_inflight */
+
+    ngx_uint_t                  resolve;   /* servers with "resolve" */
+} ngx_http_lua_upstream_t;
+
+
+/* returns the handle of the lua_config key "name", creating it if needed */
+ngx_http_lua_config_key_t *ngx_http_lua_config_key(ngx_conf_t *cf,
+    ngx_str_t *name);
+
+/* NGX_OK, NGX_DECLINED if the key has no value here, or NGX_ERROR */
+ngx_int_t ngx_http_lua_config_get(ngx_http_request_t *r,
+    ngx_http_lua_config_key_t *key, ngx_str_t *value);
+
+/* the lua_upstream block visible in the request's server, or NULL */
+ngx_http_lua_upstream_t *ngx_http_lua_config_upstream(ngx_http_request_t *r,
+    ngx_str_t *name);
+
+ngx_int_t ngx_http_lua_config_upstream_get(ngx_http_request_t *r,
+    ngx_http_lua_upstream_t *us, ngx_str_t *key, ngx_str_t *value);
+ngx_int_t ngx_http_lua_config_upstream_crc32(ngx_http_request_t *r,
+    ngx_http_lua_upstream_t *us, uint32_t *crc);
+
+/* the configuration epoch of the worker, as ngx.lua_config.epoch() */
+ngx_uint_t ngx_http_lua_config_epoch(void);
+
+
+extern ngx_module_t  ngx_http_lua_config_module;
+
+
+#endif /* _NGX_HTTP_LUA_CONFIG_H_INCLUDED_ */
@@ -12,50 +12,365 @@
 
 #include <ngx_core.h>
 #include <ngx_http.h>
+#include <ngx_sha1.h>
 #include <lauxlib.h>
 #include "ngx_http_lua_api.h"
+#include "ngx_http_lua_config.h"
 
 
 ngx_module_t  ngx_http_lua_config_module;
 
 
 typedef struct {
-    ngx_http_complex_value_t   *value;       /* complex value */
-    ngx_http_complex_value_t   *filter;      /* filter complex value */
-    ngx_uint_t                  negative;    /* negative filter */
-} ngx_http_lua_config_cmd_t;
+    ngx_hash_keys_arrays_t      keys;
+    ngx_http_lua_config_map_t  *map;
+    uint32_t                   *crc;         /* of the lua_config_map cmd */
+    ngx_uint_t                  hostnames;   /* unsigned  hostnames:1 */
+} ngx_http_lua_config_map_conf_t;
 
 
 typedef struct {
-    ngx_str_t                   key;
-    ngx_array_t                *cmds;
-} ngx_http_lua_config_keyval_t;
+    uint64_t                    fingerprint; /* of a scope's definitions */
+    ngx_uint_t                  epoch;
+} ngx_http_lua_config_epoch_t;
+
+
+/*
+ * log-linear latency histogram in nanoseconds: values below 4 have a
+ * bucket each, every following power of two is split into 4 buckets
+ */
+
+#define NGX_HTTP_LUA_CONFIG_STATS_BUCKETS     128
+
+
+typedef struct {
+    uint64_t                    count;
+    uint64_t                    sum;
+    uint64_t                    max;
+    uint32_t                    buckets[NGX_HTTP_LUA_CONFIG_STATS_BUCKETS];
+} ngx_http_lua_config_histogram_t;
+
+
+typedef struct {
+    ngx_str_node_t              sn;
+    ngx_http_lua_config_histogram_t  lookup;
+    ngx_http_lua_config_histogram_t  filter; /* conditions and maps */
+} ngx_http_lua_config_stats_t;
+
+
+/* static encodings of a lua_upstream block or a scope, by address */
+
+typedef struct {
+    ngx_rbtree_node_t           node;
+    ngx_str_t                   serialized[NGX_LUA_CONFIG_NFORMATS];
+} ngx_http_lua_config_serialized_t;
+
+
+/*
+ * the "data" of the definition chains at runtime; the conditions and
+ * maps are timed into "filter" while a sampled lookup is timed, so
+ * nothing has to be undone if a Lua error unwinds the lookup
+ */
+
+typedef struct {
+    ngx_http_request_t               *request;
+    ngx_http_lua_config_histogram_t  *filter;
+} ngx_http_lua_config_eval_t;
+
+
+/*
+ * runtime overrides of the values of keys, by key, in a shared memory
+ * zone; of two changes of a key the one with the greater version wins,
+ * then the one with the greater origin, so that nodes which receive
+ * the same changes in any order end up with the same values
+ */
+
+typedef struct {
+    ngx_str_node_t              sn;        /* key */
+    ngx_str_t                   value;
+    uint64_t                    version;
+    uint32_t                    origin;    /* node that made the change */
+    ngx_uint_t                  deleted;   /* kept to order later changes */
+    uint64_t                    updated;   /* msec, when applied here */
+    u_char                      data[1];   /* key, then value */
+} ngx_http_lua_config_override_t;
+
+
+typedef struct {
+    ngx_rbtree_t                rbtree;
+    ngx_rbtree_node_t           sentinel;
+    uint64_t                    clock;     /* greatest version seen */
+    uint32_t                    digest;    /* xor of the overrides' crc32 */
+    ngx_uint_t                  noverrides; /* not deleted */
+    ngx_uint_t                  changes;
+    uint64_t                    last_applied; /* msec, of a peer's change */
+    uint64_t                    lag;       /* msec, of that change */
+    ngx_atomic_t                sent;
+    ngx_atomic_t                received;
+    ngx_atomic_t                applied;
+    ngx_atomic_t                stale;
+    ngx_atomic_t                rejected;
+    ngx_atomic_t                undefined; /* changes of unknown keys */
+    ngx_atomic_t                dropped;   /* socket buffer was full */
+} ngx_http_lua_config_override_shctx_t;
+
+
+/*
+ * copy of the overrides in every worker, so that lookups do not take
+ * the lock of the zone; rebuilt when the changes of the zone move
+ */
+
+typedef struct {
+    ngx_str_node_t              sn;        /* key */
+    ngx_str_t                   value;
+    u_char                      data[1];   /* key, then value */
+} ngx_http_lua_config_override_copy_t;
+
+
+typedef struct {
+    ngx_pool_t                 *pool;
+    ngx_rbtree_t                rbtree;
+    ngx_rbtree_node_t           sentinel;
+    ngx_uint_t                  changes;   /* of the zone when copied */
+} ngx_http_lua_config_override_cache_t;
+
+
+/*
+ * addresses of the names of lua_upstream servers with "resolve", by
+ * name, in a shared memory zone; the first worker resolves the names
+ * and publishes their addresses for all workers
+ */
+
+typedef struct {
+    ngx_str_node_t              sn;        /* name */
+    ngx_uint_t                  naddrs;
+    ngx_str_t                  *addrs;     /* sorted, without port */
+    u_char                      data[1];   /* name */
+} ngx_http_lua_config_resolved_t;
+
+
+typedef struct {
+    ngx_rbtree_t                rbtree;
+    ngx_rbtree_node_t           sentinel;
+    ngx_atomic_t                changes;   /* sets of addresses published */
+} ngx_http_lua_config_resolve_shctx_t;
+
+
+typedef struct {
+    ngx_str_t                   name;
+    ngx_event_t                 event;     /* next query, first worker only */
+} ngx_http_lua_config_resolve_t;
+
+
+/*
+ * copy of the published addresses in every worker, and the servers of
+ * the upstreams expanded from it as they are asked for, so that neither
+ * takes the lock of the zone; rebuilt when the changes of the zone move
+ */
+
+typedef struct {
+    ngx_rbtree_node_t              node;      /* key is the upstream */
+    ngx_array_t                   *servers;
+    uint32_t                       crc;
+    ngx_uint_t                     fingerprinted;
+    ngx_lua_config_fingerprint_t   fp;
+} ngx_http_lua_config_resolved_us_t;
+
+
+typedef struct {
+    ngx_pool_t                 *pool;
+    ngx_rbtree_t                rbtree;    /* ngx_http_lua_config_resolved_t */
+    ngx_rbtree_node_t           sentinel;
+    ngx_rbtree_t                upstreams;
+    ngx_rbtree_node_t           us_sentinel;
+    ngx_atomic_uint_t           changes;   /* of the zone when copied */
+} ngx_http_lua_config_resolve_cache_t;
+
+
+#define NGX_HTTP_LUA_CONFIG_RESOLVE_RETRY     5000
+
+
+#define NGX_HTTP_LUA_CONFIG_REPL_MAGIC        "LCFGREPL"
+#define NGX_HTTP_LUA_CONFIG_REPL_VERSION      1
+
+#define NGX_HTTP_LUA_CONFIG_REPL_DELETED      0x01
+
+#define NGX_HTTP_LUA_CONFIG_REPL_MAX_KEY      255
+#define NGX_HTTP_LUA_CONFIG_REPL_MAX_VALUE    4096
+#define NGX_HTTP_LUA_CONFIG_REPL_SIGNATURE    20    /* HMAC-SHA1 */
+
+/* intervals a delete marker is kept for */
+#define NGX_HTTP_LUA_CONFIG_REPL_KEEP_DELETED 10
+
+/* datagrams sent at once when all overrides are sent again */
+#define NGX_HTTP_LUA_CONFIG_REPL_BATCH        32
+
+
+/*
+ * replication datagram, one change each, integers in network byte
+ * order; followed by the key, the value and the signature of all that
+ * precedes it
+ */
+
+typedef struct {
+    u_char                      magic[8];
+    uint32_t                    version_hi;
+    uint32_t                    version_lo;
+    uint32_t                    origin;
+    uint16_t                    protocol;
+    uint16_t                    flags;
+    uint16_t                    key_len;
+    uint16_t                    reserved;
+    uint32_t                    value_len;
+} ngx_http_lua_config_repl_header_t;
+
+
+/* the resend of all overrides, in the first worker */
+
+typedef struct {
+    ngx_str_t                   key;       /* last one sent, empty at the
+                                              start of a pass */
+    uint32_t                    hash;
+    ngx_msec_t                  delay;     /* between the batches */
+    u_char                      data[NGX_HTTP_LUA_CONFIG_REPL_MAX_KEY];
+} ngx_http_lua_config_repl_pass_t;
+
+
+#define NGX_HTTP_LUA_CONFIG_REPL_MAX_SIZE                                     \
+    (sizeof(ngx_http_lua_config_repl_header_t)                                \
+     + NGX_HTTP_LUA_CONFIG_REPL_MAX_KEY + NGX_HTTP_LUA_CONFIG_REPL_MAX_VALUE  \
+     + NGX_HTTP_LUA_CONFIG_REPL_SIGNATURE)
+
+
+typedef struct {
+    uint32_t                    key_offset;
+    uint32_t                    key_len;
+    uint32_t                    value_offset;
+    uint32_t                    value_len;
+} ngx_http_lua_config_file_entry_t;
 
 
 typedef struct {
-    ngx_str_t                   host;
-    ngx_uint_t                  port;
-    ngx_uint_t                  level;
-    ngx_uint_t                  weight;
-    ngx_uint_t                  down;
-} ngx_http_lua_upstream_server_t;
+    u_char                      magic[8];
+    uint32_t                    version;
+    uint32_t                    byte_order;
+    uint32_t                    nentries;
+    uint32_t                    reserved;
+} ngx_http_lua_config_file_header_t;
 
 
 typedef struct {
     ngx_str_t                   name;
-    ngx_array_t                *servers;   /* array of ngx_http_lua_upstream_server_t */
-    ngx_array_t                *keys;      /* array of ngx_http_lua_config_keyval_t */
-} ngx_http_lua_upstream_t;
+    ngx_str_t                   path;
+    u_char                     *start;
+    size_t                      size;
+    ngx_uint_t                  nentries;
+    ngx_http_lua_config_file_entry_t  *entries;
+    ngx_http_complex_value_t   *key;
+} ngx_http_lua_config_file_t;
+
+
+#define NGX_HTTP_LUA_CONFIG_FILE_MAGIC        "LCFGFILE"
+#define NGX_HTTP_LUA_CONFIG_FILE_VERSION      1
+#define NGX_HTTP_LUA_CONFIG_FILE_BYTE_ORDER   0x01020304
 
 
 typedef struct {
     ngx_array_t                *keys;      /* array of ngx_keyval_t */
+    ngx_lua_config_init_node_t  *init_tree;
+    ngx_array_t                *files;     /* array of
+                                              ngx_http_lua_config_file_t */
+    ngx_str_t                   snapshot;
+    u_char                     *snapshot_buf; /* until init_module */
+    size_t                      snapshot_size;
+    ngx_uint_t                  fingerprint_algorithm;
+#if (NGX_PCRE)
+    ngx_uint_t                  nregex;    /* regex conditions */
+#endif
+    ngx_flag_t                  regex_cache;
+    ngx_flag_t                  warn_shadowed;
+    ngx_uint_t                  stats_sample; /* 1/N requests, 0 is off */
+
+    /* runtime overrides and their replication to the peers */
+    ngx_shm_zone_t             *override_zone;
+    ngx_addr_t                 *repl_listen;
+    ngx_array_t                *repl_peers; /* array of ngx_addr_t */
+    ngx_str_t                   repl_secret;
+    ngx_msec_t                  repl_interval;
+    uint32_t                    repl_origin;
+
+    /* in-flight requests of lua_upstream servers */
+    ngx_flag_t                  inflight;
+    ngx_uint_t                  ninflight; /* counters of all servers */
+    ngx_shm_zone_t             *inflight_zone;
+
+    /* names of lua_upstream servers with "resolve" */
+    ngx_shm_zone_t             *resolve_zone;
+    ngx_array_t                *resolve;   /* array of
+                                              ngx_http_lua_config_resolve_t */
+    ngx_resolver_t             *resolver;
+    ngx_msec_t                  resolver_timeout;
+
+    /* key handles, by name */
+    ngx_rbtree_t                key_tree;
+    ngx_rbtree_node_t           key_sentinel;
+    ngx_array_t                *key_handles; /* array of
+                                                ngx_http_lua_config_key_t * */
+
+    /* compiled values and conditions, by source string */
+    ngx_lua_config_values_t     values;
+
+    /* server level configurations, by server_name */
+    ngx_rbtree_t                server_tree;
+    ngx_rbtree_node_t           server_sentinel;
+
+    ngx_uint_t                  epoch;     /* of this configuration */
+    ngx_array_t                *scopes;    /* array of
+                                              ngx_http_lua_config_loc_conf_t *
+                                              waiting for their epochs */
+
+    /* http level configurations, for lookups outside of a location */
+    void                       *srv_conf;  /* ngx_http_lua_config_srv_conf_t */
+    void                       *loc_conf;  /* ngx_http_lua_config_loc_conf_t */
 } ngx_http_lua_config_main_conf_t;
 
 
+#define NGX_HTTP_LUA_CONFIG_SNAPSHOT_MAGIC    "LCFGSNAP"
+#define NGX_HTTP_LUA_CONFIG_SNAPSHOT_VERSION  2
+#define NGX_HTTP_LUA_CONFIG_SNAPSHOT_BYTE_ORDER  0x01020304
+
+#define NGX_HTTP_LUA_CONFIG_SNAPSHOT_CRC      0x01
+
+
+/*
+ * snapshot file layout, all integers are uint32_t in host byte order,
+ * as marked by byte_order in the header, every string is stored as its
+ * length followed by the data padded to 4 bytes:
+ *
+ *     header
+ *     ninit       x { key, value }
+ *     nkeys       x { key, value }
+ *     nupstreams  x { name, flags, crc32, nservers,
+ *                     nservers x { host, port, level, weight, down },
+ *                     nkeys x { key, value } }
+ */
+
+typedef struct {
+    u_char                      magic[8];
+    uint32_t                    version;
+    uint32_t                    byte_order;
+    uint32_t                    size;
+    uint32_t                    ninit;
+    uint32_t                    nkeys;
+    uint32_t                    nupstreams;
+} ngx_http_lua_config_snapshot_header_t;
+
+
 typedef struct {
     ngx_array_t                *upstreams; /* array of ngx_http_lua_upstream_t */
     ngx_hash_t                  hash;
+    uint64_t                    definitions; /* fingerprint of the
+                                                upstreams' definitions */
 } ngx_http_lua_config_srv_conf_t;
 
 
@@ -64,39 +379,350 @@ typedef struct {
     ngx_hash_t                  hash;
     ngx_uint_t                  hash_max_size;
     ngx_uint_t                  hash_bucket_size;
+
+    ngx_lua_config_fingerprint_t  fp_static; /* running fingerprint of
+                                                static keys */
+    ngx_str_t                   fingerprint; /* formatted, unless dynamic */
+    ngx_array_t                *dynamic;   /* array of
+                                              ngx_http_lua_config_keyval_t *
+                                              that depend on the request */
+
+    uint64_t                    definitions; /* fingerprint of the keys'
+                                                and upstreams' definitions */
+    ngx_uint_t                  epoch;     /* last change of definitions */
 } ngx_http_lua_config_loc_conf_t;
 
 
+#if (NGX_PCRE)
+
+typedef struct {
+    ngx_int_t                   rc;        /* NGX_OK or NGX_DECLINED */
+    ngx_uint_t                  done;
+    int                        *captures;
+    ngx_uint_t                  ncaptures;
+    u_char                     *captures_data;
+} ngx_http_lua_config_regex_result_t;
+
+#endif
+
+
+typedef struct {
+    ngx_http_lua_config_loc_conf_t  *fingerprint_conf;
+    ngx_uint_t                  fingerprint_changes; /* of the overrides */
+    ngx_str_t                   fingerprint;
+    u_char                      fingerprint_buf[NGX_LUA_CONFIG_FINGERPRINT_LEN];
+#if (NGX_PCRE)
+    ngx_http_lua_config_regex_result_t  *regex; /* lmcf->nregex results */
+#endif
+} ngx_http_lua_config_ctx_t;
+
+
+#define NGX_HTTP_LUA_CONFIG_SCOPE_MAIN        0
+#define NGX_HTTP_LUA_CONFIG_SCOPE_SRV         1
+#define NGX_HTTP_LUA_CONFIG_SCOPE_LOC         2
+
+/*
+ * any greater scope is a pointer to the ngx_http_lua_config_server_t
+ * of a server given by name, as in "server:example.com"
+ */
+
+#define ngx_http_lua_config_scope_named(scope)                                \
+    ((scope) > NGX_HTTP_LUA_CONFIG_SCOPE_LOC)
+
+
+typedef struct {
+    ngx_str_node_t              sn;        /* server_name */
+    void                       *srv_conf;  /* ngx_http_lua_config_srv_conf_t */
+    void                       *loc_conf;  /* ngx_http_lua_config_loc_conf_t */
+} ngx_http_lua_config_server_t;
+
+
 static ngx_int_t ngx_http_lua_config_add_variables(ngx_conf_t *cf);
 static char *ngx_http_lua_config_directive(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
 static char *ngx_http_lua_init_config_directive(ngx_conf_t *cf,
     ngx_command_t *cmd, void *conf);
-
+static char *ngx_http_lua_config_snapshot(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static char *ngx_http_lua_config_file(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static ngx_int_t ngx_http_lua_config_file_map(ngx_conf_t *cf,
+    ngx_http_lua_config_file_t *file);
+static void ngx_http_lua_config_file_unmap(void *data);
+static ngx_int_t ngx_http_lua_config_file_find(ngx_http_lua_config_file_t *file,
+    u_char *key, size_t len, ngx_str_t *value);
+
+static ngx_http_lua_config_cmd_t *ngx_http_lua_config_add_cmd(ngx_conf_t *cf,
+    ngx_http_lua_config_loc_conf_t *llcf, ngx_str_t *name);
+static char *ngx_http_lua_config_map_block(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static int ngx_libc_cdecl ngx_http_lua_config_map_cmp_dns_wildcards(
+    const void *one, const void *two);
+static char *ngx_http_lua_config_map(ngx_conf_t *cf, ngx_command_t *dummy,
+    void *conf);
+static ngx_int_t ngx_http_lua_config_map_find(ngx_http_request_t *r,
+    ngx_http_lua_config_map_t *map, ngx_http_complex_value_t **cv);
+static ngx_int_t ngx_http_lua_config_parse_filter(ngx_conf_t *cf,
+    ngx_http_lua_config_cmd_t *lcmd, ngx_str_t *arg);
+static ngx_http_complex_value_t *ngx_http_lua_config_intern_value(
+    ngx_conf_t *cf, ngx_str_t *value, ngx_uint_t *index);
+static ngx_int_t ngx_http_lua_config_eval_filter(ngx_http_request_t *r,
+    ngx_http_lua_config_cmd_t *cmd);
+#if (NGX_PCRE)
+static ngx_uint_t ngx_http_lua_config_next_regex(ngx_conf_t *cf);
+static ngx_int_t ngx_http_lua_config_regex_exec(ngx_http_request_t *r,
+    ngx_http_lua_config_cmd_t *cmd);
+#endif
+static ngx_http_lua_config_ctx_t *ngx_http_lua_config_get_ctx(
+    ngx_http_request_t *r);
+static ngx_int_t ngx_http_lua_config_add_key_variables(ngx_conf_t *cf,
+    ngx_http_lua_config_main_conf_t *lmcf);
+static ngx_int_t ngx_http_lua_config_get_key_value(ngx_http_request_t *r,
+    ngx_http_lua_config_loc_conf_t *llcf, ngx_http_lua_config_key_t *key,
+    ngx_str_t *value, ngx_http_lua_config_cmd_t **matched);
+static ngx_int_t ngx_http_lua_config_keyval_value(ngx_http_request_t *r,
+    ngx_http_lua_config_keyval_t *kv, ngx_uint_t overrides, ngx_str_t *value,
+    ngx_http_lua_config_cmd_t **matched);
 static ngx_int_t ngx_http_lua_config_get_value_internal(ngx_http_request_t *r,
-    u_char *name, size_t len, ngx_str_t *value);
+    ngx_http_lua_config_loc_conf_t *llcf, u_char *name, size_t len,
+    ngx_str_t *value, ngx_http_lua_config_cmd_t **matched);
+static ngx_uint_t ngx_http_lua_config_check_scope(lua_State *L, int idx,
+    ngx_uint_t max);
+static ngx_uint_t ngx_http_lua_config_find_server(lua_State *L, int idx,
+    u_char *name, size_t len);
+static void *ngx_http_lua_config_scope_conf(ngx_http_request_t *r,
+    ngx_uint_t scope, ngx_uint_t srv);
+static ngx_int_t ngx_http_lua_config_eval_cmds(ngx_http_request_t *r,
+    ngx_array_t *cmds, ngx_str_t *value, ngx_http_lua_config_cmd_t **matched);
+static ngx_int_t ngx_http_lua_config_eval_timed(ngx_http_request_t *r,
+    ngx_http_lua_config_histogram_t *filter, ngx_array_t *cmds,
+    ngx_str_t *value, ngx_http_lua_config_cmd_t **matched);
+static ngx_int_t ngx_http_lua_config_static_value(ngx_array_t *cmds,
+    ngx_str_t *value);
+static void *ngx_http_lua_config_compile(ngx_conf_t *cf, ngx_str_t *value,
+    ngx_uint_t *dynamic);
+static ngx_int_t ngx_http_lua_config_cmd_filter(void *data, void *cmd);
+static ngx_int_t ngx_http_lua_config_cmd_value(void *data, void *cmd,
+    ngx_str_t *value);
+static ngx_uint_t ngx_http_lua_config_cmd_final(void *cmd);
+static void ngx_http_lua_config_cmd_unfilter(void *cmd);
+static void ngx_http_lua_config_warn_unreachable(ngx_conf_t *cf,
+    ngx_str_t *key, void *cmd);
+static ngx_int_t ngx_http_lua_upstream_init_crc32(ngx_conf_t *cf,
+    ngx_http_lua_upstream_t *us);
+static ngx_int_t ngx_http_lua_upstream_crc32(ngx_http_request_t *r,
+    ngx_http_lua_upstream_t *us, uint32_t *crc);
+static void ngx_http_lua_upstream_init_fingerprint(ngx_uint_t algorithm,
+    ngx_http_lua_upstream_t *us);
+static void ngx_http_lua_upstream_fingerprint_key(
+    ngx_lua_config_fingerprint_t *fp, ngx_str_t *key, ngx_str_t *value);
+static ngx_http_lua_upstream_t *ngx_http_lua_config_find_upstream(
+    ngx_http_request_t *r, ngx_uint_t scope, u_char *name, size_t len);
+static int ngx_http_lua_config_push_upstream(lua_State *L,
+    ngx_http_request_t *r, ngx_http_lua_upstream_t *us,
+    ngx_http_lua_config_histogram_t *filter);
+static ngx_int_t ngx_http_lua_upstream_init_hash(ngx_conf_t *cf,
+    ngx_http_lua_upstream_t *us);
 static char *ngx_http_lua_upstream_block(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
 static char *ngx_http_lua_upstream(ngx_conf_t *cf,
     ngx_command_t *dummy, void *conf);
+static ngx_int_t ngx_http_lua_upstream_export(ngx_conf_t *cf,
+    ngx_http_lua_upstream_t *us);
+static ngx_int_t ngx_http_lua_upstream_export_directive(ngx_conf_t *cf,
+    ngx_http_lua_upstream_t *us, ngx_str_t *name);
 
 static void *ngx_http_lua_config_create_main_conf(ngx_conf_t *cf);
+static char *ngx_http_lua_config_init_main_conf(ngx_conf_t *cf, void *conf);
 static void *ngx_http_lua_config_create_srv_conf(ngx_conf_t *cf);
 static char *ngx_http_lua_config_merge_srv_conf(ngx_conf_t *cf, void *parent,
     void *child);
+static ngx_int_t ngx_http_lua_config_init_upstreams_hash(ngx_conf_t *cf,
+    ngx_http_lua_config_srv_conf_t *lscf);
+static ngx_int_t ngx_http_lua_config_add_server_names(ngx_conf_t *cf,
+    ngx_http_lua_config_srv_conf_t *lscf);
 static void *ngx_http_lua_config_create_loc_conf(ngx_conf_t *cf);
 static char *ngx_http_lua_config_merge_loc_conf(ngx_conf_t *cf, void *parent,
     void *child);
+static ngx_int_t ngx_http_lua_config_init_fingerprint(ngx_conf_t *cf,
+    ngx_http_lua_config_loc_conf_t *llcf);
+static ngx_str_t *ngx_http_lua_config_cached_serialized(
+    ngx_http_lua_upstream_t *us, ngx_http_lua_config_loc_conf_t *llcf,
+    ngx_uint_t format);
+static ngx_int_t ngx_http_lua_config_encode_upstream(
+    ngx_lua_config_encoder_t *enc, ngx_http_request_t *r,
+    ngx_http_lua_upstream_t *us);
+static ngx_int_t ngx_http_lua_config_encode_scope(
+    ngx_lua_config_encoder_t *enc, ngx_http_request_t *r,
+    ngx_http_lua_config_loc_conf_t *llcf, ngx_uint_t overrides);
+static ngx_int_t ngx_http_lua_config_fingerprint_keys(ngx_http_request_t *r,
+    ngx_http_lua_config_loc_conf_t *llcf, ngx_lua_config_fingerprint_t *fp);
+static ngx_int_t ngx_http_lua_config_fingerprint(ngx_http_request_t *r,
+    ngx_http_lua_config_loc_conf_t *llcf, ngx_str_t *value);
+static ngx_int_t ngx_http_lua_config_init_keys_hash(ngx_conf_t *cf,
+    ngx_http_lua_config_loc_conf_t *llcf);
 
 static ngx_int_t ngx_http_lua_config_init(ngx_conf_t *cf);
+static ngx_int_t ngx_http_lua_config_init_module(ngx_cycle_t *cycle);
+static ngx_int_t ngx_http_lua_config_init_process(ngx_cycle_t *cycle);
+static void ngx_http_lua_config_crc32_args(ngx_conf_t *cf, uint32_t *crc);
+static void ngx_http_lua_config_fingerprint_definitions(
+    ngx_lua_config_fingerprint_t *fp, ngx_array_t *keys);
+static void ngx_http_lua_config_init_srv_definitions(ngx_conf_t *cf,
+    ngx_http_lua_config_srv_conf_t *lscf);
+static ngx_int_t ngx_http_lua_config_add_scope(ngx_conf_t *cf,
+    ngx_http_lua_config_loc_conf_t *llcf);
+static ngx_int_t ngx_http_lua_config_init_epochs(ngx_conf_t *cf,
+    ngx_http_lua_config_main_conf_t *lmcf);
+static int ngx_libc_cdecl ngx_http_lua_config_epoch_cmp(const void *one,
+    const void *two);
+static ngx_int_t ngx_http_lua_config_build_snapshot(ngx_conf_t *cf,
+    ngx_http_lua_config_main_conf_t *lmcf);
+static void ngx_http_lua_config_snapshot_cleanup(void *data);
+static void ngx_http_lua_config_write_snapshot(ngx_cycle_t *cycle,
+    ngx_http_lua_config_main_conf_t *lmcf);
 
 static int ngx_http_lua_config_create_module(lua_State *L);
 static int ngx_http_lua_config_get_config(lua_State *L);
 static int ngx_http_lua_config_get_upstream(lua_State *L);
+static int ngx_http_lua_config_get_upstream_crc(lua_State *L);
+static int ngx_http_lua_config_get_upstream_if_changed(lua_State *L);
+static int ngx_http_lua_config_get_upstream_key(lua_State *L);
+static int ngx_http_lua_config_get_upstream_servers(lua_State *L);
+static int ngx_http_lua_config_push_serialized(lua_State *L,
+    ngx_http_request_t *r, ngx_uint_t format, ngx_http_lua_upstream_t *us,
+    ngx_http_lua_config_loc_conf_t *llcf);
+static ngx_uint_t ngx_http_lua_config_check_format(lua_State *L, int idx);
+static int ngx_http_lua_config_get_upstream_serialized(lua_State *L);
+static int ngx_http_lua_config_get_scope_serialized(lua_State *L);
 static int ngx_http_lua_get_init_configs(lua_State *L);
+static int ngx_http_lua_get_init_config(lua_State *L);
+static int ngx_http_lua_config_get_from(lua_State *L);
+static int ngx_http_lua_config_get_fingerprint(lua_State *L);
+static int ngx_http_lua_config_get_epoch(lua_State *L);
+static void ngx_http_lua_config_epoch_change(void);
+static char *ngx_http_lua_config_stats(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static ngx_int_t ngx_http_lua_config_stats_handler(ngx_http_request_t *r);
+static ngx_http_lua_config_stats_t *ngx_http_lua_config_stats_entry(
+    ngx_rbtree_t *tree, ngx_str_t *name);
+static ngx_int_t ngx_http_lua_config_stats_eval(ngx_http_request_t *r,
+    ngx_http_lua_config_keyval_t *kv, ngx_str_t *value,
+    ngx_http_lua_config_cmd_t **matched);
+static void ngx_http_lua_config_stats_add(
+    ngx_http_lua_config_histogram_t *h, uint64_t ns);
+static uint64_t ngx_http_lua_config_stats_bound(ngx_uint_t n);
+static uint64_t ngx_http_lua_config_stats_now(void);
+static u_char *ngx_http_lua_config_stats_write(u_char *p, u_char *last,
+    char *type, ngx_str_t *name, char *what,
+    ngx_http_lua_config_histogram_t *h);
+static void ngx_http_lua_config_stats_push(lua_State *L,
+    ngx_http_lua_config_histogram_t *h);
+static int ngx_http_lua_config_get_stats(lua_State *L);
+static int ngx_http_lua_config_stats_push_upstream(lua_State *L,
+    ngx_http_request_t *r, ngx_http_lua_upstream_t *us);
+static int ngx_http_lua_config_get_scope_epoch(lua_State *L);
+static ngx_uint_t ngx_http_lua_config_lower_bound(ngx_array_t *keys,
+    ngx_str_t *name, ngx_uint_t after);
+static int ngx_http_lua_config_get_prefix(lua_State *L);
+static int ngx_http_lua_config_iterate(lua_State *L);
+static int ngx_http_lua_config_iterate_next(lua_State *L);
+static char *ngx_http_lua_config_override_zone(ngx_conf_t *cf,
+    ngx_command_t *cmd, void *conf);
+static ngx_int_t ngx_http_lua_config_init_override_zone(
+    ngx_shm_zone_t *shm_zone, void *data);
+static ngx_int_t ngx_http_lua_config_override_find(ngx_pool_t *pool,
+    ngx_str_t *key, ngx_str_t *value);
+static void ngx_http_lua_config_override_refresh(void);
+static ngx_int_t ngx_http_lua_config_override_apply(ngx_str_t *key,
+    ngx_str_t *value, uint64_t *version, uint32_t origin,
+    ngx_uint_t deleted);
+static uint32_t ngx_http_lua_config_override_hash(
+    ngx_http_lua_config_override_t *ov);
+static ngx_rbtree_node_t *ngx_http_lua_config_override_next(
+    ngx_rbtree_t *tree, uint32_t hash, ngx_str_t *key);
+static ngx_uint_t ngx_http_lua_config_override_defined(ngx_str_t *key);
+static char *ngx_http_lua_config_replication(ngx_conf_t *cf,
+    ngx_command_t *cmd, void *conf);
+static char *ngx_http_lua_config_replication_peer(ngx_conf_t *cf,
+    ngx_command_t *cmd, void *conf);
+static ngx_int_t ngx_http_lua_config_repl_init(ngx_cycle_t *cycle,
+    ngx_http_lua_config_main_conf_t *lmcf);
+static void ngx_http_lua_config_repl_listen(ngx_log_t *log,
+    ngx_http_lua_config_main_conf_t *lmcf);
+static void ngx_http_lua_config_repl_read_handler(ngx_event_t *rev);
+static void ngx_http_lua_config_repl_receive(
+    ngx_http_lua_config_main_conf_t *lmcf, u_char *buf, size_t n,
+    ngx_log_t *log);
+static size_t ngx_http_lua_config_repl_encode(u_char *buf,
+    ngx_str_t *secret, ngx_str_t *key, ngx_str_t *value, uint64_t version,
+    uint32_t origin, ngx_uint_t deleted);
+static void ngx_http_lua_config_repl_sign(ngx_str_t *secret, u_char *data,
+    size_t len, u_char *md);
+static void ngx_http_lua_config_repl_send(
+    ngx_http_lua_config_main_conf_t *lmcf, u_char *buf, size_t len,
+    ngx_log_t *log);
+static void ngx_http_lua_config_repl_sync_handler(ngx_event_t *ev);
+static void ngx_http_lua_config_exit_process(ngx_cycle_t *cycle);
+static int ngx_http_lua_config_set(lua_State *L);
+static int ngx_http_lua_config_delete(lua_State *L);
+static int ngx_http_lua_config_set_override(lua_State *L, ngx_str_t *key,
+    ngx_str_t *value, ngx_uint_t deleted);
+static int ngx_http_lua_config_get_replication(lua_State *L);
+static ngx_int_t ngx_http_lua_config_init_inflight_zone(
+    ngx_shm_zone_t *shm_zone, void *data);
+static ngx_http_lua_upstream_t *ngx_http_lua_config_inflight_upstream(
+    lua_State *L, int idx);
+static int ngx_http_lua_config_acquire(lua_State *L);
+static int ngx_http_lua_config_release(lua_State *L);
+static int ngx_http_lua_config_get_inflight(lua_State *L);
+static ngx_shm_zone_t *ngx_http_lua_config_add_zone(ngx_conf_t *cf,
+    ngx_str_t *value);
+static char *ngx_http_lua_config_resolve_zone(ngx_conf_t *cf,
+    ngx_command_t *cmd, void *conf);
+static ngx_int_t ngx_http_lua_config_init_resolve_zone(
+    ngx_shm_zone_t *shm_zone, void *data);
+static ngx_int_t ngx_http_lua_config_add_resolve(ngx_conf_t *cf,
+    ngx_http_lua_config_main_conf_t *lmcf, ngx_http_lua_upstream_t *us);
+static ngx_int_t ngx_http_lua_config_resolve_init(ngx_cycle_t *cycle,
+    ngx_http_lua_config_main_conf_t *lmcf);
+static void ngx_http_lua_config_resolve_expire(
+    ngx_http_lua_config_main_conf_t *lmcf);
+static void ngx_http_lua_config_resolve_handler(ngx_event_t *ev);
+static void ngx_http_lua_config_resolved_handler(ngx_resolver_ctx_t *ctx);
+static void ngx_http_lua_config_resolve_publish(
+    ngx_http_lua_config_resolve_t *rs, ngx_resolver_ctx_t *ctx);
+static ngx_http_lua_config_resolve_cache_t *
+    ngx_http_lua_config_resolve_refresh(void);
+static ngx_http_lua_config_resolved_us_t *
+    ngx_http_lua_config_resolve_upstream(ngx_http_lua_upstream_t *us);
+static ngx_array_t *ngx_http_lua_config_resolve_servers(
+    ngx_http_lua_upstream_t *us);
+static ngx_array_t *ngx_http_lua_config_upstream_servers(
+    ngx_http_lua_upstream_t *us, uint32_t *crc,
+    ngx_lua_config_fingerprint_t *fp);
+static size_t ngx_http_lua_config_resolve_pick(
+    ngx_http_lua_upstream_server_t *server, u_char *buf);
 
 static ngx_int_t ngx_http_lua_config_prefix_variable(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t data);
+static ngx_int_t ngx_http_lua_config_key_variable(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data);
+static ngx_int_t ngx_http_lua_config_fingerprint_variable(
+    ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data);
+static ngx_int_t ngx_http_lua_config_file_variable(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data);
+
+
+static ngx_lua_config_chain_t  ngx_http_lua_config_chain = {
+    sizeof(ngx_http_lua_config_cmd_t),
+    ngx_http_lua_config_compile,
+    ngx_http_lua_config_cmd_filter,
+    ngx_http_lua_config_cmd_value,
+    ngx_http_lua_config_cmd_final,
+    ngx_http_lua_config_cmd_unfilter,
+    ngx_http_lua_config_warn_unreachable
+};
 
 
 static ngx_command_t  ngx_http_lua_config_commands[] = {
@@ -108,6 +734,14 @@ static ngx_command_t  ngx_http_lua_config_commands[] = {
       0,
       NULL },
 
+    { ngx_string("lua_config_map"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_BLOCK
+                        |NGX_CONF_TAKE2,
+      ngx_http_lua_config_map_block,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
     { ngx_string("lua_config_hash_max_size"),
       NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
       ngx_conf_set_num_slot,
@@ -123,12 +757,26 @@ static ngx_command_t  ngx_http_lua_config_commands[] = {
       NULL },
 
     { ngx_string("lua_upstream"),
-      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_CONF_BLOCK|NGX_CONF_TAKE1,
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_CONF_BLOCK|NGX_CONF_TAKE12,
       ngx_http_lua_upstream_block,
       NGX_HTTP_SRV_CONF_OFFSET,
       0,
       NULL },
 
+    { ngx_string("lua_upstream_inflight"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(ngx_http_lua_config_main_conf_t, inflight),
+      NULL },
+
+    { ngx_string("lua_upstream_resolve_zone"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_http_lua_config_resolve_zone,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      0,
+      NULL },
+
     { ngx_string("lua_init_config"),
       NGX_HTTP_MAIN_CONF|NGX_CONF_2MORE,
       ngx_http_lua_init_config_directive,
@@ -136,6 +784,76 @@ static ngx_command_t  ngx_http_lua_config_commands[] = {
       0,
       NULL },
 
+    { ngx_string("lua_config_snapshot"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_http_lua_config_snapshot,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("lua_config_file"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE23,
+      ngx_http_lua_config_file,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("lua_config_regex_cache"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(ngx_http_lua_config_main_conf_t, regex_cache),
+      NULL },
+
+    { ngx_string("lua_config_warn_shadowed"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(ngx_http_lua_config_main_conf_t, warn_shadowed),
+      NULL },
+
+    { ngx_string("lua_config_stats_sample"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(ngx_http_lua_config_main_conf_t, stats_sample),
+      NULL },
+
+    { ngx_string("lua_config_stats"),
+      NGX_HTTP_LOC_CONF|NGX_CONF_NOARGS,
+      ngx_http_lua_config_stats,
+      0,
+      0,
+      NULL },
+
+    { ngx_string("lua_config_override_zone"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_http_lua_config_override_zone,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("lua_config_replication"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_2MORE,
+      ngx_http_lua_config_replication,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("lua_config_replication_peer"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_http_lua_config_replication_peer,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("lua_config_fingerprint_algorithm"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_enum_slot,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(ngx_http_lua_config_main_conf_t, fingerprint_algorithm),
+      &ngx_lua_config_fingerprint_algorithms },
+
       ngx_null_command
 };
 
@@ -144,7 +862,7 @@ static ngx_http_module_t  ngx_http_lua_config_module_ctx = {
     ngx_http_lua_config_add_variables,     /* preconfiguration */
     ngx_http_lua_config_init,              /* postconfiguration */
     ngx_http_lua_config_create_main_conf,  /* create main configuration */
-    NULL,                                  /* init main configuration */
+    ngx_http_lua_config_init_main_conf,    /* init main configuration */
     ngx_http_lua_config_create_srv_conf,   /* create server configuration */
     ngx_http_lua_config_merge_srv_conf,    /* merge server configuration */
     ngx_http_lua_config_create_loc_conf,   /* create location configuration */
@@ -158,21 +876,106 @@ ngx_module_t  ngx_http_lua_config_module = {
     ngx_http_lua_config_commands,          /* module directives */
     NGX_HTTP_MODULE,                       /* module type */
     NULL,                                  /* init master */
-    NULL,                                  /* init module */
-    NULL,                                  /* init process */
+    ngx_http_lua_config_init_module,       /* init module */
+    ngx_http_lua_config_init_process,      /* init process */
     NULL,                                  /* init thread */
     NULL,                                  /* exit thread */
-    NULL,                                  /* exit process */
+    ngx_http_lua_config_exit_process,      /* exit process */
     NULL,                                  /* exit master */
     NGX_MODULE_V1_PADDING
 };
 
 
+/*
+ * the epoch, in shared memory allocated once by the master process and
+ * kept across reloads, so that neither a reload nor a recreated zone
+ * can move it back; "changed" is the epoch of the last override or
+ * address change, which every scope sees
+ */
+
+typedef struct {
+    ngx_atomic_t                epoch;
+    ngx_atomic_t                changed;
+} ngx_http_lua_config_epoch_shctx_t;
+
+
+static ngx_shm_t                     ngx_http_lua_config_epoch_shm;
+static ngx_http_lua_config_epoch_shctx_t  *ngx_http_lua_config_epoch_sh;
+
+/*
+ * the epochs of the scopes of the last configuration loaded by this
+ * process, sorted by fingerprint; kept in the master process across
+ * reloads and inherited by the workers
+ */
+
+static ngx_http_lua_config_epoch_t  *ngx_http_lua_config_epochs;
+static ngx_uint_t                    ngx_http_lua_config_nepochs;
+
+/*
+ * sampled latencies, per worker; nothing is looked at beyond the
+ * sampling rate unless it is set
+ */
+
+static ngx_uint_t                    ngx_http_lua_config_stats_sample;
+static ngx_rbtree_t                  ngx_http_lua_config_stats_keys;
+static ngx_rbtree_node_t             ngx_http_lua_config_stats_keys_sentinel;
+static ngx_rbtree_t                  ngx_http_lua_config_stats_upstreams;
+static ngx_rbtree_node_t             ngx_http_lua_config_stats_us_sentinel;
+
+/* encodings made by this worker, see cached_serialized() */
+static ngx_rbtree_t                  ngx_http_lua_config_serialized_tree;
+static ngx_rbtree_node_t             ngx_http_lua_config_serialized_sentinel;
+static ngx_pool_t                   *ngx_http_lua_config_serialized_pool;
+
+/*
+ * runtime overrides, NULL without lua_config_override_zone, and the
+ * replication sockets of this worker
+ */
+
+static ngx_http_lua_config_override_shctx_t  *ngx_http_lua_config_overrides;
+static ngx_slab_pool_t              *ngx_http_lua_config_overrides_pool;
+static ngx_http_lua_config_override_cache_t
+                                    *ngx_http_lua_config_override_cache;
+static uint32_t                      ngx_http_lua_config_origin;
+static ngx_socket_t                  ngx_http_lua_config_repl_fd =
+                                                           (ngx_socket_t) -1;
+static ngx_connection_t             *ngx_http_lua_config_repl_conn;
+static ngx_event_t                   ngx_http_lua_config_repl_event;
+static ngx_http_lua_config_repl_pass_t  ngx_http_lua_config_repl_pass;
+
+/* in-flight counters, NULL unless lua_upstream_inflight is on */
+static ngx_atomic_t                 *ngx_http_lua_config_inflight;
+
+/* published addresses, NULL without lua_upstream_resolve_zone */
+static ngx_http_lua_config_resolve_shctx_t  *ngx_http_lua_config_resolved;
+static ngx_slab_pool_t              *ngx_http_lua_config_resolved_pool;
+static ngx_pool_t                   *ngx_http_lua_config_resolve_temp;
+static ngx_http_lua_config_resolve_cache_t
+                                    *ngx_http_lua_config_resolve_cache;
+
+
+#define ngx_http_lua_config_override_changes()                                \
+    (ngx_http_lua_config_overrides ? ngx_http_lua_config_overrides->changes : 0)
+
+#define ngx_http_lua_config_epoch_changed()                                   \
+    (ngx_http_lua_config_epoch_sh ? ngx_http_lua_config_epoch_sh->changed : 0)
+
+
+#define ngx_http_lua_config_stats_sampled(r)                                  \
+    (ngx_http_lua_config_stats_sample                                         \
+     && ((r)->connection->number + (r)->connection->requests)                 \
+        % ngx_http_lua_config_stats_sample == 0)
+
+
 static ngx_http_variable_t  ngx_http_lua_config_vars[] = {
 
     { ngx_string("lua_config_"), NULL, ngx_http_lua_config_prefix_variable,
     0, NGX_HTTP_VAR_NOCACHEABLE|NGX_HTTP_VAR_PREFIX, 0 },
 
+    { ngx_string("lua_config_fingerprint"), NULL,
+      ngx_http_lua_config_fingerprint_variable,
+      0, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
       ngx_http_null_variable
 };
 
@@ -215,7 +1018,8 @@ ngx_http_lua_config_prefix_variable(ngx_http_request_t *r,
         return NGX_OK;
     }
 
-    rc = ngx_http_lua_config_get_value_internal(r, lua_config, len, &value);
+    rc = ngx_http_lua_config_get_value_internal(r, NULL, lua_config, len,
+                                                &value, NULL);
     if (rc == NGX_ERROR) {
         return NGX_ERROR;
     }
@@ -236,178 +1040,478 @@ ngx_http_lua_config_prefix_variable(ngx_http_request_t *r,
 
 
 static ngx_int_t
-ngx_http_lua_config_init(ngx_conf_t *cf)
+ngx_http_lua_config_key_variable(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data)
 {
-    if (ngx_http_lua_add_package_preload(cf, "ngx.lua_config",
-                                         ngx_http_lua_config_create_module)
-        != NGX_OK)
-    {
+    ngx_http_lua_config_key_t  *key = (ngx_http_lua_config_key_t *) data;
+
+    ngx_str_t   value;
+    ngx_int_t   rc;
+
+    rc = ngx_http_lua_config_get_key_value(r, NULL, key, &value, NULL);
+    if (rc == NGX_ERROR) {
         return NGX_ERROR;
     }
 
+    if (rc != NGX_OK) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    v->data = value.data;
+    v->len = value.len;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+
     return NGX_OK;
 }
 
 
-static char *
-ngx_http_lua_init_config_directive(ngx_conf_t *cf, ngx_command_t *cmd,
-    void *conf)
+static ngx_int_t
+ngx_http_lua_config_fingerprint_variable(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data)
 {
-    ngx_http_lua_config_main_conf_t  *lmcf = conf;
-
-    ngx_str_t                        *value;
-    u_char                           *p;
-    ngx_keyval_t                     *kv;
-    ngx_uint_t                        i, last;
-    ngx_str_t                         separator;
+    ngx_str_t                        value;
+    ngx_http_lua_config_loc_conf_t  *llcf;
 
-    value = cf->args->elts;
+    llcf = ngx_http_get_module_loc_conf(r, ngx_http_lua_config_module);
 
-    if (value[1].len == 0) {
-        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-                           "lua_init_config directive name cannot be empty");
-        return NGX_CONF_ERROR;
+    if (ngx_http_lua_config_fingerprint(r, llcf, &value) != NGX_OK) {
+        return NGX_ERROR;
     }
 
-    for (p = value[1].data; p < value[1].data + value[1].len; p++) {
-        if (!((*p >= '0' && *p <= '9')
-              || (*p >= 'a' && *p <= 'z')
-              || *p == '_'))
-        {
-            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-                               "invalid character in lua_init_config "
-                               "directive name \"%V\"", &value[1]);
-            return NGX_CONF_ERROR;
-        }
-    }
+    v->data = value.data;
+    v->len = value.len;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
 
-    if (lmcf->keys == NULL) {
-        lmcf->keys = ngx_array_create(cf->pool, 4,
-                                     sizeof(ngx_keyval_t));
-        if (lmcf->keys == NULL) {
-            return NGX_CONF_ERROR;
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_lua_config_init(ngx_conf_t *cf)
+{
+    size_t                            size;
+    ngx_str_t                         name;
+    ngx_http_core_loc_conf_t         *clcf;
+    ngx_http_lua_config_main_conf_t  *lmcf;
+
+    if (ngx_http_lua_add_package_preload(cf, "ngx.lua_config",
+                                         ngx_http_lua_config_create_module)
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    lmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_lua_config_module);
+
+    if (ngx_http_lua_config_init_epochs(cf, lmcf) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (lmcf->inflight && lmcf->ninflight) {
+        ngx_str_set(&name, "lua_upstream_inflight");
+
+        size = 8 * ngx_pagesize
+               + ngx_align(lmcf->ninflight * sizeof(ngx_atomic_t),
+                           ngx_pagesize);
+
+        lmcf->inflight_zone = ngx_shared_memory_add(cf, &name, size,
+                                                 &ngx_http_lua_config_module);
+        if (lmcf->inflight_zone == NULL) {
+            return NGX_ERROR;
         }
+
+        lmcf->inflight_zone->init = ngx_http_lua_config_init_inflight_zone;
+        lmcf->inflight_zone->data = lmcf;
+        lmcf->inflight_zone->noreuse = 1;
     }
 
-    /* check for duplicate key: error on conflict */
-    kv = lmcf->keys->elts;
-    for (i = 0; i < lmcf->keys->nelts; i++) {
-        if (value[1].len == kv[i].key.len
-            && ngx_strncmp(value[1].data, kv[i].key.data, value[1].len) == 0)
-        {
-            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-                               "duplicate lua_init_config \"%V\"",
-                               &value[1]);
-            return NGX_CONF_ERROR;
+    if (lmcf->resolve != NULL) {
+        if (lmcf->resolve_zone == NULL) {
+            ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                          "\"resolve\" in lua_upstream requires "
+                          "\"lua_upstream_resolve_zone\"");
+            return NGX_ERROR;
+        }
+
+        /* the http level resolver, set by the merge of the servers */
+
+        clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+
+        if (clcf->resolver == NULL || clcf->resolver->connections.nelts == 0) {
+            ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                          "no resolver defined to resolve lua_upstream "
+                          "servers");
+            return NGX_ERROR;
         }
+
+        lmcf->resolver = clcf->resolver;
+        lmcf->resolver_timeout = clcf->resolver_timeout;
     }
 
-    kv = ngx_array_push(lmcf->keys);
-    if (kv == NULL) {
+    if (lmcf->snapshot.len
+        && !ngx_test_config
+        && ngx_process != NGX_PROCESS_SIGNALLER)
+    {
+        if (ngx_http_lua_config_build_snapshot(cf, lmcf) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static char *
+ngx_http_lua_config_snapshot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_lua_config_main_conf_t  *lmcf = conf;
+
+    ngx_str_t                        *value;
+
+    if (lmcf->snapshot.data) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    lmcf->snapshot = value[1];
+
+    if (ngx_conf_full_name(cf->cycle, &lmcf->snapshot, 0) != NGX_OK) {
         return NGX_CONF_ERROR;
     }
 
-    kv->key = value[1];
+    return NGX_CONF_OK;
+}
+
+
+#define ngx_http_lua_config_snapshot_str_size(s)                              \
+    (sizeof(uint32_t) + ngx_align((s)->len, sizeof(uint32_t)))
+
+
+static u_char *
+ngx_http_lua_config_snapshot_uint(u_char *p, ngx_uint_t n)
+{
+    uint32_t  v;
+
+    v = (uint32_t) n;
+
+    return ngx_cpymem(p, &v, sizeof(uint32_t));
+}
+
+
+static u_char *
+ngx_http_lua_config_snapshot_str(u_char *p, ngx_str_t *s)
+{
+    size_t  pad;
+
+    p = ngx_http_lua_config_snapshot_uint(p, s->len);
+    p = ngx_cpymem(p, s->data, s->len);
+
+    pad = ngx_align(s->len, sizeof(uint32_t)) - s->len;
+    ngx_memzero(p, pad);
+
+    return p + pad;
+}
+
+
+static ngx_int_t
+ngx_http_lua_config_build_snapshot(ngx_conf_t *cf,
+    ngx_http_lua_config_main_conf_t *lmcf)
+{
+    u_char                                 *buf, *p;
+    size_t                                  size;
+    ngx_str_t                               value, *resolved;
+    ngx_pool_cleanup_t                     *cln;
+    ngx_uint_t                              i, j, k, nkeys, flags;
+    ngx_keyval_t                           *ikv;
+    ngx_http_lua_config_keyval_t           *kv;
+    ngx_http_lua_upstream_t                *us;
+    ngx_http_lua_upstream_server_t         *server;
+    ngx_http_lua_config_srv_conf_t         *lscf;
+    ngx_http_lua_config_loc_conf_t         *llcf;
+    ngx_http_lua_config_snapshot_header_t  *header;
+
+    lscf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_lua_config_module);
+    llcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_lua_config_module);
+
+    /* only the http level is captured, it has no request dependent scope */
+
+    size = sizeof(ngx_http_lua_config_snapshot_header_t);
+
+    if (lmcf->keys) {
+        ikv = lmcf->keys->elts;
+        for (i = 0; i < lmcf->keys->nelts; i++) {
+            size += ngx_http_lua_config_snapshot_str_size(&ikv[i].key)
+                    + ngx_http_lua_config_snapshot_str_size(&ikv[i].value);
+        }
+    }
+
+    nkeys = 0;
 
-    last = cf->args->nelts - 1;
+    if (llcf->keys) {
+        kv = llcf->keys->elts;
+        for (i = 0; i < llcf->keys->nelts; i++) {
+            if (ngx_http_lua_config_static_value(kv[i].cmds, &value)
+                != NGX_OK)
+            {
+                continue;
+            }
 
-    separator.len = 1;
+            size += ngx_http_lua_config_snapshot_str_size(&kv[i].key)
+                    + ngx_http_lua_config_snapshot_str_size(&value);
+            nkeys++;
+        }
+    }
 
-    /* check for separator= */
-    if (last >= 3
-        && ngx_strncmp(value[last].data, "separator=", 10) == 0)
-    {
-        if (value[last].len != 11) {
-            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-                               "invalid separator: \"%V\"",
-                               &value[last]);
-            return NGX_CONF_ERROR;
+    if (lscf->upstreams) {
+        us = lscf->upstreams->elts;
+        for (i = 0; i < lscf->upstreams->nelts; i++) {
+            size += ngx_http_lua_config_snapshot_str_size(&us[i].name)
+                    + 4 * sizeof(uint32_t);
+
+            server = us[i].servers->elts;
+            for (j = 0; j < us[i].servers->nelts; j++) {
+                size += ngx_http_lua_config_snapshot_str_size(&server[j].host)
+                        + 4 * sizeof(uint32_t);
+            }
+
+            kv = us[i].keys->elts;
+            for (j = 0; j < us[i].keys->nelts; j++) {
+                if (ngx_http_lua_config_static_value(kv[j].cmds, &value)
+                    != NGX_OK)
+                {
+                    continue;
+                }
+
+                size += ngx_http_lua_config_snapshot_str_size(&kv[j].key)
+                        + ngx_http_lua_config_snapshot_str_size(&value);
+            }
         }
+    }
 
-        separator.data = value[last].data + 10;
-        last--;
+    if (size > NGX_MAX_UINT32_VALUE) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "lua_config_snapshot is too large");
+        return NGX_ERROR;
+    }
 
-    } else {
-        separator.data = (u_char *) ",";
+    /*
+     * the file is only written by init_module, once the new cycle is
+     * committed, so that a configuration failing later leaves the last
+     * snapshot in place; the buffer is freed before the workers fork
+     */
+
+    cln = ngx_pool_cleanup_add(cf->pool, 0);
+    if (cln == NULL) {
+        return NGX_ERROR;
     }
 
-    /* join value[2..last] with separator */
-    if (last == 2) {
-        kv->value = value[2];
+    buf = ngx_alloc(size, cf->log);
+    if (buf == NULL) {
+        return NGX_ERROR;
+    }
 
-    } else {
-        kv->value.len = last - 2;
+    ngx_memzero(buf, size);
+
+    cln->handler = ngx_http_lua_config_snapshot_cleanup;
+    cln->data = lmcf;
 
-        for (i = 2; i <= last; i++) {
-            kv->value.len += value[i].len;
+    lmcf->snapshot_buf = buf;
+    lmcf->snapshot_size = size;
+
+    header = (ngx_http_lua_config_snapshot_header_t *) buf;
+
+    ngx_memcpy(header->magic, NGX_HTTP_LUA_CONFIG_SNAPSHOT_MAGIC,
+               sizeof(header->magic));
+    header->version = NGX_HTTP_LUA_CONFIG_SNAPSHOT_VERSION;
+    header->byte_order = NGX_HTTP_LUA_CONFIG_SNAPSHOT_BYTE_ORDER;
+    header->size = (uint32_t) size;
+    header->ninit = lmcf->keys ? lmcf->keys->nelts : 0;
+    header->nkeys = nkeys;
+    header->nupstreams = lscf->upstreams ? lscf->upstreams->nelts : 0;
+
+    p = buf + sizeof(ngx_http_lua_config_snapshot_header_t);
+
+    if (lmcf->keys) {
+        ikv = lmcf->keys->elts;
+        for (i = 0; i < lmcf->keys->nelts; i++) {
+            p = ngx_http_lua_config_snapshot_str(p, &ikv[i].key);
+            p = ngx_http_lua_config_snapshot_str(p, &ikv[i].value);
         }
+    }
 
-        p = ngx_pnalloc(cf->pool, kv->value.len);
-        if (p == NULL) {
-            return NGX_CONF_ERROR;
+    if (llcf->keys) {
+        kv = llcf->keys->elts;
+        for (i = 0; i < llcf->keys->nelts; i++) {
+            if (ngx_http_lua_config_static_value(kv[i].cmds, &value)
+                != NGX_OK)
+            {
+                continue;
+            }
+
+            p = ngx_http_lua_config_snapshot_str(p, &kv[i].key);
+            p = ngx_http_lua_config_snapshot_str(p, &value);
         }
+    }
+
+    if (lscf->upstreams) {
+        us = lscf->upstreams->elts;
+        for (i = 0; i < lscf->upstreams->nelts; i++) {
+
+            /*
+             * the crc32 is only valid when every key resolves statically,
+             * it matches the one returned by get_upstream()
+             */
+
+            resolved = ngx_palloc(cf->temp_pool,
+                                  (us[i].keys->nelts + 1) * sizeof(ngx_str_t));
+            if (resolved == NULL) {
+                return NGX_ERROR;
+            }
+
+            flags = us[i].dynamic ? 0 : NGX_HTTP_LUA_CONFIG_SNAPSHOT_CRC;
+
+            kv = us[i].keys->elts;
+            for (j = 0; j < us[i].keys->nelts; j++) {
+                if (ngx_http_lua_config_static_value(kv[j].cmds, &resolved[j])
+                    != NGX_OK)
+                {
+                    resolved[j].data = NULL;
+                }
+            }
+
+            p = ngx_http_lua_config_snapshot_str(p, &us[i].name);
+            p = ngx_http_lua_config_snapshot_uint(p, flags);
+            p = ngx_http_lua_config_snapshot_uint(p, flags ? us[i].crc : 0);
+            p = ngx_http_lua_config_snapshot_uint(p, us[i].servers->nelts);
+
+            server = us[i].servers->elts;
+            for (j = 0; j < us[i].servers->nelts; j++) {
+                p = ngx_http_lua_config_snapshot_str(p, &server[j].host);
+                p = ngx_http_lua_config_snapshot_uint(p, server[j].port);
+                p = ngx_http_lua_config_snapshot_uint(p, server[j].level);
+                p = ngx_http_lua_config_snapshot_uint(p, server[j].weight);
+                p = ngx_http_lua_config_snapshot_uint(p, server[j].down);
+            }
+
+            k = 0;
+            for (j = 0; j < us[i].keys->nelts; j++) {
+                if (resolved[j].data != NULL) {
+                    k++;
+                }
+            }
 
-        kv->value.data = p;
+            p = ngx_http_lua_config_snapshot_uint(p, k);
 
-        p = ngx_cpymem(p, value[2].data, value[2].len);
+            for (j = 0; j < us[i].keys->nelts; j++) {
+                if (resolved[j].data == NULL) {
+                    continue;
+                }
 
-        for (i = 3; i <= last; i++) {
-            p = ngx_cpymem(p, separator.data, separator.len);
-            p = ngx_cpymem(p, value[i].data, value[i].len);
+                p = ngx_http_lua_config_snapshot_str(p, &kv[j].key);
+                p = ngx_http_lua_config_snapshot_str(p, &resolved[j]);
+            }
         }
     }
 
-    return NGX_CONF_OK;
+    return NGX_OK;
 }
 
 
-static int
-ngx_http_lua_get_init_configs(lua_State *L)
+static void
+ngx_http_lua_config_snapshot_cleanup(void *data)
 {
-    ngx_http_lua_config_main_conf_t  *lmcf;
-    ngx_keyval_t                     *kv;
-    ngx_uint_t                        i;
+    ngx_http_lua_config_main_conf_t  *lmcf = data;
 
-    lmcf = ngx_http_cycle_get_module_main_conf(ngx_cycle,
-                                               ngx_http_lua_config_module);
+    if (lmcf->snapshot_buf) {
+        ngx_free(lmcf->snapshot_buf);
+        lmcf->snapshot_buf = NULL;
+    }
+}
 
-    lua_createtable(L, 0, (lmcf != NULL && lmcf->keys != NULL)
-                           ? (int) lmcf->keys->nelts : 0);
 
-    if (lmcf == NULL || lmcf->keys == NULL) {
-        return 1;
+static void
+ngx_http_lua_config_write_snapshot(ngx_cycle_t *cycle,
+    ngx_http_lua_config_main_conf_t *lmcf)
+{
+    u_char    *temp;
+    ssize_t    n;
+    ngx_fd_t   fd;
+
+    /*
+     * the new cycle is already running, so errors only keep the old
+     * snapshot; write to a temporary file and rename it over the old one
+     */
+
+    temp = ngx_pnalloc(cycle->pool, lmcf->snapshot.len + sizeof(".tmp"));
+    if (temp == NULL) {
+        return;
     }
 
-    kv = lmcf->keys->elts;
-    for (i = 0; i < lmcf->keys->nelts; i++) {
-        lua_pushlstring(L, (char *) kv[i].key.data, kv[i].key.len);
-        lua_pushlstring(L, (char *) kv[i].value.data, kv[i].value.len);
-        lua_rawset(L, -3);
+    ngx_sprintf(temp, "%V.tmp%Z", &lmcf->snapshot);
+
+    fd = ngx_open_file(temp, NGX_FILE_WRONLY, NGX_FILE_TRUNCATE,
+                       NGX_FILE_DEFAULT_ACCESS);
+
+    if (fd == NGX_INVALID_FILE) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                      ngx_open_file_n " \"%s\" failed", temp);
+        return;
     }
 
-    return 1;
+    n = ngx_write_fd(fd, lmcf->snapshot_buf, lmcf->snapshot_size);
+
+    if (ngx_close_file(fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", temp);
+    }
+
+    if (n != (ssize_t) lmcf->snapshot_size) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                      ngx_write_fd_n " \"%s\" failed", temp);
+        goto failed;
+    }
+
+    if (ngx_rename_file(temp, lmcf->snapshot.data) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                      ngx_rename_file_n " \"%s\" to \"%V\" failed",
+                      temp, &lmcf->snapshot);
+        goto failed;
+    }
+
+    return;
+
+failed:
+
+    if (ngx_delete_file(temp) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                      ngx_delete_file_n " \"%s\" failed", temp);
+    }
 }
 
 
 static char *
-ngx_http_lua_config_directive(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+ngx_http_lua_config_file(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
-    ngx_http_lua_config_loc_conf_t *llcf = conf;
-
-    ngx_str_t                      *value;
-    u_char                         *p;
-    ngx_http_lua_config_keyval_t   *kv;
-    ngx_http_lua_config_cmd_t      *lcmd;
-    ngx_uint_t                      i, last;
-    ngx_str_t                       s, separator;
+    ngx_http_lua_config_main_conf_t  *lmcf = conf;
 
-    ngx_http_compile_complex_value_t   ccv;
+    u_char                             *p;
+    ngx_str_t                          *value, name, s;
+    ngx_uint_t                          i;
+    ngx_http_variable_t                *var;
+    ngx_http_lua_config_file_t         *file;
+    ngx_http_compile_complex_value_t    ccv;
 
     value = cf->args->elts;
 
     if (value[1].len == 0) {
         ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-                           "lua config directive name cannot be empty");
+                           "lua_config_file name cannot be empty");
         return NGX_CONF_ERROR;
     }
 
@@ -417,68 +1521,63 @@ ngx_http_lua_config_directive(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
               || *p == '_'))
         {
             ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-                               "invalid character in lua config "
-                               "directive name \"%V\"", &value[1]);
+                               "invalid character in lua_config_file "
+                               "name \"%V\"", &value[1]);
             return NGX_CONF_ERROR;
         }
     }
 
-    if (llcf->keys == NULL) { 
-        llcf->keys = ngx_array_create(cf->pool, 4,
-                                      sizeof(ngx_http_lua_config_keyval_t));
-        if (llcf->keys == NULL) {
+    if (lmcf->files == NULL) {
+        lmcf->files = ngx_array_create(cf->pool, 4,
+                                       sizeof(ngx_http_lua_config_file_t));
+        if (lmcf->files == NULL) {
             return NGX_CONF_ERROR;
         }
     }
 
-    kv = llcf->keys->elts;
-    for (i = 0; i < llcf->keys->nelts; i++) {
-        if (value[1].len == kv[i].key.len &&
-            ngx_strncmp(value[1].data, kv[i].key.data, value[1].len) == 0)
+    file = lmcf->files->elts;
+    for (i = 0; i < lmcf->files->nelts; i++) {
+        if (value[1].len == file[i].name.len
+            && ngx_strncmp(value[1].data, file[i].name.data, value[1].len)
+               == 0)
         {
-            break;
-        }
-    }
-
-    if (i == llcf->keys->nelts) {
-        kv = ngx_array_push(llcf->keys);
-        if (kv == NULL) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "duplicate lua_config_file \"%V\"",
+                               &value[1]);
             return NGX_CONF_ERROR;
         }
+    }
 
-        kv->key = value[1];
+    file = ngx_array_push(lmcf->files);
+    if (file == NULL) {
+        return NGX_CONF_ERROR;
+    }
 
-        kv->cmds = ngx_array_create(cf->pool, 4,
-                                    sizeof(ngx_http_lua_config_cmd_t));
-        if (kv->cmds == NULL) {
-            return NGX_CONF_ERROR;
-        }
+    ngx_memzero(file, sizeof(ngx_http_lua_config_file_t));
 
-    } else {
-        kv = &kv[i];
-    }
+    file->name = value[1];
+    file->path = value[2];
 
-    lcmd = ngx_array_push(kv->cmds);
-    if (lcmd == NULL) {
+    if (ngx_conf_full_name(cf->cycle, &file->path, 1) != NGX_OK) {
         return NGX_CONF_ERROR;
     }
 
-    lcmd->negative = 0;
-    lcmd->filter = NULL;
-
-    last = cf->args->nelts - 1;
+    if (cf->args->nelts == 4) {
+        if (ngx_strncmp(value[3].data, "key=", 4) != 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid parameter \"%V\"", &value[3]);
+            return NGX_CONF_ERROR;
+        }
 
-    if (ngx_strncmp(value[last].data, "if=", 3) == 0) {
-        s.len = value[last].len - 3;
-        s.data = value[last].data + 3;
-        lcmd->negative = 0;
+        s.len = value[3].len - 4;
+        s.data = value[3].data + 4;
 
         ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
 
         ccv.cf = cf;
         ccv.value = &s;
         ccv.complex_value = ngx_palloc(cf->pool,
-                                    sizeof(ngx_http_complex_value_t));
+                                       sizeof(ngx_http_complex_value_t));
         if (ccv.complex_value == NULL) {
             return NGX_CONF_ERROR;
         }
@@ -487,401 +1586,432 @@ ngx_http_lua_config_directive(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             return NGX_CONF_ERROR;
         }
 
-        lcmd->filter = ccv.complex_value;
-        last--;
-
-    } else if (ngx_strncmp(value[last].data, "if!=", 4) == 0) {
-        s.len = value[last].len - 4;
-        s.data = value[last].data + 4;
-        lcmd->negative = 1;
+        file->key = ccv.complex_value;
 
-        ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
-
-        ccv.cf = cf;
-        ccv.value = &s;
-        ccv.complex_value = ngx_palloc(cf->pool,
-                                    sizeof(ngx_http_complex_value_t));
-        if (ccv.complex_value == NULL) {
+        name.len = sizeof("lua_config_file_") - 1 + file->name.len;
+        name.data = ngx_pnalloc(cf->pool, name.len);
+        if (name.data == NULL) {
             return NGX_CONF_ERROR;
         }
 
-        if (ngx_http_compile_complex_value(&ccv) != NGX_OK) {
+        ngx_sprintf(name.data, "lua_config_file_%V", &file->name);
+
+        var = ngx_http_add_variable(cf, &name, NGX_HTTP_VAR_NOCACHEABLE);
+        if (var == NULL) {
             return NGX_CONF_ERROR;
         }
 
-        lcmd->filter = ccv.complex_value;
-        last--;
+        var->get_handler = ngx_http_lua_config_file_variable;
+        var->data = (uintptr_t) file;
     }
 
-    separator.len = 1;
+    if (ngx_http_lua_config_file_map(cf, file) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
 
-    if (last >= 3
-        && ngx_strncmp(value[last].data, "separator=", 10) == 0)
-    {
-        if (value[last].len != 11) {
-            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-                               "invalid separator: \"%V\"",
-                               &value[last]);
-            return NGX_CONF_ERROR;
-        }
+    return NGX_CONF_OK;
+}
 
-        separator.data = value[last].data + 10;
-        last--;
 
-    } else {
-        separator.data = (u_char *) ",";
+static ngx_int_t
+ngx_http_lua_config_file_map(ngx_conf_t *cf, ngx_http_lua_config_file_t *file)
+{
+    u_char                             *start;
+    size_t                              size;
+    ngx_fd_t                            fd;
+    ngx_uint_t                          i;
+    ngx_file_info_t                     fi;
+    ngx_pool_cleanup_t                 *cln;
+    ngx_http_lua_config_file_entry_t   *entry;
+    ngx_http_lua_config_file_header_t  *header;
+
+    fd = ngx_open_file(file->path.data, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+
+    if (fd == NGX_INVALID_FILE) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, ngx_errno,
+                           ngx_open_file_n " \"%V\" failed", &file->path);
+        return NGX_ERROR;
     }
 
-    if (last < 2) {
-        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-                           "no value specified for lua_config \"%V\"",
-                           &value[1]);
-        return NGX_CONF_ERROR;
+    if (ngx_fd_info(fd, &fi) == NGX_FILE_ERROR) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, ngx_errno,
+                           ngx_fd_info_n " \"%V\" failed", &file->path);
+        goto failed;
     }
 
-    if (last == 2) {
-        s = value[2];
+    size = (size_t) ngx_file_size(&fi);
 
-    } else {
-        s.len = separator.len * (last - 2);
+    if (size < sizeof(ngx_http_lua_config_file_header_t)) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "lua_config_file \"%V\" is truncated",
+                           &file->path);
+        goto failed;
+    }
 
-        for (i = 2; i <= last; i++) {
-            s.len += value[i].len;
-        }
+    start = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
 
-        p = ngx_pnalloc(cf->pool, s.len);
-        if (p == NULL) {
-            return NGX_CONF_ERROR;
-        }
+    if (start == MAP_FAILED) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, ngx_errno,
+                           "mmap(\"%V\") failed", &file->path);
+        goto failed;
+    }
 
-        s.data = p;
+    if (ngx_close_file(fd) == NGX_FILE_ERROR) {
+        ngx_conf_log_error(NGX_LOG_ALERT, cf, ngx_errno,
+                           ngx_close_file_n " \"%V\" failed", &file->path);
+    }
 
-        p = ngx_cpymem(p, value[2].data, value[2].len);
+    file->start = start;
+    file->size = size;
 
-        for (i = 3; i <= last; i++) {
-            p = ngx_cpymem(p, separator.data, separator.len);
-            p = ngx_cpymem(p, value[i].data, value[i].len);
-        }
+    cln = ngx_pool_cleanup_add(cf->pool, 0);
+    if (cln == NULL) {
+        ngx_http_lua_config_file_unmap(file);
+        return NGX_ERROR;
     }
 
-    ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
+    cln->handler = ngx_http_lua_config_file_unmap;
+    cln->data = file;
 
-    ccv.cf = cf;
-    ccv.value = &s;
-    ccv.complex_value = ngx_palloc(cf->pool, sizeof(ngx_http_complex_value_t));
-    if (ccv.complex_value == NULL) {
-        return NGX_CONF_ERROR;
+    /* the whole index is validated once, lookups trust it afterwards */
+
+    header = (ngx_http_lua_config_file_header_t *) start;
+
+    if (ngx_memcmp(header->magic, NGX_HTTP_LUA_CONFIG_FILE_MAGIC,
+                   sizeof(header->magic))
+        != 0
+        || header->byte_order != NGX_HTTP_LUA_CONFIG_FILE_BYTE_ORDER)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"%V\" is not a lua_config_file",
+                           &file->path);
+        return NGX_ERROR;
     }
 
-    if (ngx_http_compile_complex_value(&ccv) != NGX_OK) {
-        return NGX_CONF_ERROR;
+    if (header->version != NGX_HTTP_LUA_CONFIG_FILE_VERSION) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "lua_config_file \"%V\" has unsupported "
+                           "version %uD", &file->path, header->version);
+        return NGX_ERROR;
     }
 
-    lcmd->value = ccv.complex_value;
+    if (header->nentries > (size - sizeof(ngx_http_lua_config_file_header_t))
+                           / sizeof(ngx_http_lua_config_file_entry_t))
+    {
+        goto invalid;
+    }
 
-    return NGX_CONF_OK;
-}
+    file->nentries = header->nentries;
+    file->entries = (ngx_http_lua_config_file_entry_t *)
+                        (start + sizeof(ngx_http_lua_config_file_header_t));
 
+    entry = file->entries;
 
-static void *
-ngx_http_lua_config_create_main_conf(ngx_conf_t *cf)
-{
-    ngx_http_lua_config_main_conf_t  *conf;
+    for (i = 0; i < file->nentries; i++) {
+        if (entry[i].key_offset > size
+            || entry[i].key_len > size - entry[i].key_offset
+            || entry[i].value_offset > size
+            || entry[i].value_len > size - entry[i].value_offset)
+        {
+            goto invalid;
+        }
 
-    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_lua_config_main_conf_t));
-    if (conf == NULL) {
-        return NULL;
+        if (i > 0
+            && ngx_memn2cmp(start + entry[i - 1].key_offset,
+                            start + entry[i].key_offset,
+                            entry[i - 1].key_len, entry[i].key_len)
+               >= 0)
+        {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "lua_config_file \"%V\" is not sorted "
+                               "at entry %ui", &file->path, i);
+            return NGX_ERROR;
+        }
     }
 
-    /*
-     * set by ngx_pcalloc():
-     *
-     *     conf->keys = NULL;
-     */
+    return NGX_OK;
 
-    return conf;
-}
+invalid:
 
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "lua_config_file \"%V\" is corrupted", &file->path);
 
-static void *
-ngx_http_lua_config_create_srv_conf(ngx_conf_t *cf)
-{
-    ngx_http_lua_config_srv_conf_t  *conf;
+    return NGX_ERROR;
 
-    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_lua_config_srv_conf_t));
-    if (conf == NULL) {
-        return NULL;
+failed:
+
+    if (ngx_close_file(fd) == NGX_FILE_ERROR) {
+        ngx_conf_log_error(NGX_LOG_ALERT, cf, ngx_errno,
+                           ngx_close_file_n " \"%V\" failed", &file->path);
     }
 
-    /*
-     * set by ngx_pcalloc():
-     *
-     *     conf->hash = { NULL };
-     *     conf->upstreams = NULL;
-     */
+    return NGX_ERROR;
+}
 
-    return conf;
+
+static void
+ngx_http_lua_config_file_unmap(void *data)
+{
+    ngx_http_lua_config_file_t  *file = data;
+
+    if (munmap(file->start, file->size) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                      "munmap(\"%V\") failed", &file->path);
+    }
 }
 
 
-static char *
-ngx_http_lua_config_merge_srv_conf(ngx_conf_t *cf, void *parent, void *child)
+static ngx_int_t
+ngx_http_lua_config_file_find(ngx_http_lua_config_file_t *file, u_char *key,
+    size_t len, ngx_str_t *value)
 {
-    ngx_http_lua_config_srv_conf_t  *prev = parent;
-    ngx_http_lua_config_srv_conf_t  *conf = child;
+    ngx_int_t                          rc;
+    ngx_uint_t                         lo, hi, mid;
+    ngx_http_lua_config_file_entry_t  *entry;
 
-    ngx_hash_init_t                  hash;
-    ngx_hash_keys_arrays_t           ha;
-    ngx_uint_t                       i, j, found;
-    ngx_http_lua_upstream_t         *src, *dst, *us;
+    lo = 0;
+    hi = file->nentries;
 
-    if (prev->upstreams != NULL && prev->hash.buckets == NULL) {
-        ngx_memzero(&ha, sizeof(ngx_hash_keys_arrays_t));
-        ha.pool = cf->pool;
-        ha.temp_pool = cf->temp_pool;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        entry = &file->entries[mid];
 
-        if (ngx_hash_keys_array_init(&ha, NGX_HASH_SMALL) != NGX_OK) {
-            return NGX_CONF_ERROR;
-        }
+        rc = ngx_memn2cmp(key, file->start + entry->key_offset,
+                          len, entry->key_len);
 
-        us = prev->upstreams->elts;
-        for (i = 0; i < prev->upstreams->nelts; i++) {
-            if (ngx_hash_add_key(&ha, &us[i].name, &us[i], 0) != NGX_OK) {
-                return NGX_CONF_ERROR;
-            }
+        if (rc == 0) {
+            value->data = file->start + entry->value_offset;
+            value->len = entry->value_len;
+            return NGX_OK;
         }
 
-        if (ha.keys.nelts > 0) {
-            hash.key = ngx_hash_key;
-            hash.max_size = 512;
-            hash.bucket_size = ngx_align(64, ngx_cacheline_size);
-            hash.name = "lua_upstream_hash";
-            hash.pool = cf->pool;
-            hash.temp_pool = NULL;
-            hash.hash = &prev->hash;
+        if (rc < 0) {
+            hi = mid;
 
-            if (ngx_hash_init(&hash, ha.keys.elts, ha.keys.nelts) != NGX_OK) {
-                return NGX_CONF_ERROR;
-            }
+        } else {
+            lo = mid + 1;
         }
     }
 
-    if (conf->upstreams == NULL) {
-        conf->hash = prev->hash;
-        conf->upstreams = prev->upstreams;
-        return NGX_CONF_OK;
-    }
+    return NGX_DECLINED;
+}
 
-    if (prev->upstreams && prev->upstreams->nelts != 0) {
-        src = prev->upstreams->elts;
-        for (i = 0; i < prev->upstreams->nelts; i++) {
-            found = 0;
 
-            dst = conf->upstreams->elts;
-            for (j = 0; j < conf->upstreams->nelts; j++) {
-                if (src[i].name.len == dst[j].name.len
-                    && ngx_strcmp(dst[j].name.data, src[i].name.data) == 0)
-                {
-                    found = 1;
-                    break;
-                }
-            }
+static ngx_int_t
+ngx_http_lua_config_file_variable(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data)
+{
+    ngx_http_lua_config_file_t  *file = (ngx_http_lua_config_file_t *) data;
 
-            if (found) {
-                continue;
-            }
+    ngx_str_t  key, value;
 
-            us = ngx_array_push(conf->upstreams);
-            if (us == NULL) {
-                return NGX_CONF_ERROR;
-            }
+    if (ngx_http_complex_value(r, file->key, &key) != NGX_OK) {
+        return NGX_ERROR;
+    }
 
-            *us = src[i];
-        }
+    if (ngx_http_lua_config_file_find(file, key.data, key.len, &value)
+        != NGX_OK)
+    {
+        v->not_found = 1;
+        return NGX_OK;
     }
 
-    ngx_memzero(&ha, sizeof(ngx_hash_keys_arrays_t));
-    ha.pool = cf->pool;
-    ha.temp_pool = cf->temp_pool;
+    v->data = value.data;
+    v->len = value.len;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
 
-    if (ngx_hash_keys_array_init(&ha, NGX_HASH_SMALL) != NGX_OK) {
-        return NGX_CONF_ERROR;
-    }
+    return NGX_OK;
+}
 
-    us = conf->upstreams->elts;
-    for (i = 0; i < conf->upstreams->nelts; i++) {
-        if (ngx_hash_add_key(&ha, &us[i].name, &us[i], 0) != NGX_OK) {
-            return NGX_CONF_ERROR;
-        }
+
+static int
+ngx_http_lua_config_get_from(lua_State *L)
+{
+    u_char                           *name, *key;
+    size_t                            name_len, key_len;
+    ngx_str_t                         value;
+    ngx_uint_t                        i;
+    ngx_http_lua_config_file_t       *file;
+    ngx_http_lua_config_main_conf_t  *lmcf;
+
+    if (lua_gettop(L) != 2) {
+        return luaL_error(L, "exactly two arguments expected");
     }
 
-    if (ha.keys.nelts == 0) {
-        return NGX_CONF_OK;
+    name = (u_char *) luaL_checklstring(L, 1, &name_len);
+    key = (u_char *) luaL_checklstring(L, 2, &key_len);
+
+    lmcf = ngx_http_cycle_get_module_main_conf(ngx_cycle,
+                                               ngx_http_lua_config_module);
+
+    if (lmcf == NULL || lmcf->files == NULL) {
+        lua_pushnil(L);
+        return 1;
     }
 
-    hash.key = ngx_hash_key;
-    hash.max_size = 512;
-    hash.bucket_size = ngx_align(64, ngx_cacheline_size);
-    hash.name = "lua_upstream_hash";
-    hash.pool = cf->pool;
-    hash.temp_pool = NULL;
-    hash.hash = &conf->hash;
+    file = lmcf->files->elts;
+    for (i = 0; i < lmcf->files->nelts; i++) {
+        if (name_len != file[i].name.len
+            || ngx_strncmp(name, file[i].name.data, name_len) != 0)
+        {
+            continue;
+        }
 
-    if (ngx_hash_init(&hash, ha.keys.elts, ha.keys.nelts) != NGX_OK) {
-        return NGX_CONF_ERROR;
+        if (ngx_http_lua_config_file_find(&file[i], key, key_len, &value)
+            != NGX_OK)
+        {
+            break;
+        }
+
+        lua_pushlstring(L, (char *) value.data, value.len);
+        return 1;
     }
 
-    return NGX_CONF_OK;
+    lua_pushnil(L);
+    return 1;
 }
 
 
-static void *
-ngx_http_lua_config_create_loc_conf(ngx_conf_t *cf)
+static char *
+ngx_http_lua_init_config_directive(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
 {
-    ngx_http_lua_config_loc_conf_t  *conf;
+    ngx_http_lua_config_main_conf_t  *lmcf = conf;
 
-    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_lua_config_loc_conf_t));
-    if (conf == NULL) {
-        return NULL;
-    }
+    return ngx_lua_config_init_config(cf, &lmcf->keys);
+}
 
-    /*
-     * set by ngx_pcalloc():
-     *
-     *     conf->hash = { NULL };
-     *     conf->keys = NULL;
-     */
 
-    conf->hash_max_size = NGX_CONF_UNSET_UINT;
-    conf->hash_bucket_size = NGX_CONF_UNSET_UINT;
+static int
+ngx_http_lua_get_init_configs(lua_State *L)
+{
+    ngx_http_lua_config_main_conf_t  *lmcf;
 
-    return conf;
+    lmcf = ngx_http_cycle_get_module_main_conf(ngx_cycle,
+                                               ngx_http_lua_config_module);
+
+    return ngx_lua_config_push_init_configs(L, lmcf ? lmcf->keys : NULL);
 }
 
 
 static char *
-ngx_http_lua_config_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
+ngx_http_lua_config_init_main_conf(ngx_conf_t *cf, void *conf)
 {
-    ngx_http_lua_config_loc_conf_t  *prev = parent;
-    ngx_http_lua_config_loc_conf_t  *conf = child;
+    ngx_http_lua_config_main_conf_t  *lmcf = conf;
 
-    ngx_hash_init_t                  hash;
-    ngx_hash_keys_arrays_t           ha;
-    ngx_uint_t                       i, j, found;
-    ngx_http_lua_config_keyval_t    *src, *dst, *kv;
-    ngx_http_lua_config_cmd_t       *cmd_src, *cmd_dst;
-    ngx_uint_t                       k;
+    ngx_uint_t                        i;
+    ngx_addr_t                       *peer;
+    ngx_http_lua_upstream_t          *us;
+    ngx_http_lua_config_srv_conf_t   *lscf;
+    ngx_http_lua_config_loc_conf_t   *llcf;
 
-    ngx_conf_merge_uint_value(conf->hash_max_size, prev->hash_max_size, 512);
-    ngx_conf_merge_uint_value(conf->hash_bucket_size, prev->hash_bucket_size,
-                              ngx_align(64, ngx_cacheline_size));
+    /*
+     * the http level is never merged, so its hashes are built here once
+     * instead of lazily by the first server that inherits from it
+     */
 
-    if (prev->keys != NULL && prev->hash.buckets == NULL) {
-        ngx_memzero(&ha, sizeof(ngx_hash_keys_arrays_t));
-        ha.pool = cf->pool;
-        ha.temp_pool = cf->temp_pool;
+    lscf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_lua_config_module);
+    llcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_lua_config_module);
 
-        if (ngx_hash_keys_array_init(&ha, NGX_HASH_SMALL) != NGX_OK) {
-            return NGX_CONF_ERROR;
-        }
+    lmcf->srv_conf = lscf;
+    lmcf->loc_conf = llcf;
 
-        kv = prev->keys->elts;
-        for (i = 0; i < prev->keys->nelts; i++) {
-            if (ngx_hash_add_key(&ha, &kv[i].key, &kv[i], 0) != NGX_OK) {
-                return NGX_CONF_ERROR;
-            }
-        }
+    ngx_conf_init_uint_value(lmcf->fingerprint_algorithm,
+                             NGX_LUA_CONFIG_FINGERPRINT_XXH64);
+    ngx_conf_init_value(lmcf->regex_cache, 0);
+    ngx_conf_init_value(lmcf->warn_shadowed, 0);
+    ngx_conf_init_uint_value(lmcf->stats_sample, 0);
+    ngx_conf_init_msec_value(lmcf->repl_interval, 5000);
+    ngx_conf_init_value(lmcf->inflight, 0);
+
+    if (lmcf->repl_peers != NULL && lmcf->repl_listen == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"lua_config_replication_peer\" requires "
+                           "\"lua_config_replication\"");
+        return NGX_CONF_ERROR;
+    }
 
-        if (ha.keys.nelts > 0) {
-            hash.key = ngx_hash_key;
-            hash.max_size = (prev->hash_max_size != NGX_CONF_UNSET_UINT)
-                            ? prev->hash_max_size : 512;
-            hash.bucket_size = (prev->hash_bucket_size != NGX_CONF_UNSET_UINT)
-                                ? prev->hash_bucket_size
-                                : ngx_align(64, ngx_cacheline_size);
-            hash.name = "lua_config_hash";
-            hash.pool = cf->pool;
-            hash.temp_pool = NULL;
-            hash.hash = &prev->hash;
+    if (lmcf->repl_listen != NULL && lmcf->override_zone == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"lua_config_replication\" requires "
+                           "\"lua_config_override_zone\"");
+        return NGX_CONF_ERROR;
+    }
 
-            if (ngx_hash_init(&hash, ha.keys.elts, ha.keys.nelts) != NGX_OK) {
+    if (lmcf->repl_peers != NULL) {
+        peer = lmcf->repl_peers->elts;
+        for (i = 0; i < lmcf->repl_peers->nelts; i++) {
+            if (peer[i].sockaddr->sa_family
+                != lmcf->repl_listen->sockaddr->sa_family)
+            {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "lua_config_replication_peer \"%V\" "
+                                   "and the \"listen\" address are of "
+                                   "different families", &peer[i].name);
                 return NGX_CONF_ERROR;
             }
         }
     }
 
-    if (conf->keys == NULL) {
-        conf->hash = prev->hash;
-        conf->keys = prev->keys;
-        return NGX_CONF_OK;
-    }
-
-    if (prev->keys && prev->keys->nelts != 0) {
-        src = prev->keys->elts;
-        for (i = 0; i < prev->keys->nelts; i++) {
-            found = 0;
-
-            dst = conf->keys->elts;
-            for (j = 0; j < conf->keys->nelts; j++) {
-                if (src[i].key.len == dst[j].key.len
-                    && ngx_strcmp(dst[j].key.data, src[i].key.data) == 0)
-                {
-                    found = 1;
-                    break;
-                }
-            }
+    ngx_lua_config_fingerprint_init_engine();
 
-            if (found) {
-                /* append parent cmds to the end of child's same-name kv */
-                cmd_src = src[i].cmds->elts;
-                for (k = 0; k < src[i].cmds->nelts; k++) {
-                    cmd_dst = ngx_array_push(dst[j].cmds);
-                    if (cmd_dst == NULL) {
-                        return NGX_CONF_ERROR;
-                    }
-                    *cmd_dst = cmd_src[k];
-                }
+    if (lmcf->key_handles != NULL
+        && ngx_http_lua_config_add_key_variables(cf, lmcf) != NGX_OK)
+    {
+        return NGX_CONF_ERROR;
+    }
 
-                continue;
-            }
+    if (lscf->upstreams != NULL) {
+        us = lscf->upstreams->elts;
+        for (i = 0; i < lscf->upstreams->nelts; i++) {
+            ngx_lua_config_prune_keys(cf, &ngx_http_lua_config_chain,
+                                      us[i].keys);
+            ngx_http_lua_upstream_init_fingerprint(lmcf->fingerprint_algorithm,
+                                                   &us[i]);
 
-            kv = ngx_array_push(conf->keys);
-            if (kv == NULL) {
+            if (ngx_http_lua_config_add_resolve(cf, lmcf, &us[i]) != NGX_OK) {
                 return NGX_CONF_ERROR;
             }
 
-            *kv = src[i];
+            us[i].inflight = lmcf->ninflight;
+            lmcf->ninflight += us[i].servers->nelts;
+        }
+
+        if (ngx_http_lua_config_init_upstreams_hash(cf, lscf) != NGX_OK) {
+            return NGX_CONF_ERROR;
         }
     }
 
-    ngx_memzero(&ha, sizeof(ngx_hash_keys_arrays_t));
-    ha.pool = cf->pool;
-    ha.temp_pool = cf->temp_pool;
+    ngx_http_lua_config_init_srv_definitions(cf, lscf);
 
-    if (ngx_hash_keys_array_init(&ha, NGX_HASH_SMALL) != NGX_OK) {
+    ngx_conf_init_uint_value(llcf->hash_max_size, 512);
+    ngx_conf_init_uint_value(llcf->hash_bucket_size,
+                             ngx_align(64, ngx_cacheline_size));
+
+    ngx_lua_config_prune_keys(cf, &ngx_http_lua_config_chain, llcf->keys);
+
+    if (ngx_http_lua_config_init_fingerprint(cf, llcf) != NGX_OK) {
         return NGX_CONF_ERROR;
     }
 
-    kv = conf->keys->elts;
-    for (i = 0; i < conf->keys->nelts; i++) {
-        if (ngx_hash_add_key(&ha, &kv[i].key, &kv[i], 0) != NGX_OK) {
-            return NGX_CONF_ERROR;
-        }
+    if (llcf->keys != NULL
+        && ngx_http_lua_config_init_keys_hash(cf, llcf) != NGX_OK)
+    {
+        return NGX_CONF_ERROR;
     }
 
-    if (ha.keys.nelts == 0) {
-        return NGX_CONF_OK;
+    if (ngx_http_lua_config_add_scope(cf, llcf) != NGX_OK) {
+        return NGX_CONF_ERROR;
     }
 
-    hash.key = ngx_hash_key;
-    hash.max_size = conf->hash_max_size;
-    hash.bucket_size = conf->hash_bucket_size;
-    hash.name = "lua_config_hash";
-    hash.pool = cf->pool;
-    hash.temp_pool = NULL;
-    hash.hash = &conf->hash;
+    if (lmcf->keys == NULL) {
+        return NGX_CONF_OK;
+    }
 
-    if (ngx_hash_init(&hash, ha.keys.elts, ha.keys.nelts) != NGX_OK) {
+    lmcf->init_tree = ngx_lua_config_init_tree(cf, lmcf->keys);
+    if (lmcf->init_tree == NULL) {
         return NGX_CONF_ERROR;
     }
 
@@ -889,670 +2019,6491 @@ ngx_http_lua_config_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
 }
 
 
-static char *
-ngx_http_lua_upstream_block(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+static int
+ngx_http_lua_get_init_config(lua_State *L)
 {
-    ngx_http_lua_config_srv_conf_t  *lscf = conf;
+    ngx_http_lua_config_main_conf_t  *lmcf;
 
-    ngx_str_t                       *value;
-    u_char                          *p;
-    ngx_http_lua_upstream_t         *us;
-    ngx_uint_t                       i;
-    char                            *rv;
-    ngx_conf_t                       save;
+    lmcf = ngx_http_cycle_get_module_main_conf(ngx_cycle,
+                                               ngx_http_lua_config_module);
+
+    return ngx_lua_config_push_init_config(L, lmcf ? lmcf->init_tree : NULL);
+}
+
+
+static char *
+ngx_http_lua_config_directive(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_lua_config_loc_conf_t *llcf = conf;
+
+    ngx_str_t                      *value;
+    ngx_http_lua_config_cmd_t      *lcmd;
+    ngx_uint_t                      last;
+    ngx_str_t                       s;
 
     value = cf->args->elts;
 
-    if (value[1].len == 0) {
-        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-                           "lua_upstream name cannot be empty");
+    lcmd = ngx_http_lua_config_add_cmd(cf, llcf, &value[1]);
+    if (lcmd == NULL) {
         return NGX_CONF_ERROR;
     }
 
-    if (lscf->upstreams == NULL) {
-        lscf->upstreams = ngx_array_create(cf->pool, 4,
-                                       sizeof(ngx_http_lua_upstream_t));
-        if (lscf->upstreams == NULL) {
-            return NGX_CONF_ERROR;
-        }
-    }
+    last = cf->args->nelts - 1;
 
-    /* check for duplicate name in current context */
-    us = lscf->upstreams->elts;
-    for (i = 0; i < lscf->upstreams->nelts; i++) {
-        if (value[1].len == us[i].name.len
-            && ngx_strcmp(value[1].data, us[i].name.data) == 0)
-        {
-            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-                               "duplicate lua_upstream \"%V\"", &value[1]);
-            return NGX_CONF_ERROR;
-        }
-    }
+    switch (ngx_http_lua_config_parse_filter(cf, lcmd, &value[last])) {
 
-    us = ngx_array_push(lscf->upstreams);
-    if (us == NULL) {
+    case NGX_OK:
+        last--;
+        break;
+
+    case NGX_DECLINED:
+        break;
+
+    default: /* NGX_ERROR */
         return NGX_CONF_ERROR;
     }
 
-    us->name = value[1];
+    switch (ngx_lua_config_join_args(cf, value, 2, last, &s)) {
 
-    us->servers = ngx_array_create(cf->pool, 4,
-                                   sizeof(ngx_http_lua_upstream_server_t));
-    if (us->servers == NULL) {
+    case NGX_OK:
+        break;
+
+    case NGX_DECLINED:
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "no value specified for lua_config \"%V\"",
+                           &value[1]);
+        return NGX_CONF_ERROR;
+
+    default: /* NGX_ERROR */
         return NGX_CONF_ERROR;
     }
 
-    us->keys = ngx_array_create(cf->pool, 4,
-                                sizeof(ngx_http_lua_config_keyval_t));
-    if (us->keys == NULL) {
+    lcmd->value = ngx_http_lua_config_intern_value(cf, &s, &lcmd->index);
+    if (lcmd->value == NULL) {
         return NGX_CONF_ERROR;
     }
 
-    save = *cf;
-    cf->handler = ngx_http_lua_upstream;
-    cf->handler_conf = conf;
+    return NGX_CONF_OK;
+}
 
-    rv = ngx_conf_parse(cf, NULL);
 
-    *cf = save;
+static ngx_http_lua_config_cmd_t *
+ngx_http_lua_config_add_cmd(ngx_conf_t *cf,
+    ngx_http_lua_config_loc_conf_t *llcf, ngx_str_t *name)
+{
+    ngx_http_lua_config_key_t  *key;
+    ngx_http_lua_config_cmd_t  *lcmd;
+
+    lcmd = ngx_lua_config_add_cmd(cf, &ngx_http_lua_config_chain,
+                                  &llcf->keys, name);
+    if (lcmd == NULL) {
+        return NULL;
+    }
+
+    /* taken by $lua_config_fingerprint and $lua_config_file_<name> */
+
+    if ((name->len == sizeof("fingerprint") - 1
+         && ngx_strncmp(name->data, "fingerprint", name->len) == 0)
+        || (name->len >= sizeof("file_") - 1
+            && ngx_strncmp(name->data, "file_", sizeof("file_") - 1) == 0))
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "lua config directive name \"%V\" is reserved",
+                           name);
+        return NULL;
+    }
+
+    key = ngx_http_lua_config_key(cf, name);
+    if (key == NULL) {
+        return NULL;
+    }
+
+    key->defined = 1;
+
+    ngx_crc32_init(lcmd->crc);
+    ngx_http_lua_config_crc32_args(cf, &lcmd->crc);
+
+    lcmd->file = cf->conf_file->file.name.data;
+    lcmd->line = cf->conf_file->line;
 
-    return rv;
+    return lcmd;
 }
 
 
 static char *
-ngx_http_lua_upstream(ngx_conf_t *cf, ngx_command_t *dummy, void *conf)
+ngx_http_lua_config_map_block(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
-    ngx_http_lua_config_srv_conf_t  *lscf = conf;
-    ngx_http_lua_upstream_t         *us;
-    ngx_str_t                       *value;
-    ngx_uint_t                       i, last;
-    ngx_http_lua_upstream_server_t  *server;
-    ngx_http_lua_config_keyval_t    *kv;
-    ngx_http_lua_config_cmd_t       *lcmd;
-    ngx_http_compile_complex_value_t ccv;
-    ngx_str_t                        s, separator;
-    ngx_url_t                        u;
-    u_char                          *p;
+    ngx_http_lua_config_loc_conf_t *llcf = conf;
+
+    char                               *rv;
+    ngx_str_t                          *value;
+    ngx_conf_t                          save;
+    ngx_hash_init_t                     hash;
+    ngx_http_lua_config_cmd_t          *lcmd;
+    ngx_http_lua_config_map_t          *map;
+    ngx_http_lua_config_map_conf_t      ctx;
+    ngx_http_compile_complex_value_t    ccv;
 
     value = cf->args->elts;
 
-    us = (ngx_http_lua_upstream_t *) lscf->upstreams->elts
-         + (lscf->upstreams->nelts - 1);
-    if (us == NULL) {
-        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-                           "lua_upstream handler called without context");
+    lcmd = ngx_http_lua_config_add_cmd(cf, llcf, &value[1]);
+    if (lcmd == NULL) {
         return NGX_CONF_ERROR;
     }
 
-    /* parse "server host[:port] [level=N] [weight=N] [down]" */
-    if (ngx_strcmp(value[0].data, "server") == 0) {
-        if (cf->args->nelts < 2) {
-            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-                               "invalid number of arguments in "
-                               "\"server\" directive inside lua_upstream");
-            return NGX_CONF_ERROR;
-        }
+    map = ngx_pcalloc(cf->pool, sizeof(ngx_http_lua_config_map_t));
+    if (map == NULL) {
+        return NGX_CONF_ERROR;
+    }
 
-        server = ngx_array_push(us->servers);
-        if (server == NULL) {
+    lcmd->map = map;
+
+    ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
+
+    ccv.cf = cf;
+    ccv.value = &value[2];
+    ccv.complex_value = &map->source;
+
+    if (ngx_http_compile_complex_value(&ccv) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_memzero(&ctx, sizeof(ngx_http_lua_config_map_conf_t));
+
+    ctx.keys.pool = cf->pool;
+    ctx.keys.temp_pool = cf->temp_pool;
+
+    if (ngx_hash_keys_array_init(&ctx.keys, NGX_HASH_SMALL) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    ctx.map = map;
+    ctx.crc = &lcmd->crc;
+
+    save = *cf;
+    cf->handler = ngx_http_lua_config_map;
+    cf->handler_conf = (char *) &ctx;
+
+    rv = ngx_conf_parse(cf, NULL);
+
+    *cf = save;
+
+    if (rv != NGX_CONF_OK) {
+        return rv;
+    }
+
+    /* the same hash sizes as for the keys, if already set at this level */
+
+    hash.key = ngx_hash_key_lc;
+    hash.max_size = llcf->hash_max_size != NGX_CONF_UNSET_UINT
+                    ? llcf->hash_max_size : 512;
+    hash.bucket_size = llcf->hash_bucket_size != NGX_CONF_UNSET_UINT
+                       ? llcf->hash_bucket_size
+                       : ngx_align(64, ngx_cacheline_size);
+    hash.name = "lua_config_map_hash";
+    hash.pool = cf->pool;
+
+    if (ctx.keys.keys.nelts) {
+        hash.hash = &map->hash.hash;
+        hash.temp_pool = NULL;
+
+        if (ngx_hash_init(&hash, ctx.keys.keys.elts, ctx.keys.keys.nelts)
+            != NGX_OK)
+        {
             return NGX_CONF_ERROR;
         }
+    }
 
-        server->level = 1;
-        server->weight = 1;
-        server->down = 0;
-        server->port = 0;
-
-        ngx_memzero(&u, sizeof(ngx_url_t));
+    if (ctx.keys.dns_wc_head.nelts) {
 
-        u.url = value[1];
-        u.default_port = 0;
-        u.no_resolve = 1;
+        ngx_qsort(ctx.keys.dns_wc_head.elts,
+                  (size_t) ctx.keys.dns_wc_head.nelts,
+                  sizeof(ngx_hash_key_t),
+                  ngx_http_lua_config_map_cmp_dns_wildcards);
 
-        if (ngx_parse_url(cf->pool, &u) != NGX_OK) {
-            if (u.err) {
-                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-                                   "%s in upstream \"%V\"", u.err, &u.url);
-            }
+        hash.hash = NULL;
+        hash.temp_pool = cf->temp_pool;
 
+        if (ngx_hash_wildcard_init(&hash, ctx.keys.dns_wc_head.elts,
+                                   ctx.keys.dns_wc_head.nelts)
+            != NGX_OK)
+        {
             return NGX_CONF_ERROR;
         }
 
-        if (u.family == AF_UNIX) {
-            server->host.data = value[1].data;
-            server->host.len = sizeof("unix:") - 1 + u.host.len;
+        map->hash.wc_head = (ngx_hash_wildcard_t *) hash.hash;
+    }
 
-        } else {
-            server->host = u.host;
+    if (ctx.keys.dns_wc_tail.nelts) {
+
+        ngx_qsort(ctx.keys.dns_wc_tail.elts,
+                  (size_t) ctx.keys.dns_wc_tail.nelts,
+                  sizeof(ngx_hash_key_t),
+                  ngx_http_lua_config_map_cmp_dns_wildcards);
+
+        hash.hash = NULL;
+        hash.temp_pool = cf->temp_pool;
+
+        if (ngx_hash_wildcard_init(&hash, ctx.keys.dns_wc_tail.elts,
+                                   ctx.keys.dns_wc_tail.nelts)
+            != NGX_OK)
+        {
+            return NGX_CONF_ERROR;
         }
 
-        server->port = u.port;
+        map->hash.wc_tail = (ngx_hash_wildcard_t *) hash.hash;
+    }
 
-        /* parse optional params: level=N, weight=N, down */
-        for (i = 2; i < cf->args->nelts; i++) {
-            if (ngx_strncmp(value[i].data, "level=", 6) == 0) {
-                server->level = ngx_atoi(value[i].data + 6,
-                                         value[i].len - 6);
+    return NGX_CONF_OK;
+}
 
-                if (server->level == (ngx_uint_t) NGX_ERROR) {
-                    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-                                       "invalid level value \"%V\"",
-                                       &value[i]);
-                    return NGX_CONF_ERROR;
-                }
 
-                continue;
-            }
+static int ngx_libc_cdecl
+ngx_http_lua_config_map_cmp_dns_wildcards(const void *one, const void *two)
+{
+    ngx_hash_key_t  *first, *second;
 
-            if (ngx_strncmp(value[i].data, "weight=", 7) == 0) {
-                server->weight = ngx_atoi(value[i].data + 7,
-                                          value[i].len - 7);
+    first = (ngx_hash_key_t *) one;
+    second = (ngx_hash_key_t *) two;
 
-                if (server->weight == (ngx_uint_t) NGX_ERROR) {
-                    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-                                       "invalid weight value \"%V\"",
-                                       &value[i]);
-                    return NGX_CONF_ERROR;
-                }
+    return ngx_dns_strcmp(first->key.data, second->key.data);
+}
 
-                if (server->weight == 0) {
-                    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-                                       "weight value cannot be zero "
-                                       "\"%V\"", &value[i]);
-                    return NGX_CONF_ERROR;
-                }
 
-                continue;
-            }
+static char *
+ngx_http_lua_config_map(ngx_conf_t *cf, ngx_command_t *dummy, void *conf)
+{
+    ngx_http_lua_config_map_conf_t  *ctx = conf;
 
-            if (ngx_strcmp(value[i].data, "down") == 0) {
-                server->down = 1;
-                continue;
-            }
+    ngx_int_t                          rc;
+    ngx_str_t                         *value;
+    ngx_http_complex_value_t          *cv;
 
-            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-                               "invalid parameter \"%V\" in server directive "
-                               "inside lua_upstream", &value[i]);
+    value = cf->args->elts;
 
-            return NGX_CONF_ERROR;
-        }
+    ngx_http_lua_config_crc32_args(cf, ctx->crc);
 
+    if (cf->args->nelts == 1
+        && ngx_strcmp(value[0].data, "hostnames") == 0)
+    {
+        ctx->hostnames = 1;
         return NGX_CONF_OK;
     }
 
-    /* parse other config items: key arg1 [arg2 ...] [separator=X] [if=|if!=] */
-    if (cf->args->nelts < 2) {
+    if (cf->args->nelts != 2) {
         ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-                            "invalid number of the lua_upstream parameters");
+                           "invalid number of the lua_config_map parameters");
         return NGX_CONF_ERROR;
     }
 
-    /* validate key name */
-    for (p = value[0].data; p < value[0].data + value[0].len; p++) {
-        if (!((*p >= '0' && *p <= '9')
-              || (*p >= 'a' && *p <= 'z')
-              || *p == '_'))
-        {
+    if (ngx_strcmp(value[0].data, "include") == 0) {
+        return ngx_conf_include(cf, dummy, conf);
+    }
+
+    cv = ngx_http_lua_config_intern_value(cf, &value[1], NULL);
+    if (cv == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (ngx_strcmp(value[0].data, "default") == 0) {
+
+        if (ctx->map->default_value) {
             ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-                               "invalid character in lua_upstream "
-                               "config key \"%V\"", &value[0]);
+                               "duplicate default lua_config_map parameter");
             return NGX_CONF_ERROR;
         }
+
+        ctx->map->default_value = cv;
+
+        return NGX_CONF_OK;
     }
 
-    if (ngx_strcmp(value[0].data, "name") == 0
-        || ngx_strcmp(value[0].data, "crc32") == 0)
-    {
+    if (value[0].len && value[0].data[0] == '\\') {
+        value[0].len--;
+        value[0].data++;
+    }
+
+    rc = ngx_hash_add_key(&ctx->keys, &value[0], cv,
+                          (ctx->hostnames) ? NGX_HASH_WILDCARD_KEY : 0);
+
+    if (rc == NGX_OK) {
+        return NGX_CONF_OK;
+    }
+
+    if (rc == NGX_DECLINED) {
         ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-                           "invalid directive name in lua_upstream");
-        return NGX_CONF_ERROR;
+                           "invalid hostname or wildcard \"%V\"", &value[0]);
     }
 
-    /* find or create keyval */
-    kv = us->keys->elts;
-    for (i = 0; i < us->keys->nelts; i++) {
-        if (value[0].len == kv[i].key.len
-            && ngx_strncmp(value[0].data, kv[i].key.data, value[0].len) == 0)
-        {
-            break;
+    if (rc == NGX_BUSY) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "conflicting parameter \"%V\"", &value[0]);
+    }
+
+    return NGX_CONF_ERROR;
+}
+
+
+static ngx_int_t
+ngx_http_lua_config_map_find(ngx_http_request_t *r,
+    ngx_http_lua_config_map_t *map, ngx_http_complex_value_t **cv)
+{
+    u_char      *low;
+    ngx_str_t    source;
+    ngx_uint_t   key;
+
+    if (ngx_http_complex_value(r, &map->source, &source) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (source.len && source.data[source.len - 1] == '.'
+        && (map->hash.wc_head || map->hash.wc_tail))
+    {
+        source.len--;
+    }
+
+    *cv = NULL;
+
+    if (source.len) {
+        low = ngx_pnalloc(r->pool, source.len);
+        if (low == NULL) {
+            return NGX_ERROR;
+        }
+
+        key = ngx_hash_strlow(low, source.data, source.len);
+
+        *cv = ngx_hash_find_combined(&map->hash, key, low, source.len);
+    }
+
+    if (*cv == NULL) {
+        *cv = map->default_value;
+    }
+
+    return *cv ? NGX_OK : NGX_DECLINED;
+}
+
+
+ngx_http_lua_config_key_t *
+ngx_http_lua_config_key(ngx_conf_t *cf, ngx_str_t *name)
+{
+    uint32_t                           hash;
+    ngx_http_lua_config_key_t         *key, **keyp;
+    ngx_http_lua_config_main_conf_t   *lmcf;
+
+    lmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_lua_config_module);
+
+    hash = ngx_crc32_short(name->data, name->len);
+
+    key = (ngx_http_lua_config_key_t *)
+              ngx_str_rbtree_lookup(&lmcf->key_tree, name, hash);
+
+    if (key != NULL) {
+        return key;
+    }
+
+    if (lmcf->key_handles == NULL) {
+        lmcf->key_handles = ngx_array_create(cf->pool, 16,
+                                        sizeof(ngx_http_lua_config_key_t *));
+        if (lmcf->key_handles == NULL) {
+            return NULL;
         }
     }
 
-    if (i == us->keys->nelts) {
-        kv = ngx_array_push(us->keys);
-        if (kv == NULL) {
-            return NGX_CONF_ERROR;
-        }
+    key = ngx_pcalloc(cf->pool, sizeof(ngx_http_lua_config_key_t));
+    if (key == NULL) {
+        return NULL;
+    }
+
+    /* the name may be in a buffer of the caller */
+
+    key->sn.str.len = name->len;
+    key->sn.str.data = ngx_pstrdup(cf->pool, name);
+    if (key->sn.str.data == NULL) {
+        return NULL;
+    }
+
+    key->sn.node.key = hash;
+    key->hash = ngx_hash_key(name->data, name->len);
+
+    ngx_rbtree_insert(&lmcf->key_tree, &key->sn.node);
+
+    keyp = ngx_array_push(lmcf->key_handles);
+    if (keyp == NULL) {
+        return NULL;
+    }
+
+    *keyp = key;
+
+    return key;
+}
+
+
+static ngx_int_t
+ngx_http_lua_config_parse_filter(ngx_conf_t *cf,
+    ngx_http_lua_config_cmd_t *lcmd, ngx_str_t *arg)
+{
+    ngx_str_t                          s;
+    ngx_uint_t                         regex;
+#if (NGX_PCRE)
+    u_char                            *p;
+    ngx_regex_compile_t                rc;
+    u_char                             errstr[NGX_MAX_CONF_ERRSTR];
+#endif
+
+    /*
+     * if=value, if!=value, and the regex forms if~=value:regex,
+     * if~*=value:regex (caseless), if!~=value:regex, if!~*=value:regex
+     */
+
+    if (ngx_lua_config_parse_filter(arg, &lcmd->negative, &regex, &s)
+        != NGX_OK)
+    {
+        return NGX_DECLINED;
+    }
+
+    if (!regex) {
+        lcmd->filter = ngx_http_lua_config_intern_value(cf, &s, NULL);
+        if (lcmd->filter == NULL) {
+            return NGX_ERROR;
+        }
+
+        return NGX_OK;
+    }
+
+#if (NGX_PCRE)
+
+    p = ngx_strlchr(s.data, s.data + s.len, ':');
+
+    if (p == NULL || p == s.data || p + 1 == s.data + s.len) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid regex condition \"%V\"", arg);
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(&rc, sizeof(ngx_regex_compile_t));
+
+    rc.pattern.data = p + 1;
+    rc.pattern.len = s.data + s.len - (p + 1);
+    rc.err.len = NGX_MAX_CONF_ERRSTR;
+    rc.err.data = errstr;
+    rc.options = (regex == 2) ? NGX_REGEX_CASELESS : 0;
+
+    s.len = p - s.data;
+
+    lcmd->filter = ngx_http_lua_config_intern_value(cf, &s, NULL);
+    if (lcmd->filter == NULL) {
+        return NGX_ERROR;
+    }
+
+    lcmd->regex = ngx_http_regex_compile(cf, &rc);
+    if (lcmd->regex == NULL) {
+        return NGX_ERROR;
+    }
+
+    lcmd->regex_index = ngx_http_lua_config_next_regex(cf);
+
+    return NGX_OK;
+
+#else
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "using regex \"%V\" requires PCRE library", arg);
+    return NGX_ERROR;
+
+#endif
+}
+
+
+static ngx_http_complex_value_t *
+ngx_http_lua_config_intern_value(ngx_conf_t *cf, ngx_str_t *value,
+    ngx_uint_t *index)
+{
+    ngx_http_lua_config_main_conf_t  *lmcf;
+
+    lmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_lua_config_module);
+
+    return ngx_lua_config_intern_value(cf, &ngx_http_lua_config_chain,
+                                       &lmcf->values, value, index);
+}
+
+
+static void *
+ngx_http_lua_config_compile(ngx_conf_t *cf, ngx_str_t *value,
+    ngx_uint_t *dynamic)
+{
+    ngx_http_complex_value_t          *cv;
+    ngx_http_compile_complex_value_t   ccv;
+
+    cv = ngx_palloc(cf->pool, sizeof(ngx_http_complex_value_t));
+    if (cv == NULL) {
+        return NULL;
+    }
+
+    ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
+
+    ccv.cf = cf;
+    ccv.value = value;
+    ccv.complex_value = cv;
+
+    if (ngx_http_compile_complex_value(&ccv) != NGX_OK) {
+        return NULL;
+    }
+
+    *dynamic = (cv->lengths != NULL);
+
+    return cv;
+}
+
+
+#if (NGX_PCRE)
+
+static ngx_uint_t
+ngx_http_lua_config_next_regex(ngx_conf_t *cf)
+{
+    ngx_http_lua_config_main_conf_t  *lmcf;
+
+    lmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_lua_config_module);
+
+    return lmcf->nregex++;
+}
+
+#endif
+
+
+static ngx_int_t
+ngx_http_lua_config_add_key_variables(ngx_conf_t *cf,
+    ngx_http_lua_config_main_conf_t *lmcf)
+{
+    ngx_str_t                    name, rest;
+    ngx_uint_t                   i, j;
+    ngx_http_variable_t         *var;
+    ngx_http_lua_config_key_t   *key, **keys;
+    ngx_http_lua_config_file_t  *file;
+
+    /*
+     * every key gets its own $lua_config_<name> variable, so that the
+     * variable is resolved by index and the key hash is precomputed;
+     * defined keys cannot take the names of the module's other
+     * variables, handles of the C API that do are left without one
+     */
+
+    keys = lmcf->key_handles->elts;
+
+    for (i = 0; i < lmcf->key_handles->nelts; i++) {
+        key = keys[i];
+
+        if (key->sn.str.len == sizeof("fingerprint") - 1
+            && ngx_strncmp(key->sn.str.data, "fingerprint",
+                           sizeof("fingerprint") - 1) == 0)
+        {
+            continue;
+        }
+
+        if (lmcf->files && key->sn.str.len > sizeof("file_") - 1
+            && ngx_strncmp(key->sn.str.data, "file_", sizeof("file_") - 1)
+               == 0)
+        {
+            rest.len = key->sn.str.len - (sizeof("file_") - 1);
+            rest.data = key->sn.str.data + sizeof("file_") - 1;
+
+            file = lmcf->files->elts;
+            for (j = 0; j < lmcf->files->nelts; j++) {
+                if (file[j].key != NULL
+                    && file[j].name.len == rest.len
+                    && ngx_strncmp(file[j].name.data, rest.data, rest.len)
+                       == 0)
+                {
+                    break;
+                }
+            }
+
+            if (j != lmcf->files->nelts) {
+                continue;
+            }
+        }
+
+        name.len = sizeof("lua_config_") - 1 + key->sn.str.len;
+        name.data = ngx_pnalloc(cf->pool, name.len);
+        if (name.data == NULL) {
+            return NGX_ERROR;
+        }
+
+        ngx_sprintf(name.data, "lua_config_%V", &key->sn.str);
+
+        var = ngx_http_add_variable(cf, &name, NGX_HTTP_VAR_NOCACHEABLE);
+        if (var == NULL) {
+            return NGX_ERROR;
+        }
+
+        var->get_handler = ngx_http_lua_config_key_variable;
+        var->data = (uintptr_t) key;
+    }
+
+    return NGX_OK;
+}
+
+
+static void *
+ngx_http_lua_config_create_main_conf(ngx_conf_t *cf)
+{
+    ngx_http_lua_config_main_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_lua_config_main_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->keys = NULL;
+     */
+
+    ngx_rbtree_init(&conf->key_tree, &conf->key_sentinel,
+                    ngx_str_rbtree_insert_value);
+    ngx_lua_config_values_init(&conf->values);
+    ngx_rbtree_init(&conf->server_tree, &conf->server_sentinel,
+                    ngx_str_rbtree_insert_value);
+
+    conf->fingerprint_algorithm = NGX_CONF_UNSET_UINT;
+    conf->regex_cache = NGX_CONF_UNSET;
+    conf->warn_shadowed = NGX_CONF_UNSET;
+    conf->stats_sample = NGX_CONF_UNSET_UINT;
+    conf->repl_interval = NGX_CONF_UNSET_MSEC;
+    conf->inflight = NGX_CONF_UNSET;
+
+    return conf;
+}
+
+
+static void *
+ngx_http_lua_config_create_srv_conf(ngx_conf_t *cf)
+{
+    ngx_http_lua_config_srv_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_lua_config_srv_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->hash = { NULL };
+     *     conf->upstreams = NULL;
+     */
+
+    return conf;
+}
+
+
+static char *
+ngx_http_lua_config_merge_srv_conf(ngx_conf_t *cf, void *parent, void *child)
+{
+    ngx_http_lua_config_srv_conf_t  *prev = parent;
+    ngx_http_lua_config_srv_conf_t  *conf = child;
+
+    ngx_uint_t                        i, j, found;
+    ngx_http_lua_upstream_t          *src, *dst, *us;
+    ngx_http_lua_config_main_conf_t  *lmcf;
+
+    if (ngx_http_lua_config_add_server_names(cf, conf) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    /* the http level hash is built by ngx_http_lua_config_init_main_conf() */
+
+    if (conf->upstreams == NULL) {
+        conf->hash = prev->hash;
+        conf->upstreams = prev->upstreams;
+        conf->definitions = prev->definitions;
+        return NGX_CONF_OK;
+    }
+
+    /*
+     * the algorithm is only known once the http block is parsed, so
+     * fingerprints of the server's own upstreams are computed here,
+     * inherited ones already have theirs
+     */
+
+    lmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_lua_config_module);
+
+    us = conf->upstreams->elts;
+    for (i = 0; i < conf->upstreams->nelts; i++) {
+        ngx_lua_config_prune_keys(cf, &ngx_http_lua_config_chain, us[i].keys);
+        ngx_http_lua_upstream_init_fingerprint(lmcf->fingerprint_algorithm,
+                                               &us[i]);
+
+        if (ngx_http_lua_config_add_resolve(cf, lmcf, &us[i]) != NGX_OK) {
+            return NGX_CONF_ERROR;
+        }
+
+        /* inherited blocks share the counters of the http level */
+        us[i].inflight = lmcf->ninflight;
+        lmcf->ninflight += us[i].servers->nelts;
+    }
+
+    if (prev->upstreams && prev->upstreams->nelts != 0) {
+        src = prev->upstreams->elts;
+        for (i = 0; i < prev->upstreams->nelts; i++) {
+            found = 0;
+
+            dst = conf->upstreams->elts;
+            for (j = 0; j < conf->upstreams->nelts; j++) {
+                if (src[i].name.len == dst[j].name.len
+                    && ngx_strcmp(dst[j].name.data, src[i].name.data) == 0)
+                {
+                    found = 1;
+                    break;
+                }
+            }
+
+            if (found) {
+                continue;
+            }
+
+            us = ngx_array_push(conf->upstreams);
+            if (us == NULL) {
+                return NGX_CONF_ERROR;
+            }
+
+            *us = src[i];
+        }
+    }
+
+    if (ngx_http_lua_config_init_upstreams_hash(cf, conf) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_http_lua_config_init_srv_definitions(cf, conf);
+
+    return NGX_CONF_OK;
+}
+
+
+static ngx_int_t
+ngx_http_lua_config_add_server_names(ngx_conf_t *cf,
+    ngx_http_lua_config_srv_conf_t *lscf)
+{
+    uint32_t                          hash;
+    ngx_uint_t                        i;
+    ngx_http_server_name_t           *name;
+    ngx_http_core_srv_conf_t         *cscf;
+    ngx_http_lua_config_server_t     *server;
+    ngx_http_lua_config_main_conf_t  *lmcf;
+
+    /*
+     * makes the server addressable as "server:name" outside of its
+     * requests; regex names are skipped, and of servers sharing a name
+     * the first one wins
+     */
+
+    lmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_lua_config_module);
+    cscf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_core_module);
+
+    name = cscf->server_names.elts;
+
+    for (i = 0; i < cscf->server_names.nelts; i++) {
+
+        if (name[i].regex || name[i].name.len == 0) {
+            continue;
+        }
+
+        hash = ngx_crc32_short(name[i].name.data, name[i].name.len);
+
+        if (ngx_str_rbtree_lookup(&lmcf->server_tree, &name[i].name, hash)) {
+            continue;
+        }
+
+        server = ngx_palloc(cf->pool, sizeof(ngx_http_lua_config_server_t));
+        if (server == NULL) {
+            return NGX_ERROR;
+        }
+
+        server->sn.node.key = hash;
+        server->sn.str = name[i].name;
+        server->srv_conf = lscf;
+        server->loc_conf = ngx_http_conf_get_module_loc_conf(cf,
+                                                  ngx_http_lua_config_module);
+
+        ngx_rbtree_insert(&lmcf->server_tree, &server->sn.node);
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_lua_config_init_upstreams_hash(ngx_conf_t *cf,
+    ngx_http_lua_config_srv_conf_t *lscf)
+{
+    ngx_hash_init_t                  hash;
+    ngx_hash_keys_arrays_t           ha;
+    ngx_uint_t                       i;
+    ngx_http_lua_upstream_t         *us;
+
+    ngx_memzero(&ha, sizeof(ngx_hash_keys_arrays_t));
+    ha.pool = cf->pool;
+    ha.temp_pool = cf->temp_pool;
+
+    if (ngx_hash_keys_array_init(&ha, NGX_HASH_SMALL) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    us = lscf->upstreams->elts;
+    for (i = 0; i < lscf->upstreams->nelts; i++) {
+        if (ngx_hash_add_key(&ha, &us[i].name, &us[i], 0) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
+    if (ha.keys.nelts == 0) {
+        return NGX_OK;
+    }
+
+    hash.key = ngx_hash_key;
+    hash.max_size = 512;
+    hash.bucket_size = ngx_align(64, ngx_cacheline_size);
+    hash.name = "lua_upstream_hash";
+    hash.pool = cf->pool;
+    hash.temp_pool = NULL;
+    hash.hash = &lscf->hash;
+
+    return ngx_hash_init(&hash, ha.keys.elts, ha.keys.nelts);
+}
+
+
+static void *
+ngx_http_lua_config_create_loc_conf(ngx_conf_t *cf)
+{
+    ngx_http_lua_config_loc_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_lua_config_loc_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->hash = { NULL };
+     *     conf->keys = NULL;
+     */
+
+    conf->hash_max_size = NGX_CONF_UNSET_UINT;
+    conf->hash_bucket_size = NGX_CONF_UNSET_UINT;
+
+    return conf;
+}
+
+
+static char *
+ngx_http_lua_config_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
+{
+    ngx_http_lua_config_loc_conf_t  *prev = parent;
+    ngx_http_lua_config_loc_conf_t  *conf = child;
+
+    ngx_conf_merge_uint_value(conf->hash_max_size, prev->hash_max_size, 512);
+    ngx_conf_merge_uint_value(conf->hash_bucket_size, prev->hash_bucket_size,
+                              ngx_align(64, ngx_cacheline_size));
+
+    /* the http level hash is built by ngx_http_lua_config_init_main_conf() */
+
+    if (conf->keys == NULL) {
+        conf->hash = prev->hash;
+        conf->keys = prev->keys;
+        conf->fp_static = prev->fp_static;
+        conf->fingerprint = prev->fingerprint;
+        conf->dynamic = prev->dynamic;
+
+        if (ngx_http_lua_config_add_scope(cf, conf) != NGX_OK) {
+            return NGX_CONF_ERROR;
+        }
+
+        return NGX_CONF_OK;
+    }
+
+    if (ngx_lua_config_merge_keys(cf, &ngx_http_lua_config_chain, conf->keys,
+                                  prev->keys)
+        != NGX_OK)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    if (ngx_http_lua_config_init_fingerprint(cf, conf) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (ngx_http_lua_config_init_keys_hash(cf, conf) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (ngx_http_lua_config_add_scope(cf, conf) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static void
+ngx_http_lua_config_crc32_args(ngx_conf_t *cf, uint32_t *crc)
+{
+    ngx_str_t   *value;
+    ngx_uint_t   i;
+
+    /* arguments are null-terminated, the terminator separates them */
+
+    value = cf->args->elts;
+
+    for (i = 0; i < cf->args->nelts; i++) {
+        ngx_crc32_update(crc, value[i].data, value[i].len + 1);
+    }
+}
+
+
+static void
+ngx_http_lua_config_fingerprint_definitions(ngx_lua_config_fingerprint_t *fp,
+    ngx_array_t *keys)
+{
+    ngx_uint_t                     i, j;
+    ngx_http_lua_config_cmd_t     *cmd;
+    ngx_http_lua_config_keyval_t  *kv;
+
+    if (keys == NULL) {
+        return;
+    }
+
+    kv = keys->elts;
+    for (i = 0; i < keys->nelts; i++) {
+        ngx_lua_config_fingerprint_str(fp, &kv[i].key);
+
+        cmd = kv[i].cmds->elts;
+        for (j = 0; j < kv[i].cmds->nelts; j++) {
+            ngx_lua_config_fingerprint_uint(fp, cmd[j].crc);
+        }
+    }
+}
+
+
+static void
+ngx_http_lua_config_init_srv_definitions(ngx_conf_t *cf,
+    ngx_http_lua_config_srv_conf_t *lscf)
+{
+    ngx_uint_t                        i;
+    ngx_http_lua_upstream_t          *us;
+    ngx_lua_config_fingerprint_t      fp, fps;
+    ngx_http_lua_config_main_conf_t  *lmcf;
+
+    lmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_lua_config_module);
+
+    ngx_lua_config_fingerprint_init(&fp, lmcf->fingerprint_algorithm);
+
+    if (lscf->upstreams != NULL) {
+        us = lscf->upstreams->elts;
+        for (i = 0; i < lscf->upstreams->nelts; i++) {
+            fps = us[i].fp_servers;
+            ngx_lua_config_fingerprint_uint(&fp,
+                                        ngx_lua_config_fingerprint_final(&fps));
+            ngx_http_lua_config_fingerprint_definitions(&fp, us[i].keys);
+        }
+    }
+
+    lscf->definitions = ngx_lua_config_fingerprint_final(&fp);
+}
+
+
+static ngx_int_t
+ngx_http_lua_config_add_scope(ngx_conf_t *cf,
+    ngx_http_lua_config_loc_conf_t *llcf)
+{
+    ngx_lua_config_fingerprint_t       fp;
+    ngx_http_lua_config_srv_conf_t    *lscf;
+    ngx_http_lua_config_main_conf_t   *lmcf;
+    ngx_http_lua_config_loc_conf_t   **scope;
+
+    /*
+     * a scope sees its own keys and the upstreams of its server, the
+     * epoch is assigned by ngx_http_lua_config_init_epochs() once all
+     * scopes are merged
+     */
+
+    lmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_lua_config_module);
+    lscf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_lua_config_module);
+
+    ngx_lua_config_fingerprint_init(&fp, lmcf->fingerprint_algorithm);
+    ngx_lua_config_fingerprint_uint(&fp, lscf->definitions);
+    ngx_http_lua_config_fingerprint_definitions(&fp, llcf->keys);
+
+    llcf->definitions = ngx_lua_config_fingerprint_final(&fp);
+
+    if (lmcf->scopes == NULL) {
+        lmcf->scopes = ngx_array_create(cf->pool, 16,
+                                    sizeof(ngx_http_lua_config_loc_conf_t *));
+        if (lmcf->scopes == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    scope = ngx_array_push(lmcf->scopes);
+    if (scope == NULL) {
+        return NGX_ERROR;
+    }
+
+    *scope = llcf;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_lua_config_init_epochs(ngx_conf_t *cf,
+    ngx_http_lua_config_main_conf_t *lmcf)
+{
+    ngx_uint_t                        i, n, lo, hi, mid;
+    ngx_http_lua_config_epoch_t      *epochs, *prev;
+    ngx_http_lua_config_loc_conf_t  **scope;
+
+    /*
+     * every configuration load starts a new epoch; a scope keeps the
+     * epoch of the previous configuration if its definitions did not
+     * change, and gets the new one otherwise
+     */
+
+    lmcf->epoch = ngx_http_lua_config_epoch() + 1;
+
+    n = lmcf->scopes ? lmcf->scopes->nelts : 0;
+
+    epochs = ngx_alloc((n ? n : 1) * sizeof(ngx_http_lua_config_epoch_t),
+                       cf->log);
+    if (epochs == NULL) {
+        return NGX_ERROR;
+    }
+
+    prev = ngx_http_lua_config_epochs;
+    scope = lmcf->scopes ? lmcf->scopes->elts : NULL;
+
+    for (i = 0; i < n; i++) {
+        scope[i]->epoch = lmcf->epoch;
+
+        lo = 0;
+        hi = ngx_http_lua_config_nepochs;
+
+        while (lo < hi) {
+            mid = lo + (hi - lo) / 2;
+
+            if (prev[mid].fingerprint < scope[i]->definitions) {
+                lo = mid + 1;
+
+            } else {
+                hi = mid;
+            }
+        }
+
+        if (lo < ngx_http_lua_config_nepochs
+            && prev[lo].fingerprint == scope[i]->definitions)
+        {
+            scope[i]->epoch = prev[lo].epoch;
+        }
+
+        epochs[i].fingerprint = scope[i]->definitions;
+        epochs[i].epoch = scope[i]->epoch;
+    }
+
+    /* many scopes share their definitions with the parent */
+
+    ngx_qsort(epochs, n, sizeof(ngx_http_lua_config_epoch_t),
+              ngx_http_lua_config_epoch_cmp);
+
+    for (i = 1, hi = n ? 1 : 0; i < n; i++) {
+        if (epochs[i].fingerprint != epochs[hi - 1].fingerprint) {
+            epochs[hi++] = epochs[i];
+        }
+    }
+
+    if (prev) {
+        ngx_free(prev);
+    }
+
+    ngx_http_lua_config_epochs = epochs;
+    ngx_http_lua_config_nepochs = hi;
+
+    return NGX_OK;
+}
+
+
+static int ngx_libc_cdecl
+ngx_http_lua_config_epoch_cmp(const void *one, const void *two)
+{
+    const ngx_http_lua_config_epoch_t  *a = one;
+    const ngx_http_lua_config_epoch_t  *b = two;
+
+    if (a->fingerprint == b->fingerprint) {
+        return 0;
+    }
+
+    return (a->fingerprint < b->fingerprint) ? -1 : 1;
+}
+
+
+static ngx_int_t
+ngx_http_lua_config_init_module(ngx_cycle_t *cycle)
+{
+    ngx_atomic_uint_t                 epoch;
+    ngx_http_lua_config_main_conf_t  *lmcf;
+
+    lmcf = ngx_http_cycle_get_module_main_conf(cycle,
+                                               ngx_http_lua_config_module);
+    if (lmcf == NULL) {
+        return NGX_OK;
+    }
+
+    if (ngx_http_lua_config_epoch_sh == NULL) {
+        ngx_http_lua_config_epoch_shm.size =
+                                   sizeof(ngx_http_lua_config_epoch_shctx_t);
+        ngx_str_set(&ngx_http_lua_config_epoch_shm.name, "lua_config_epoch");
+        ngx_http_lua_config_epoch_shm.log = cycle->log;
+
+        if (ngx_shm_alloc(&ngx_http_lua_config_epoch_shm) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        ngx_http_lua_config_epoch_sh = (ngx_http_lua_config_epoch_shctx_t *)
+                                       ngx_http_lua_config_epoch_shm.addr;
+    }
+
+    /*
+     * the configuration is committed: its epoch is published, unless the
+     * workers of the previous one have moved the epoch past it meanwhile
+     */
+
+    for ( ;; ) {
+        epoch = ngx_http_lua_config_epoch_sh->epoch;
+
+        if (epoch >= lmcf->epoch
+            || ngx_atomic_cmp_set(&ngx_http_lua_config_epoch_sh->epoch,
+                                  epoch, lmcf->epoch))
+        {
+            break;
+        }
+    }
+
+    if (lmcf->snapshot_buf == NULL) {
+        return NGX_OK;
+    }
+
+    ngx_http_lua_config_write_snapshot(cycle, lmcf);
+
+    ngx_free(lmcf->snapshot_buf);
+    lmcf->snapshot_buf = NULL;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_lua_config_init_process(ngx_cycle_t *cycle)
+{
+    ngx_http_lua_config_main_conf_t  *lmcf;
+
+    lmcf = ngx_http_cycle_get_module_main_conf(cycle,
+                                               ngx_http_lua_config_module);
+    if (lmcf == NULL) {
+        return NGX_OK;
+    }
+
+    ngx_http_lua_config_stats_sample = lmcf->stats_sample;
+
+    ngx_rbtree_init(&ngx_http_lua_config_stats_keys,
+                    &ngx_http_lua_config_stats_keys_sentinel,
+                    ngx_str_rbtree_insert_value);
+    ngx_rbtree_init(&ngx_http_lua_config_stats_upstreams,
+                    &ngx_http_lua_config_stats_us_sentinel,
+                    ngx_str_rbtree_insert_value);
+    ngx_rbtree_init(&ngx_http_lua_config_serialized_tree,
+                    &ngx_http_lua_config_serialized_sentinel,
+                    ngx_rbtree_insert_value);
+
+    if (lmcf->inflight_zone != NULL) {
+        ngx_http_lua_config_inflight = lmcf->inflight_zone->data;
+    }
+
+    if (lmcf->resolve != NULL
+        && (ngx_process == NGX_PROCESS_WORKER
+            || ngx_process == NGX_PROCESS_SINGLE)
+        && ngx_http_lua_config_resolve_init(cycle, lmcf) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    if (lmcf->override_zone == NULL) {
+        return NGX_OK;
+    }
+
+    ngx_http_lua_config_overrides = lmcf->override_zone->data;
+    ngx_http_lua_config_overrides_pool =
+                           (ngx_slab_pool_t *) lmcf->override_zone->shm.addr;
+    ngx_http_lua_config_origin = lmcf->repl_origin;
+
+    if (lmcf->repl_listen == NULL
+        || (ngx_process != NGX_PROCESS_WORKER
+            && ngx_process != NGX_PROCESS_SINGLE))
+    {
+        return NGX_OK;
+    }
+
+    return ngx_http_lua_config_repl_init(cycle, lmcf);
+}
+
+
+static ngx_int_t
+ngx_http_lua_config_init_fingerprint(ngx_conf_t *cf,
+    ngx_http_lua_config_loc_conf_t *llcf)
+{
+    ngx_http_lua_config_main_conf_t  *lmcf;
+
+    lmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_lua_config_module);
+
+    return ngx_lua_config_init_fingerprint(cf, &ngx_http_lua_config_chain,
+                                           llcf->keys,
+                                           lmcf->fingerprint_algorithm,
+                                           &llcf->fp_static, &llcf->dynamic,
+                                           &llcf->fingerprint);
+}
+
+
+static ngx_int_t
+ngx_http_lua_config_fingerprint(ngx_http_request_t *r,
+    ngx_http_lua_config_loc_conf_t *llcf, ngx_str_t *value)
+{
+    u_char                        *p;
+    ngx_uint_t                     changes;
+    ngx_lua_config_fingerprint_t   fp;
+    ngx_http_lua_config_ctx_t     *ctx;
+    ngx_http_lua_config_eval_t     ev;
+
+    static u_char  buf[NGX_LUA_CONFIG_FINGERPRINT_LEN];
+
+    changes = ngx_http_lua_config_override_changes();
+
+    if (llcf->dynamic == NULL && changes == 0) {
+        *value = llcf->fingerprint;
+        return NGX_OK;
+    }
+
+    /*
+     * without a request only the static keys are there to be hashed
+     * again, as overridden, see get_fingerprint()
+     */
+
+    if (r == NULL) {
+        if (ngx_http_lua_config_fingerprint_keys(NULL, llcf, &fp) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        p = ngx_lua_config_fingerprint_format(buf, fp.algorithm,
+                                        ngx_lua_config_fingerprint_final(&fp));
+
+        value->data = buf;
+        value->len = p - buf;
+
+        return NGX_OK;
+    }
+
+    /* computed once per request for the last location asked for */
+
+    ctx = ngx_http_lua_config_get_ctx(r);
+    if (ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (ctx->fingerprint_conf == llcf && ctx->fingerprint_changes == changes) {
+        *value = ctx->fingerprint;
+        return NGX_OK;
+    }
+
+    if (changes) {
+        if (ngx_http_lua_config_fingerprint_keys(r, llcf, &fp) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+    } else {
+        fp = llcf->fp_static;
+
+        ev.request = r;
+        ev.filter = NULL;
+
+        if (ngx_lua_config_hash_dynamic(&ngx_http_lua_config_chain, &ev,
+                                        llcf->dynamic, &fp)
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+    }
+
+    p = ngx_lua_config_fingerprint_format(ctx->fingerprint_buf, fp.algorithm,
+                                     ngx_lua_config_fingerprint_final(&fp));
+
+    ctx->fingerprint_conf = llcf;
+    ctx->fingerprint_changes = changes;
+    ctx->fingerprint.data = ctx->fingerprint_buf;
+    ctx->fingerprint.len = p - ctx->fingerprint_buf;
+
+    *value = ctx->fingerprint;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_lua_config_fingerprint_keys(ngx_http_request_t *r,
+    ngx_http_lua_config_loc_conf_t *llcf, ngx_lua_config_fingerprint_t *fp)
+{
+    ngx_int_t                       rc;
+    ngx_str_t                       value;
+    ngx_uint_t                      i;
+    ngx_http_lua_config_keyval_t   *kv, **dkv;
+
+    /*
+     * every key as the request sees it, overrides included, in the order
+     * of ngx_lua_config_init_fingerprint(): the static keys first, then
+     * the keys that depend on the request; without an override in this
+     * scope the result is the fingerprint computed without overrides
+     */
+
+    ngx_lua_config_fingerprint_init(fp, llcf->fp_static.algorithm);
+
+    kv = llcf->keys ? llcf->keys->elts : NULL;
+
+    for (i = 0; kv && i < llcf->keys->nelts; i++) {
+        if (ngx_http_lua_config_static_value(kv[i].cmds, &value)
+            == NGX_AGAIN)
+        {
+            continue;
+        }
+
+        rc = ngx_http_lua_config_keyval_value(r, &kv[i], 1, &value, NULL);
+
+        if (rc == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+
+        if (rc == NGX_OK) {
+            ngx_lua_config_fingerprint_str(fp, &kv[i].key);
+            ngx_lua_config_fingerprint_str(fp, &value);
+        }
+    }
+
+    dkv = llcf->dynamic ? llcf->dynamic->elts : NULL;
+
+    for (i = 0; dkv && i < llcf->dynamic->nelts; i++) {
+        rc = ngx_http_lua_config_keyval_value(r, dkv[i], 1, &value, NULL);
+
+        if (rc == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+
+        if (rc == NGX_OK) {
+            ngx_lua_config_fingerprint_str(fp, &dkv[i]->key);
+            ngx_lua_config_fingerprint_str(fp, &value);
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_lua_config_init_keys_hash(ngx_conf_t *cf,
+    ngx_http_lua_config_loc_conf_t *llcf)
+{
+    ngx_hash_init_t                  hash;
+    ngx_hash_keys_arrays_t           ha;
+    ngx_uint_t                       i;
+    ngx_http_lua_config_keyval_t    *kv;
+
+    ngx_memzero(&ha, sizeof(ngx_hash_keys_arrays_t));
+    ha.pool = cf->pool;
+    ha.temp_pool = cf->temp_pool;
+
+    if (ngx_hash_keys_array_init(&ha, NGX_HASH_SMALL) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    kv = llcf->keys->elts;
+    for (i = 0; i < llcf->keys->nelts; i++) {
+        if (ngx_hash_add_key(&ha, &kv[i].key, &kv[i], 0) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
+    if (ha.keys.nelts == 0) {
+        return NGX_OK;
+    }
+
+    hash.key = ngx_hash_key;
+    hash.max_size = llcf->hash_max_size;
+    hash.bucket_size = llcf->hash_bucket_size;
+    hash.name = "lua_config_hash";
+    hash.pool = cf->pool;
+    hash.temp_pool = NULL;
+    hash.hash = &llcf->hash;
+
+    return ngx_hash_init(&hash, ha.keys.elts, ha.keys.nelts);
+}
+
+
+static char *
+ngx_http_lua_upstream_block(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_lua_config_srv_conf_t  *lscf = conf;
+
+    ngx_str_t                       *value;
+    u_char                          *p;
+    ngx_http_lua_upstream_t         *us;
+    ngx_uint_t                       i, export;
+    char                            *rv;
+    ngx_conf_t                       save;
+
+    value = cf->args->elts;
+
+    if (value[1].len == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "lua_upstream name cannot be empty");
+        return NGX_CONF_ERROR;
+    }
+
+    export = 0;
+
+    if (cf->args->nelts == 3) {
+        if (value[2].len != sizeof("export=upstream") - 1
+            || ngx_strncmp(value[2].data, "export=upstream",
+                           sizeof("export=upstream") - 1) != 0)
+        {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid parameter \"%V\"", &value[2]);
+            return NGX_CONF_ERROR;
+        }
+
+        export = 1;
+    }
+
+    if (lscf->upstreams == NULL) {
+        lscf->upstreams = ngx_array_create(cf->pool, 4,
+                                       sizeof(ngx_http_lua_upstream_t));
+        if (lscf->upstreams == NULL) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    /* check for duplicate name in current context */
+    us = lscf->upstreams->elts;
+    for (i = 0; i < lscf->upstreams->nelts; i++) {
+        if (value[1].len == us[i].name.len
+            && ngx_strcmp(value[1].data, us[i].name.data) == 0)
+        {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "duplicate lua_upstream \"%V\"", &value[1]);
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    us = ngx_array_push(lscf->upstreams);
+    if (us == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_memzero(us, sizeof(ngx_http_lua_upstream_t));
+
+    us->name = value[1];
+
+    us->servers = ngx_array_create(cf->pool, 4,
+                                   sizeof(ngx_http_lua_upstream_server_t));
+    if (us->servers == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    us->keys = ngx_array_create(cf->pool, 4,
+                                sizeof(ngx_http_lua_config_keyval_t));
+    if (us->keys == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    save = *cf;
+    cf->handler = ngx_http_lua_upstream;
+    cf->handler_conf = conf;
+
+    rv = ngx_conf_parse(cf, NULL);
+
+    *cf = save;
+
+    if (rv != NGX_CONF_OK) {
+        return rv;
+    }
+
+    /* keys are kept sorted, both the crc32 and the snapshot rely on it */
+
+    ngx_qsort(us->keys->elts, us->keys->nelts,
+              sizeof(ngx_http_lua_config_keyval_t),
+              ngx_lua_config_key_cmp);
+
+    if (ngx_http_lua_upstream_init_crc32(cf, us) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (ngx_http_lua_upstream_init_hash(cf, us) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (export && ngx_http_lua_upstream_export(cf, us) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static ngx_str_t  ngx_http_lua_upstream_export_keys[] = {
+    ngx_string("keepalive"),
+    ngx_string("keepalive_requests"),
+    ngx_string("keepalive_time"),
+    ngx_string("keepalive_timeout"),
+    ngx_null_string
+};
+
+
+static ngx_int_t
+ngx_http_lua_upstream_export(ngx_conf_t *cf, ngx_http_lua_upstream_t *us)
+{
+    u_char                          *p;
+    void                            *mconf;
+    ngx_url_t                        u;
+    ngx_uint_t                       i, m, level;
+    ngx_conf_t                       save;
+    ngx_http_module_t               *module;
+    ngx_http_conf_ctx_t             *ctx, *http_ctx;
+    ngx_http_upstream_server_t      *s;
+    ngx_http_upstream_srv_conf_t    *uscf;
+    ngx_http_lua_upstream_server_t  *server;
+
+    if (us->servers->nelts == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "no servers are inside lua_upstream \"%V\" "
+                           "exported as upstream", &us->name);
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(&u, sizeof(ngx_url_t));
+
+    u.host = us->name;
+    u.no_resolve = 1;
+    u.no_port = 1;
+
+    uscf = ngx_http_upstream_add(cf, &u, NGX_HTTP_UPSTREAM_CREATE
+                                         |NGX_HTTP_UPSTREAM_WEIGHT
+                                         |NGX_HTTP_UPSTREAM_MAX_FAILS
+                                         |NGX_HTTP_UPSTREAM_FAIL_TIMEOUT
+                                         |NGX_HTTP_UPSTREAM_DOWN
+                                         |NGX_HTTP_UPSTREAM_BACKUP);
+    if (uscf == NULL) {
+        return NGX_ERROR;
+    }
+
+    /* the same configuration context an upstream{} block gets */
+
+    ctx = ngx_pcalloc(cf->pool, sizeof(ngx_http_conf_ctx_t));
+    if (ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    http_ctx = cf->ctx;
+    ctx->main_conf = http_ctx->main_conf;
+
+    ctx->srv_conf = ngx_pcalloc(cf->pool, sizeof(void *) * ngx_http_max_module);
+    if (ctx->srv_conf == NULL) {
+        return NGX_ERROR;
+    }
+
+    ctx->srv_conf[ngx_http_upstream_module.ctx_index] = uscf;
+
+    uscf->srv_conf = ctx->srv_conf;
+
+    ctx->loc_conf = ngx_pcalloc(cf->pool, sizeof(void *) * ngx_http_max_module);
+    if (ctx->loc_conf == NULL) {
+        return NGX_ERROR;
+    }
+
+    for (m = 0; cf->cycle->modules[m]; m++) {
+        if (cf->cycle->modules[m]->type != NGX_HTTP_MODULE) {
+            continue;
+        }
+
+        module = cf->cycle->modules[m]->ctx;
+
+        if (module->create_srv_conf) {
+            mconf = module->create_srv_conf(cf);
+            if (mconf == NULL) {
+                return NGX_ERROR;
+            }
+
+            ctx->srv_conf[cf->cycle->modules[m]->ctx_index] = mconf;
+        }
+
+        if (module->create_loc_conf) {
+            mconf = module->create_loc_conf(cf);
+            if (mconf == NULL) {
+                return NGX_ERROR;
+            }
+
+            ctx->loc_conf[cf->cycle->modules[m]->ctx_index] = mconf;
+        }
+    }
+
+    uscf->servers = ngx_array_create(cf->pool, us->servers->nelts,
+                                     sizeof(ngx_http_upstream_server_t));
+    if (uscf->servers == NULL) {
+        return NGX_ERROR;
+    }
+
+    /* nginx has a single backup tier: every level but the first goes there */
+
+    server = us->servers->elts;
+
+    level = server[0].level;
+    for (i = 1; i < us->servers->nelts; i++) {
+        level = ngx_min(level, server[i].level);
+    }
+
+    for (i = 0; i < us->servers->nelts; i++) {
+        ngx_memzero(&u, sizeof(ngx_url_t));
+
+        if (server[i].port) {
+            p = ngx_pnalloc(cf->pool, server[i].host.len + 1 + NGX_INT_T_LEN);
+            if (p == NULL) {
+                return NGX_ERROR;
+            }
+
+            u.url.data = p;
+            u.url.len = ngx_sprintf(p, "%V:%ui", &server[i].host,
+                                    server[i].port)
+                        - p;
+
+        } else {
+            u.url = server[i].host;
+        }
+
+        u.default_port = 80;
+
+        if (ngx_parse_url(cf->pool, &u) != NGX_OK) {
+            if (u.err) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "%s in lua_upstream \"%V\" server \"%V\"",
+                                   u.err, &us->name, &u.url);
+            }
+
+            return NGX_ERROR;
+        }
+
+        s = ngx_array_push(uscf->servers);
+        if (s == NULL) {
+            return NGX_ERROR;
+        }
+
+        ngx_memzero(s, sizeof(ngx_http_upstream_server_t));
+
+        s->name = u.url;
+        s->addrs = u.addrs;
+        s->naddrs = u.naddrs;
+        s->weight = server[i].weight;
+        s->max_fails = 1;
+        s->fail_timeout = 10;
+        s->down = server[i].down;
+        s->backup = (server[i].level > level);
+    }
+
+    save = *cf;
+    cf->ctx = ctx;
+    cf->cmd_type = NGX_HTTP_UPS_CONF;
+
+    for (i = 0; ngx_http_lua_upstream_export_keys[i].len; i++) {
+        if (ngx_http_lua_upstream_export_directive(cf, us,
+                &ngx_http_lua_upstream_export_keys[i])
+            != NGX_OK)
+        {
+            *cf = save;
+            return NGX_ERROR;
+        }
+    }
+
+    *cf = save;
+
+    us->upstream = uscf;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_lua_upstream_export_directive(ngx_conf_t *cf,
+    ngx_http_lua_upstream_t *us, ngx_str_t *name)
+{
+    char                          *rv;
+    void                         **confp;
+    ngx_str_t                      value, *arg;
+    ngx_uint_t                     i, key;
+    ngx_array_t                    args;
+    ngx_command_t                 *cmd;
+    ngx_http_lua_config_keyval_t  *kv;
+
+    key = ngx_hash_key(name->data, name->len);
+
+    kv = ngx_hash_find(&us->hash, key, name->data, name->len);
+    if (kv == NULL) {
+        return NGX_OK;
+    }
+
+    if (ngx_http_lua_config_static_value(kv->cmds, &value) != NGX_OK) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"%V\" of lua_upstream \"%V\" must be "
+                           "a constant to be exported", name, &us->name);
+        return NGX_ERROR;
+    }
+
+    /* the directive of the upstream{} block with the same name */
+
+    for (i = 0; cf->cycle->modules[i]; i++) {
+        if (cf->cycle->modules[i]->type != NGX_HTTP_MODULE) {
+            continue;
+        }
+
+        cmd = cf->cycle->modules[i]->commands;
+        if (cmd == NULL) {
+            continue;
+        }
+
+        for ( /* void */ ; cmd->name.len; cmd++) {
+            if (!(cmd->type & NGX_HTTP_UPS_CONF)
+                || cmd->name.len != name->len
+                || ngx_strncmp(cmd->name.data, name->data, name->len) != 0)
+            {
+                continue;
+            }
+
+            if (ngx_array_init(&args, cf->temp_pool, 2, sizeof(ngx_str_t))
+                != NGX_OK)
+            {
+                return NGX_ERROR;
+            }
+
+            arg = ngx_array_push_n(&args, 2);
+            if (arg == NULL) {
+                return NGX_ERROR;
+            }
+
+            arg[0] = *name;
+            arg[1] = value;
+
+            cf->args = &args;
+
+            confp = *(void **) ((char *) cf->ctx + cmd->conf);
+
+            rv = cmd->set(cf, cmd, confp[cf->cycle->modules[i]->ctx_index]);
+
+            if (rv == NGX_CONF_OK) {
+                return NGX_OK;
+            }
+
+            if (rv != NGX_CONF_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "\"%V\" of lua_upstream \"%V\" %s",
+                                   name, &us->name, rv);
+            }
+
+            return NGX_ERROR;
+        }
+    }
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "\"%V\" of lua_upstream \"%V\" cannot be exported, "
+                       "the directive is not available", name, &us->name);
+
+    return NGX_ERROR;
+}
+
+
+static ngx_int_t
+ngx_http_lua_upstream_init_hash(ngx_conf_t *cf, ngx_http_lua_upstream_t *us)
+{
+    ngx_hash_init_t                  hash;
+    ngx_hash_keys_arrays_t           ha;
+    ngx_uint_t                       i;
+    ngx_http_lua_config_keyval_t    *kv;
+
+    if (us->keys->nelts == 0) {
+        return NGX_OK;
+    }
+
+    ngx_memzero(&ha, sizeof(ngx_hash_keys_arrays_t));
+    ha.pool = cf->pool;
+    ha.temp_pool = cf->temp_pool;
+
+    if (ngx_hash_keys_array_init(&ha, NGX_HASH_SMALL) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    kv = us->keys->elts;
+    for (i = 0; i < us->keys->nelts; i++) {
+        if (ngx_hash_add_key(&ha, &kv[i].key, &kv[i], 0) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
+    hash.key = ngx_hash_key;
+    hash.max_size = 512;
+    hash.bucket_size = ngx_align(64, ngx_cacheline_size);
+    hash.name = "lua_upstream_keys_hash";
+    hash.pool = cf->pool;
+    hash.temp_pool = NULL;
+    hash.hash = &us->hash;
+
+    return ngx_hash_init(&hash, ha.keys.elts, ha.keys.nelts);
+}
+
+
+static char *
+ngx_http_lua_upstream(ngx_conf_t *cf, ngx_command_t *dummy, void *conf)
+{
+    ngx_http_lua_config_srv_conf_t  *lscf = conf;
+    ngx_http_lua_upstream_t         *us;
+    ngx_str_t                       *value;
+    ngx_uint_t                       last;
+    ngx_http_lua_config_cmd_t       *lcmd;
+    ngx_str_t                        s;
+
+    value = cf->args->elts;
+
+    us = (ngx_http_lua_upstream_t *) lscf->upstreams->elts
+         + (lscf->upstreams->nelts - 1);
+    if (us == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "lua_upstream handler called without context");
+        return NGX_CONF_ERROR;
+    }
+
+    if (ngx_strcmp(value[0].data, "server") == 0) {
+        return ngx_lua_config_parse_server(cf, us->servers, 1);
+    }
+
+    /* parse other config items: key arg1 [arg2 ...] [separator=X] [if=|if!=] */
+    if (cf->args->nelts < 2) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                            "invalid number of the lua_upstream parameters");
+        return NGX_CONF_ERROR;
+    }
+
+    if (ngx_lua_config_check_key(&value[0]) != NGX_OK) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid character in lua_upstream "
+                           "config key \"%V\"", &value[0]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (ngx_strcmp(value[0].data, "name") == 0
+        || ngx_strcmp(value[0].data, "crc32") == 0)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid directive name in lua_upstream");
+        return NGX_CONF_ERROR;
+    }
+
+    lcmd = ngx_lua_config_add_cmd(cf, &ngx_http_lua_config_chain, &us->keys,
+                                  &value[0]);
+    if (lcmd == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_crc32_init(lcmd->crc);
+    ngx_http_lua_config_crc32_args(cf, &lcmd->crc);
+
+    lcmd->file = cf->conf_file->file.name.data;
+    lcmd->line = cf->conf_file->line;
+
+    last = cf->args->nelts - 1;
+
+    /* check for a condition at the end */
+
+    switch (ngx_http_lua_config_parse_filter(cf, lcmd, &value[last])) {
+
+    case NGX_OK:
+        last--;
+        break;
+
+    case NGX_DECLINED:
+        break;
+
+    default: /* NGX_ERROR */
+        return NGX_CONF_ERROR;
+    }
+
+    switch (ngx_lua_config_join_args(cf, value, 1, last, &s)) {
+
+    case NGX_OK:
+        break;
+
+    case NGX_DECLINED:
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "no value specified for lua_upstream "
+                           "config key \"%V\"", &value[0]);
+        return NGX_CONF_ERROR;
+
+    default: /* NGX_ERROR */
+        return NGX_CONF_ERROR;
+    }
+
+    lcmd->value = ngx_http_lua_config_intern_value(cf, &s, &lcmd->index);
+    if (lcmd->value == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static ngx_int_t
+ngx_http_lua_config_get_value_internal(ngx_http_request_t *r,
+    ngx_http_lua_config_loc_conf_t *llcf, u_char *name, size_t len,
+    ngx_str_t *value, ngx_http_lua_config_cmd_t **matched)
+{
+    ngx_http_lua_config_key_t  key;
+
+    key.sn.str.data = name;
+    key.sn.str.len = len;
+    key.hash = ngx_hash_key(name, len);
+
+    return ngx_http_lua_config_get_key_value(r, llcf, &key, value, matched);
+}
+
+
+static ngx_int_t
+ngx_http_lua_config_get_key_value(ngx_http_request_t *r,
+    ngx_http_lua_config_loc_conf_t *llcf, ngx_http_lua_config_key_t *key,
+    ngx_str_t *value, ngx_http_lua_config_cmd_t **matched)
+{
+    ngx_http_lua_config_keyval_t  *kv;
+
+    if (llcf == NULL) {
+        if (r == NULL) {
+            return NGX_DECLINED;
+        }
+
+        llcf = ngx_http_get_module_loc_conf(r, ngx_http_lua_config_module);
+    }
+
+    if (llcf == NULL || llcf->keys == NULL || llcf->hash.buckets == NULL) {
+        return NGX_DECLINED;
+    }
+
+    kv = ngx_hash_find(&llcf->hash, key->hash, key->sn.str.data,
+                       key->sn.str.len);
+    if (kv == NULL) {
+        return NGX_DECLINED;
+    }
+
+    return ngx_http_lua_config_keyval_value(r, kv, 1, value, matched);
+}
+
+
+/*
+ * the value of a key as every reader sees it: an override comes first,
+ * then the definitions of the key, timed if the request is sampled
+ */
+
+static ngx_int_t
+ngx_http_lua_config_keyval_value(ngx_http_request_t *r,
+    ngx_http_lua_config_keyval_t *kv, ngx_uint_t overrides, ngx_str_t *value,
+    ngx_http_lua_config_cmd_t **matched)
+{
+    ngx_int_t  rc;
+
+    if (overrides && ngx_http_lua_config_overrides != NULL) {
+        rc = ngx_http_lua_config_override_find(r ? r->pool : NULL, &kv->key,
+                                               value);
+
+        if (rc != NGX_DECLINED) {
+            if (matched) {
+                *matched = NULL;
+            }
+
+            return rc;
+        }
+    }
+
+    if (r != NULL && ngx_http_lua_config_stats_sampled(r)) {
+        return ngx_http_lua_config_stats_eval(r, kv, value, matched);
+    }
+
+    return ngx_http_lua_config_eval_cmds(r, kv->cmds, value, matched);
+}
+
+
+ngx_int_t
+ngx_http_lua_config_get(ngx_http_request_t *r, ngx_http_lua_config_key_t *key,
+    ngx_str_t *value)
+{
+    return ngx_http_lua_config_get_key_value(r, NULL, key, value, NULL);
+}
+
+
+ngx_http_lua_upstream_t *
+ngx_http_lua_config_upstream(ngx_http_request_t *r, ngx_str_t *name)
+{
+    return ngx_http_lua_config_find_upstream(r, NGX_HTTP_LUA_CONFIG_SCOPE_SRV,
+                                             name->data, name->len);
+}
+
+
+ngx_int_t
+ngx_http_lua_config_upstream_get(ngx_http_request_t *r,
+    ngx_http_lua_upstream_t *us, ngx_str_t *key, ngx_str_t *value)
+{
+    ngx_http_lua_config_keyval_t  *kv;
+
+    if (us->hash.buckets == NULL) {
+        return NGX_DECLINED;
+    }
+
+    kv = ngx_hash_find(&us->hash, ngx_hash_key(key->data, key->len),
+                       key->data, key->len);
+    if (kv == NULL) {
+        return NGX_DECLINED;
+    }
+
+    return ngx_http_lua_config_eval_cmds(r, kv->cmds, value, NULL);
+}
+
+
+ngx_int_t
+ngx_http_lua_config_upstream_crc32(ngx_http_request_t *r,
+    ngx_http_lua_upstream_t *us, uint32_t *crc)
+{
+    return ngx_http_lua_upstream_crc32(r, us, crc);
+}
+
+
+ngx_uint_t
+ngx_http_lua_config_epoch(void)
+{
+    if (ngx_http_lua_config_epoch_sh == NULL) {
+        return 0;
+    }
+
+    return ngx_http_lua_config_epoch_sh->epoch;
+}
+
+
+/* an override or an address change, seen by every scope */
+
+static void
+ngx_http_lua_config_epoch_change(void)
+{
+    ngx_atomic_uint_t  epoch, changed;
+
+    if (ngx_http_lua_config_epoch_sh == NULL) {
+        return;
+    }
+
+    epoch = ngx_atomic_fetch_add(&ngx_http_lua_config_epoch_sh->epoch, 1) + 1;
+
+    /* of two concurrent changes the later epoch stays */
+
+    for ( ;; ) {
+        changed = ngx_http_lua_config_epoch_sh->changed;
+
+        if (changed >= epoch
+            || ngx_atomic_cmp_set(&ngx_http_lua_config_epoch_sh->changed,
+                                  changed, epoch))
+        {
+            break;
+        }
+    }
+}
+
+
+static ngx_int_t
+ngx_http_lua_config_eval_cmds(ngx_http_request_t *r, ngx_array_t *cmds,
+    ngx_str_t *value, ngx_http_lua_config_cmd_t **matched)
+{
+    return ngx_http_lua_config_eval_timed(r, NULL, cmds, value, matched);
+}
+
+
+static ngx_int_t
+ngx_http_lua_config_eval_timed(ngx_http_request_t *r,
+    ngx_http_lua_config_histogram_t *filter, ngx_array_t *cmds,
+    ngx_str_t *value, ngx_http_lua_config_cmd_t **matched)
+{
+    void                        *cmd;
+    ngx_int_t                    rc;
+    ngx_http_lua_config_eval_t   ev;
+
+    ev.request = r;
+    ev.filter = filter;
+
+    cmd = NULL;
+
+    rc = ngx_lua_config_eval_cmds(&ngx_http_lua_config_chain,
+                                  r ? &ev : NULL, cmds, value, &cmd);
+
+    if (matched) {
+        *matched = cmd;
+    }
+
+    return rc;
+}
+
+
+static ngx_int_t
+ngx_http_lua_config_cmd_filter(void *data, void *cmd)
+{
+    ngx_http_lua_config_eval_t  *ev = data;
+    ngx_http_lua_config_cmd_t   *lcmd = cmd;
+
+    uint64_t   start;
+    ngx_int_t  rc;
+
+    if (lcmd->filter == NULL) {
+        return NGX_OK;
+    }
+
+    if (ev == NULL) {
+#if (NGX_PCRE)
+        if (lcmd->regex) {
+            return NGX_AGAIN;
+        }
+#endif
+
+        if (lcmd->filter->lengths != NULL) {
+            return NGX_AGAIN;
+        }
+
+        return ngx_lua_config_condition(&lcmd->filter->value,
+                                        lcmd->negative);
+    }
+
+    if (ev->filter == NULL) {
+        return ngx_http_lua_config_eval_filter(ev->request, lcmd);
+    }
+
+    start = ngx_http_lua_config_stats_now();
+    rc = ngx_http_lua_config_eval_filter(ev->request, lcmd);
+    ngx_http_lua_config_stats_add(ev->filter,
+                                  ngx_http_lua_config_stats_now() - start);
+
+    return rc;
+}
+
+
+static ngx_int_t
+ngx_http_lua_config_cmd_value(void *data, void *cmd, ngx_str_t *value)
+{
+    ngx_http_lua_config_eval_t  *ev = data;
+    ngx_http_lua_config_cmd_t   *lcmd = cmd;
+
+    uint64_t                   start;
+    ngx_int_t                  rc;
+    ngx_http_request_t        *r;
+    ngx_http_complex_value_t  *cv;
+
+    r = ev ? ev->request : NULL;
+
+    if (lcmd->map == NULL) {
+        cv = lcmd->value;
+
+    } else if (r == NULL) {
+        return NGX_AGAIN;
+
+    } else if (ev->filter == NULL) {
+        rc = ngx_http_lua_config_map_find(r, lcmd->map, &cv);
+        if (rc != NGX_OK) {
+            return rc;
+        }
+
+    } else {
+        start = ngx_http_lua_config_stats_now();
+        rc = ngx_http_lua_config_map_find(r, lcmd->map, &cv);
+        ngx_http_lua_config_stats_add(ev->filter,
+                                      ngx_http_lua_config_stats_now() - start);
+
+        if (rc != NGX_OK) {
+            return rc;
+        }
+    }
+
+    /* static values point straight at the configuration memory */
+
+    if (cv->lengths == NULL) {
+        *value = cv->value;
+        return NGX_OK;
+    }
+
+    if (r == NULL) {
+        return NGX_AGAIN;
+    }
+
+    if (ngx_http_complex_value(r, cv, value) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_lua_config_eval_filter(ngx_http_request_t *r,
+    ngx_http_lua_config_cmd_t *cmd)
+{
+    ngx_str_t   s;
+    ngx_uint_t  empty;
+#if (NGX_PCRE)
+    ngx_int_t   rc;
+#endif
+
+    /* NGX_OK if the condition holds, NGX_DECLINED otherwise */
+
+#if (NGX_PCRE)
+
+    if (cmd->regex) {
+        rc = ngx_http_lua_config_regex_exec(r, cmd);
+
+        if (rc == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+
+        empty = (rc == NGX_DECLINED);
+
+        return (empty == cmd->negative) ? NGX_OK : NGX_DECLINED;
+    }
+
+#endif
+
+    if (ngx_http_complex_value(r, cmd->filter, &s) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    return ngx_lua_config_condition(&s, cmd->negative);
+}
+
+
+#if (NGX_PCRE)
+
+static ngx_int_t
+ngx_http_lua_config_regex_exec(ngx_http_request_t *r,
+    ngx_http_lua_config_cmd_t *cmd)
+{
+    ngx_int_t                            rc;
+    ngx_str_t                            s;
+    ngx_http_lua_config_ctx_t           *ctx;
+    ngx_http_core_main_conf_t           *cmcf;
+    ngx_http_lua_config_main_conf_t     *lmcf;
+    ngx_http_lua_config_regex_result_t  *res;
+
+    lmcf = ngx_http_get_module_main_conf(r, ngx_http_lua_config_module);
+
+    res = NULL;
+
+    if (lmcf->regex_cache) {
+        ctx = ngx_http_lua_config_get_ctx(r);
+        if (ctx == NULL) {
+            return NGX_ERROR;
+        }
+
+        if (ctx->regex == NULL) {
+            ctx->regex = ngx_pcalloc(r->pool,
+                               lmcf->nregex
+                               * sizeof(ngx_http_lua_config_regex_result_t));
+            if (ctx->regex == NULL) {
+                return NGX_ERROR;
+            }
+        }
+
+        res = &ctx->regex[cmd->regex_index];
+
+        if (res->done) {
+
+            /*
+             * captures are restored into a fresh array of the size
+             * ngx_http_regex_exec() expects, as it reuses r->captures
+             */
+
+            if (res->ncaptures) {
+                cmcf = ngx_http_get_module_main_conf(r, ngx_http_core_module);
+
+                r->captures = ngx_palloc(r->pool,
+                                         cmcf->ncaptures * sizeof(int));
+                if (r->captures == NULL) {
+                    return NGX_ERROR;
+                }
+
+                ngx_memcpy(r->captures, res->captures,
+                           res->ncaptures * sizeof(int));
+
+                r->ncaptures = res->ncaptures;
+                r->captures_data = res->captures_data;
+            }
+
+            return res->rc;
+        }
+    }
+
+    if (ngx_http_complex_value(r, cmd->filter, &s) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    rc = ngx_http_regex_exec(r, cmd->regex, &s);
+
+    if (rc == NGX_ERROR || res == NULL) {
+        return rc;
+    }
+
+    res->done = 1;
+    res->rc = rc;
+
+    if (rc == NGX_OK && cmd->regex->ncaptures && r->ncaptures) {
+        res->captures = ngx_palloc(r->pool, r->ncaptures * sizeof(int));
+        if (res->captures == NULL) {
+            return NGX_ERROR;
+        }
+
+        ngx_memcpy(res->captures, r->captures, r->ncaptures * sizeof(int));
+
+        res->ncaptures = r->ncaptures;
+        res->captures_data = r->captures_data;
+    }
+
+    return rc;
+}
+
+#endif
+
+
+static ngx_http_lua_config_ctx_t *
+ngx_http_lua_config_get_ctx(ngx_http_request_t *r)
+{
+    ngx_http_lua_config_ctx_t  *ctx;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_lua_config_module);
+
+    if (ctx == NULL) {
+        ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_lua_config_ctx_t));
+        if (ctx == NULL) {
+            return NULL;
+        }
+
+        ngx_http_set_ctx(r, ctx, ngx_http_lua_config_module);
+    }
+
+    return ctx;
+}
+
+
+static ngx_int_t
+ngx_http_lua_config_static_value(ngx_array_t *cmds, ngx_str_t *value)
+{
+    /*
+     * resolves a definition chain without a request: NGX_OK if it yields
+     * a constant, NGX_DECLINED if no definition can ever match, and
+     * NGX_AGAIN if the result depends on the request
+     */
+
+    return ngx_lua_config_eval_cmds(&ngx_http_lua_config_chain, NULL, cmds,
+                                    value, NULL);
+}
+
+
+static ngx_uint_t
+ngx_http_lua_config_cmd_final(void *cmd)
+{
+    ngx_http_lua_config_cmd_t  *lcmd = cmd;
+
+    /* a definition that always matches ends its chain */
+
+    if (lcmd->filter) {
+        return 0;
+    }
+
+    return (lcmd->map == NULL || lcmd->map->default_value != NULL);
+}
+
+
+static void
+ngx_http_lua_config_cmd_unfilter(void *cmd)
+{
+    ngx_http_lua_config_cmd_t  *lcmd = cmd;
+
+    lcmd->filter = NULL;
+}
+
+
+static void
+ngx_http_lua_config_warn_unreachable(ngx_conf_t *cf, ngx_str_t *key,
+    void *cmd)
+{
+    ngx_http_lua_config_cmd_t  *lcmd = cmd;
+
+    ngx_http_lua_config_main_conf_t  *lmcf;
+
+    lmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_lua_config_module);
+
+    if (!lmcf->warn_shadowed) {
+        return;
+    }
+
+    /* reported where the definition is, not where it is merged */
+
+    ngx_log_error(NGX_LOG_WARN, cf->log, 0,
+                  "unreachable definition of lua_config \"%V\" in %s:%ui",
+                  key, lcmd->file, lcmd->line);
+}
+
+
+static ngx_uint_t
+ngx_http_lua_config_check_scope(lua_State *L, int idx, ngx_uint_t max)
+{
+    u_char  *p;
+    size_t   len;
+
+    if (lua_isnoneornil(L, idx)) {
+        return max;
+    }
+
+    p = (u_char *) luaL_checklstring(L, idx, &len);
+
+    if (len > 7 && ngx_strncmp(p, "server:", 7) == 0) {
+        return ngx_http_lua_config_find_server(L, idx, p + 7, len - 7);
+    }
+
+    if (len == 4 && ngx_strncmp(p, "main", 4) == 0) {
+        return NGX_HTTP_LUA_CONFIG_SCOPE_MAIN;
+    }
+
+    if (len == 6 && ngx_strncmp(p, "server", 6) == 0) {
+        return NGX_HTTP_LUA_CONFIG_SCOPE_SRV;
+    }
+
+    if (max == NGX_HTTP_LUA_CONFIG_SCOPE_LOC
+        && len == 8 && ngx_strncmp(p, "location", 8) == 0)
+    {
+        return NGX_HTTP_LUA_CONFIG_SCOPE_LOC;
+    }
+
+    return luaL_argerror(L, idx, "invalid scope");
+}
+
+
+static ngx_uint_t
+ngx_http_lua_config_find_server(lua_State *L, int idx, u_char *name,
+    size_t len)
+{
+    ngx_str_t                         s;
+    ngx_rbtree_node_t                *node;
+    ngx_http_lua_config_main_conf_t  *lmcf;
+
+    lmcf = ngx_http_cycle_get_module_main_conf(ngx_cycle,
+                                               ngx_http_lua_config_module);
+    if (lmcf == NULL) {
+        return luaL_argerror(L, idx, "unknown server");
+    }
+
+    s.data = name;
+    s.len = len;
+
+    node = (ngx_rbtree_node_t *) ngx_str_rbtree_lookup(&lmcf->server_tree,
+                                              &s, ngx_crc32_short(name, len));
+    if (node == NULL) {
+        return luaL_argerror(L, idx, "unknown server");
+    }
+
+    return (ngx_uint_t) (uintptr_t) node;
+}
+
+
+static void *
+ngx_http_lua_config_scope_conf(ngx_http_request_t *r, ngx_uint_t scope,
+    ngx_uint_t srv)
+{
+    ngx_http_core_srv_conf_t         *cscf;
+    ngx_http_lua_config_server_t     *server;
+    ngx_http_lua_config_main_conf_t  *lmcf;
+
+    /*
+     * returns the srv or loc configuration of this module at the given
+     * level; the server level one is taken from the server context, so
+     * it is correct even before a location has been matched; without a
+     * request only the http level and named servers are known
+     */
+
+    if (ngx_http_lua_config_scope_named(scope)) {
+        server = (ngx_http_lua_config_server_t *) (uintptr_t) scope;
+        return srv ? server->srv_conf : server->loc_conf;
+    }
+
+    if (r == NULL) {
+        if (scope != NGX_HTTP_LUA_CONFIG_SCOPE_MAIN) {
+            return NULL;
+        }
+
+        lmcf = ngx_http_cycle_get_module_main_conf(ngx_cycle,
+                                                   ngx_http_lua_config_module);
+        if (lmcf == NULL) {
+            return NULL;
+        }
+
+        return srv ? lmcf->srv_conf : lmcf->loc_conf;
+    }
+
+    switch (scope) {
+
+    case NGX_HTTP_LUA_CONFIG_SCOPE_MAIN:
+        lmcf = ngx_http_get_module_main_conf(r, ngx_http_lua_config_module);
+        return srv ? lmcf->srv_conf : lmcf->loc_conf;
+
+    case NGX_HTTP_LUA_CONFIG_SCOPE_SRV:
+        if (srv) {
+            return ngx_http_get_module_srv_conf(r, ngx_http_lua_config_module);
+        }
+
+        cscf = ngx_http_get_module_srv_conf(r, ngx_http_core_module);
+        return cscf->ctx->loc_conf[ngx_http_lua_config_module.ctx_index];
+
+    default: /* NGX_HTTP_LUA_CONFIG_SCOPE_LOC */
+        return ngx_http_get_module_loc_conf(r, ngx_http_lua_config_module);
+    }
+}
+
+
+static int
+ngx_http_lua_config_get_config(lua_State *L)
+{
+    ngx_http_request_t         *r;
+    u_char                     *name_data;
+    size_t                      name_len;
+    ngx_str_t                   value;
+    ngx_int_t                   rc;
+    ngx_uint_t                  scope;
+    ngx_http_lua_config_cmd_t  *cmd;
+
+    ngx_http_lua_config_loc_conf_t  *llcf;
+
+    if (lua_gettop(L) < 1 || lua_gettop(L) > 2) {
+        return luaL_error(L, "expecting one or two arguments");
+    }
+
+    name_data = (u_char *) luaL_checklstring(L, 1, &name_len);
+
+    scope = ngx_http_lua_config_check_scope(L, 2,
+                                            NGX_HTTP_LUA_CONFIG_SCOPE_LOC);
+
+    r = ngx_http_lua_get_request(L);
+
+    llcf = ngx_http_lua_config_scope_conf(r, scope, 0);
+    if (llcf == NULL) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    rc = ngx_http_lua_config_get_value_internal(r, llcf, name_data, name_len,
+                                                &value, &cmd);
+
+    switch (rc) {
+
+    case NGX_OK:
+        ngx_lua_config_push_value(L, &value, cmd ? cmd->index : 0);
+        return 1;
+
+    case NGX_AGAIN:
+        lua_pushnil(L);
+        lua_pushliteral(L, "depends on the request");
+        return 2;
+
+    default: /* NGX_DECLINED, NGX_ERROR */
+        lua_pushnil(L);
+        return 1;
+    }
+}
+
+
+static ngx_uint_t
+ngx_http_lua_config_lower_bound(ngx_array_t *keys, ngx_str_t *name,
+    ngx_uint_t after)
+{
+    ngx_int_t                      rc;
+    ngx_uint_t                     lo, hi, mid;
+    ngx_http_lua_config_keyval_t  *kv;
+
+    /*
+     * keys are sorted by ngx_http_lua_config_init_fingerprint(), returns
+     * the index of the first key not less than the name, or greater than
+     * it if "after" is set
+     */
+
+    kv = keys->elts;
+    lo = 0;
+    hi = keys->nelts;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+
+        rc = ngx_lua_config_key_cmp(&kv[mid].key, name);
+
+        if (rc < 0 || (after && rc == 0)) {
+            lo = mid + 1;
+
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
+
+
+static int
+ngx_http_lua_config_get_prefix(lua_State *L)
+{
+    ngx_int_t                        rc;
+    ngx_str_t                        prefix, value;
+    ngx_uint_t                       i, scope;
+    ngx_http_request_t              *r;
+    ngx_http_lua_config_cmd_t       *cmd;
+    ngx_http_lua_config_keyval_t    *kv;
+    ngx_http_lua_config_loc_conf_t  *llcf;
+
+    if (lua_gettop(L) < 1 || lua_gettop(L) > 2) {
+        return luaL_error(L, "expecting one or two arguments");
+    }
+
+    prefix.data = (u_char *) luaL_checklstring(L, 1, &prefix.len);
+
+    scope = ngx_http_lua_config_check_scope(L, 2,
+                                            NGX_HTTP_LUA_CONFIG_SCOPE_LOC);
+
+    r = ngx_http_lua_get_request(L);
+
+    llcf = ngx_http_lua_config_scope_conf(r, scope, 0);
+    if (llcf == NULL) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    lua_newtable(L);
+
+    if (llcf->keys == NULL) {
+        return 1;
+    }
+
+    /* the matching keys are adjacent in the sorted keys */
+
+    kv = llcf->keys->elts;
+
+    for (i = ngx_http_lua_config_lower_bound(llcf->keys, &prefix, 0);
+         i < llcf->keys->nelts;
+         i++)
+    {
+        if (kv[i].key.len < prefix.len
+            || ngx_strncmp(kv[i].key.data, prefix.data, prefix.len) != 0)
+        {
+            break;
+        }
+
+        rc = ngx_http_lua_config_keyval_value(r, &kv[i], 1, &value, &cmd);
+
+        if (rc == NGX_ERROR) {
+            return luaL_error(L, "failed to evaluate \"%s\"",
+                              kv[i].key.data);
+        }
+
+        if (rc != NGX_OK) {
+            continue;
+        }
+
+        lua_pushlstring(L, (char *) kv[i].key.data, kv[i].key.len);
+        ngx_lua_config_push_value(L, &value, cmd ? cmd->index : 0);
+        lua_rawset(L, -3);
+    }
+
+    return 1;
+}
+
+
+static int
+ngx_http_lua_config_iterate(lua_State *L)
+{
+    ngx_uint_t  scope;
+
+    if (lua_gettop(L) > 2) {
+        return luaL_error(L, "expecting zero, one or two arguments");
+    }
+
+    if (!lua_isnoneornil(L, 1)) {
+        luaL_checkstring(L, 1);
+    }
+
+    scope = ngx_http_lua_config_check_scope(L, 2,
+                                            NGX_HTTP_LUA_CONFIG_SCOPE_LOC);
+
+    /*
+     * for key, value in iterate(prefix) do ... end; the iterator keeps
+     * no position of its own, each step looks up the key after the
+     * previous one, so no table of the matches is ever built; a named
+     * scope is a pointer, so it is kept as a light userdata
+     */
+
+    lua_pushvalue(L, lua_upvalueindex(1));
+    lua_pushlightuserdata(L, (void *) (uintptr_t) scope);
+    lua_pushcclosure(L, ngx_http_lua_config_iterate_next, 2);
+
+    if (lua_isnoneornil(L, 1)) {
+        lua_pushliteral(L, "");
+
+    } else {
+        lua_pushvalue(L, 1);
+    }
+
+    lua_pushnil(L);
+
+    return 3;
+}
+
+
+static int
+ngx_http_lua_config_iterate_next(lua_State *L)
+{
+    ngx_int_t                        rc;
+    ngx_str_t                        prefix, prev, value;
+    ngx_uint_t                       i, scope;
+    ngx_http_request_t              *r;
+    ngx_http_lua_config_cmd_t       *cmd;
+    ngx_http_lua_config_keyval_t    *kv;
+    ngx_http_lua_config_loc_conf_t  *llcf;
+
+    prefix.data = (u_char *) luaL_checklstring(L, 1, &prefix.len);
+
+    r = ngx_http_lua_get_request(L);
+
+    scope = (ngx_uint_t) (uintptr_t) lua_touserdata(L, lua_upvalueindex(2));
+
+    llcf = ngx_http_lua_config_scope_conf(r, scope, 0);
+
+    if (llcf == NULL || llcf->keys == NULL) {
+        return 0;
+    }
+
+    if (lua_isnil(L, 2)) {
+        i = ngx_http_lua_config_lower_bound(llcf->keys, &prefix, 0);
+
+    } else {
+        prev.data = (u_char *) luaL_checklstring(L, 2, &prev.len);
+        i = ngx_http_lua_config_lower_bound(llcf->keys, &prev, 1);
+    }
+
+    kv = llcf->keys->elts;
+
+    for ( /* void */ ; i < llcf->keys->nelts; i++) {
+        if (kv[i].key.len < prefix.len
+            || ngx_strncmp(kv[i].key.data, prefix.data, prefix.len) != 0)
+        {
+            return 0;
+        }
+
+        rc = ngx_http_lua_config_keyval_value(r, &kv[i], 1, &value, &cmd);
+
+        if (rc == NGX_ERROR) {
+            return luaL_error(L, "failed to evaluate \"%s\"",
+                              kv[i].key.data);
+        }
+
+        if (rc == NGX_OK) {
+            lua_pushlstring(L, (char *) kv[i].key.data, kv[i].key.len);
+            ngx_lua_config_push_value(L, &value, cmd ? cmd->index : 0);
+            return 2;
+        }
+    }
+
+    return 0;
+}
+
+
+static char *
+ngx_http_lua_config_stats(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_core_loc_conf_t  *clcf;
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    clcf->handler = ngx_http_lua_config_stats_handler;
+
+    return NGX_CONF_OK;
+}
+
+
+static ngx_int_t
+ngx_http_lua_config_stats_handler(ngx_http_request_t *r)
+{
+    size_t                        size;
+    ngx_int_t                     rc;
+    ngx_buf_t                    *b;
+    ngx_uint_t                    i, n;
+    ngx_chain_t                   out;
+    ngx_rbtree_t                 *tree;
+    ngx_rbtree_node_t            *node;
+    ngx_http_lua_config_stats_t  *st;
+
+    /*
+     * the statistics of the worker that serves the request:
+     *
+     *     sample N
+     *     key|upstream <name> lookup|filter count=N sum=NS max=NS LE:N ...
+     */
+
+    static char  *types[] = { "key", "upstream" };
+
+    if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+
+    rc = ngx_http_discard_request_body(r);
+
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    size = sizeof("sample \n") + NGX_INT_T_LEN;
+
+    for (i = 0; i < 2; i++) {
+        tree = i ? &ngx_http_lua_config_stats_upstreams
+                 : &ngx_http_lua_config_stats_keys;
+
+        if (ngx_http_lua_config_stats_sample == 0
+            || tree->root == tree->sentinel)
+        {
+            continue;
+        }
+
+        for (node = ngx_rbtree_min(tree->root, tree->sentinel);
+             node;
+             node = ngx_rbtree_next(tree, node))
+        {
+            st = (ngx_http_lua_config_stats_t *) node;
+
+            /* two lines, each with every bucket at most */
+
+            size += 2 * (sizeof("upstream  lookup count= sum= max=\n") - 1
+                         + st->sn.str.len + 3 * NGX_INT64_LEN
+                         + NGX_HTTP_LUA_CONFIG_STATS_BUCKETS
+                           * (sizeof(" :") - 1 + NGX_INT64_LEN
+                              + NGX_INT32_LEN));
+        }
+    }
+
+    b = ngx_create_temp_buf(r->pool, size);
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    b->last = ngx_sprintf(b->last, "sample %ui\n",
+                          ngx_http_lua_config_stats_sample);
+
+    for (i = 0; i < 2; i++) {
+        tree = i ? &ngx_http_lua_config_stats_upstreams
+                 : &ngx_http_lua_config_stats_keys;
+
+        if (ngx_http_lua_config_stats_sample == 0
+            || tree->root == tree->sentinel)
+        {
+            continue;
+        }
+
+        for (node = ngx_rbtree_min(tree->root, tree->sentinel);
+             node;
+             node = ngx_rbtree_next(tree, node))
+        {
+            st = (ngx_http_lua_config_stats_t *) node;
+
+            b->last = ngx_http_lua_config_stats_write(b->last, b->end,
+                                                      types[i], &st->sn.str,
+                                                      "lookup", &st->lookup);
+
+            if (st->filter.count) {
+                b->last = ngx_http_lua_config_stats_write(b->last, b->end,
+                                                      types[i], &st->sn.str,
+                                                      "filter", &st->filter);
+            }
+        }
+    }
+
+    n = b->last - b->pos;
+
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = n;
+    ngx_str_set(&r->headers_out.content_type, "text/plain");
+    r->headers_out.content_type_len = r->headers_out.content_type.len;
+
+    b->last_buf = (r == r->main) ? 1 : 0;
+    b->last_in_chain = 1;
+
+    rc = ngx_http_send_header(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    out.buf = b;
+    out.next = NULL;
+
+    return ngx_http_output_filter(r, &out);
+}
+
+
+static u_char *
+ngx_http_lua_config_stats_write(u_char *p, u_char *last, char *type,
+    ngx_str_t *name, char *what, ngx_http_lua_config_histogram_t *h)
+{
+    ngx_uint_t  n;
+
+    p = ngx_slprintf(p, last, "%s %V %s count=%uL sum=%uL max=%uL",
+                     type, name, what, h->count, h->sum, h->max);
+
+    for (n = 0; n < NGX_HTTP_LUA_CONFIG_STATS_BUCKETS; n++) {
+        if (h->buckets[n]) {
+            p = ngx_slprintf(p, last, " %uL:%uD",
+                             ngx_http_lua_config_stats_bound(n),
+                             h->buckets[n]);
+        }
+    }
+
+    return ngx_slprintf(p, last, "\n");
+}
+
+
+static ngx_http_lua_config_stats_t *
+ngx_http_lua_config_stats_entry(ngx_rbtree_t *tree, ngx_str_t *name)
+{
+    uint32_t                      hash;
+    ngx_http_lua_config_stats_t  *st;
+
+    hash = ngx_crc32_short(name->data, name->len);
+
+    st = (ngx_http_lua_config_stats_t *)
+             ngx_str_rbtree_lookup(tree, name, hash);
+
+    if (st != NULL) {
+        return st;
+    }
+
+    /* entries live as long as the worker */
+
+    st = ngx_pcalloc(ngx_cycle->pool,
+                     sizeof(ngx_http_lua_config_stats_t) + name->len);
+    if (st == NULL) {
+        return NULL;
+    }
+
+    st->sn.node.key = hash;
+    st->sn.str.len = name->len;
+    st->sn.str.data = (u_char *) st + sizeof(ngx_http_lua_config_stats_t);
+    ngx_memcpy(st->sn.str.data, name->data, name->len);
+
+    ngx_rbtree_insert(tree, &st->sn.node);
+
+    return st;
+}
+
+
+static ngx_int_t
+ngx_http_lua_config_stats_eval(ngx_http_request_t *r,
+    ngx_http_lua_config_keyval_t *kv, ngx_str_t *value,
+    ngx_http_lua_config_cmd_t **matched)
+{
+    uint64_t                      start;
+    ngx_int_t                     rc;
+    ngx_http_lua_config_stats_t  *st;
+
+    st = ngx_http_lua_config_stats_entry(&ngx_http_lua_config_stats_keys,
+                                         &kv->key);
+    if (st == NULL) {
+        return ngx_http_lua_config_eval_cmds(r, kv->cmds, value, matched);
+    }
+
+    /* the conditions of the chain are timed by the chain itself */
+
+    start = ngx_http_lua_config_stats_now();
+
+    rc = ngx_http_lua_config_eval_timed(r, &st->filter, kv->cmds, value,
+                                        matched);
+
+    ngx_http_lua_config_stats_add(&st->lookup,
+                                  ngx_http_lua_config_stats_now() - start);
+
+    return rc;
+}
+
+
+static int
+ngx_http_lua_config_stats_push_upstream(lua_State *L, ngx_http_request_t *r,
+    ngx_http_lua_upstream_t *us)
+{
+    int                           n;
+    uint64_t                      start;
+    ngx_http_lua_config_stats_t  *st;
+
+    st = ngx_http_lua_config_stats_entry(&ngx_http_lua_config_stats_upstreams,
+                                         &us->name);
+    if (st == NULL) {
+        return ngx_http_lua_config_push_upstream(L, r, us, NULL);
+    }
+
+    /*
+     * a Lua error in push_upstream() leaves nothing behind, the lookup
+     * just goes unrecorded
+     */
+
+    start = ngx_http_lua_config_stats_now();
+
+    n = ngx_http_lua_config_push_upstream(L, r, us, &st->filter);
+
+    ngx_http_lua_config_stats_add(&st->lookup,
+                                  ngx_http_lua_config_stats_now() - start);
+
+    return n;
+}
+
+
+static void
+ngx_http_lua_config_stats_add(ngx_http_lua_config_histogram_t *h,
+    uint64_t ns)
+{
+    ngx_uint_t  n, bit;
+
+    if (ns < 4) {
+        n = (ngx_uint_t) ns;
+
+    } else {
+        for (bit = 2; bit < 63 && (ns >> (bit + 1)); bit++) {
+            /* void */
+        }
+
+        n = 4 * (bit - 1) + (ngx_uint_t) ((ns >> (bit - 2)) & 3);
+
+        if (n >= NGX_HTTP_LUA_CONFIG_STATS_BUCKETS) {
+            n = NGX_HTTP_LUA_CONFIG_STATS_BUCKETS - 1;
+        }
+    }
+
+    h->buckets[n]++;
+    h->count++;
+    h->sum += ns;
+
+    if (ns > h->max) {
+        h->max = ns;
+    }
+}
+
+
+static uint64_t
+ngx_http_lua_config_stats_bound(ngx_uint_t n)
+{
+    ngx_uint_t  bit;
+
+    /* the exclusive upper bound of bucket n, in nanoseconds */
+
+    if (n < 4) {
+        return n + 1;
+    }
+
+    bit = n / 4 + 1;
+
+    return (uint64_t) (5 + n % 4) << (bit - 2);
+}
+
+
+static uint64_t
+ngx_http_lua_config_stats_now(void)
+{
+#if (NGX_HAVE_CLOCK_MONOTONIC)
+    struct timespec  ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+#else
+    struct timeval   tv;
+
+    ngx_gettimeofday(&tv);
+
+    return (uint64_t) tv.tv_sec * 1000000000 + tv.tv_usec * 1000;
+#endif
+}
+
+
+static void
+ngx_http_lua_config_stats_push(lua_State *L,
+    ngx_http_lua_config_histogram_t *h)
+{
+    ngx_uint_t  i, n;
+
+    lua_createtable(L, 0, 4);
+
+    lua_pushnumber(L, (lua_Number) h->count);
+    lua_setfield(L, -2, "count");
+
+    lua_pushnumber(L, (lua_Number) h->sum);
+    lua_setfield(L, -2, "sum");
+
+    lua_pushnumber(L, (lua_Number) h->max);
+    lua_setfield(L, -2, "max");
+
+    /* { { le, count }, ... } for the buckets in use, in order */
+
+    lua_newtable(L);
+
+    for (i = 0, n = 0; i < NGX_HTTP_LUA_CONFIG_STATS_BUCKETS; i++) {
+        if (h->buckets[i] == 0) {
+            continue;
+        }
+
+        lua_createtable(L, 2, 0);
+
+        lua_pushnumber(L, (lua_Number) ngx_http_lua_config_stats_bound(i));
+        lua_rawseti(L, -2, 1);
+
+        lua_pushnumber(L, (lua_Number) h->buckets[i]);
+        lua_rawseti(L, -2, 2);
+
+        lua_rawseti(L, -2, (int) ++n);
+    }
+
+    lua_setfield(L, -2, "buckets");
+}
+
+
+static int
+ngx_http_lua_config_get_stats(lua_State *L)
+{
+    ngx_uint_t                    i;
+    ngx_rbtree_t                 *tree;
+    ngx_rbtree_node_t            *node;
+    ngx_http_lua_config_stats_t  *st;
+
+    static char  *names[] = { "keys", "upstreams" };
+
+    if (lua_gettop(L) != 0) {
+        return luaL_error(L, "expecting no arguments");
+    }
+
+    if (ngx_http_lua_config_stats_sample == 0) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    lua_createtable(L, 0, 3);
+
+    lua_pushnumber(L, (lua_Number) ngx_http_lua_config_stats_sample);
+    lua_setfield(L, -2, "sample");
+
+    for (i = 0; i < 2; i++) {
+        tree = i ? &ngx_http_lua_config_stats_upstreams
+                 : &ngx_http_lua_config_stats_keys;
+
+        lua_newtable(L);
+
+        if (tree->root != tree->sentinel) {
+            for (node = ngx_rbtree_min(tree->root, tree->sentinel);
+                 node;
+                 node = ngx_rbtree_next(tree, node))
+            {
+                st = (ngx_http_lua_config_stats_t *) node;
+
+                lua_pushlstring(L, (char *) st->sn.str.data, st->sn.str.len);
+
+                lua_createtable(L, 0, 2);
+
+                ngx_http_lua_config_stats_push(L, &st->lookup);
+                lua_setfield(L, -2, "lookup");
+
+                ngx_http_lua_config_stats_push(L, &st->filter);
+                lua_setfield(L, -2, "filter");
+
+                lua_rawset(L, -3);
+            }
+        }
+
+        lua_setfield(L, -2, names[i]);
+    }
+
+    return 1;
+}
+
+
+static char *
+ngx_http_lua_config_override_zone(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+    ngx_http_lua_config_main_conf_t  *lmcf = conf;
+
+    ngx_str_t  *value;
+
+    if (lmcf->override_zone != NULL) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    lmcf->override_zone = ngx_http_lua_config_add_zone(cf, &value[1]);
+    if (lmcf->override_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    lmcf->override_zone->init = ngx_http_lua_config_init_override_zone;
+    lmcf->override_zone->data = lmcf;
+
+    return NGX_CONF_OK;
+}
+
+
+static ngx_shm_zone_t *
+ngx_http_lua_config_add_zone(ngx_conf_t *cf, ngx_str_t *value)
+{
+    u_char          *p;
+    ssize_t          size;
+    ngx_str_t        name, s;
+    ngx_shm_zone_t  *shm_zone;
+
+    /* "name:size", for a zone of this module that must not be shared */
+
+    p = (u_char *) ngx_strlchr(value->data, value->data + value->len, ':');
+    if (p == NULL || p == value->data) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid zone \"%V\"", value);
+        return NULL;
+    }
+
+    name.data = value->data;
+    name.len = p - value->data;
+
+    s.data = p + 1;
+    s.len = value->data + value->len - s.data;
+
+    size = ngx_parse_size(&s);
+
+    if (size == NGX_ERROR) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid zone size \"%V\"", value);
+        return NULL;
+    }
+
+    if (size < (ssize_t) (8 * ngx_pagesize)) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "zone \"%V\" is too small", value);
+        return NULL;
+    }
+
+    shm_zone = ngx_shared_memory_add(cf, &name, size,
+                                     &ngx_http_lua_config_module);
+    if (shm_zone == NULL) {
+        return NULL;
+    }
+
+    if (shm_zone->data) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "duplicate zone \"%V\"", &name);
+        return NULL;
+    }
+
+    return shm_zone;
+}
+
+
+static ngx_int_t
+ngx_http_lua_config_init_override_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    size_t                                 len;
+    ngx_slab_pool_t                       *shpool;
+    ngx_http_lua_config_override_shctx_t  *sh;
+
+    if (data) {
+        /* the overrides survive reloads that keep the zone */
+        shm_zone->data = data;
+        return NGX_OK;
+    }
+
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        shm_zone->data = shpool->data;
+        return NGX_OK;
+    }
+
+    sh = ngx_slab_calloc(shpool, sizeof(ngx_http_lua_config_override_shctx_t));
+    if (sh == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_rbtree_init(&sh->rbtree, &sh->sentinel, ngx_str_rbtree_insert_value);
+
+    shpool->data = sh;
+    shm_zone->data = sh;
+
+    len = sizeof(" in lua_config_override_zone \"\"") + shm_zone->shm.name.len;
+
+    shpool->log_ctx = ngx_slab_alloc(shpool, len);
+    if (shpool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(shpool->log_ctx, " in lua_config_override_zone \"%V\"%Z",
+                &shm_zone->shm.name);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_lua_config_override_find(ngx_pool_t *pool, ngx_str_t *key,
+    ngx_str_t *value)
+{
+    uint32_t                               hash;
+    ngx_http_lua_config_override_copy_t   *cp;
+    ngx_http_lua_config_override_cache_t  *cache;
+
+    /*
+     * racy reads, an override being set right now may be missed;
+     * without a pool, the value is valid until the next call
+     */
+
+    if (ngx_http_lua_config_overrides->noverrides == 0) {
+        return NGX_DECLINED;
+    }
+
+    cache = ngx_http_lua_config_override_cache;
+
+    if (cache == NULL
+        || cache->changes != ngx_http_lua_config_overrides->changes)
+    {
+        ngx_http_lua_config_override_refresh();
+
+        cache = ngx_http_lua_config_override_cache;
+        if (cache == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    hash = ngx_crc32_short(key->data, key->len);
+
+    cp = (ngx_http_lua_config_override_copy_t *)
+             ngx_str_rbtree_lookup(&cache->rbtree, key, hash);
+
+    if (cp == NULL) {
+        return NGX_DECLINED;
+    }
+
+    if (pool == NULL) {
+        *value = cp->value;
+        return NGX_OK;
+    }
+
+    value->len = cp->value.len;
+    value->data = ngx_pnalloc(pool, value->len);
+    if (value->data == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memcpy(value->data, cp->value.data, value->len);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_lua_config_override_refresh(void)
+{
+    u_char                                *p;
+    ngx_pool_t                            *pool;
+    ngx_rbtree_t                          *tree;
+    ngx_rbtree_node_t                     *node;
+    ngx_http_lua_config_override_t        *ov;
+    ngx_http_lua_config_override_copy_t   *cp;
+    ngx_http_lua_config_override_cache_t  *cache;
+
+    /* on errors the previous copy is kept and the next lookup retries */
+
+    pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, ngx_cycle->log);
+    if (pool == NULL) {
+        return;
+    }
+
+    cache = ngx_palloc(pool, sizeof(ngx_http_lua_config_override_cache_t));
+    if (cache == NULL) {
+        ngx_destroy_pool(pool);
+        return;
+    }
+
+    cache->pool = pool;
+
+    ngx_rbtree_init(&cache->rbtree, &cache->sentinel,
+                    ngx_str_rbtree_insert_value);
+
+    tree = &ngx_http_lua_config_overrides->rbtree;
+
+    ngx_shmtx_lock(&ngx_http_lua_config_overrides_pool->mutex);
+
+    cache->changes = ngx_http_lua_config_overrides->changes;
+
+    node = (tree->root != tree->sentinel)
+           ? ngx_rbtree_min(tree->root, tree->sentinel) : NULL;
+
+    for ( /* void */ ; node; node = ngx_rbtree_next(tree, node)) {
+        ov = (ngx_http_lua_config_override_t *) node;
+
+        if (ov->deleted) {
+            continue;
+        }
+
+        cp = ngx_palloc(pool, offsetof(ngx_http_lua_config_override_copy_t,
+                                       data)
+                              + ov->sn.str.len + ov->value.len);
+        if (cp == NULL) {
+            ngx_shmtx_unlock(&ngx_http_lua_config_overrides_pool->mutex);
+            ngx_destroy_pool(pool);
+            return;
+        }
+
+        cp->sn.node.key = ov->sn.node.key;
+        cp->sn.str.len = ov->sn.str.len;
+        cp->sn.str.data = cp->data;
+
+        p = ngx_cpymem(cp->data, ov->sn.str.data, ov->sn.str.len);
+
+        cp->value.len = ov->value.len;
+        cp->value.data = p;
+
+        ngx_memcpy(p, ov->value.data, ov->value.len);
+
+        ngx_rbtree_insert(&cache->rbtree, &cp->sn.node);
+    }
+
+    ngx_shmtx_unlock(&ngx_http_lua_config_overrides_pool->mutex);
+
+    if (ngx_http_lua_config_override_cache != NULL) {
+        ngx_destroy_pool(ngx_http_lua_config_override_cache->pool);
+    }
+
+    ngx_http_lua_config_override_cache = cache;
+}
+
+
+static ngx_int_t
+ngx_http_lua_config_override_apply(ngx_str_t *key, ngx_str_t *value,
+    uint64_t *version, uint32_t origin, ngx_uint_t deleted)
+{
+    uint32_t                               hash;
+    uint64_t                               now;
+    ngx_time_t                            *tp;
+    ngx_slab_pool_t                       *shpool;
+    ngx_http_lua_config_override_t        *ov, *old;
+    ngx_http_lua_config_override_shctx_t  *sh;
+
+    /*
+     * last writer wins: the greater version, then the greater origin;
+     * a zero version asks for a new local one, ahead of everything seen
+     * so far and of the wall clock, so that versions of different nodes
+     * roughly follow the real order of the changes
+     */
+
+    sh = ngx_http_lua_config_overrides;
+    shpool = ngx_http_lua_config_overrides_pool;
+
+    tp = ngx_timeofday();
+    now = (uint64_t) tp->sec * 1000 + tp->msec;
+
+    hash = ngx_crc32_short(key->data, key->len);
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    if (*version == 0) {
+        *version = ngx_max(sh->clock + 1, now);
+    }
+
+    if (*version > sh->clock) {
+        sh->clock = *version;
+    }
+
+    old = (ngx_http_lua_config_override_t *)
+              ngx_str_rbtree_lookup(&sh->rbtree, key, hash);
+
+    if (old != NULL
+        && (old->version > *version
+            || (old->version == *version && old->origin >= origin)))
+    {
+        ngx_shmtx_unlock(&shpool->mutex);
+        return NGX_DECLINED;
+    }
+
+    /*
+     * without replication every change is local and newer than all the
+     * others, a delete marker would order nothing
+     */
+
+    if (deleted && ngx_http_lua_config_repl_fd == (ngx_socket_t) -1) {
+
+        if (old != NULL) {
+            sh->digest ^= ngx_http_lua_config_override_hash(old);
+            sh->noverrides -= old->deleted ? 0 : 1;
+            sh->changes++;
+
+            ngx_rbtree_delete(&sh->rbtree, &old->sn.node);
+            ngx_slab_free_locked(shpool, old);
+
+            ngx_http_lua_config_epoch_change();
+        }
+
+        ngx_shmtx_unlock(&shpool->mutex);
+
+        return NGX_OK;
+    }
+
+    ov = ngx_slab_alloc_locked(shpool,
+                               offsetof(ngx_http_lua_config_override_t, data)
+                               + key->len + (deleted ? 0 : value->len));
+    if (ov == NULL) {
+        ngx_shmtx_unlock(&shpool->mutex);
+        return NGX_ERROR;
+    }
+
+    ov->sn.node.key = hash;
+    ov->sn.str.len = key->len;
+    ov->sn.str.data = ov->data;
+    ngx_memcpy(ov->sn.str.data, key->data, key->len);
+
+    ov->value.len = deleted ? 0 : value->len;
+    ov->value.data = ov->data + key->len;
+    ngx_memcpy(ov->value.data, value->data, ov->value.len);
+
+    ov->version = *version;
+    ov->origin = origin;
+    ov->deleted = deleted;
+    ov->updated = now;
+
+    if (old != NULL) {
+        sh->digest ^= ngx_http_lua_config_override_hash(old);
+        sh->noverrides -= old->deleted ? 0 : 1;
+
+        ngx_rbtree_delete(&sh->rbtree, &old->sn.node);
+        ngx_slab_free_locked(shpool, old);
+    }
+
+    ngx_rbtree_insert(&sh->rbtree, &ov->sn.node);
+
+    sh->digest ^= ngx_http_lua_config_override_hash(ov);
+    sh->noverrides += deleted ? 0 : 1;
+    sh->changes++;
+
+    ngx_http_lua_config_epoch_change();
+
+    if (origin != ngx_http_lua_config_origin) {
+        sh->last_applied = now;
+        sh->lag = (now > *version) ? now - *version : 0;
+    }
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    return NGX_OK;
+}
+
+
+static uint32_t
+ngx_http_lua_config_override_hash(ngx_http_lua_config_override_t *ov)
+{
+    uint32_t  crc, n[3];
+
+    /* in network byte order as on the wire, so that peers compare */
+
+    n[0] = htonl((uint32_t) (ov->version >> 32));
+    n[1] = htonl((uint32_t) ov->version);
+    n[2] = htonl(ov->origin);
+
+    ngx_crc32_init(crc);
+    ngx_crc32_update(&crc, ov->sn.str.data, ov->sn.str.len);
+    ngx_crc32_update(&crc, (u_char *) n, sizeof(n));
+    ngx_crc32_final(crc);
+
+    return crc;
+}
+
+
+static ngx_uint_t
+ngx_http_lua_config_override_defined(ngx_str_t *key)
+{
+    ngx_http_lua_config_key_t        *k;
+    ngx_http_lua_config_main_conf_t  *lmcf;
+
+    /*
+     * only a key some lua_config directive defines can be overridden,
+     * a handle of the C API alone does not define a key
+     */
+
+    lmcf = ngx_http_cycle_get_module_main_conf(ngx_cycle,
+                                               ngx_http_lua_config_module);
+
+    k = (ngx_http_lua_config_key_t *)
+            ngx_str_rbtree_lookup(&lmcf->key_tree, key,
+                                  ngx_crc32_short(key->data, key->len));
+
+    return k != NULL && k->defined;
+}
+
+
+static char *
+ngx_http_lua_config_replication(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+    ngx_http_lua_config_main_conf_t  *lmcf = conf;
+
+    ngx_int_t    node;
+    ngx_url_t    u;
+    ngx_str_t   *value, s;
+    ngx_msec_t   interval;
+    ngx_uint_t   i;
+
+    if (lmcf->repl_listen != NULL) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "listen=", 7) == 0) {
+
+            ngx_memzero(&u, sizeof(ngx_url_t));
+
+            u.url.len = value[i].len - 7;
+            u.url.data = value[i].data + 7;
+            u.listen = 1;
+
+            if (ngx_parse_url(cf->pool, &u) != NGX_OK) {
+                if (u.err) {
+                    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                       "%s in \"%V\"", u.err, &u.url);
+                }
+
+                return NGX_CONF_ERROR;
+            }
+
+            if (u.no_port || u.naddrs == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "no port in \"%V\"", &u.url);
+                return NGX_CONF_ERROR;
+            }
+
+            lmcf->repl_listen = &u.addrs[0];
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "secret=", 7) == 0) {
+
+            lmcf->repl_secret.len = value[i].len - 7;
+            lmcf->repl_secret.data = value[i].data + 7;
+
+            if (lmcf->repl_secret.len == 0) {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "interval=", 9) == 0) {
+
+            s.len = value[i].len - 9;
+            s.data = value[i].data + 9;
+
+            interval = ngx_parse_time(&s, 0);
+            if (interval == (ngx_msec_t) NGX_ERROR || interval == 0) {
+                goto invalid;
+            }
+
+            lmcf->repl_interval = interval;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "node=", 5) == 0) {
+
+            node = ngx_atoi(value[i].data + 5, value[i].len - 5);
+            if (node == NGX_ERROR || node == 0 || node > 0xffffffff) {
+                goto invalid;
+            }
+
+            lmcf->repl_origin = (uint32_t) node;
+
+            continue;
+        }
+
+        goto invalid;
+    }
+
+    if (lmcf->repl_listen == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"listen\" parameter is required");
+        return NGX_CONF_ERROR;
+    }
+
+    if (lmcf->repl_secret.len == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"secret\" parameter is required");
+        return NGX_CONF_ERROR;
+    }
+
+    /*
+     * the origin of the local changes, unique among the peers; without
+     * "node" it is derived from the host name and the listen address,
+     * which containers and copied hosts may well share
+     */
+
+    if (lmcf->repl_origin != 0) {
+        return NGX_CONF_OK;
+    }
+
+    ngx_crc32_init(lmcf->repl_origin);
+    ngx_crc32_update(&lmcf->repl_origin, cf->cycle->hostname.data,
+                     cf->cycle->hostname.len);
+    ngx_crc32_update(&lmcf->repl_origin, lmcf->repl_listen->name.data,
+                     lmcf->repl_listen->name.len);
+    ngx_crc32_final(lmcf->repl_origin);
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+
+    return NGX_CONF_ERROR;
+}
+
+
+static char *
+ngx_http_lua_config_replication_peer(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+    ngx_http_lua_config_main_conf_t  *lmcf = conf;
+
+    ngx_url_t    u;
+    ngx_str_t   *value;
+    ngx_uint_t   i;
+    ngx_addr_t  *peer;
+
+    value = cf->args->elts;
+
+    ngx_memzero(&u, sizeof(ngx_url_t));
+
+    u.url = value[1];
+
+    if (ngx_parse_url(cf->pool, &u) != NGX_OK) {
+        if (u.err) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "%s in \"%V\"", u.err, &u.url);
+        }
+
+        return NGX_CONF_ERROR;
+    }
+
+    if (u.no_port) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "no port in \"%V\"", &u.url);
+        return NGX_CONF_ERROR;
+    }
+
+    if (lmcf->repl_peers == NULL) {
+        lmcf->repl_peers = ngx_array_create(cf->pool, 4, sizeof(ngx_addr_t));
+        if (lmcf->repl_peers == NULL) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    for (i = 0; i < u.naddrs; i++) {
+        peer = ngx_array_push(lmcf->repl_peers);
+        if (peer == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        *peer = u.addrs[i];
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static ngx_int_t
+ngx_http_lua_config_repl_init(ngx_cycle_t *cycle,
+    ngx_http_lua_config_main_conf_t *lmcf)
+{
+    ngx_socket_t   s;
+    ngx_event_t   *ev;
+
+    /*
+     * every worker sends its own changes from an unbound socket, the
+     * first one also receives the changes of the peers and resends all
+     * overrides every interval so that lost datagrams are made up for
+     */
+
+    s = ngx_socket(lmcf->repl_listen->sockaddr->sa_family, SOCK_DGRAM, 0);
+
+    if (s == (ngx_socket_t) -1) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_socket_errno,
+                      ngx_socket_n " failed");
+        return NGX_ERROR;
+    }
+
+    if (ngx_nonblocking(s) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_socket_errno,
+                      ngx_nonblocking_n " failed");
+
+        if (ngx_close_socket(s) == -1) {
+            ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_socket_errno,
+                          ngx_close_socket_n " failed");
+        }
+
+        return NGX_ERROR;
+    }
+
+    ngx_http_lua_config_repl_fd = s;
+
+    if (ngx_worker != 0) {
+        return NGX_OK;
+    }
+
+    ngx_http_lua_config_repl_listen(cycle->log, lmcf);
+
+    ev = &ngx_http_lua_config_repl_event;
+
+    ev->handler = ngx_http_lua_config_repl_sync_handler;
+    ev->data = lmcf;
+    ev->log = cycle->log;
+    ev->cancelable = 1;
+
+    ngx_add_timer(ev, lmcf->repl_interval);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_lua_config_repl_listen(ngx_log_t *log,
+    ngx_http_lua_config_main_conf_t *lmcf)
+{
+    int                reuse;
+    ngx_addr_t        *addr;
+    ngx_socket_t       s;
+    ngx_connection_t  *c;
+
+    addr = lmcf->repl_listen;
+
+    s = ngx_socket(addr->sockaddr->sa_family, SOCK_DGRAM, 0);
+
+    if (s == (ngx_socket_t) -1) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_socket_errno,
+                      ngx_socket_n " failed");
+        return;
+    }
+
+    /*
+     * the first worker of the previous configuration keeps the address
+     * until it exits, a failed bind() is retried every interval
+     */
+
+    reuse = 1;
+
+    if (setsockopt(s, SOL_SOCKET, SO_REUSEADDR,
+                   (const void *) &reuse, sizeof(int))
+        == -1)
+    {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_socket_errno,
+                      "setsockopt(SO_REUSEADDR) for %V failed", &addr->name);
+        goto failed;
+    }
+
+#if (NGX_HAVE_REUSEPORT && defined SO_REUSEPORT)
+
+    if (setsockopt(s, SOL_SOCKET, SO_REUSEPORT,
+                   (const void *) &reuse, sizeof(int))
+        == -1)
+    {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_socket_errno,
+                      "setsockopt(SO_REUSEPORT) for %V failed", &addr->name);
+        goto failed;
+    }
+
+#endif
+
+    if (ngx_nonblocking(s) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_socket_errno,
+                      ngx_nonblocking_n " failed");
+        goto failed;
+    }
+
+    if (bind(s, addr->sockaddr, addr->socklen) == -1) {
+        ngx_log_error(NGX_LOG_ERR, log, ngx_socket_errno,
+                      "lua_config replication bind() to %V failed",
+                      &addr->name);
+        goto failed;
+    }
+
+    c = ngx_get_connection(s, log);
+    if (c == NULL) {
+        goto failed;
+    }
+
+    c->type = SOCK_DGRAM;
+    c->data = lmcf;
+    c->log = log;
+
+    c->read->handler = ngx_http_lua_config_repl_read_handler;
+    c->read->log = log;
+
+    if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+        ngx_close_connection(c);
+        return;
+    }
+
+    ngx_http_lua_config_repl_conn = c;
+
+    ngx_log_error(NGX_LOG_NOTICE, log, 0,
+                  "lua_config replication listening on %V", &addr->name);
+
+    return;
+
+failed:
+
+    if (ngx_close_socket(s) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_socket_errno,
+                      ngx_close_socket_n " failed");
+    }
+}
+
+
+static void
+ngx_http_lua_config_repl_read_handler(ngx_event_t *rev)
+{
+    ssize_t                           n;
+    ngx_err_t                         err;
+    ngx_connection_t                 *c;
+    ngx_http_lua_config_main_conf_t  *lmcf;
+
+    static u_char  buf[NGX_HTTP_LUA_CONFIG_REPL_MAX_SIZE + 1];
+
+    c = rev->data;
+    lmcf = c->data;
+
+    for ( ;; ) {
+        n = recv(c->fd, buf, sizeof(buf), 0);
+
+        if (n == -1) {
+            err = ngx_socket_errno;
+
+            if (err == NGX_EAGAIN) {
+                break;
+            }
+
+            if (err == NGX_EINTR) {
+                continue;
+            }
+
+            ngx_log_error(NGX_LOG_ERR, c->log, err,
+                          "lua_config replication recv() failed");
+            break;
+        }
+
+        ngx_http_lua_config_repl_receive(lmcf, buf, n, c->log);
+    }
+
+    if (ngx_handle_read_event(rev, 0) != NGX_OK) {
+        ngx_close_connection(c);
+        ngx_http_lua_config_repl_conn = NULL;
+    }
+}
+
+
+static void
+ngx_http_lua_config_repl_receive(ngx_http_lua_config_main_conf_t *lmcf,
+    u_char *buf, size_t n, ngx_log_t *log)
+{
+    u_char                              *sig;
+    uint32_t                             origin;
+    uint64_t                             version;
+    ngx_int_t                            rc;
+    ngx_str_t                            key, value;
+    ngx_uint_t                           i, diff;
+    ngx_http_lua_config_repl_header_t    h;
+    ngx_http_lua_config_override_shctx_t  *sh;
+
+    u_char  md[NGX_HTTP_LUA_CONFIG_REPL_SIGNATURE];
+
+    sh = ngx_http_lua_config_overrides;
+
+    if (n < sizeof(h) + NGX_HTTP_LUA_CONFIG_REPL_SIGNATURE) {
+        goto rejected;
+    }
+
+    ngx_memcpy(&h, buf, sizeof(h));
+
+    if (ngx_memcmp(h.magic, NGX_HTTP_LUA_CONFIG_REPL_MAGIC, 8) != 0
+        || ntohs(h.protocol) != NGX_HTTP_LUA_CONFIG_REPL_VERSION)
+    {
+        goto rejected;
+    }
+
+    key.len = ntohs(h.key_len);
+    value.len = ntohl(h.value_len);
+
+    if (key.len == 0
+        || key.len > NGX_HTTP_LUA_CONFIG_REPL_MAX_KEY
+        || value.len > NGX_HTTP_LUA_CONFIG_REPL_MAX_VALUE
+        || n != sizeof(h) + key.len + value.len
+                + NGX_HTTP_LUA_CONFIG_REPL_SIGNATURE)
+    {
+        goto rejected;
+    }
+
+    sig = buf + n - NGX_HTTP_LUA_CONFIG_REPL_SIGNATURE;
+
+    ngx_http_lua_config_repl_sign(&lmcf->repl_secret, buf, sig - buf, md);
+
+    /* in constant time */
+
+    for (i = 0, diff = 0; i < NGX_HTTP_LUA_CONFIG_REPL_SIGNATURE; i++) {
+        diff |= md[i] ^ sig[i];
+    }
+
+    if (diff) {
+        goto rejected;
+    }
+
+    key.data = buf + sizeof(h);
+    value.data = key.data + key.len;
+
+    version = (uint64_t) ntohl(h.version_hi) << 32 | ntohl(h.version_lo);
+    origin = ntohl(h.origin);
+
+    if (version == 0 || ngx_lua_config_check_key(&key) != NGX_OK) {
+        goto rejected;
+    }
+
+    (void) ngx_atomic_fetch_add(&sh->received, 1);
+
+    /* a peer may define keys this configuration does not */
+
+    if (!ngx_http_lua_config_override_defined(&key)) {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0,
+                       "lua_config replication: \"%V\" is not defined",
+                       &key);
+
+        (void) ngx_atomic_fetch_add(&sh->undefined, 1);
+        return;
+    }
+
+    rc = ngx_http_lua_config_override_apply(&key, &value, &version, origin,
+                       ntohs(h.flags) & NGX_HTTP_LUA_CONFIG_REPL_DELETED);
+
+    switch (rc) {
+
+    case NGX_OK:
+        ngx_log_debug3(NGX_LOG_DEBUG_HTTP, log, 0,
+                       "lua_config replication: \"%V\" version %uL from %uD",
+                       &key, version, origin);
+
+        (void) ngx_atomic_fetch_add(&sh->applied, 1);
+        break;
+
+    case NGX_DECLINED:
+        (void) ngx_atomic_fetch_add(&sh->stale, 1);
+        break;
+
+    default: /* NGX_ERROR */
+        ngx_log_error(NGX_LOG_ERR, log, 0,
+                      "lua_config replication: no memory for \"%V\" "
+                      "in lua_config_override_zone", &key);
+    }
+
+    return;
+
+rejected:
+
+    ngx_log_error(NGX_LOG_INFO, log, 0,
+                  "lua_config replication: rejected datagram of %uz bytes",
+                  n);
+
+    (void) ngx_atomic_fetch_add(&sh->rejected, 1);
+}
+
+
+static size_t
+ngx_http_lua_config_repl_encode(u_char *buf, ngx_str_t *secret,
+    ngx_str_t *key, ngx_str_t *value, uint64_t version, uint32_t origin,
+    ngx_uint_t deleted)
+{
+    u_char                             *p;
+    ngx_http_lua_config_repl_header_t   h;
+
+    ngx_memcpy(h.magic, NGX_HTTP_LUA_CONFIG_REPL_MAGIC, 8);
+
+    h.version_hi = htonl((uint32_t) (version >> 32));
+    h.version_lo = htonl((uint32_t) version);
+    h.origin = htonl(origin);
+    h.protocol = htons(NGX_HTTP_LUA_CONFIG_REPL_VERSION);
+    h.flags = htons(deleted ? NGX_HTTP_LUA_CONFIG_REPL_DELETED : 0);
+    h.key_len = htons((uint16_t) key->len);
+    h.reserved = 0;
+    h.value_len = htonl((uint32_t) value->len);
+
+    p = ngx_cpymem(buf, &h, sizeof(h));
+    p = ngx_cpymem(p, key->data, key->len);
+    p = ngx_cpymem(p, value->data, value->len);
+
+    ngx_http_lua_config_repl_sign(secret, buf, p - buf, p);
+
+    return p - buf + NGX_HTTP_LUA_CONFIG_REPL_SIGNATURE;
+}
+
+
+static void
+ngx_http_lua_config_repl_sign(ngx_str_t *secret, u_char *data, size_t len,
+    u_char *md)
+{
+    u_char      key[64], pad[64];
+    ngx_uint_t  i;
+    ngx_sha1_t  sha1;
+
+    /* HMAC-SHA1, RFC 2104 */
+
+    ngx_memzero(key, sizeof(key));
+
+    if (secret->len > sizeof(key)) {
+        ngx_sha1_init(&sha1);
+        ngx_sha1_update(&sha1, secret->data, secret->len);
+        ngx_sha1_final(key, &sha1);
+
+    } else {
+        ngx_memcpy(key, secret->data, secret->len);
+    }
+
+    for (i = 0; i < sizeof(pad); i++) {
+        pad[i] = key[i] ^ 0x36;
+    }
+
+    ngx_sha1_init(&sha1);
+    ngx_sha1_update(&sha1, pad, sizeof(pad));
+    ngx_sha1_update(&sha1, data, len);
+    ngx_sha1_final(md, &sha1);
+
+    for (i = 0; i < sizeof(pad); i++) {
+        pad[i] = key[i] ^ 0x5c;
+    }
+
+    ngx_sha1_init(&sha1);
+    ngx_sha1_update(&sha1, pad, sizeof(pad));
+    ngx_sha1_update(&sha1, md, NGX_HTTP_LUA_CONFIG_REPL_SIGNATURE);
+    ngx_sha1_final(md, &sha1);
+}
+
+
+static void
+ngx_http_lua_config_repl_send(ngx_http_lua_config_main_conf_t *lmcf,
+    u_char *buf, size_t len, ngx_log_t *log)
+{
+    ngx_err_t    err;
+    ngx_uint_t   i;
+    ngx_addr_t  *peer;
+
+    if (ngx_http_lua_config_repl_fd == (ngx_socket_t) -1
+        || lmcf->repl_peers == NULL)
+    {
+        return;
+    }
+
+    peer = lmcf->repl_peers->elts;
+
+    for (i = 0; i < lmcf->repl_peers->nelts; i++) {
+
+        if (sendto(ngx_http_lua_config_repl_fd, (const void *) buf, len, 0,
+                   peer[i].sockaddr, peer[i].socklen)
+            == -1)
+        {
+            err = ngx_socket_errno;
+
+            /* a full socket buffer, made up for by the next resend */
+
+            if (err == NGX_EAGAIN) {
+                ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, err,
+                               "lua_config replication sendto() to %V "
+                               "would block", &peer[i].name);
+
+                (void) ngx_atomic_fetch_add(
+                                      &ngx_http_lua_config_overrides->dropped,
+                                      1);
+                continue;
+            }
+
+            ngx_log_error(NGX_LOG_ERR, log, err,
+                          "lua_config replication sendto() to %V failed",
+                          &peer[i].name);
+            continue;
+        }
+
+        (void) ngx_atomic_fetch_add(&ngx_http_lua_config_overrides->sent, 1);
+    }
+}
+
+
+static void
+ngx_http_lua_config_repl_sync_handler(ngx_event_t *ev)
+{
+    u_char                                *buf, *p, *last;
+    size_t                                 size, len;
+    uint64_t                               now, keep;
+    ngx_uint_t                             i, n;
+    ngx_time_t                            *tp;
+    ngx_slab_pool_t                       *shpool;
+    ngx_rbtree_node_t                     *node, *next;
+    ngx_http_lua_config_override_t        *ov;
+    ngx_http_lua_config_repl_pass_t       *pass;
+    ngx_http_lua_config_main_conf_t       *lmcf;
+    ngx_http_lua_config_override_shctx_t  *sh;
+
+    if (ngx_exiting) {
+        return;
+    }
+
+    lmcf = ev->data;
+    sh = ngx_http_lua_config_overrides;
+    shpool = ngx_http_lua_config_overrides_pool;
+    pass = &ngx_http_lua_config_repl_pass;
+
+    if (ngx_http_lua_config_repl_conn == NULL && pass->key.len == 0) {
+        ngx_http_lua_config_repl_listen(ev->log, lmcf);
+    }
+
+    /*
+     * all overrides are sent again once per interval, in batches spread
+     * over the interval rather than in one burst that would overflow
+     * the socket buffer; the datagrams are signed into a buffer under
+     * the lock and sent after it is released
+     */
+
+    buf = NULL;
+    size = 0;
+
+    tp = ngx_timeofday();
+    now = (uint64_t) tp->sec * 1000 + tp->msec;
+    keep = (uint64_t) lmcf->repl_interval
+           * NGX_HTTP_LUA_CONFIG_REPL_KEEP_DELETED;
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    if (pass->key.len == 0) {
+
+        /*
+         * a delete marker has been sent to the peers for a while by now,
+         * so it is dropped before the zone fills up with them
+         */
+
+        n = 0;
+
+        node = (sh->rbtree.root != sh->rbtree.sentinel)
+               ? ngx_rbtree_min(sh->rbtree.root, sh->rbtree.sentinel)
+               : NULL;
+
+        for ( /* void */ ; node; node = next) {
+            next = ngx_rbtree_next(&sh->rbtree, node);
+
+            ov = (ngx_http_lua_config_override_t *) node;
+
+            if (!ov->deleted || now < ov->updated + keep) {
+                n++;
+                continue;
+            }
+
+            sh->digest ^= ngx_http_lua_config_override_hash(ov);
+
+            ngx_rbtree_delete(&sh->rbtree, node);
+            ngx_slab_free_locked(shpool, ov);
+        }
+
+        n = (n + NGX_HTTP_LUA_CONFIG_REPL_BATCH - 1)
+            / NGX_HTTP_LUA_CONFIG_REPL_BATCH;
+
+        pass->delay = ngx_max(lmcf->repl_interval / ngx_max(n, 1), 1);
+
+        node = (sh->rbtree.root != sh->rbtree.sentinel)
+               ? ngx_rbtree_min(sh->rbtree.root, sh->rbtree.sentinel)
+               : NULL;
+
+    } else {
+        node = ngx_http_lua_config_override_next(&sh->rbtree, pass->hash,
+                                                 &pass->key);
+    }
+
+    if (lmcf->repl_peers != NULL && node != NULL) {
+
+        for (next = node, i = 0;
+             next && i < NGX_HTTP_LUA_CONFIG_REPL_BATCH;
+             next = ngx_rbtree_next(&sh->rbtree, next), i++)
+        {
+            ov = (ngx_http_lua_config_override_t *) next;
+
+            size += sizeof(ngx_http_lua_config_repl_header_t)
+                    + ov->sn.str.len + ov->value.len
+                    + NGX_HTTP_LUA_CONFIG_REPL_SIGNATURE;
+        }
+
+        buf = ngx_alloc(size, ev->log);
+    }
+
+    if (buf != NULL) {
+        p = buf;
+        ov = NULL;
+
+        for (i = 0; node && i < NGX_HTTP_LUA_CONFIG_REPL_BATCH; i++) {
+            ov = (ngx_http_lua_config_override_t *) node;
+
+            p += ngx_http_lua_config_repl_encode(p, &lmcf->repl_secret,
+                                                 &ov->sn.str, &ov->value,
+                                                 ov->version, ov->origin,
+                                                 ov->deleted);
+
+            node = ngx_rbtree_next(&sh->rbtree, node);
+        }
+
+        /* the pass goes on after the last override sent */
+
+        if (node != NULL) {
+            pass->hash = (uint32_t) ov->sn.node.key;
+            pass->key.len = ov->sn.str.len;
+            pass->key.data = pass->data;
+            ngx_memcpy(pass->data, ov->sn.str.data, ov->sn.str.len);
+
+        } else {
+            pass->key.len = 0;
+        }
+
+    } else {
+        pass->key.len = 0;
+    }
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    if (buf == NULL) {
+        goto done;
+    }
+
+    last = buf + size;
+
+    for (p = buf; p < last; p += len) {
+        len = sizeof(ngx_http_lua_config_repl_header_t)
+              + ntohs(((ngx_http_lua_config_repl_header_t *) p)->key_len)
+              + ntohl(((ngx_http_lua_config_repl_header_t *) p)->value_len)
+              + NGX_HTTP_LUA_CONFIG_REPL_SIGNATURE;
+
+        ngx_http_lua_config_repl_send(lmcf, p, len, ev->log);
+    }
+
+    ngx_free(buf);
+
+done:
+
+    ngx_add_timer(ev, pass->delay);
+}
+
+
+static ngx_rbtree_node_t *
+ngx_http_lua_config_override_next(ngx_rbtree_t *tree, uint32_t hash,
+    ngx_str_t *key)
+{
+    ngx_int_t                        rc;
+    ngx_rbtree_node_t               *node, *sentinel, *next;
+    ngx_http_lua_config_override_t  *ov;
+
+    /*
+     * the first override after "key" in the order of the tree, whether
+     * or not "key" is still there
+     */
+
+    node = tree->root;
+    sentinel = tree->sentinel;
+    next = NULL;
+
+    while (node != sentinel) {
+        ov = (ngx_http_lua_config_override_t *) node;
+
+        if (hash != node->key) {
+            rc = (hash < node->key) ? -1 : 1;
+
+        } else {
+            rc = ngx_memn2cmp(key->data, ov->sn.str.data, key->len,
+                              ov->sn.str.len);
+        }
+
+        if (rc < 0) {
+            next = node;
+            node = node->left;
+
+        } else {
+            node = node->right;
+        }
+    }
+
+    return next;
+}
+
+
+static void
+ngx_http_lua_config_exit_process(ngx_cycle_t *cycle)
+{
+    if (ngx_http_lua_config_repl_conn != NULL) {
+        ngx_close_connection(ngx_http_lua_config_repl_conn);
+        ngx_http_lua_config_repl_conn = NULL;
+    }
+
+    if (ngx_http_lua_config_repl_fd != (ngx_socket_t) -1) {
+        if (ngx_close_socket(ngx_http_lua_config_repl_fd) == -1) {
+            ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_socket_errno,
+                          ngx_close_socket_n " failed");
+        }
+
+        ngx_http_lua_config_repl_fd = (ngx_socket_t) -1;
+    }
+}
+
+
+static int
+ngx_http_lua_config_set(lua_State *L)
+{
+    ngx_str_t  key, value;
+
+    if (lua_gettop(L) != 2) {
+        return luaL_error(L, "expecting two arguments");
+    }
+
+    key.data = (u_char *) luaL_checklstring(L, 1, &key.len);
+    value.data = (u_char *) luaL_checklstring(L, 2, &value.len);
+
+    return ngx_http_lua_config_set_override(L, &key, &value, 0);
+}
+
+
+static int
+ngx_http_lua_config_delete(lua_State *L)
+{
+    ngx_str_t  key, value;
+
+    if (lua_gettop(L) != 1) {
+        return luaL_error(L, "expecting one argument");
+    }
+
+    key.data = (u_char *) luaL_checklstring(L, 1, &key.len);
+
+    ngx_str_null(&value);
+
+    return ngx_http_lua_config_set_override(L, &key, &value, 1);
+}
+
+
+static int
+ngx_http_lua_config_set_override(lua_State *L, ngx_str_t *key,
+    ngx_str_t *value, ngx_uint_t deleted)
+{
+    size_t                            len;
+    uint64_t                          version;
+    ngx_int_t                         rc;
+    ngx_http_lua_config_main_conf_t  *lmcf;
+
+    u_char  buf[NGX_HTTP_LUA_CONFIG_REPL_MAX_SIZE];
+
+    if (ngx_http_lua_config_overrides == NULL) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "no lua_config_override_zone");
+        return 2;
+    }
+
+    if (key->len == 0
+        || key->len > NGX_HTTP_LUA_CONFIG_REPL_MAX_KEY
+        || ngx_lua_config_check_key(key) != NGX_OK)
+    {
+        lua_pushnil(L);
+        lua_pushliteral(L, "invalid key");
+        return 2;
+    }
+
+    if (!ngx_http_lua_config_override_defined(key)) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "undefined key");
+        return 2;
+    }
+
+    if (value->len > NGX_HTTP_LUA_CONFIG_REPL_MAX_VALUE) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "value too long");
+        return 2;
+    }
+
+    version = 0;
+
+    rc = ngx_http_lua_config_override_apply(key, value, &version,
+                                            ngx_http_lua_config_origin,
+                                            deleted);
+    if (rc != NGX_OK) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "no memory");
+        return 2;
+    }
+
+    lmcf = ngx_http_cycle_get_module_main_conf(ngx_cycle,
+                                               ngx_http_lua_config_module);
+
+    if (lmcf->repl_peers != NULL) {
+        len = ngx_http_lua_config_repl_encode(buf, &lmcf->repl_secret, key,
+                                              value, version,
+                                              ngx_http_lua_config_origin,
+                                              deleted);
+
+        ngx_http_lua_config_repl_send(lmcf, buf, len, ngx_cycle->log);
+    }
+
+    lua_pushnumber(L, (lua_Number) version);
+
+    return 1;
+}
+
+
+static int
+ngx_http_lua_config_get_replication(lua_State *L)
+{
+    ngx_http_lua_config_override_shctx_t  *sh;
+
+    if (lua_gettop(L) != 0) {
+        return luaL_error(L, "expecting no arguments");
+    }
+
+    sh = ngx_http_lua_config_overrides;
+
+    if (sh == NULL) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    lua_createtable(L, 0, 14);
+
+    lua_pushnumber(L, (lua_Number) ngx_http_lua_config_origin);
+    lua_setfield(L, -2, "node");
+
+    lua_pushnumber(L, (lua_Number) sh->noverrides);
+    lua_setfield(L, -2, "overrides");
+
+    lua_pushnumber(L, (lua_Number) sh->clock);
+    lua_setfield(L, -2, "version");
+
+    lua_pushnumber(L, (lua_Number) sh->digest);
+    lua_setfield(L, -2, "digest");
+
+    lua_pushnumber(L, (lua_Number) sh->changes);
+    lua_setfield(L, -2, "changes");
+
+    lua_pushnumber(L, (lua_Number) sh->sent);
+    lua_setfield(L, -2, "sent");
+
+    lua_pushnumber(L, (lua_Number) sh->dropped);
+    lua_setfield(L, -2, "dropped");
+
+    lua_pushnumber(L, (lua_Number) sh->received);
+    lua_setfield(L, -2, "received");
+
+    lua_pushnumber(L, (lua_Number) sh->applied);
+    lua_setfield(L, -2, "applied");
+
+    lua_pushnumber(L, (lua_Number) sh->stale);
+    lua_setfield(L, -2, "stale");
+
+    lua_pushnumber(L, (lua_Number) sh->rejected);
+    lua_setfield(L, -2, "rejected");
+
+    lua_pushnumber(L, (lua_Number) sh->undefined);
+    lua_setfield(L, -2, "undefined");
+
+    lua_pushnumber(L, (lua_Number) sh->last_applied / 1000);
+    lua_setfield(L, -2, "last_applied");
+
+    lua_pushnumber(L, (lua_Number) sh->lag);
+    lua_setfield(L, -2, "lag");
+
+    return 1;
+}
+
+
+static int
+ngx_http_lua_config_get_epoch(lua_State *L)
+{
+    if (lua_gettop(L) != 0) {
+        return luaL_error(L, "expecting no arguments");
+    }
+
+    lua_pushnumber(L, (lua_Number) ngx_http_lua_config_epoch());
+
+    return 1;
+}
+
+
+static int
+ngx_http_lua_config_get_scope_epoch(lua_State *L)
+{
+    ngx_uint_t                       scope;
+    ngx_http_request_t              *r;
+    ngx_http_lua_config_loc_conf_t  *llcf;
+
+    if (lua_gettop(L) > 1) {
+        return luaL_error(L, "expecting zero or one argument");
+    }
+
+    scope = ngx_http_lua_config_check_scope(L, 1,
+                                            NGX_HTTP_LUA_CONFIG_SCOPE_LOC);
+
+    r = ngx_http_lua_get_request(L);
+
+    llcf = ngx_http_lua_config_scope_conf(r, scope, 0);
+    if (llcf == NULL) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    /*
+     * overrides and addresses are not tracked per scope, their changes
+     * move every scope
+     */
+
+    lua_pushnumber(L, (lua_Number) ngx_max(llcf->epoch,
+                                   ngx_http_lua_config_epoch_changed()));
+
+    return 1;
+}
+
+
+static int
+ngx_http_lua_config_get_fingerprint(lua_State *L)
+{
+    ngx_http_request_t              *r;
+    ngx_str_t                        value;
+    ngx_uint_t                       scope;
+    ngx_http_lua_config_loc_conf_t  *llcf;
+
+    if (lua_gettop(L) > 1) {
+        return luaL_error(L, "expecting zero or one argument");
+    }
+
+    scope = ngx_http_lua_config_check_scope(L, 1,
+                                            NGX_HTTP_LUA_CONFIG_SCOPE_LOC);
+
+    r = ngx_http_lua_get_request(L);
+
+    llcf = ngx_http_lua_config_scope_conf(r, scope, 0);
+
+    /* a fingerprint of request dependent values needs the request */
+
+    if (llcf == NULL || (r == NULL && llcf->dynamic != NULL)) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    if (ngx_http_lua_config_fingerprint(r, llcf, &value) != NGX_OK) {
+        return luaL_error(L, "failed to compute fingerprint");
+    }
+
+    lua_pushlstring(L, (char *) value.data, value.len);
+
+    return 1;
+}
+
+
+static ngx_int_t
+ngx_http_lua_upstream_init_crc32(ngx_conf_t *cf, ngx_http_lua_upstream_t *us)
+{
+    uint32_t  crc;
+
+    /*
+     * the name and servers never depend on the request, so their part of
+     * the crc32 is always precomputed; the final value is precomputed too
+     * when every key resolves statically
+     */
+
+    ngx_lua_config_servers_crc32(&us->name, us->servers, &us->crc_servers);
+
+    crc = us->crc_servers;
+
+    if (ngx_lua_config_hash_keys(&ngx_http_lua_config_chain, NULL, us->keys,
+                                 &crc, NULL)
+        != NGX_OK)
+    {
+        us->dynamic = 1;
+        return NGX_OK;
+    }
+
+    ngx_crc32_final(crc);
+
+    us->crc = crc;
+    us->dynamic = 0;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_lua_upstream_crc32(ngx_http_request_t *r, ngx_http_lua_upstream_t *us,
+    uint32_t *crc)
+{
+    ngx_http_lua_config_eval_t  ev;
+
+    if (!us->dynamic && !us->resolve) {
+        *crc = us->crc;
+        return NGX_OK;
+    }
+
+    if (ngx_http_lua_config_upstream_servers(us, crc, NULL) == NULL) {
+        return NGX_ERROR;
+    }
+
+    ev.request = r;
+    ev.filter = NULL;
+
+    if (ngx_lua_config_hash_keys(&ngx_http_lua_config_chain, r ? &ev : NULL,
+                                 us->keys, crc, NULL)
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    ngx_crc32_final(*crc);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_lua_upstream_init_fingerprint(ngx_uint_t algorithm,
+    ngx_http_lua_upstream_t *us)
+{
+    ngx_lua_config_fingerprint_t  fp;
+
+    /* the servers part, followed by key and value of every key */
+
+    ngx_lua_config_servers_fingerprint(&us->fp_servers, algorithm, &us->name,
+                                       us->servers);
+
+    if (us->dynamic) {
+        return;
+    }
+
+    fp = us->fp_servers;
+
+    (void) ngx_lua_config_hash_keys(&ngx_http_lua_config_chain, NULL,
+                                    us->keys, NULL, &fp);
+
+    us->fingerprint = ngx_lua_config_fingerprint_final(&fp);
+}
+
+
+static void
+ngx_http_lua_upstream_fingerprint_key(ngx_lua_config_fingerprint_t *fp,
+    ngx_str_t *key, ngx_str_t *value)
+{
+    ngx_lua_config_fingerprint_str(fp, key);
+    ngx_lua_config_fingerprint_str(fp, value);
+}
+
+
+static ngx_http_lua_upstream_t *
+ngx_http_lua_config_find_upstream(ngx_http_request_t *r, ngx_uint_t scope,
+    u_char *name, size_t len)
+{
+    ngx_uint_t                       key;
+    ngx_http_lua_config_srv_conf_t  *lscf;
+
+    lscf = ngx_http_lua_config_scope_conf(r, scope, 1);
+    if (lscf == NULL || lscf->upstreams == NULL
+        || lscf->hash.buckets == NULL)
+    {
+        return NULL;
+    }
+
+    key = ngx_hash_key(name, len);
+
+    return ngx_hash_find(&lscf->hash, key, name, len);
+}
+
+
+static int
+ngx_http_lua_config_push_upstream(lua_State *L, ngx_http_request_t *r,
+    ngx_http_lua_upstream_t *us, ngx_http_lua_config_histogram_t *filter)
+{
+    ngx_http_lua_config_keyval_t    *kv;
+    ngx_http_lua_config_cmd_t       *cmd;
+    ngx_str_t                        val;
+    ngx_int_t                        rc;
+    ngx_uint_t                       i;
+    uint32_t                         crc;
+    uint64_t                         fingerprint;
+    u_char                           crc_str[8];
+    size_t                           crc_str_len;
+    ngx_lua_config_fingerprint_t     fp;
+    u_char                           fp_str[NGX_LUA_CONFIG_FINGERPRINT_LEN];
+    u_char                          *p;
+    ngx_uint_t                       dynamic;
+    ngx_array_t                     *servers;
+
+    /* incremental crc32 and fingerprint computation */
+    servers = ngx_http_lua_config_upstream_servers(us, &crc, &fp);
+    if (servers == NULL) {
+        return luaL_error(L, "no memory");
+    }
+
+    /* resolved addresses change the checksums too */
+    dynamic = us->dynamic || servers != us->servers;
+
+    /* create result table */
+    lua_createtable(L, 0, 4 + us->keys->nelts);
+
+    /* name */
+    lua_pushlstring(L, (char *) us->name.data, us->name.len);
+    lua_setfield(L, -2, "name");
+
+    /* servers */
+    ngx_lua_config_push_servers(L, servers);
+    lua_setfield(L, -2, "servers");
+
+    /* keys are sorted alphabetically at configuration time */
+    kv = us->keys->elts;
+
+    /* process config keys */
+    for (i = 0; i < us->keys->nelts; i++) {
+        rc = ngx_http_lua_config_eval_timed(r, filter, kv[i].cmds, &val,
+                                            &cmd);
+
+        if (rc == NGX_ERROR) {
+            return luaL_error(L, "failed to evaluate \"%s\"",
+                              kv[i].key.data);
+        }
+
+        if (rc != NGX_OK) {
+            continue;
+        }
+
+        ngx_lua_config_push_value(L, &val, cmd ? cmd->index : 0);
+
+        if (dynamic) {
+            ngx_lua_config_crc32_key(&crc, &kv[i].key, &val);
+            ngx_http_lua_upstream_fingerprint_key(&fp, &kv[i].key, &val);
+        }
+
+        lua_setfield(L, -2, (char *) kv[i].key.data);
+    }
+
+    /* compute crc32 */
+    if (dynamic) {
+        ngx_crc32_final(crc);
+        fingerprint = ngx_lua_config_fingerprint_final(&fp);
+
+    } else {
+        crc = us->crc;
+        fingerprint = us->fingerprint;
+    }
+
+    crc_str_len = ngx_sprintf(crc_str, "%08xD", crc) - crc_str;
+
+    lua_pushlstring(L, (char *) crc_str, crc_str_len);
+    lua_setfield(L, -2, "crc32");
+
+    p = ngx_lua_config_fingerprint_format(fp_str, us->fp_servers.algorithm,
+                                          fingerprint);
+
+    lua_pushlstring(L, (char *) fp_str, p - fp_str);
+    lua_setfield(L, -2, "fingerprint");
+
+    return 1;
+}
+
+
+static int
+ngx_http_lua_config_get_upstream(lua_State *L)
+{
+    ngx_http_request_t              *r;
+    ngx_http_lua_upstream_t         *us;
+    ngx_uint_t                       scope;
+    u_char                          *name_data;
+    size_t                           name_len;
+
+    if (lua_gettop(L) < 1 || lua_gettop(L) > 2) {
+        return luaL_error(L, "expecting one or two arguments");
+    }
+
+    name_data = (u_char *) luaL_checklstring(L, 1, &name_len);
+
+    scope = ngx_http_lua_config_check_scope(L, 2,
+                                            NGX_HTTP_LUA_CONFIG_SCOPE_SRV);
+
+    r = ngx_http_lua_get_request(L);
+
+    us = ngx_http_lua_config_find_upstream(r, scope, name_data, name_len);
+    if (us == NULL || (r == NULL && us->dynamic)) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    if (r != NULL && ngx_http_lua_config_stats_sampled(r)) {
+        return ngx_http_lua_config_stats_push_upstream(L, r, us);
+    }
+
+    return ngx_http_lua_config_push_upstream(L, r, us, NULL);
+}
+
+
+static int
+ngx_http_lua_config_get_upstream_crc(lua_State *L)
+{
+    ngx_http_request_t              *r;
+    ngx_http_lua_upstream_t         *us;
+    ngx_uint_t                       scope;
+    u_char                          *name_data;
+    size_t                           name_len;
+    uint32_t                         crc;
+    u_char                           crc_str[8];
+
+    if (lua_gettop(L) < 1 || lua_gettop(L) > 2) {
+        return luaL_error(L, "expecting one or two arguments");
+    }
+
+    name_data = (u_char *) luaL_checklstring(L, 1, &name_len);
+
+    scope = ngx_http_lua_config_check_scope(L, 2,
+                                            NGX_HTTP_LUA_CONFIG_SCOPE_SRV);
+
+    r = ngx_http_lua_get_request(L);
+
+    us = ngx_http_lua_config_find_upstream(r, scope, name_data, name_len);
+    if (us == NULL || (r == NULL && us->dynamic)) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    if (ngx_http_lua_upstream_crc32(r, us, &crc) != NGX_OK) {
+        return luaL_error(L, "failed to evaluate upstream \"%s\"",
+                          us->name.data);
+    }
+
+    ngx_sprintf(crc_str, "%08xD", crc);
+
+    lua_pushlstring(L, (char *) crc_str, sizeof(crc_str));
+
+    return 1;
+}
+
+
+static int
+ngx_http_lua_config_get_upstream_if_changed(lua_State *L)
+{
+    ngx_http_request_t              *r;
+    ngx_http_lua_upstream_t         *us;
+    ngx_uint_t                       scope;
+    u_char                          *name_data, *prev;
+    size_t                           name_len, prev_len;
+    uint32_t                         crc;
+    u_char                           crc_str[8];
+
+    if (lua_gettop(L) < 2 || lua_gettop(L) > 3) {
+        return luaL_error(L, "expecting two or three arguments");
+    }
+
+    name_data = (u_char *) luaL_checklstring(L, 1, &name_len);
+
+    if (lua_isnil(L, 2)) {
+        prev = NULL;
+        prev_len = 0;
+
+    } else {
+        prev = (u_char *) luaL_checklstring(L, 2, &prev_len);
+    }
+
+    scope = ngx_http_lua_config_check_scope(L, 3,
+                                            NGX_HTTP_LUA_CONFIG_SCOPE_SRV);
+
+    r = ngx_http_lua_get_request(L);
+
+    us = ngx_http_lua_config_find_upstream(r, scope, name_data, name_len);
+    if (us == NULL) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "not found");
+        return 2;
+    }
+
+    if (r == NULL && us->dynamic) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "depends on the request");
+        return 2;
+    }
+
+    if (prev != NULL && prev_len == sizeof(crc_str)) {
+        if (ngx_http_lua_upstream_crc32(r, us, &crc) != NGX_OK) {
+            return luaL_error(L, "failed to evaluate upstream \"%s\"",
+                              us->name.data);
+        }
+
+        ngx_sprintf(crc_str, "%08xD", crc);
+
+        if (ngx_strncmp(crc_str, prev, sizeof(crc_str)) == 0) {
+            lua_pushnil(L);
+            return 1;
+        }
+    }
+
+    return ngx_http_lua_config_push_upstream(L, r, us, NULL);
+}
+
+
+static int
+ngx_http_lua_config_get_upstream_key(lua_State *L)
+{
+    ngx_http_request_t              *r;
+    ngx_http_lua_upstream_t         *us;
+    ngx_http_lua_config_keyval_t    *kv;
+    ngx_http_lua_config_cmd_t       *cmd;
+    ngx_str_t                        val;
+    ngx_int_t                        rc;
+    ngx_uint_t                       scope;
+    u_char                          *name_data, *key_data;
+    size_t                           name_len, key_len;
+
+    if (lua_gettop(L) < 2 || lua_gettop(L) > 3) {
+        return luaL_error(L, "expecting two or three arguments");
+    }
+
+    name_data = (u_char *) luaL_checklstring(L, 1, &name_len);
+    key_data = (u_char *) luaL_checklstring(L, 2, &key_len);
+
+    scope = ngx_http_lua_config_check_scope(L, 3,
+                                            NGX_HTTP_LUA_CONFIG_SCOPE_SRV);
+
+    r = ngx_http_lua_get_request(L);
+
+    us = ngx_http_lua_config_find_upstream(r, scope, name_data, name_len);
+    if (us == NULL || us->hash.buckets == NULL) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    kv = ngx_hash_find(&us->hash, ngx_hash_key(key_data, key_len),
+                       key_data, key_len);
+    if (kv == NULL) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    /* only the requested key is evaluated */
+
+    rc = ngx_http_lua_config_eval_cmds(r, kv->cmds, &val, &cmd);
+
+    if (rc == NGX_ERROR) {
+        return luaL_error(L, "failed to evaluate \"%s\"", kv->key.data);
+    }
+
+    if (rc != NGX_OK) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    ngx_lua_config_push_value(L, &val, cmd ? cmd->index : 0);
+
+    return 1;
+}
+
+
+static int
+ngx_http_lua_config_get_upstream_servers(lua_State *L)
+{
+    ngx_array_t                     *servers;
+    ngx_http_request_t              *r;
+    ngx_http_lua_upstream_t         *us;
+    ngx_uint_t                       scope;
+    u_char                          *name_data;
+    size_t                           name_len;
+
+    if (lua_gettop(L) < 1 || lua_gettop(L) > 2) {
+        return luaL_error(L, "expecting one or two arguments");
+    }
+
+    name_data = (u_char *) luaL_checklstring(L, 1, &name_len);
+
+    scope = ngx_http_lua_config_check_scope(L, 2,
+                                            NGX_HTTP_LUA_CONFIG_SCOPE_SRV);
+
+    r = ngx_http_lua_get_request(L);
+
+    us = ngx_http_lua_config_find_upstream(r, scope, name_data, name_len);
+    if (us == NULL) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    servers = ngx_http_lua_config_resolve_servers(us);
+    if (servers == NULL) {
+        return luaL_error(L, "no memory");
+    }
+
+    ngx_lua_config_push_servers(L, servers);
+
+    return 1;
+}
+
+
+static ngx_str_t *
+ngx_http_lua_config_cached_serialized(ngx_http_lua_upstream_t *us,
+    ngx_http_lua_config_loc_conf_t *llcf, ngx_uint_t format)
+{
+    ngx_int_t                          rc;
+    ngx_str_t                         *s;
+    ngx_rbtree_key_t                   key;
+    ngx_rbtree_node_t                 *node, *sentinel;
+    ngx_lua_config_encoder_t           enc;
+    ngx_http_lua_config_serialized_t  *cached;
+
+    /*
+     * blocks and scopes that never depend on the request are encoded by
+     * a worker the first time they are asked for in a format, and the
+     * Lua API returns that string from then on; scopes are cached by
+     * their keys, which the locations that inherit them all share
+     */
+
+    key = us ? (ngx_rbtree_key_t) (uintptr_t) us
+             : (ngx_rbtree_key_t) (uintptr_t) llcf->keys;
+
+    node = ngx_http_lua_config_serialized_tree.root;
+    sentinel = ngx_http_lua_config_serialized_tree.sentinel;
+
+    while (node != sentinel && node->key != key) {
+        node = (key < node->key) ? node->left : node->right;
+    }
+
+    if (ngx_http_lua_config_serialized_pool == NULL) {
+        ngx_http_lua_config_serialized_pool =
+                         ngx_create_pool(NGX_DEFAULT_POOL_SIZE, ngx_cycle->log);
+        if (ngx_http_lua_config_serialized_pool == NULL) {
+            return NULL;
+        }
+    }
+
+    if (node != sentinel) {
+        cached = (ngx_http_lua_config_serialized_t *) node;
+
+    } else {
+        cached = ngx_pcalloc(ngx_http_lua_config_serialized_pool,
+                             sizeof(ngx_http_lua_config_serialized_t));
+        if (cached == NULL) {
+            return NULL;
+        }
+
+        cached->node.key = key;
+
+        ngx_rbtree_insert(&ngx_http_lua_config_serialized_tree,
+                          &cached->node);
+    }
+
+    s = &cached->serialized[format];
+
+    if (s->data != NULL) {
+        return s;
+    }
+
+    ngx_lua_config_encoder_init(&enc, format, NULL, 0,
+                                ngx_http_lua_config_serialized_pool,
+                                ngx_cycle->log);
+
+    if (us) {
+        rc = ngx_http_lua_config_encode_upstream(&enc, NULL, us);
+
+    } else {
+        rc = ngx_http_lua_config_encode_scope(&enc, NULL, llcf, 0);
+    }
+
+    if (rc != NGX_OK || enc.failed) {
+        return NULL;
+    }
+
+    s->data = enc.start;
+    s->len = enc.pos - enc.start;
+
+    return s;
+}
+
+
+static ngx_int_t
+ngx_http_lua_config_encode_upstream(ngx_lua_config_encoder_t *enc,
+    ngx_http_request_t *r, ngx_http_lua_upstream_t *us)
+{
+    size_t                          map;
+    u_char                         *p;
+    uint32_t                        crc;
+    uint64_t                        fingerprint;
+    ngx_int_t                       rc;
+    ngx_str_t                       val, s;
+    ngx_uint_t                      i, n, dynamic;
+    ngx_array_t                    *servers;
+    ngx_http_lua_config_cmd_t      *cmd;
+    ngx_lua_config_fingerprint_t    fp;
+    ngx_http_lua_config_keyval_t   *kv;
+    u_char                          crc_str[8];
+    u_char                          fp_str[NGX_LUA_CONFIG_FINGERPRINT_LEN];
+
+    static ngx_str_t  name_key = ngx_string("name");
+    static ngx_str_t  servers_key = ngx_string("servers");
+    static ngx_str_t  crc32_key = ngx_string("crc32");
+    static ngx_str_t  fingerprint_key = ngx_string("fingerprint");
+
+    /* the same fields as ngx_http_lua_config_push_upstream() */
+
+    servers = ngx_http_lua_config_upstream_servers(us, &crc, &fp);
+    if (servers == NULL) {
+        enc->failed = 1;
+        return NGX_OK;
+    }
+
+    dynamic = us->dynamic || servers != us->servers;
+
+    map = ngx_lua_config_encode_map(enc);
+
+    ngx_lua_config_encode_key(enc, &name_key);
+    ngx_lua_config_encode_str(enc, &us->name);
+
+    ngx_lua_config_encode_key(enc, &servers_key);
+    ngx_lua_config_encode_servers(enc, servers);
+
+    n = 4;
+
+    kv = us->keys->elts;
+
+    for (i = 0; i < us->keys->nelts; i++) {
+        rc = ngx_http_lua_config_eval_cmds(r, kv[i].cmds, &val, &cmd);
+
+        if (rc == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+
+        if (rc != NGX_OK) {
+            continue;
+        }
+
+        ngx_lua_config_encode_key(enc, &kv[i].key);
+        ngx_lua_config_encode_str(enc, &val);
+        n++;
+
+        if (dynamic) {
+            ngx_lua_config_crc32_key(&crc, &kv[i].key, &val);
+            ngx_http_lua_upstream_fingerprint_key(&fp, &kv[i].key, &val);
+        }
+    }
+
+    if (dynamic) {
+        ngx_crc32_final(crc);
+        fingerprint = ngx_lua_config_fingerprint_final(&fp);
+
+    } else {
+        crc = us->crc;
+        fingerprint = us->fingerprint;
+    }
+
+    s.data = crc_str;
+    s.len = ngx_sprintf(crc_str, "%08xD", crc) - crc_str;
+
+    ngx_lua_config_encode_key(enc, &crc32_key);
+    ngx_lua_config_encode_str(enc, &s);
+
+    p = ngx_lua_config_fingerprint_format(fp_str, us->fp_servers.algorithm,
+                                          fingerprint);
+
+    s.data = fp_str;
+    s.len = p - fp_str;
+
+    ngx_lua_config_encode_key(enc, &fingerprint_key);
+    ngx_lua_config_encode_str(enc, &s);
+
+    ngx_lua_config_encode_map_end(enc, map, n);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_lua_config_encode_scope(ngx_lua_config_encoder_t *enc,
+    ngx_http_request_t *r, ngx_http_lua_config_loc_conf_t *llcf,
+    ngx_uint_t overrides)
+{
+    size_t                          map;
+    ngx_int_t                       rc;
+    ngx_str_t                       value;
+    ngx_uint_t                      i, n;
+    ngx_http_lua_config_keyval_t   *kv;
+
+    /* the same keys and values as get_prefix("") */
+
+    map = ngx_lua_config_encode_map(enc);
+    n = 0;
+
+    kv = llcf->keys ? llcf->keys->elts : NULL;
+
+    for (i = 0; kv && i < llcf->keys->nelts; i++) {
+        rc = ngx_http_lua_config_keyval_value(r, &kv[i], overrides, &value,
+                                              NULL);
+
+        if (rc == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+
+        if (rc != NGX_OK) {
+            continue;
+        }
+
+        ngx_lua_config_encode_key(enc, &kv[i].key);
+        ngx_lua_config_encode_str(enc, &value);
+        n++;
+    }
+
+    ngx_lua_config_encode_map_end(enc, map, n);
+
+    return NGX_OK;
+}
+
+
+static int
+ngx_http_lua_config_push_serialized(lua_State *L, ngx_http_request_t *r,
+    ngx_uint_t format, ngx_http_lua_upstream_t *us,
+    ngx_http_lua_config_loc_conf_t *llcf)
+{
+    ngx_int_t                 rc;
+    ngx_lua_config_encoder_t  enc;
+
+    static u_char            *buf;
+    static size_t             size;
+
+    /*
+     * values that depend on the request are encoded straight into
+     * a buffer kept by the worker, which only grows
+     */
+
+    ngx_lua_config_encoder_init(&enc, format, buf, size, NULL,
+                                ngx_cycle->log);
+
+    if (us) {
+        rc = ngx_http_lua_config_encode_upstream(&enc, r, us);
+
+    } else {
+        rc = ngx_http_lua_config_encode_scope(&enc, r, llcf, 1);
+    }
+
+    buf = enc.start;
+    size = enc.end - enc.start;
+
+    if (rc != NGX_OK) {
+        return luaL_error(L, "failed to evaluate %s",
+                          us ? "upstream" : "scope");
+    }
+
+    if (enc.failed) {
+        return luaL_error(L, "no memory");
+    }
+
+    lua_pushlstring(L, (char *) enc.start, enc.pos - enc.start);
+
+    return 1;
+}
+
+
+static ngx_uint_t
+ngx_http_lua_config_check_format(lua_State *L, int idx)
+{
+    ngx_int_t  format;
+    ngx_str_t  name;
+
+    name.data = (u_char *) luaL_checklstring(L, idx, &name.len);
+
+    format = ngx_lua_config_encode_format(&name);
+    if (format == NGX_ERROR) {
+        return luaL_argerror(L, idx, "unknown format");
+    }
+
+    return (ngx_uint_t) format;
+}
+
+
+static int
+ngx_http_lua_config_get_upstream_serialized(lua_State *L)
+{
+    u_char                   *name_data;
+    size_t                    name_len;
+    ngx_str_t                *s;
+    ngx_uint_t                format, scope;
+    ngx_http_request_t       *r;
+    ngx_http_lua_upstream_t  *us;
+
+    if (lua_gettop(L) < 2 || lua_gettop(L) > 3) {
+        return luaL_error(L, "expecting two or three arguments");
+    }
+
+    name_data = (u_char *) luaL_checklstring(L, 1, &name_len);
+
+    format = ngx_http_lua_config_check_format(L, 2);
+
+    scope = ngx_http_lua_config_check_scope(L, 3,
+                                            NGX_HTTP_LUA_CONFIG_SCOPE_SRV);
+
+    r = ngx_http_lua_get_request(L);
+
+    us = ngx_http_lua_config_find_upstream(r, scope, name_data, name_len);
+    if (us == NULL) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    if (!us->dynamic && !us->resolve) {
+        s = ngx_http_lua_config_cached_serialized(us, NULL, format);
+        if (s == NULL) {
+            return luaL_error(L, "no memory");
+        }
+
+        lua_pushlstring(L, (char *) s->data, s->len);
+        return 1;
+    }
+
+    if (r == NULL && us->dynamic) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "depends on the request");
+        return 2;
+    }
+
+    return ngx_http_lua_config_push_serialized(L, r, format, us, NULL);
+}
+
+
+static int
+ngx_http_lua_config_get_scope_serialized(lua_State *L)
+{
+    ngx_str_t                       *s;
+    ngx_uint_t                       format, scope;
+    ngx_http_request_t              *r;
+    ngx_http_lua_config_loc_conf_t  *llcf;
+
+    if (lua_gettop(L) < 1 || lua_gettop(L) > 2) {
+        return luaL_error(L, "expecting one or two arguments");
+    }
+
+    format = ngx_http_lua_config_check_format(L, 1);
+
+    scope = ngx_http_lua_config_check_scope(L, 2,
+                                            NGX_HTTP_LUA_CONFIG_SCOPE_LOC);
+
+    r = ngx_http_lua_get_request(L);
+
+    llcf = ngx_http_lua_config_scope_conf(r, scope, 0);
+    if (llcf == NULL) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    /* any override may change a value, the cached string is then stale */
+
+    if (llcf->dynamic == NULL && ngx_http_lua_config_override_changes() == 0) {
+        s = ngx_http_lua_config_cached_serialized(NULL, llcf, format);
+        if (s == NULL) {
+            return luaL_error(L, "no memory");
+        }
+
+        lua_pushlstring(L, (char *) s->data, s->len);
+        return 1;
+    }
+
+    if (r == NULL && llcf->dynamic != NULL) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "depends on the request");
+        return 2;
+    }
+
+    return ngx_http_lua_config_push_serialized(L, r, format, NULL, llcf);
+}
+
+
+static ngx_int_t
+ngx_http_lua_config_init_inflight_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_atomic_t                     *counters;
+    ngx_slab_pool_t                  *shpool;
+    ngx_http_lua_config_main_conf_t  *lmcf;
+
+    /*
+     * the zone is never reused: the counters of a configuration are
+     * indexed by its own servers, the workers of the previous one keep
+     * their zone while they finish their requests
+     */
+
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        shm_zone->data = shpool->data;
+        return NGX_OK;
+    }
+
+    lmcf = shm_zone->data;
+
+    counters = ngx_slab_calloc(shpool, lmcf->ninflight * sizeof(ngx_atomic_t));
+    if (counters == NULL) {
+        return NGX_ERROR;
+    }
+
+    shpool->data = (void *) counters;
+    shm_zone->data = (void *) counters;
+
+    return NGX_OK;
+}
+
+
+static ngx_http_lua_upstream_t *
+ngx_http_lua_config_inflight_upstream(lua_State *L, int idx)
+{
+    u_char                   *name_data;
+    size_t                    name_len;
+    ngx_uint_t                scope;
+    ngx_http_request_t       *r;
+    ngx_http_lua_upstream_t  *us;
+
+    name_data = (u_char *) luaL_checklstring(L, 1, &name_len);
+
+    scope = ngx_http_lua_config_check_scope(L, idx,
+                                            NGX_HTTP_LUA_CONFIG_SCOPE_SRV);
+
+    if (ngx_http_lua_config_inflight == NULL) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "lua_upstream_inflight is off");
+        return NULL;
+    }
+
+    r = ngx_http_lua_get_request(L);
+
+    us = ngx_http_lua_config_find_upstream(r, scope, name_data, name_len);
+    if (us == NULL) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "not found");
+        return NULL;
+    }
+
+    return us;
+}
+
+
+static int
+ngx_http_lua_config_acquire(lua_State *L)
+{
+    size_t                           len;
+    ngx_uint_t                       i, k, n, best;
+    ngx_atomic_t                    *conns;
+    ngx_atomic_uint_t                c, bc;
+    ngx_http_lua_upstream_t         *us;
+    ngx_http_lua_upstream_server_t  *server;
+    u_char                           addr[NGX_SOCKADDR_STRLEN];
+
+    static ngx_uint_t  start;
+
+    if (lua_gettop(L) < 1 || lua_gettop(L) > 2) {
+        return luaL_error(L, "expecting one or two arguments");
+    }
+
+    us = ngx_http_lua_config_inflight_upstream(L, 2);
+    if (us == NULL) {
+        return 2;
+    }
+
+    conns = ngx_http_lua_config_inflight + us->inflight;
+    server = us->servers->elts;
+    n = us->servers->nelts;
+
+    /*
+     * the live server of the lowest level with the fewest requests in
+     * flight per weight; ties are broken round robin by the starting
+     * point, which moves on every call
+     */
+
+    best = n;
+    bc = 0;
+
+    start++;
+
+    for (k = 0; k < n; k++) {
+        i = (start + k) % n;
+
+        if (server[i].down) {
+            continue;
+        }
+
+        c = conns[i];
+
+        if (best != n
+            && (server[i].level > server[best].level
+                || (server[i].level == server[best].level
+                    && c * server[best].weight >= bc * server[i].weight)))
+        {
+            continue;
+        }
+
+        best = i;
+        bc = c;
+    }
+
+    if (best == n) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "no live servers");
+        return 2;
+    }
+
+    (void) ngx_atomic_fetch_add(&conns[best], 1);
+
+    lua_pushinteger(L, (lua_Integer) best + 1);
+
+    len = ngx_http_lua_config_resolve_pick(&server[best], addr);
+
+    if (len) {
+        lua_pushlstring(L, (char *) addr, len);
+
+    } else {
+        lua_pushlstring(L, (char *) server[best].host.data,
+                        server[best].host.len);
+    }
+
+    lua_pushinteger(L, (lua_Integer) server[best].port);
+
+    return 3;
+}
+
+
+static int
+ngx_http_lua_config_release(lua_State *L)
+{
+    lua_Integer               idx;
+    ngx_atomic_t             *conn;
+    ngx_atomic_uint_t         old;
+    ngx_http_lua_upstream_t  *us;
+
+    if (lua_gettop(L) < 2 || lua_gettop(L) > 3) {
+        return luaL_error(L, "expecting two or three arguments");
+    }
+
+    idx = luaL_checkinteger(L, 2);
+
+    us = ngx_http_lua_config_inflight_upstream(L, 3);
+    if (us == NULL) {
+        return 2;
+    }
+
+    if (idx < 1 || idx > (lua_Integer) us->servers->nelts) {
+        return luaL_argerror(L, 2, "invalid server index");
+    }
+
+    conn = &ngx_http_lua_config_inflight[us->inflight + idx - 1];
+
+    /* never below zero, not even for a moment seen by other workers */
+
+    for ( ;; ) {
+        old = *conn;
+
+        if (old == 0) {
+            lua_pushnil(L);
+            lua_pushliteral(L, "not acquired");
+            return 2;
+        }
+
+        if (ngx_atomic_cmp_set(conn, old, old - 1)) {
+            break;
+        }
+    }
+
+    lua_pushboolean(L, 1);
+
+    return 1;
+}
+
+
+static int
+ngx_http_lua_config_get_inflight(lua_State *L)
+{
+    ngx_uint_t                i;
+    ngx_atomic_t             *conns;
+    ngx_http_lua_upstream_t  *us;
+
+    if (lua_gettop(L) < 1 || lua_gettop(L) > 2) {
+        return luaL_error(L, "expecting one or two arguments");
+    }
+
+    us = ngx_http_lua_config_inflight_upstream(L, 2);
+    if (us == NULL) {
+        return 2;
+    }
+
+    conns = ngx_http_lua_config_inflight + us->inflight;
+
+    lua_createtable(L, (int) us->servers->nelts, 0);
+
+    for (i = 0; i < us->servers->nelts; i++) {
+        lua_pushnumber(L, (lua_Number) conns[i]);
+        lua_rawseti(L, -2, (int) i + 1);
+    }
+
+    return 1;
+}
+
+
+static char *
+ngx_http_lua_config_resolve_zone(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+    ngx_http_lua_config_main_conf_t  *lmcf = conf;
+
+    ngx_str_t  *value;
+
+    if (lmcf->resolve_zone != NULL) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    lmcf->resolve_zone = ngx_http_lua_config_add_zone(cf, &value[1]);
+    if (lmcf->resolve_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    lmcf->resolve_zone->init = ngx_http_lua_config_init_resolve_zone;
+    lmcf->resolve_zone->data = lmcf;
+
+    return NGX_CONF_OK;
+}
+
+
+static ngx_int_t
+ngx_http_lua_config_init_resolve_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    size_t                                len;
+    ngx_slab_pool_t                      *shpool;
+    ngx_http_lua_config_resolve_shctx_t  *sh;
+
+    if (data) {
+        /* the addresses survive reloads, new workers start warm */
+        shm_zone->data = data;
+        return NGX_OK;
+    }
+
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        shm_zone->data = shpool->data;
+        return NGX_OK;
+    }
+
+    sh = ngx_slab_calloc(shpool, sizeof(ngx_http_lua_config_resolve_shctx_t));
+    if (sh == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_rbtree_init(&sh->rbtree, &sh->sentinel, ngx_str_rbtree_insert_value);
+
+    shpool->data = sh;
+    shm_zone->data = sh;
+
+    len = sizeof(" in lua_upstream_resolve_zone \"\"") + shm_zone->shm.name.len;
+
+    shpool->log_ctx = ngx_slab_alloc(shpool, len);
+    if (shpool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(shpool->log_ctx, " in lua_upstream_resolve_zone \"%V\"%Z",
+                &shm_zone->shm.name);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_lua_config_add_resolve(ngx_conf_t *cf,
+    ngx_http_lua_config_main_conf_t *lmcf, ngx_http_lua_upstream_t *us)
+{
+    ngx_uint_t                      i, j;
+    ngx_http_lua_config_resolve_t  *rs;
+    ngx_http_lua_upstream_server_t *server;
+
+    /* every name is resolved once, however many servers use it */
+
+    server = us->servers->elts;
+
+    for (i = 0; i < us->servers->nelts; i++) {
+        if (!server[i].resolve) {
+            continue;
+        }
+
+        us->resolve = 1;
+
+        if (lmcf->resolve == NULL) {
+            lmcf->resolve = ngx_array_create(cf->pool, 4,
+                                        sizeof(ngx_http_lua_config_resolve_t));
+            if (lmcf->resolve == NULL) {
+                return NGX_ERROR;
+            }
+        }
+
+        rs = lmcf->resolve->elts;
+
+        for (j = 0; j < lmcf->resolve->nelts; j++) {
+            if (rs[j].name.len == server[i].host.len
+                && ngx_strncmp(rs[j].name.data, server[i].host.data,
+                               rs[j].name.len)
+                   == 0)
+            {
+                break;
+            }
+        }
+
+        if (j < lmcf->resolve->nelts) {
+            continue;
+        }
+
+        rs = ngx_array_push(lmcf->resolve);
+        if (rs == NULL) {
+            return NGX_ERROR;
+        }
+
+        ngx_memzero(rs, sizeof(ngx_http_lua_config_resolve_t));
+
+        rs->name = server[i].host;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_lua_config_resolve_init(ngx_cycle_t *cycle,
+    ngx_http_lua_config_main_conf_t *lmcf)
+{
+    ngx_uint_t                      i;
+    ngx_event_t                    *ev;
+    ngx_http_lua_config_resolve_t  *rs;
+
+    ngx_http_lua_config_resolved = lmcf->resolve_zone->data;
+    ngx_http_lua_config_resolved_pool =
+                            (ngx_slab_pool_t *) lmcf->resolve_zone->shm.addr;
+
+    /*
+     * only the first worker queries the resolver, the others read the
+     * addresses it publishes; names the configuration no longer has are
+     * dropped first
+     */
+
+    if (ngx_worker != 0) {
+        return NGX_OK;
+    }
+
+    ngx_http_lua_config_resolve_temp = ngx_create_pool(NGX_DEFAULT_POOL_SIZE,
+                                                       cycle->log);
+    if (ngx_http_lua_config_resolve_temp == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_http_lua_config_resolve_expire(lmcf);
+
+    rs = lmcf->resolve->elts;
+
+    for (i = 0; i < lmcf->resolve->nelts; i++) {
+        ev = &rs[i].event;
+
+        ev->handler = ngx_http_lua_config_resolve_handler;
+        ev->data = &rs[i];
+        ev->log = cycle->log;
+        ev->cancelable = 1;
+
+        ngx_add_timer(ev, 1);
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_lua_config_resolve_expire(ngx_http_lua_config_main_conf_t *lmcf)
+{
+    ngx_uint_t                            i;
+    ngx_rbtree_t                         *tree;
+    ngx_slab_pool_t                      *shpool;
+    ngx_rbtree_node_t                    *node, *next;
+    ngx_http_lua_config_resolve_t        *rs;
+    ngx_http_lua_config_resolved_t       *rn;
+
+    shpool = ngx_http_lua_config_resolved_pool;
+    tree = &ngx_http_lua_config_resolved->rbtree;
+
+    rs = lmcf->resolve->elts;
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    if (tree->root == tree->sentinel) {
+        ngx_shmtx_unlock(&shpool->mutex);
+        return;
+    }
+
+    for (node = ngx_rbtree_min(tree->root, tree->sentinel);
+         node != NULL;
+         node = next)
+    {
+        next = ngx_rbtree_next(tree, node);
+
+        rn = (ngx_http_lua_config_resolved_t *) node;
+
+        for (i = 0; i < lmcf->resolve->nelts; i++) {
+            if (rs[i].name.len == rn->sn.str.len
+                && ngx_strncmp(rs[i].name.data, rn->sn.str.data,
+                               rs[i].name.len)
+                   == 0)
+            {
+                break;
+            }
+        }
+
+        if (i < lmcf->resolve->nelts) {
+            continue;
+        }
+
+        ngx_rbtree_delete(tree, node);
+
+        if (rn->addrs) {
+            ngx_slab_free_locked(shpool, rn->addrs);
+        }
+
+        ngx_slab_free_locked(shpool, rn);
+    }
+
+    ngx_shmtx_unlock(&shpool->mutex);
+}
+
+
+static void
+ngx_http_lua_config_resolve_handler(ngx_event_t *ev)
+{
+    ngx_resolver_ctx_t               *ctx;
+    ngx_http_lua_config_resolve_t    *rs;
+    ngx_http_lua_config_main_conf_t  *lmcf;
+
+    if (ngx_exiting) {
+        return;
+    }
+
+    rs = ev->data;
+
+    lmcf = ngx_http_cycle_get_module_main_conf(ngx_cycle,
+                                               ngx_http_lua_config_module);
+
+    ctx = ngx_resolve_start(lmcf->resolver, NULL);
+
+    if (ctx == NULL) {
+        ngx_add_timer(ev, NGX_HTTP_LUA_CONFIG_RESOLVE_RETRY);
+        return;
+    }
+
+    if (ctx == NGX_NO_RESOLVER) {
+        ngx_log_error(NGX_LOG_ERR, ev->log, 0,
+                      "no resolver defined to resolve %V", &rs->name);
+        return;
+    }
+
+    ctx->name = rs->name;
+    ctx->handler = ngx_http_lua_config_resolved_handler;
+    ctx->data = rs;
+    ctx->timeout = lmcf->resolver_timeout;
 
-        kv->key = value[0];
+    if (ngx_resolve_name(ctx) != NGX_OK) {
+        ngx_add_timer(ev, NGX_HTTP_LUA_CONFIG_RESOLVE_RETRY);
+    }
+}
 
-        kv->cmds = ngx_array_create(cf->pool, 4,
-                                    sizeof(ngx_http_lua_config_cmd_t));
-        if (kv->cmds == NULL) {
-            return NGX_CONF_ERROR;
-        }
 
-    } else {
-        kv = &kv[i];
-    }
+static void
+ngx_http_lua_config_resolved_handler(ngx_resolver_ctx_t *ctx)
+{
+    time_t                          valid;
+    ngx_http_lua_config_resolve_t  *rs;
 
-    lcmd = ngx_array_push(kv->cmds);
-    if (lcmd == NULL) {
-        return NGX_CONF_ERROR;
+    rs = ctx->data;
+
+    if (ngx_exiting) {
+        ngx_resolve_name_done(ctx);
+        return;
     }
 
-    lcmd->negative = 0;
-    lcmd->filter = NULL;
+    /* on errors the addresses known so far are kept */
 
-    last = cf->args->nelts - 1;
+    if (ctx->state) {
+        ngx_log_error(NGX_LOG_ERR, rs->event.log, 0,
+                      "lua_upstream could not resolve %V: %i: %s",
+                      &ctx->name, ctx->state,
+                      ngx_resolver_strerror(ctx->state));
 
-    separator.len = 1;
+        ngx_resolve_name_done(ctx);
+        ngx_add_timer(&rs->event, NGX_HTTP_LUA_CONFIG_RESOLVE_RETRY);
+        return;
+    }
 
-    /* check for if=/if!= at the end */
-    if (ngx_strncmp(value[last].data, "if=", 3) == 0) {
-        s.len = value[last].len - 3;
-        s.data = value[last].data + 3;
+    ngx_http_lua_config_resolve_publish(rs, ctx);
 
-        ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
+    valid = ctx->valid - ngx_time();
 
-        ccv.cf = cf;
-        ccv.value = &s;
-        ccv.complex_value = ngx_palloc(cf->pool,
-                                       sizeof(ngx_http_complex_value_t));
-        if (ccv.complex_value == NULL) {
-            return NGX_CONF_ERROR;
-        }
+    ngx_resolve_name_done(ctx);
 
-        if (ngx_http_compile_complex_value(&ccv) != NGX_OK) {
-            return NGX_CONF_ERROR;
-        }
+    ngx_add_timer(&rs->event, (ngx_msec_t) ngx_max(valid, 1) * 1000);
+}
 
-        lcmd->filter = ccv.complex_value;
-        lcmd->negative = 0;
-        last--;
 
-    } else if (ngx_strncmp(value[last].data, "if!=", 4) == 0) {
-        s.len = value[last].len - 4;
-        s.data = value[last].data + 4;
-        
+static void
+ngx_http_lua_config_resolve_publish(ngx_http_lua_config_resolve_t *rs,
+    ngx_resolver_ctx_t *ctx)
+{
+    u_char                          *p;
+    size_t                           size;
+    uint32_t                         hash;
+    ngx_str_t                       *addrs, *dst;
+    ngx_uint_t                       i, n;
+    ngx_pool_t                      *pool;
+    ngx_slab_pool_t                 *shpool;
+    ngx_http_lua_config_resolved_t  *rn;
 
-        ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
+    /*
+     * the resolver rotates the addresses of a name, so they are sorted
+     * here and only a different set is published
+     */
 
-        ccv.cf = cf;
-        ccv.value = &s;
-        ccv.complex_value = ngx_palloc(cf->pool,
-                                       sizeof(ngx_http_complex_value_t));
-        if (ccv.complex_value == NULL) {
-            return NGX_CONF_ERROR;
-        }
+    pool = ngx_http_lua_config_resolve_temp;
+    ngx_reset_pool(pool);
 
-        if (ngx_http_compile_complex_value(&ccv) != NGX_OK) {
-            return NGX_CONF_ERROR;
-        }
+    n = ctx->naddrs;
 
-        lcmd->filter = ccv.complex_value;
-        lcmd->negative = 1;
-        last--;
+    addrs = ngx_palloc(pool, n * sizeof(ngx_str_t));
+    if (addrs == NULL) {
+        return;
     }
 
-    if (last >= 2
-        && ngx_strncmp(value[last].data, "separator=", 10) == 0)
-    {
-        if (value[last].len != 11) {
-            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-                               "invalid separator: \"%V\"",
-                               &value[last]);
-            return NGX_CONF_ERROR;
-        }
+    size = n * sizeof(ngx_str_t);
 
-        separator.data = value[last].data + 10;
-        last--;
+    for (i = 0; i < n; i++) {
+        addrs[i].data = ngx_pnalloc(pool, NGX_SOCKADDR_STRLEN);
+        if (addrs[i].data == NULL) {
+            return;
+        }
 
-    } else {
-        separator.data = (u_char *) ",";
+        addrs[i].len = ngx_sock_ntop(ctx->addrs[i].sockaddr,
+                                     ctx->addrs[i].socklen, addrs[i].data,
+                                     NGX_SOCKADDR_STRLEN, 0);
+        size += addrs[i].len;
     }
 
-    if (last < 1) {
-        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-                           "no value specified for lua_upstream "
-                           "config key \"%V\"", &value[0]);
-        return NGX_CONF_ERROR;
-    }
+    ngx_qsort(addrs, n, sizeof(ngx_str_t), ngx_lua_config_key_cmp);
 
-    if (last == 1) {
-        s = value[1];
+    shpool = ngx_http_lua_config_resolved_pool;
+    hash = ngx_crc32_short(rs->name.data, rs->name.len);
 
-    } else {
-        s.len = last - 1;
+    ngx_shmtx_lock(&shpool->mutex);
+
+    rn = (ngx_http_lua_config_resolved_t *)
+             ngx_str_rbtree_lookup(&ngx_http_lua_config_resolved->rbtree,
+                                   &rs->name, hash);
 
-        for (i = 1; i <= last; i++) {
-            s.len += value[i].len;
+    if (rn != NULL && rn->naddrs == n) {
+        for (i = 0; i < n; i++) {
+            if (ngx_lua_config_key_cmp(&rn->addrs[i], &addrs[i]) != 0) {
+                break;
+            }
         }
 
-        p = ngx_pnalloc(cf->pool, s.len);
-        if (p == NULL) {
-            return NGX_CONF_ERROR;
+        if (i == n) {
+            ngx_shmtx_unlock(&shpool->mutex);
+            return;
+        }
+    }
+
+    if (rn == NULL) {
+        rn = ngx_slab_alloc_locked(shpool,
+                             offsetof(ngx_http_lua_config_resolved_t, data)
+                             + rs->name.len);
+        if (rn == NULL) {
+            goto failed;
         }
 
-        s.data = p;
+        ngx_memcpy(rn->data, rs->name.data, rs->name.len);
 
-        p = ngx_cpymem(p, value[1].data, value[1].len);
+        rn->sn.node.key = hash;
+        rn->sn.str.data = rn->data;
+        rn->sn.str.len = rs->name.len;
+        rn->naddrs = 0;
+        rn->addrs = NULL;
 
-        for (i = 2; i <= last; i++) {
-            p = ngx_cpymem(p, separator.data, separator.len);
-            p = ngx_cpymem(p, value[i].data, value[i].len);
-        }
+        ngx_rbtree_insert(&ngx_http_lua_config_resolved->rbtree,
+                          &rn->sn.node);
     }
 
-    ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
+    dst = ngx_slab_alloc_locked(shpool, size);
+    if (dst == NULL) {
+        goto failed;
+    }
 
-    ccv.cf = cf;
-    ccv.value = &s;
-    ccv.complex_value = ngx_palloc(cf->pool, sizeof(ngx_http_complex_value_t));
-    if (ccv.complex_value == NULL) {
-        return NGX_CONF_ERROR;
+    p = (u_char *) &dst[n];
+
+    for (i = 0; i < n; i++) {
+        dst[i].len = addrs[i].len;
+        dst[i].data = p;
+        p = ngx_cpymem(p, addrs[i].data, addrs[i].len);
     }
 
-    if (ngx_http_compile_complex_value(&ccv) != NGX_OK) {
-        return NGX_CONF_ERROR;
+    if (rn->addrs) {
+        ngx_slab_free_locked(shpool, rn->addrs);
     }
 
-    lcmd->value = ccv.complex_value;
+    rn->addrs = dst;
+    rn->naddrs = n;
 
-    return NGX_CONF_OK;
+    ngx_http_lua_config_resolved->changes++;
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    ngx_http_lua_config_epoch_change();
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, rs->event.log, 0,
+                   "lua_upstream resolved %V to %ui addresses",
+                   &rs->name, n);
+
+    return;
+
+failed:
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    ngx_log_error(NGX_LOG_ERR, rs->event.log, 0,
+                  "could not allocate addresses of %V%s",
+                  &rs->name, shpool->log_ctx);
 }
 
 
-static ngx_int_t
-ngx_http_lua_config_get_value_internal(ngx_http_request_t *r, u_char *name,
-    size_t len, ngx_str_t *value)
+static ngx_http_lua_config_resolve_cache_t *
+ngx_http_lua_config_resolve_refresh(void)
 {
-    ngx_http_lua_config_loc_conf_t  *llcf;
-    ngx_http_lua_config_keyval_t    *kv;
-    ngx_http_lua_config_cmd_t       *cmds;
-    ngx_str_t                        s;
-    ngx_uint_t                       key, i;
+    u_char                               *p;
+    size_t                                size;
+    ngx_str_t                            *addrs;
+    ngx_uint_t                            i;
+    ngx_pool_t                           *pool;
+    ngx_rbtree_t                         *tree;
+    ngx_slab_pool_t                      *shpool;
+    ngx_rbtree_node_t                    *node;
+    ngx_http_lua_config_resolved_t       *rn, *cp;
+    ngx_http_lua_config_resolve_cache_t  *cache;
+
+    /* on errors the previous copy, if any, is used until the next call */
+
+    cache = ngx_http_lua_config_resolve_cache;
+
+    if (cache != NULL
+        && cache->changes == ngx_http_lua_config_resolved->changes)
+    {
+        return cache;
+    }
 
-    if (r == NULL) {
-        return NGX_DECLINED;
+    pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, ngx_cycle->log);
+    if (pool == NULL) {
+        return ngx_http_lua_config_resolve_cache;
     }
 
-    s.len = len;
-    s.data = name;
+    cache = ngx_palloc(pool, sizeof(ngx_http_lua_config_resolve_cache_t));
+    if (cache == NULL) {
+        ngx_destroy_pool(pool);
+        return ngx_http_lua_config_resolve_cache;
+    }
 
-    llcf = ngx_http_get_module_loc_conf(r, ngx_http_lua_config_module);
+    cache->pool = pool;
 
-    if (llcf == NULL || llcf->keys == NULL || llcf->hash.buckets == NULL) {
-        return NGX_DECLINED;
-    }
+    ngx_rbtree_init(&cache->rbtree, &cache->sentinel,
+                    ngx_str_rbtree_insert_value);
+    ngx_rbtree_init(&cache->upstreams, &cache->us_sentinel,
+                    ngx_rbtree_insert_value);
 
-    key = ngx_hash_key(s.data, s.len);
+    shpool = ngx_http_lua_config_resolved_pool;
+    tree = &ngx_http_lua_config_resolved->rbtree;
 
-    kv = ngx_hash_find(&llcf->hash, key, s.data, s.len);
-    if (kv == NULL) {
-        return NGX_DECLINED;
-    }
+    ngx_shmtx_lock(&shpool->mutex);
 
-    cmds = kv->cmds->elts;
-    for (i = 0; i < kv->cmds->nelts; i++) {
-        if (cmds[i].filter) {
-            if (ngx_http_complex_value(r, cmds[i].filter, &s)
-                != NGX_OK)
-            {
-                return NGX_ERROR;
-            }
+    cache->changes = ngx_http_lua_config_resolved->changes;
 
-            if (s.len == 0
-                || (s.len == 1 && s.data[0] == '0'))
-            {
-                if (!cmds[i].negative) {
-                    continue;
-                }
+    node = (tree->root != tree->sentinel)
+           ? ngx_rbtree_min(tree->root, tree->sentinel) : NULL;
 
-            } else {
-                if (cmds[i].negative) {
-                    continue;
-                }
-            }
+    for ( /* void */ ; node; node = ngx_rbtree_next(tree, node)) {
+        rn = (ngx_http_lua_config_resolved_t *) node;
+
+        cp = ngx_palloc(pool, offsetof(ngx_http_lua_config_resolved_t, data)
+                              + rn->sn.str.len);
+        if (cp == NULL) {
+            goto failed;
         }
 
-        if (ngx_http_complex_value(r, cmds[i].value, value) != NGX_OK) {
-            return NGX_ERROR;
+        size = rn->naddrs * sizeof(ngx_str_t);
+
+        for (i = 0; i < rn->naddrs; i++) {
+            size += rn->addrs[i].len;
         }
 
-        return NGX_OK;
-    }
+        addrs = ngx_palloc(pool, size);
+        if (addrs == NULL) {
+            goto failed;
+        }
 
-    return NGX_DECLINED;
-}
+        p = (u_char *) &addrs[rn->naddrs];
 
+        for (i = 0; i < rn->naddrs; i++) {
+            addrs[i].len = rn->addrs[i].len;
+            addrs[i].data = p;
+            p = ngx_cpymem(p, rn->addrs[i].data, rn->addrs[i].len);
+        }
 
-static int
-ngx_http_lua_config_get_config(lua_State *L)
-{
-    ngx_http_request_t    *r;
-    u_char                *name_data;
-    size_t                 name_len;
-    ngx_str_t              value;
-    ngx_int_t              rc;
+        ngx_memcpy(cp->data, rn->sn.str.data, rn->sn.str.len);
 
-    if (lua_gettop(L) != 1) {
-        return luaL_error(L, "exactly one argument expected");
+        cp->sn.node.key = rn->sn.node.key;
+        cp->sn.str.data = cp->data;
+        cp->sn.str.len = rn->sn.str.len;
+        cp->naddrs = rn->naddrs;
+        cp->addrs = addrs;
+
+        ngx_rbtree_insert(&cache->rbtree, &cp->sn.node);
     }
 
-    name_data = (u_char *) luaL_checklstring(L, 1, &name_len);
+    ngx_shmtx_unlock(&shpool->mutex);
 
-    r = ngx_http_lua_get_request(L);
+    if (ngx_http_lua_config_resolve_cache != NULL) {
+        ngx_destroy_pool(ngx_http_lua_config_resolve_cache->pool);
+    }
 
-    rc = ngx_http_lua_config_get_value_internal(r, name_data, name_len, &value);
-    if (rc == NGX_OK) {
-        lua_pushlstring(L, (char *) value.data, value.len);
+    ngx_http_lua_config_resolve_cache = cache;
 
-    } else {
-        lua_pushnil(L);
-    }
+    return cache;
 
-    return 1;
+failed:
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    ngx_destroy_pool(pool);
+
+    return ngx_http_lua_config_resolve_cache;
 }
 
 
-static int
-ngx_http_lua_upstream_key_cmp(const void *a, const void *b)
+static ngx_http_lua_config_resolved_us_t *
+ngx_http_lua_config_resolve_upstream(ngx_http_lua_upstream_t *us)
 {
-    const ngx_http_lua_config_keyval_t  *ka = a;
-    const ngx_http_lua_config_keyval_t  *kb = b;
+    uint32_t                              hash;
+    ngx_uint_t                            i, j;
+    ngx_rbtree_key_t                      key;
+    ngx_rbtree_node_t                    *node, *sentinel;
+    ngx_http_lua_config_resolved_t       *rn;
+    ngx_http_lua_upstream_server_t       *server, *s;
+    ngx_http_lua_config_resolved_us_t    *ru;
+    ngx_http_lua_config_resolve_cache_t  *cache;
 
-    ngx_uint_t  min_len;
-    ngx_int_t   rc;
+    /*
+     * servers with "resolve" are replaced by one server per address
+     * known, once per copy of the addresses; a name not resolved yet is
+     * kept as it is
+     */
 
-    min_len = ngx_min(ka->key.len, kb->key.len);
-    rc = ngx_strncmp(ka->key.data, kb->key.data, min_len);
-    if (rc != 0) {
-        return rc;
+    cache = ngx_http_lua_config_resolve_refresh();
+    if (cache == NULL) {
+        return NULL;
     }
 
-    return (int) ka->key.len - (int) kb->key.len;
-}
+    key = (ngx_rbtree_key_t) (uintptr_t) us;
 
+    node = cache->upstreams.root;
+    sentinel = cache->upstreams.sentinel;
 
-static int
-ngx_http_lua_config_get_upstream(lua_State *L)
-{
-    ngx_http_request_t              *r;
-    ngx_http_lua_config_srv_conf_t  *lscf;
-    ngx_http_lua_upstream_t         *us;
-    ngx_http_lua_upstream_server_t  *servers;
-    ngx_http_lua_config_keyval_t    *kv, *sorted_kv;
-    ngx_http_lua_config_cmd_t       *cmds;
-    ngx_str_t                        val;
-    ngx_uint_t                       key, i, j;
-    u_char                          *name_data;
-    size_t                           name_len;
-    uint32_t                         crc;
-    u_char                           crc_str[8];
-    size_t                           crc_str_len;
+    while (node != sentinel) {
 
-    u_char                           num_buf[NGX_INT_T_LEN];
-    size_t                           num_len;
+        if (key != node->key) {
+            node = (key < node->key) ? node->left : node->right;
+            continue;
+        }
 
-    if (lua_gettop(L) != 1) {
-        return luaL_error(L, "exactly one argument expected");
+        return (ngx_http_lua_config_resolved_us_t *) node;
     }
 
-    name_data = (u_char *) luaL_checklstring(L, 1, &name_len);
-
-    r = ngx_http_lua_get_request(L);
-    if (r == NULL) {
-        lua_pushnil(L);
-        return 1;
+    ru = ngx_pcalloc(cache->pool, sizeof(ngx_http_lua_config_resolved_us_t));
+    if (ru == NULL) {
+        return NULL;
     }
 
-    lscf = ngx_http_get_module_srv_conf(r, ngx_http_lua_config_module);
-    if (lscf == NULL || lscf->upstreams == NULL
-        || lscf->hash.buckets == NULL)
-    {
-        lua_pushnil(L);
-        return 1;
+    ru->servers = ngx_array_create(cache->pool, us->servers->nelts * 2,
+                                   sizeof(ngx_http_lua_upstream_server_t));
+    if (ru->servers == NULL) {
+        return NULL;
     }
 
-    key = ngx_hash_key(name_data, name_len);
-    us = ngx_hash_find(&lscf->hash, key, name_data, name_len);
-    if (us == NULL) {
-        lua_pushnil(L);
-        return 1;
+    server = us->servers->elts;
+
+    for (i = 0; i < us->servers->nelts; i++) {
+        rn = NULL;
+
+        if (server[i].resolve) {
+            hash = ngx_crc32_short(server[i].host.data, server[i].host.len);
+
+            rn = (ngx_http_lua_config_resolved_t *)
+                     ngx_str_rbtree_lookup(&cache->rbtree, &server[i].host,
+                                           hash);
+        }
+
+        if (rn == NULL || rn->naddrs == 0) {
+            s = ngx_array_push(ru->servers);
+            if (s == NULL) {
+                return NULL;
+            }
+
+            *s = server[i];
+            continue;
+        }
+
+        for (j = 0; j < rn->naddrs; j++) {
+            s = ngx_array_push(ru->servers);
+            if (s == NULL) {
+                return NULL;
+            }
+
+            *s = server[i];
+            s->host = rn->addrs[j];
+        }
     }
 
-    /* incremental crc32 computation */
-    ngx_crc32_init(crc);
+    ngx_lua_config_servers_crc32(&us->name, ru->servers, &ru->crc);
 
-    /* start with name */
-    ngx_crc32_update(&crc, us->name.data, us->name.len);
+    ru->node.key = key;
+    ngx_rbtree_insert(&cache->upstreams, &ru->node);
 
-    servers = us->servers->elts;
+    return ru;
+}
 
-    /* create result table */
-    lua_createtable(L, 0, 4 + us->keys->nelts);
 
-    /* name */
-    lua_pushlstring(L, (char *) us->name.data, us->name.len);
-    lua_setfield(L, -2, "name");
+static ngx_array_t *
+ngx_http_lua_config_resolve_servers(ngx_http_lua_upstream_t *us)
+{
+    ngx_http_lua_config_resolved_us_t  *ru;
 
-    /* servers */
-    lua_createtable(L, us->servers->nelts, 0);
+    /* valid until a later call finds the addresses changed */
 
-    for (i = 0; i < us->servers->nelts; i++) {
-        lua_createtable(L, 0, 5);
+    if (!us->resolve || ngx_http_lua_config_resolved == NULL) {
+        return us->servers;
+    }
+
+    ru = ngx_http_lua_config_resolve_upstream(us);
+
+    return ru ? ru->servers : NULL;
+}
 
-        lua_pushlstring(L, (char *) servers[i].host.data, servers[i].host.len);
-        lua_setfield(L, -2, "host");
 
-        lua_pushinteger(L, servers[i].port);
-        lua_setfield(L, -2, "port");
+static ngx_array_t *
+ngx_http_lua_config_upstream_servers(ngx_http_lua_upstream_t *us,
+    uint32_t *crc, ngx_lua_config_fingerprint_t *fp)
+{
+    ngx_http_lua_config_resolved_us_t  *ru;
 
-        lua_pushinteger(L, servers[i].level);
-        lua_setfield(L, -2, "level");
+    /*
+     * the servers to return and the running crc32 and fingerprint of the
+     * name and servers, computed again once addresses are resolved
+     */
 
-        lua_pushinteger(L, servers[i].weight);
-        lua_setfield(L, -2, "weight");
+    if (!us->resolve || ngx_http_lua_config_resolved == NULL) {
+        *crc = us->crc_servers;
 
-        lua_pushboolean(L, servers[i].down);
-        lua_setfield(L, -2, "down");
+        if (fp) {
+            *fp = us->fp_servers;
+        }
 
-        lua_rawseti(L, -2, i + 1);
+        return us->servers;
+    }
 
-        /* crc: |host:port:level:weight:down */
-        ngx_crc32_update(&crc, (u_char *) "|", 1);
-        ngx_crc32_update(&crc, servers[i].host.data, servers[i].host.len);
-        ngx_crc32_update(&crc, (u_char *) ":", 1);
-        num_len = ngx_sprintf(num_buf, "%ui", servers[i].port) - num_buf;
-        ngx_crc32_update(&crc, num_buf, num_len);
-        ngx_crc32_update(&crc, (u_char *) ":", 1);
-        num_len = ngx_sprintf(num_buf, "%ui", servers[i].level) - num_buf;
-        ngx_crc32_update(&crc, num_buf, num_len);
-        ngx_crc32_update(&crc, (u_char *) ":", 1);
-        num_len = ngx_sprintf(num_buf, "%ui", servers[i].weight) - num_buf;
-        ngx_crc32_update(&crc, num_buf, num_len);
-        ngx_crc32_update(&crc, (u_char *) ":", 1);
-        ngx_crc32_update(&crc, servers[i].down ? (u_char *) "1"
-                                               : (u_char *) "0", 1);
+    ru = ngx_http_lua_config_resolve_upstream(us);
+    if (ru == NULL) {
+        return NULL;
     }
 
-    lua_setfield(L, -2, "servers");
+    *crc = ru->crc;
 
-    /* sort keys alphabetically for crc and output */
-    kv = us->keys->elts;
+    if (fp) {
+        if (!ru->fingerprinted) {
+            ngx_lua_config_servers_fingerprint(&ru->fp,
+                                               us->fp_servers.algorithm,
+                                               &us->name, ru->servers);
+            ru->fingerprinted = 1;
+        }
 
-    sorted_kv = ngx_palloc(r->pool,
-                           us->keys->nelts
-                                       * sizeof(ngx_http_lua_config_keyval_t));
-    if (sorted_kv == NULL) {
-        return luaL_error(L, "memory allocation failed");
+        *fp = ru->fp;
     }
 
-    ngx_memcpy(sorted_kv, kv,
-               us->keys->nelts * sizeof(ngx_http_lua_config_keyval_t));
+    return ru->servers;
+}
 
-    ngx_qsort(sorted_kv, us->keys->nelts,
-              sizeof(ngx_http_lua_config_keyval_t),
-              ngx_http_lua_upstream_key_cmp);
 
-    /* process config keys */
-    for (i = 0; i < us->keys->nelts; i++) {
-        cmds = sorted_kv[i].cmds->elts;
+static size_t
+ngx_http_lua_config_resolve_pick(ngx_http_lua_upstream_server_t *server,
+    u_char *buf)
+{
+    uint32_t                              hash;
+    ngx_str_t                            *addr;
+    ngx_http_lua_config_resolved_t       *rn;
+    ngx_http_lua_config_resolve_cache_t  *cache;
 
-        /* find first matching value (filter logic from lua_config) */
-        for (j = 0; j < sorted_kv[i].cmds->nelts; j++) {
-            if (cmds[j].filter) {
-                if (ngx_http_complex_value(r, cmds[j].filter, &val)
-                    != NGX_OK)
-                {
-                    return luaL_error(L, "failed to evaluate filter");
-                }
+    static ngx_uint_t  next;
 
-                if (val.len == 0
-                    || (val.len == 1 && val.data[0] == '0'))
-                {
-                    if (!cmds[j].negative) {
-                        continue;
-                    }
-
-                } else {
-                    if (cmds[j].negative) {
-                        continue;
-                    }
-                }
-            }
+    /* one of the addresses of the server in turn, 0 if none is known */
 
-            /* matched */
-            if (ngx_http_complex_value(r, cmds[j].value, &val)
-                != NGX_OK)
-            {
-                return luaL_error(L, "failed to evaluate value");
-            }
+    if (!server->resolve || ngx_http_lua_config_resolved == NULL) {
+        return 0;
+    }
 
-            lua_pushlstring(L, (char *) val.data, val.len);
+    cache = ngx_http_lua_config_resolve_refresh();
+    if (cache == NULL) {
+        return 0;
+    }
 
-            /* crc: |key=value */
-            ngx_crc32_update(&crc, (u_char *) "|", 1);
-            ngx_crc32_update(&crc, sorted_kv[i].key.data,
-                                sorted_kv[i].key.len);
-            ngx_crc32_update(&crc, (u_char *) "=", 1);
-            ngx_crc32_update(&crc, val.data, val.len);
+    hash = ngx_crc32_short(server->host.data, server->host.len);
 
-            lua_setfield(L, -2, (char *) sorted_kv[i].key.data);
-            break;
-        }
+    rn = (ngx_http_lua_config_resolved_t *)
+             ngx_str_rbtree_lookup(&cache->rbtree, &server->host, hash);
+
+    if (rn == NULL || rn->naddrs == 0) {
+        return 0;
     }
 
-    /* compute crc32 */
-    ngx_crc32_final(crc);
-    crc_str_len = ngx_sprintf(crc_str, "%08xD", crc) - crc_str;
+    addr = &rn->addrs[next++ % rn->naddrs];
 
-    lua_pushlstring(L, (char *) crc_str, crc_str_len);
-    lua_setfield(L, -2, "crc32");
+    ngx_memcpy(buf, addr->data, addr->len);
 
-    return 1;
+    return addr->len;
 }
 
 
@@ -1561,16 +8512,85 @@ ngx_http_lua_config_create_module(lua_State *L)
 {
     /* ngx.lua_config */
 
-    lua_createtable(L, 0, 3);
+    lua_createtable(L, 0, 23);
+
+    /* interned static values, shared by the getters */
+    lua_newtable(L);
+
+    lua_pushvalue(L, -1);
+    lua_pushcclosure(L, ngx_http_lua_config_get_config, 1);
+    lua_setfield(L, -3, "get");
+
+    lua_pushvalue(L, -1);
+    lua_pushcclosure(L, ngx_http_lua_config_get_prefix, 1);
+    lua_setfield(L, -3, "get_prefix");
+
+    lua_pushvalue(L, -1);
+    lua_pushcclosure(L, ngx_http_lua_config_iterate, 1);
+    lua_setfield(L, -3, "iterate");
+
+    lua_pushvalue(L, -1);
+    lua_pushcclosure(L, ngx_http_lua_config_get_upstream, 1);
+    lua_setfield(L, -3, "get_upstream");
 
-    lua_pushcfunction(L, ngx_http_lua_config_get_config);
-    lua_setfield(L, -2, "get");
+    lua_pushvalue(L, -1);
+    lua_pushcclosure(L, ngx_http_lua_config_get_upstream_if_changed, 1);
+    lua_setfield(L, -3, "get_upstream_if_changed");
 
-    lua_pushcfunction(L, ngx_http_lua_config_get_upstream);
-    lua_setfield(L, -2, "get_upstream");
+    lua_pushcclosure(L, ngx_http_lua_config_get_upstream_key, 1);
+    lua_setfield(L, -2, "get_upstream_key");
+
+    lua_pushcfunction(L, ngx_http_lua_config_get_upstream_servers);
+    lua_setfield(L, -2, "get_upstream_servers");
+
+    lua_pushcfunction(L, ngx_http_lua_config_get_upstream_serialized);
+    lua_setfield(L, -2, "get_upstream_serialized");
+
+    lua_pushcfunction(L, ngx_http_lua_config_get_scope_serialized);
+    lua_setfield(L, -2, "get_scope_serialized");
+
+    lua_pushcfunction(L, ngx_http_lua_config_get_upstream_crc);
+    lua_setfield(L, -2, "get_upstream_crc");
 
     lua_pushcfunction(L, ngx_http_lua_get_init_configs);
     lua_setfield(L, -2, "get_init_configs");
 
+    lua_pushboolean(L, 0);
+    lua_pushcclosure(L, ngx_http_lua_get_init_config, 1);
+    lua_setfield(L, -2, "get_init_config");
+
+    lua_pushcfunction(L, ngx_http_lua_config_get_from);
+    lua_setfield(L, -2, "get_from");
+
+    lua_pushcfunction(L, ngx_http_lua_config_get_fingerprint);
+    lua_setfield(L, -2, "fingerprint");
+
+    lua_pushcfunction(L, ngx_http_lua_config_get_epoch);
+    lua_setfield(L, -2, "epoch");
+
+    lua_pushcfunction(L, ngx_http_lua_config_get_scope_epoch);
+    lua_setfield(L, -2, "scope_epoch");
+
+    lua_pushcfunction(L, ngx_http_lua_config_get_stats);
+    lua_setfield(L, -2, "stats");
+
+    lua_pushcfunction(L, ngx_http_lua_config_set);
+    lua_setfield(L, -2, "set");
+
+    lua_pushcfunction(L, ngx_http_lua_config_delete);
+    lua_setfield(L, -2, "delete");
+
+    lua_pushcfunction(L, ngx_http_lua_config_get_replication);
+    lua_setfield(L, -2, "replication");
+
+    lua_pushcfunction(L, ngx_http_lua_config_acquire);
+    lua_setfield(L, -2, "acquire");
+
+    lua_pushcfunction(L, ngx_http_lua_config_release);
+    lua_setfield(L, -2, "release");
+
+    lua_pushcfunction(L, ngx_http_lua_config_get_inflight);
+    lua_setfield(L, -2, "inflight");
+
     return 1;
 }
\ No newline at end of file
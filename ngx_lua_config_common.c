@@ -0,0 +1,1663 @@
+
+/*
+ * Copyright (C) Hanada
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <lauxlib.h>
+#include "ngx_lua_config_common.h"
+
+
+typedef struct {
+    ngx_str_node_t              sn;
+    void                       *cv;        /* compiled by the subsystem */
+    ngx_uint_t                  dynamic;
+    ngx_uint_t                  index;     /* interned slot, 0 if none yet */
+} ngx_lua_config_value_t;
+
+
+static ngx_int_t ngx_lua_config_init_add_node(ngx_conf_t *cf,
+    ngx_lua_config_init_node_t *root, ngx_keyval_t *kv);
+static int ngx_lua_config_init_readonly(lua_State *L);
+static int ngx_lua_config_init_pairs(lua_State *L);
+static int ngx_lua_config_init_next(lua_State *L);
+static void ngx_lua_config_init_push(lua_State *L,
+    ngx_lua_config_init_node_t *node, int paths);
+
+
+ngx_int_t
+ngx_lua_config_check_key(ngx_str_t *name)
+{
+    u_char  *p;
+
+    for (p = name->data; p < name->data + name->len; p++) {
+        if (!((*p >= '0' && *p <= '9')
+              || (*p >= 'a' && *p <= 'z')
+              || *p == '_'))
+        {
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_lua_config_join_args(ngx_conf_t *cf, ngx_str_t *value, ngx_uint_t first,
+    ngx_uint_t last, ngx_str_t *s)
+{
+    u_char     *p;
+    ngx_str_t   separator;
+    ngx_uint_t  i;
+
+    /*
+     * joins value[first..last] into one string, a trailing "separator=X"
+     * replaces the default ","; NGX_DECLINED if no value is left
+     */
+
+    separator.len = 1;
+
+    if (last > first
+        && ngx_strncmp(value[last].data, "separator=", 10) == 0)
+    {
+        if (value[last].len != 11) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid separator: \"%V\"",
+                               &value[last]);
+            return NGX_ERROR;
+        }
+
+        separator.data = value[last].data + 10;
+        last--;
+
+    } else {
+        separator.data = (u_char *) ",";
+    }
+
+    if (last < first) {
+        return NGX_DECLINED;
+    }
+
+    if (last == first) {
+        *s = value[first];
+        return NGX_OK;
+    }
+
+    s->len = separator.len * (last - first);
+
+    for (i = first; i <= last; i++) {
+        s->len += value[i].len;
+    }
+
+    p = ngx_pnalloc(cf->pool, s->len);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    s->data = p;
+
+    p = ngx_cpymem(p, value[first].data, value[first].len);
+
+    for (i = first + 1; i <= last; i++) {
+        p = ngx_cpymem(p, separator.data, separator.len);
+        p = ngx_cpymem(p, value[i].data, value[i].len);
+    }
+
+    return NGX_OK;
+}
+
+
+int ngx_libc_cdecl
+ngx_lua_config_key_cmp(const void *one, const void *two)
+{
+    /* the elements compared start with their ngx_str_t key */
+
+    const ngx_str_t  *a = one;
+    const ngx_str_t  *b = two;
+
+    ngx_int_t  rc;
+
+    rc = ngx_strncmp(a->data, b->data, ngx_min(a->len, b->len));
+    if (rc != 0) {
+        return rc;
+    }
+
+    return (int) a->len - (int) b->len;
+}
+
+
+char *
+ngx_lua_config_parse_server(ngx_conf_t *cf, ngx_array_t *servers,
+    ngx_uint_t resolve)
+{
+    ngx_str_t                *value;
+    ngx_url_t                 u;
+    ngx_addr_t                addr;
+    ngx_uint_t                i;
+    ngx_lua_config_server_t  *server;
+
+    /*
+     * "server host[:port] [level=N] [weight=N] [down] [resolve]",
+     * "resolve" is only accepted if the caller can re-resolve names
+     */
+
+    value = cf->args->elts;
+
+    if (cf->args->nelts < 2) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid number of arguments in "
+                           "\"server\" directive inside lua_upstream");
+        return NGX_CONF_ERROR;
+    }
+
+    server = ngx_array_push(servers);
+    if (server == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    server->level = 1;
+    server->weight = 1;
+    server->down = 0;
+    server->port = 0;
+    server->resolve = 0;
+    server->index = servers->nelts;
+
+    ngx_memzero(&u, sizeof(ngx_url_t));
+
+    u.url = value[1];
+    u.default_port = 0;
+    u.no_resolve = 1;
+
+    if (ngx_parse_url(cf->pool, &u) != NGX_OK) {
+        if (u.err) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "%s in upstream \"%V\"", u.err, &u.url);
+        }
+
+        return NGX_CONF_ERROR;
+    }
+
+    if (u.family == AF_UNIX) {
+        server->host.data = value[1].data;
+        server->host.len = sizeof("unix:") - 1 + u.host.len;
+
+    } else {
+        server->host = u.host;
+    }
+
+    server->port = u.port;
+
+    for (i = 2; i < cf->args->nelts; i++) {
+        if (ngx_strncmp(value[i].data, "level=", 6) == 0) {
+            server->level = ngx_atoi(value[i].data + 6, value[i].len - 6);
+
+            if (server->level == (ngx_uint_t) NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid level value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "weight=", 7) == 0) {
+            server->weight = ngx_atoi(value[i].data + 7, value[i].len - 7);
+
+            if (server->weight == (ngx_uint_t) NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid weight value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            if (server->weight == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "weight value cannot be zero \"%V\"",
+                                   &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "down") == 0) {
+            server->down = 1;
+            continue;
+        }
+
+        if (resolve && ngx_strcmp(value[i].data, "resolve") == 0) {
+            server->resolve = 1;
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid parameter \"%V\" in server directive "
+                           "inside lua_upstream", &value[i]);
+
+        return NGX_CONF_ERROR;
+    }
+
+    if (server->resolve
+        && (u.family == AF_UNIX
+            || server->host.data[0] == '['
+            || ngx_parse_addr(cf->pool, &addr, server->host.data,
+                              server->host.len)
+               == NGX_OK))
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"resolve\" requires a domain name "
+                           "in server \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+void
+ngx_lua_config_servers_crc32(ngx_str_t *name, ngx_array_t *servers,
+    uint32_t *crc)
+{
+    u_char                   *p;
+    ngx_uint_t                i;
+    ngx_lua_config_server_t  *server;
+    u_char                    buf[NGX_INT_T_LEN * 3 + 4];
+
+    ngx_crc32_init(*crc);
+
+    /* start with name */
+    ngx_crc32_update(crc, name->data, name->len);
+
+    server = servers->elts;
+
+    for (i = 0; i < servers->nelts; i++) {
+
+        /* crc: |host:port:level:weight:down */
+
+        ngx_crc32_update(crc, (u_char *) "|", 1);
+        ngx_crc32_update(crc, server[i].host.data, server[i].host.len);
+
+        p = ngx_sprintf(buf, ":%ui:%ui:%ui:%c", server[i].port,
+                        server[i].level, server[i].weight,
+                        server[i].down ? '1' : '0');
+
+        ngx_crc32_update(crc, buf, p - buf);
+    }
+}
+
+
+void
+ngx_lua_config_servers_fingerprint(ngx_lua_config_fingerprint_t *fp,
+    ngx_uint_t algorithm, ngx_str_t *name, ngx_array_t *servers)
+{
+    ngx_uint_t                i;
+    ngx_lua_config_server_t  *server;
+
+    /*
+     * same layout as the crc32, but fed as binary fields:
+     * name, then host, port, level, weight and down of every server
+     */
+
+    ngx_lua_config_fingerprint_init(fp, algorithm);
+    ngx_lua_config_fingerprint_str(fp, name);
+
+    server = servers->elts;
+
+    for (i = 0; i < servers->nelts; i++) {
+        ngx_lua_config_fingerprint_str(fp, &server[i].host);
+        ngx_lua_config_fingerprint_uint(fp, server[i].port);
+        ngx_lua_config_fingerprint_uint(fp, server[i].level);
+        ngx_lua_config_fingerprint_uint(fp, server[i].weight);
+        ngx_lua_config_fingerprint_uint(fp, server[i].down);
+    }
+}
+
+
+void
+ngx_lua_config_crc32_key(uint32_t *crc, ngx_str_t *key, ngx_str_t *value)
+{
+    /* crc: |key=value */
+
+    ngx_crc32_update(crc, (u_char *) "|", 1);
+    ngx_crc32_update(crc, key->data, key->len);
+    ngx_crc32_update(crc, (u_char *) "=", 1);
+    ngx_crc32_update(crc, value->data, value->len);
+}
+
+
+void
+ngx_lua_config_values_init(ngx_lua_config_values_t *values)
+{
+    ngx_rbtree_init(&values->tree, &values->sentinel,
+                    ngx_str_rbtree_insert_value);
+
+    values->nstatic = 0;
+}
+
+
+void *
+ngx_lua_config_intern_value(ngx_conf_t *cf, ngx_lua_config_chain_t *chain,
+    ngx_lua_config_values_t *values, ngx_str_t *value, ngx_uint_t *index)
+{
+    uint32_t                 hash;
+    ngx_lua_config_value_t  *v;
+
+    /*
+     * values and conditions with the same source compile to the same
+     * program in any context, so every occurrence shares one compiled
+     * value, and static values also share one interned Lua string slot
+     */
+
+    hash = ngx_crc32_short(value->data, value->len);
+
+    v = (ngx_lua_config_value_t *)
+            ngx_str_rbtree_lookup(&values->tree, value, hash);
+
+    if (v == NULL) {
+        v = ngx_pcalloc(cf->pool, sizeof(ngx_lua_config_value_t));
+        if (v == NULL) {
+            return NULL;
+        }
+
+        v->cv = chain->compile(cf, value, &v->dynamic);
+        if (v->cv == NULL) {
+            return NULL;
+        }
+
+        v->sn.node.key = hash;
+        v->sn.str = *value;
+
+        ngx_rbtree_insert(&values->tree, &v->sn.node);
+    }
+
+    if (index) {
+        if (v->index == 0 && !v->dynamic) {
+            v->index = ++values->nstatic;
+        }
+
+        *index = v->index;
+    }
+
+    return v->cv;
+}
+
+
+void *
+ngx_lua_config_add_cmd(ngx_conf_t *cf, ngx_lua_config_chain_t *chain,
+    ngx_array_t **keys, ngx_str_t *name)
+{
+    void                     *cmd;
+    ngx_uint_t                i;
+    ngx_lua_config_keyval_t  *kv;
+
+    if (name->len == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "lua config directive name cannot be empty");
+        return NULL;
+    }
+
+    if (ngx_lua_config_check_key(name) != NGX_OK) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid character in lua config "
+                           "directive name \"%V\"", name);
+        return NULL;
+    }
+
+    if (*keys == NULL) {
+        *keys = ngx_array_create(cf->pool, 4,
+                                 sizeof(ngx_lua_config_keyval_t));
+        if (*keys == NULL) {
+            return NULL;
+        }
+    }
+
+    kv = (*keys)->elts;
+    for (i = 0; i < (*keys)->nelts; i++) {
+        if (name->len == kv[i].key.len
+            && ngx_strncmp(name->data, kv[i].key.data, name->len) == 0)
+        {
+            break;
+        }
+    }
+
+    if (i == (*keys)->nelts) {
+        kv = ngx_array_push(*keys);
+        if (kv == NULL) {
+            return NULL;
+        }
+
+        kv->key = *name;
+
+        kv->cmds = ngx_array_create(cf->pool, 4, chain->size);
+        if (kv->cmds == NULL) {
+            return NULL;
+        }
+
+    } else {
+        kv = &kv[i];
+    }
+
+    cmd = ngx_array_push(kv->cmds);
+    if (cmd == NULL) {
+        return NULL;
+    }
+
+    ngx_memzero(cmd, chain->size);
+
+    return cmd;
+}
+
+
+ngx_int_t
+ngx_lua_config_parse_filter(ngx_str_t *arg, ngx_uint_t *negative,
+    ngx_uint_t *regex, ngx_str_t *value)
+{
+    ngx_str_t  s;
+
+    /*
+     * if=value, if!=value, and the regex forms if~=, if~*= (caseless),
+     * if!~= and if!~*=; "regex" is 1 for a regex, 2 for a caseless one,
+     * NGX_DECLINED if the argument is not a condition
+     */
+
+    if (arg->len < 2 || ngx_strncmp(arg->data, "if", 2) != 0) {
+        return NGX_DECLINED;
+    }
+
+    s.data = arg->data + 2;
+    s.len = arg->len - 2;
+
+    *negative = 0;
+    *regex = 0;
+
+    if (s.len && s.data[0] == '!') {
+        *negative = 1;
+        s.data++;
+        s.len--;
+    }
+
+    if (s.len && s.data[0] == '~') {
+        *regex = 1;
+        s.data++;
+        s.len--;
+
+        if (s.len && s.data[0] == '*') {
+            *regex = 2;
+            s.data++;
+            s.len--;
+        }
+    }
+
+    if (s.len == 0 || s.data[0] != '=') {
+        return NGX_DECLINED;
+    }
+
+    value->data = s.data + 1;
+    value->len = s.len - 1;
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_lua_config_condition(ngx_str_t *value, ngx_uint_t negative)
+{
+    ngx_uint_t  empty;
+
+    /* a condition holds unless its value is empty or "0" */
+
+    empty = (value->len == 0 || (value->len == 1 && value->data[0] == '0'));
+
+    return (empty == negative) ? NGX_OK : NGX_DECLINED;
+}
+
+
+ngx_int_t
+ngx_lua_config_eval_cmds(ngx_lua_config_chain_t *chain, void *data,
+    ngx_array_t *cmds, ngx_str_t *value, void **matched)
+{
+    u_char      *cmd;
+    ngx_int_t    rc;
+    ngx_uint_t   i;
+
+    /*
+     * the value of the first definition whose condition holds: NGX_OK,
+     * NGX_DECLINED if there is none, and without a request NGX_AGAIN
+     * if the result depends on one
+     */
+
+    cmd = cmds->elts;
+
+    for (i = 0; i < cmds->nelts; i++, cmd += chain->size) {
+        rc = chain->filter(data, cmd);
+
+        if (rc == NGX_DECLINED) {
+            continue;
+        }
+
+        if (rc != NGX_OK) {
+            return rc;
+        }
+
+        rc = chain->value(data, cmd, value);
+
+        if (rc == NGX_DECLINED) {
+            continue;
+        }
+
+        if (rc == NGX_OK && matched) {
+            *matched = cmd;
+        }
+
+        return rc;
+    }
+
+    return NGX_DECLINED;
+}
+
+
+void
+ngx_lua_config_prune_keys(ngx_conf_t *cf, ngx_lua_config_chain_t *chain,
+    ngx_array_t *keys)
+{
+    ngx_uint_t                i;
+    ngx_lua_config_keyval_t  *kv;
+
+    if (keys == NULL) {
+        return;
+    }
+
+    kv = keys->elts;
+    for (i = 0; i < keys->nelts; i++) {
+        ngx_lua_config_prune_cmds(cf, chain, &kv[i], kv[i].cmds->nelts);
+    }
+}
+
+
+void
+ngx_lua_config_prune_cmds(ngx_conf_t *cf, ngx_lua_config_chain_t *chain,
+    ngx_lua_config_keyval_t *kv, ngx_uint_t nown)
+{
+    u_char      *cmd, *dst;
+    ngx_uint_t   i, n;
+
+    /*
+     * removes definitions that can never be reached: those with a static
+     * condition that never holds, and everything after a definition that
+     * always matches; a static condition that always holds is dropped,
+     * so a chain of static conditions collapses into a single definition.
+     * the first nown definitions are the context's own, the rest are
+     * inherited; pruning keeps the result of every lookup unchanged.
+     * only own definitions are reported, so each one is reported once,
+     * in the context that defines it; inherited definitions cut off by
+     * an own one are simply overridden
+     */
+
+    cmd = kv->cmds->elts;
+    dst = cmd;
+    n = 0;
+
+    for (i = 0; i < kv->cmds->nelts; i++, cmd += chain->size) {
+
+        switch (chain->filter(NULL, cmd)) {
+
+        case NGX_DECLINED:
+            if (i < nown && chain->unreachable) {
+                chain->unreachable(cf, &kv->key, cmd);
+            }
+
+            continue;
+
+        case NGX_OK:
+            chain->unfilter(cmd);
+            break;
+
+        default: /* NGX_AGAIN */
+            break;
+        }
+
+        if (dst != cmd) {
+            ngx_memcpy(dst, cmd, chain->size);
+        }
+
+        n++;
+
+        if (chain->final(dst)) {
+            for (i++, cmd += chain->size;
+                 i < nown && chain->unreachable;
+                 i++, cmd += chain->size)
+            {
+                chain->unreachable(cf, &kv->key, cmd);
+            }
+
+            break;
+        }
+
+        dst += chain->size;
+    }
+
+    kv->cmds->nelts = n;
+}
+
+
+ngx_int_t
+ngx_lua_config_merge_keys(ngx_conf_t *cf, ngx_lua_config_chain_t *chain,
+    ngx_array_t *keys, ngx_array_t *prev)
+{
+    u_char                   *cmd;
+    ngx_uint_t                i, j, n;
+    ngx_lua_config_keyval_t  *src, *dst, *kv;
+
+    /*
+     * the context's own definitions of a key are evaluated first and the
+     * inherited ones after them; the own definitions are pruned first,
+     * so the inherited ones are only appended to chains that can still
+     * fall through to them
+     */
+
+    ngx_lua_config_prune_keys(cf, chain, keys);
+
+    if (prev == NULL) {
+        return NGX_OK;
+    }
+
+    src = prev->elts;
+    for (i = 0; i < prev->nelts; i++) {
+
+        dst = keys->elts;
+        for (j = 0; j < keys->nelts; j++) {
+            if (src[i].key.len == dst[j].key.len
+                && ngx_strcmp(dst[j].key.data, src[i].key.data) == 0)
+            {
+                break;
+            }
+        }
+
+        if (j == keys->nelts) {
+            kv = ngx_array_push(keys);
+            if (kv == NULL) {
+                return NGX_ERROR;
+            }
+
+            *kv = src[i];
+            continue;
+        }
+
+        n = dst[j].cmds->nelts;
+
+        if (n && chain->final((u_char *) dst[j].cmds->elts
+                              + (n - 1) * chain->size))
+        {
+            continue;
+        }
+
+        cmd = ngx_array_push_n(dst[j].cmds, src[i].cmds->nelts);
+        if (cmd == NULL) {
+            return NGX_ERROR;
+        }
+
+        ngx_memcpy(cmd, src[i].cmds->elts, src[i].cmds->nelts * chain->size);
+
+        ngx_lua_config_prune_cmds(cf, chain, &dst[j], n);
+    }
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_lua_config_init_fingerprint(ngx_conf_t *cf, ngx_lua_config_chain_t *chain,
+    ngx_array_t *keys, ngx_uint_t algorithm, ngx_lua_config_fingerprint_t *fp,
+    ngx_array_t **dynamic, ngx_str_t *fingerprint)
+{
+    u_char                        *p;
+    uint64_t                       value64;
+    ngx_str_t                      value;
+    ngx_uint_t                     i;
+    ngx_lua_config_keyval_t       *kv, **dkv;
+    ngx_lua_config_fingerprint_t   copy;
+
+    /*
+     * static keys are hashed here in key order; keys that depend on the
+     * request are remembered in "dynamic" and hashed after them by
+     * ngx_lua_config_hash_dynamic(), also in key order
+     */
+
+    ngx_lua_config_fingerprint_init(fp, algorithm);
+
+    *dynamic = NULL;
+
+    if (keys != NULL) {
+        ngx_qsort(keys->elts, keys->nelts, sizeof(ngx_lua_config_keyval_t),
+                  ngx_lua_config_key_cmp);
+
+        kv = keys->elts;
+        for (i = 0; i < keys->nelts; i++) {
+            switch (ngx_lua_config_eval_cmds(chain, NULL, kv[i].cmds, &value,
+                                             NULL))
+            {
+            case NGX_OK:
+                ngx_lua_config_fingerprint_str(fp, &kv[i].key);
+                ngx_lua_config_fingerprint_str(fp, &value);
+                break;
+
+            case NGX_DECLINED:
+                break;
+
+            default: /* NGX_AGAIN */
+                if (*dynamic == NULL) {
+                    *dynamic = ngx_array_create(cf->pool, 4,
+                                           sizeof(ngx_lua_config_keyval_t *));
+                    if (*dynamic == NULL) {
+                        return NGX_ERROR;
+                    }
+                }
+
+                dkv = ngx_array_push(*dynamic);
+                if (dkv == NULL) {
+                    return NGX_ERROR;
+                }
+
+                *dkv = &kv[i];
+            }
+        }
+    }
+
+    if (*dynamic != NULL) {
+        return NGX_OK;
+    }
+
+    p = ngx_pnalloc(cf->pool, NGX_LUA_CONFIG_FINGERPRINT_LEN);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    copy = *fp;
+    value64 = ngx_lua_config_fingerprint_final(&copy);
+
+    fingerprint->data = p;
+    fingerprint->len = ngx_lua_config_fingerprint_format(p, algorithm,
+                                                         value64)
+                       - p;
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_lua_config_hash_keys(ngx_lua_config_chain_t *chain, void *data,
+    ngx_array_t *keys, uint32_t *crc, ngx_lua_config_fingerprint_t *fp)
+{
+    ngx_int_t                 rc;
+    ngx_str_t                 value;
+    ngx_uint_t                i;
+    ngx_lua_config_keyval_t  *kv;
+
+    /*
+     * adds every key that has a value to a running crc32, a running
+     * fingerprint, or both; without a request, NGX_AGAIN as soon as a
+     * key depends on one
+     */
+
+    kv = keys->elts;
+    for (i = 0; i < keys->nelts; i++) {
+        rc = ngx_lua_config_eval_cmds(chain, data, kv[i].cmds, &value, NULL);
+
+        if (rc == NGX_DECLINED) {
+            continue;
+        }
+
+        if (rc != NGX_OK) {
+            return rc;
+        }
+
+        if (crc) {
+            ngx_lua_config_crc32_key(crc, &kv[i].key, &value);
+        }
+
+        if (fp) {
+            ngx_lua_config_fingerprint_str(fp, &kv[i].key);
+            ngx_lua_config_fingerprint_str(fp, &value);
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_lua_config_hash_dynamic(ngx_lua_config_chain_t *chain, void *data,
+    ngx_array_t *dynamic, ngx_lua_config_fingerprint_t *fp)
+{
+    ngx_int_t                  rc;
+    ngx_str_t                  value;
+    ngx_uint_t                 i;
+    ngx_lua_config_keyval_t  **kv;
+
+    /* the keys left out by ngx_lua_config_init_fingerprint() */
+
+    kv = dynamic->elts;
+    for (i = 0; i < dynamic->nelts; i++) {
+        rc = ngx_lua_config_eval_cmds(chain, data, kv[i]->cmds, &value, NULL);
+
+        if (rc == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+
+        if (rc == NGX_OK) {
+            ngx_lua_config_fingerprint_str(fp, &kv[i]->key);
+            ngx_lua_config_fingerprint_str(fp, &value);
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+char *
+ngx_lua_config_init_config(ngx_conf_t *cf, ngx_array_t **keys)
+{
+    u_char        *p;
+    ngx_str_t     *value;
+    ngx_uint_t     i;
+    ngx_keyval_t  *kv;
+
+    value = cf->args->elts;
+
+    if (value[1].len == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "lua_init_config directive name cannot be empty");
+        return NGX_CONF_ERROR;
+    }
+
+    for (p = value[1].data; p < value[1].data + value[1].len; p++) {
+        if (!((*p >= '0' && *p <= '9')
+              || (*p >= 'a' && *p <= 'z')
+              || *p == '_'
+              || *p == '.'))
+        {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid character in lua_init_config "
+                               "directive name \"%V\"", &value[1]);
+            return NGX_CONF_ERROR;
+        }
+
+        /* dots separate non-empty path components */
+
+        if (*p == '.'
+            && (p == value[1].data
+                || p == value[1].data + value[1].len - 1
+                || *(p - 1) == '.'))
+        {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "empty component in lua_init_config "
+                               "directive name \"%V\"", &value[1]);
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    if (*keys == NULL) {
+        *keys = ngx_array_create(cf->pool, 4, sizeof(ngx_keyval_t));
+        if (*keys == NULL) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    /* check for duplicate key: error on conflict */
+    kv = (*keys)->elts;
+    for (i = 0; i < (*keys)->nelts; i++) {
+        if (value[1].len == kv[i].key.len
+            && ngx_strncmp(value[1].data, kv[i].key.data, value[1].len) == 0)
+        {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "duplicate lua_init_config \"%V\"",
+                               &value[1]);
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    kv = ngx_array_push(*keys);
+    if (kv == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    kv->key = value[1];
+
+    if (ngx_lua_config_join_args(cf, value, 2, cf->args->nelts - 1,
+                                 &kv->value)
+        != NGX_OK)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+ngx_lua_config_init_node_t *
+ngx_lua_config_init_tree(ngx_conf_t *cf, ngx_array_t *keys)
+{
+    ngx_uint_t                   i;
+    ngx_keyval_t                *kv;
+    ngx_lua_config_init_node_t  *root;
+
+    root = ngx_pcalloc(cf->pool, sizeof(ngx_lua_config_init_node_t));
+    if (root == NULL) {
+        return NULL;
+    }
+
+    root->type = NGX_LUA_CONFIG_INIT_TABLE;
+
+    kv = keys->elts;
+    for (i = 0; i < keys->nelts; i++) {
+        if (ngx_lua_config_init_add_node(cf, root, &kv[i]) != NGX_OK) {
+            return NULL;
+        }
+    }
+
+    return root;
+}
+
+
+static ngx_int_t
+ngx_lua_config_init_add_node(ngx_conf_t *cf, ngx_lua_config_init_node_t *root,
+    ngx_keyval_t *kv)
+{
+    u_char                      *p, *last, *end;
+    ngx_str_t                    name, *v;
+    ngx_uint_t                   i;
+    ngx_lua_config_init_node_t  *node, *child;
+
+    node = root;
+
+    p = kv->key.data;
+    end = kv->key.data + kv->key.len;
+
+    for ( ;; ) {
+        last = ngx_strlchr(p, end, '.');
+        if (last == NULL) {
+            last = end;
+        }
+
+        name.data = p;
+        name.len = last - p;
+
+        if (node->type != NGX_LUA_CONFIG_INIT_TABLE) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "lua_init_config \"%V\" conflicts with "
+                               "\"%V\"", &kv->key, &node->path);
+            return NGX_ERROR;
+        }
+
+        if (node->children == NULL) {
+            node->children = ngx_array_create(cf->pool, 4,
+                                        sizeof(ngx_lua_config_init_node_t));
+            if (node->children == NULL) {
+                return NGX_ERROR;
+            }
+        }
+
+        child = node->children->elts;
+        for (i = 0; i < node->children->nelts; i++) {
+            if (child[i].name.len == name.len
+                && ngx_strncmp(child[i].name.data, name.data, name.len) == 0)
+            {
+                break;
+            }
+        }
+
+        if (i < node->children->nelts) {
+            child = &child[i];
+
+            if (last == end) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "lua_init_config \"%V\" conflicts with "
+                                   "\"%V.*\"", &kv->key, &child->path);
+                return NGX_ERROR;
+            }
+
+        } else {
+            child = ngx_array_push(node->children);
+            if (child == NULL) {
+                return NGX_ERROR;
+            }
+
+            ngx_memzero(child, sizeof(ngx_lua_config_init_node_t));
+
+            child->name = name;
+            child->path.data = kv->key.data;
+            child->path.len = last - kv->key.data;
+            child->type = NGX_LUA_CONFIG_INIT_TABLE;
+        }
+
+        if (last == end) {
+            break;
+        }
+
+        node = child;
+        p = last + 1;
+    }
+
+    /*
+     * the leaf is typed once here: canonical integers become numbers,
+     * "true" and "false" become booleans, anything else stays a string
+     */
+
+    v = &kv->value;
+
+    child->type = NGX_LUA_CONFIG_INIT_STRING;
+    child->value = *v;
+
+    if (v->len == 4 && ngx_strncmp(v->data, "true", 4) == 0) {
+        child->type = NGX_LUA_CONFIG_INIT_BOOLEAN;
+        child->number = 1;
+
+    } else if (v->len == 5 && ngx_strncmp(v->data, "false", 5) == 0) {
+        child->type = NGX_LUA_CONFIG_INIT_BOOLEAN;
+        child->number = 0;
+
+    } else if (v->len > 0 && v->len < NGX_INT32_LEN) {
+        p = v->data;
+        end = v->data + v->len;
+
+        if (*p == '-' && v->len > 1) {
+            p++;
+        }
+
+        if (*p != '0' || end - p == 1) {
+            child->number = ngx_atoi(p, end - p);
+
+            if (child->number != NGX_ERROR) {
+                child->type = NGX_LUA_CONFIG_INIT_NUMBER;
+
+                if (v->data[0] == '-') {
+                    child->number = -child->number;
+                }
+            }
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+void
+ngx_lua_config_push_value(lua_State *L, ngx_str_t *value, ngx_uint_t index)
+{
+    /*
+     * static values are interned in the table held by upvalue 1 of the
+     * calling closure, so each of them is turned into a Lua string once
+     * per worker
+     */
+
+    if (index == 0) {
+        lua_pushlstring(L, (char *) value->data, value->len);
+        return;
+    }
+
+    lua_rawgeti(L, lua_upvalueindex(1), (int) index);
+
+    if (!lua_isnil(L, -1)) {
+        return;
+    }
+
+    lua_pop(L, 1);
+
+    lua_pushlstring(L, (char *) value->data, value->len);
+    lua_pushvalue(L, -1);
+    lua_rawseti(L, lua_upvalueindex(1), (int) index);
+}
+
+
+void
+ngx_lua_config_push_servers(lua_State *L, ngx_array_t *servers)
+{
+    ngx_uint_t                i;
+    ngx_lua_config_server_t  *server;
+
+    server = servers->elts;
+
+    lua_createtable(L, servers->nelts, 0);
+
+    for (i = 0; i < servers->nelts; i++) {
+        lua_createtable(L, 0, 6);
+
+        lua_pushlstring(L, (char *) server[i].host.data, server[i].host.len);
+        lua_setfield(L, -2, "host");
+
+        lua_pushinteger(L, server[i].port);
+        lua_setfield(L, -2, "port");
+
+        lua_pushinteger(L, server[i].level);
+        lua_setfield(L, -2, "level");
+
+        lua_pushinteger(L, server[i].weight);
+        lua_setfield(L, -2, "weight");
+
+        lua_pushboolean(L, server[i].down);
+        lua_setfield(L, -2, "down");
+
+        lua_pushinteger(L, server[i].index);
+        lua_setfield(L, -2, "index");
+
+        lua_rawseti(L, -2, i + 1);
+    }
+}
+
+
+int
+ngx_lua_config_push_init_configs(lua_State *L, ngx_array_t *keys)
+{
+    ngx_uint_t     i;
+    ngx_keyval_t  *kv;
+
+    lua_createtable(L, 0, keys ? (int) keys->nelts : 0);
+
+    if (keys == NULL) {
+        return 1;
+    }
+
+    kv = keys->elts;
+    for (i = 0; i < keys->nelts; i++) {
+        lua_pushlstring(L, (char *) kv[i].key.data, kv[i].key.len);
+        lua_pushlstring(L, (char *) kv[i].value.data, kv[i].value.len);
+        lua_rawset(L, -3);
+    }
+
+    return 1;
+}
+
+
+int
+ngx_lua_config_push_init_config(lua_State *L, ngx_lua_config_init_node_t *tree)
+{
+    int  top;
+
+    if (lua_gettop(L) != 1) {
+        return luaL_error(L, "exactly one argument expected");
+    }
+
+    luaL_checkstring(L, 1);
+
+    /*
+     * upvalue 1 of the calling closure holds the path index once it is
+     * built for this worker
+     */
+
+    if (!lua_istable(L, lua_upvalueindex(1))) {
+        lua_newtable(L);
+        top = lua_gettop(L);
+
+        if (tree != NULL) {
+            ngx_lua_config_init_push(L, tree, top);
+            lua_settop(L, top);
+        }
+
+        lua_replace(L, lua_upvalueindex(1));
+    }
+
+    lua_pushvalue(L, 1);
+    lua_rawget(L, lua_upvalueindex(1));
+
+    return 1;
+}
+
+
+static int
+ngx_lua_config_init_readonly(lua_State *L)
+{
+    return luaL_error(L, "lua_init_config tables are read-only");
+}
+
+
+static int
+ngx_lua_config_init_pairs(lua_State *L)
+{
+    /* pairs() walks the children behind the proxy */
+
+    if (!lua_getmetatable(L, 1)) {
+        return luaL_error(L, "not a lua_init_config table");
+    }
+
+    lua_pushcfunction(L, ngx_lua_config_init_next);
+    lua_pushliteral(L, "__index");
+    lua_rawget(L, -3);
+    lua_pushnil(L);
+
+    return 3;
+}
+
+
+static int
+ngx_lua_config_init_next(lua_State *L)
+{
+    luaL_checktype(L, 1, LUA_TTABLE);
+    lua_settop(L, 2);
+
+    if (lua_next(L, 1)) {
+        return 2;
+    }
+
+    lua_pushnil(L);
+
+    return 1;
+}
+
+
+static void
+ngx_lua_config_init_push(lua_State *L, ngx_lua_config_init_node_t *node,
+    int paths)
+{
+    ngx_uint_t                   i;
+    ngx_lua_config_init_node_t  *child;
+
+    switch (node->type) {
+
+    case NGX_LUA_CONFIG_INIT_NUMBER:
+        lua_pushinteger(L, node->number);
+        break;
+
+    case NGX_LUA_CONFIG_INIT_BOOLEAN:
+        lua_pushboolean(L, (int) node->number);
+        break;
+
+    case NGX_LUA_CONFIG_INIT_TABLE:
+
+        /*
+         * an empty proxy, the children are only reachable through its
+         * metatable, so no assignment can reach the shared tables
+         */
+
+        lua_createtable(L, 0, 0);
+        lua_createtable(L, 0, 4);
+        lua_createtable(L, 0, node->children ? node->children->nelts : 0);
+
+        if (node->children) {
+            child = node->children->elts;
+            for (i = 0; i < node->children->nelts; i++) {
+                lua_pushlstring(L, (char *) child[i].name.data,
+                                child[i].name.len);
+                ngx_lua_config_init_push(L, &child[i], paths);
+                lua_rawset(L, -3);
+            }
+        }
+
+        lua_setfield(L, -2, "__index");
+        lua_pushcfunction(L, ngx_lua_config_init_readonly);
+        lua_setfield(L, -2, "__newindex");
+        lua_pushcfunction(L, ngx_lua_config_init_pairs);
+        lua_setfield(L, -2, "__pairs");
+        lua_pushboolean(L, 0);
+        lua_setfield(L, -2, "__metatable");
+        lua_setmetatable(L, -2);
+        break;
+
+    default: /* NGX_LUA_CONFIG_INIT_STRING */
+        lua_pushlstring(L, (char *) node->value.data, node->value.len);
+    }
+
+    /* every node is also reachable by its full dotted path */
+
+    if (node->path.len) {
+        lua_pushlstring(L, (char *) node->path.data, node->path.len);
+        lua_pushvalue(L, -2);
+        lua_rawset(L, paths);
+    }
+}
+
+
+ngx_int_t
+ngx_lua_config_encode_format(ngx_str_t *name)
+{
+    if (name->len == 4 && ngx_strncmp(name->data, "json", 4) == 0) {
+        return NGX_LUA_CONFIG_JSON;
+    }
+
+    if (name->len == 7 && ngx_strncmp(name->data, "msgpack", 7) == 0) {
+        return NGX_LUA_CONFIG_MSGPACK;
+    }
+
+    return NGX_ERROR;
+}
+
+
+void
+ngx_lua_config_encoder_init(ngx_lua_config_encoder_t *enc, ngx_uint_t format,
+    u_char *buf, size_t size, ngx_pool_t *pool, ngx_log_t *log)
+{
+    enc->format = format;
+    enc->start = buf;
+    enc->pos = buf;
+    enc->end = buf + size;
+    enc->pool = pool;
+    enc->log = log;
+    enc->first = 1;
+    enc->failed = 0;
+}
+
+
+static u_char *
+ngx_lua_config_encode_reserve(ngx_lua_config_encoder_t *enc, size_t size)
+{
+    u_char  *p;
+    size_t   used, n;
+
+    if (enc->failed) {
+        return NULL;
+    }
+
+    if ((size_t) (enc->end - enc->pos) >= size) {
+        return enc->pos;
+    }
+
+    used = enc->pos - enc->start;
+
+    n = ngx_max((size_t) (enc->end - enc->start) * 2, used + size);
+    n = ngx_max(n, 256);
+
+    /*
+     * a buffer without a pool is owned by the caller and kept across
+     * calls, so the old one is freed as soon as its data is copied
+     */
+
+    if (enc->pool) {
+        p = ngx_pnalloc(enc->pool, n);
+
+    } else {
+        p = ngx_alloc(n, enc->log);
+    }
+
+    if (p == NULL) {
+        enc->failed = 1;
+        return NULL;
+    }
+
+    if (used) {
+        ngx_memcpy(p, enc->start, used);
+    }
+
+    if (enc->pool == NULL && enc->start != NULL) {
+        ngx_free(enc->start);
+    }
+
+    enc->start = p;
+    enc->pos = p + used;
+    enc->end = p + n;
+
+    return enc->pos;
+}
+
+
+static void
+ngx_lua_config_encode_raw(ngx_lua_config_encoder_t *enc, u_char *data,
+    size_t len)
+{
+    u_char  *p;
+
+    p = ngx_lua_config_encode_reserve(enc, len);
+    if (p == NULL) {
+        return;
+    }
+
+    enc->pos = ngx_cpymem(p, data, len);
+}
+
+
+static void
+ngx_lua_config_encode_header(ngx_lua_config_encoder_t *enc, u_char fix,
+    ngx_uint_t max, u_char code, size_t size, uint64_t n)
+{
+    u_char  buf[9], *p;
+
+    /*
+     * a MessagePack type header: "fix" or'ed with n if n is below "max",
+     * else "code" followed by n in big endian; "code" is for n in "size"
+     * bytes, the codes for twice as many bytes follow it
+     */
+
+    p = buf;
+
+    if (n < max) {
+        *p++ = (u_char) (fix | n);
+        ngx_lua_config_encode_raw(enc, buf, 1);
+        return;
+    }
+
+    while (size < 8 && (n >> (size * 8)) != 0) {
+        size *= 2;
+        code++;
+    }
+
+    *p++ = code;
+
+    while (size--) {
+        *p++ = (u_char) (n >> (size * 8));
+    }
+
+    ngx_lua_config_encode_raw(enc, buf, p - buf);
+}
+
+
+size_t
+ngx_lua_config_encode_map(ngx_lua_config_encoder_t *enc)
+{
+    size_t   offset;
+    u_char   map32[5] = { 0xdf, 0, 0, 0, 0 };
+
+    /*
+     * the number of entries is only known at the end, so MessagePack
+     * maps always get a 32-bit size, which is filled in then
+     */
+
+    offset = enc->pos - enc->start;
+    enc->first = 1;
+
+    if (enc->format == NGX_LUA_CONFIG_JSON) {
+        ngx_lua_config_encode_raw(enc, (u_char *) "{", 1);
+
+    } else {
+        ngx_lua_config_encode_raw(enc, map32, sizeof(map32));
+    }
+
+    return offset;
+}
+
+
+void
+ngx_lua_config_encode_map_end(ngx_lua_config_encoder_t *enc, size_t map,
+    ngx_uint_t n)
+{
+    u_char  *p;
+
+    enc->first = 0;
+
+    if (enc->format == NGX_LUA_CONFIG_JSON) {
+        ngx_lua_config_encode_raw(enc, (u_char *) "}", 1);
+        return;
+    }
+
+    if (enc->failed) {
+        return;
+    }
+
+    p = enc->start + map + 1;
+
+    *p++ = (u_char) (n >> 24);
+    *p++ = (u_char) (n >> 16);
+    *p++ = (u_char) (n >> 8);
+    *p = (u_char) n;
+}
+
+
+void
+ngx_lua_config_encode_array(ngx_lua_config_encoder_t *enc, ngx_uint_t n)
+{
+    enc->first = 1;
+
+    if (enc->format == NGX_LUA_CONFIG_JSON) {
+        ngx_lua_config_encode_raw(enc, (u_char *) "[", 1);
+        return;
+    }
+
+    /* fixarray, array 16 or array 32 */
+
+    ngx_lua_config_encode_header(enc, 0x90, 16, 0xdc, 2, n);
+}
+
+
+void
+ngx_lua_config_encode_array_end(ngx_lua_config_encoder_t *enc)
+{
+    enc->first = 0;
+
+    if (enc->format == NGX_LUA_CONFIG_JSON) {
+        ngx_lua_config_encode_raw(enc, (u_char *) "]", 1);
+    }
+}
+
+
+void
+ngx_lua_config_encode_next(ngx_lua_config_encoder_t *enc)
+{
+    if (enc->format == NGX_LUA_CONFIG_JSON && !enc->first) {
+        ngx_lua_config_encode_raw(enc, (u_char *) ",", 1);
+    }
+
+    enc->first = 0;
+}
+
+
+void
+ngx_lua_config_encode_key(ngx_lua_config_encoder_t *enc, ngx_str_t *key)
+{
+    ngx_lua_config_encode_next(enc);
+    ngx_lua_config_encode_str(enc, key);
+
+    if (enc->format == NGX_LUA_CONFIG_JSON) {
+        ngx_lua_config_encode_raw(enc, (u_char *) ":", 1);
+    }
+}
+
+
+void
+ngx_lua_config_encode_str(ngx_lua_config_encoder_t *enc, ngx_str_t *s)
+{
+    u_char  *p;
+    size_t   len;
+
+    if (enc->format == NGX_LUA_CONFIG_MSGPACK) {
+        ngx_lua_config_encode_header(enc, 0xa0, 32, 0xd9, 1, s->len);
+        ngx_lua_config_encode_raw(enc, s->data, s->len);
+        return;
+    }
+
+    len = s->len + ngx_escape_json(NULL, s->data, s->len);
+
+    p = ngx_lua_config_encode_reserve(enc, len + 2);
+    if (p == NULL) {
+        return;
+    }
+
+    *p++ = '"';
+
+    if (len == s->len) {
+        p = ngx_cpymem(p, s->data, len);
+
+    } else {
+        p = (u_char *) ngx_escape_json(p, s->data, s->len);
+    }
+
+    *p++ = '"';
+
+    enc->pos = p;
+}
+
+
+void
+ngx_lua_config_encode_uint(ngx_lua_config_encoder_t *enc, ngx_uint_t n)
+{
+    u_char  buf[NGX_INT_T_LEN], *p;
+
+    if (enc->format == NGX_LUA_CONFIG_MSGPACK) {
+        /* positive fixint or uint 8, 16, 32, 64 */
+        ngx_lua_config_encode_header(enc, 0x00, 128, 0xcc, 1, n);
+        return;
+    }
+
+    p = ngx_sprintf(buf, "%ui", n);
+
+    ngx_lua_config_encode_raw(enc, buf, p - buf);
+}
+
+
+void
+ngx_lua_config_encode_bool(ngx_lua_config_encoder_t *enc, ngx_uint_t b)
+{
+    u_char  c;
+
+    if (enc->format == NGX_LUA_CONFIG_MSGPACK) {
+        c = b ? 0xc3 : 0xc2;
+        ngx_lua_config_encode_raw(enc, &c, 1);
+        return;
+    }
+
+    if (b) {
+        ngx_lua_config_encode_raw(enc, (u_char *) "true", 4);
+
+    } else {
+        ngx_lua_config_encode_raw(enc, (u_char *) "false", 5);
+    }
+}
+
+
+void
+ngx_lua_config_encode_servers(ngx_lua_config_encoder_t *enc,
+    ngx_array_t *servers)
+{
+    size_t                    map;
+    ngx_uint_t                i;
+    ngx_lua_config_server_t  *server;
+
+    static ngx_str_t  host = ngx_string("host");
+    static ngx_str_t  port = ngx_string("port");
+    static ngx_str_t  level = ngx_string("level");
+    static ngx_str_t  weight = ngx_string("weight");
+    static ngx_str_t  down = ngx_string("down");
+    static ngx_str_t  idx = ngx_string("index");
+
+    /* the same fields as ngx_lua_config_push_servers() */
+
+    server = servers->elts;
+
+    ngx_lua_config_encode_array(enc, servers->nelts);
+
+    for (i = 0; i < servers->nelts; i++) {
+        ngx_lua_config_encode_next(enc);
+
+        map = ngx_lua_config_encode_map(enc);
+
+        ngx_lua_config_encode_key(enc, &host);
+        ngx_lua_config_encode_str(enc, &server[i].host);
+
+        ngx_lua_config_encode_key(enc, &port);
+        ngx_lua_config_encode_uint(enc, server[i].port);
+
+        ngx_lua_config_encode_key(enc, &level);
+        ngx_lua_config_encode_uint(enc, server[i].level);
+
+        ngx_lua_config_encode_key(enc, &weight);
+        ngx_lua_config_encode_uint(enc, server[i].weight);
+
+        ngx_lua_config_encode_key(enc, &down);
+        ngx_lua_config_encode_bool(enc, server[i].down);
+
+        ngx_lua_config_encode_key(enc, &idx);
+        ngx_lua_config_encode_uint(enc, server[i].index);
+
+        ngx_lua_config_encode_map_end(enc, map, 6);
+    }
+
+    ngx_lua_config_encode_array_end(enc);
+}
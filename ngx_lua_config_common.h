@@ -0,0 +1,199 @@
+
+/*
+ * Copyright (C) Hanada
+ */
+
+
+#ifndef _NGX_LUA_CONFIG_COMMON_H_INCLUDED_
+#define _NGX_LUA_CONFIG_COMMON_H_INCLUDED_
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include "ngx_lua_config_fingerprint.h"
+
+
+/*
+ * Configuration and Lua helpers that do not depend on the subsystem,
+ * shared by the http and the stream modules.
+ */
+
+
+#define NGX_LUA_CONFIG_INIT_STRING            0
+#define NGX_LUA_CONFIG_INIT_NUMBER            1
+#define NGX_LUA_CONFIG_INIT_BOOLEAN           2
+#define NGX_LUA_CONFIG_INIT_TABLE             3
+
+#define NGX_LUA_CONFIG_JSON                   0
+#define NGX_LUA_CONFIG_MSGPACK                1
+#define NGX_LUA_CONFIG_NFORMATS               2
+
+
+typedef struct {
+    ngx_str_t                   host;
+    ngx_uint_t                  port;
+    ngx_uint_t                  level;
+    ngx_uint_t                  weight;
+    ngx_uint_t                  down;
+    ngx_uint_t                  resolve;   /* host is re-resolved */
+    ngx_uint_t                  index;     /* 1-based position in the
+                                              configuration, shared by
+                                              the addresses of a name */
+} ngx_lua_config_server_t;
+
+
+typedef struct {
+    ngx_str_t                   key;
+    ngx_array_t                *cmds;      /* definitions of the key, in
+                                              the subsystem's type */
+} ngx_lua_config_keyval_t;
+
+
+/*
+ * the subsystem's part of the definition chains: "data" is the request
+ * or the session, or NULL to resolve a chain at configuration time
+ */
+
+typedef struct {
+    size_t                      size;      /* of a definition */
+
+    /* compiles a value or a condition, "dynamic" unless a constant */
+    void                     *(*compile)(ngx_conf_t *cf, ngx_str_t *value,
+                                         ngx_uint_t *dynamic);
+
+    /*
+     * NGX_OK if the definition has no condition or it holds, NGX_DECLINED
+     * if it does not, and NGX_AGAIN without a request if it depends on one
+     */
+    ngx_int_t                 (*filter)(void *data, void *cmd);
+
+    /* the value of the definition, with the same results */
+    ngx_int_t                 (*value)(void *data, void *cmd,
+                                       ngx_str_t *value);
+
+    /* the definition yields a value whenever its condition holds */
+    ngx_uint_t                (*final)(void *cmd);
+
+    /* drops a condition that always holds */
+    void                      (*unfilter)(void *cmd);
+
+    /* reports an own definition that can never be used, may be NULL */
+    void                      (*unreachable)(ngx_conf_t *cf, ngx_str_t *key,
+                                             void *cmd);
+} ngx_lua_config_chain_t;
+
+
+/* compiled values and conditions, by source string */
+
+typedef struct {
+    ngx_rbtree_t                tree;
+    ngx_rbtree_node_t           sentinel;
+    ngx_uint_t                  nstatic;   /* interned static values */
+} ngx_lua_config_values_t;
+
+
+typedef struct {
+    ngx_str_t                   name;      /* last component of the path */
+    ngx_str_t                   path;      /* dotted key */
+    ngx_uint_t                  type;
+    ngx_str_t                   value;
+    ngx_int_t                   number;
+    ngx_array_t                *children;  /* array of
+                                              ngx_lua_config_init_node_t */
+} ngx_lua_config_init_node_t;
+
+
+/*
+ * writes JSON or MessagePack into a buffer that grows as needed; an
+ * allocation failure is remembered in "failed" and makes the rest of
+ * the calls no-ops
+ */
+
+typedef struct {
+    ngx_uint_t                  format;
+    u_char                     *start;
+    u_char                     *pos;
+    u_char                     *end;
+    ngx_pool_t                 *pool;      /* NULL if the buffer is
+                                              allocated and kept by
+                                              the caller */
+    ngx_log_t                  *log;
+    unsigned                    first:1;   /* no entry in the current
+                                              map or array yet */
+    unsigned                    failed:1;
+} ngx_lua_config_encoder_t;
+
+
+struct lua_State;
+
+
+ngx_int_t ngx_lua_config_check_key(ngx_str_t *name);
+ngx_int_t ngx_lua_config_join_args(ngx_conf_t *cf, ngx_str_t *value,
+    ngx_uint_t first, ngx_uint_t last, ngx_str_t *s);
+int ngx_libc_cdecl ngx_lua_config_key_cmp(const void *one, const void *two);
+
+char *ngx_lua_config_parse_server(ngx_conf_t *cf, ngx_array_t *servers,
+    ngx_uint_t resolve);
+void ngx_lua_config_servers_crc32(ngx_str_t *name, ngx_array_t *servers,
+    uint32_t *crc);
+void ngx_lua_config_servers_fingerprint(ngx_lua_config_fingerprint_t *fp,
+    ngx_uint_t algorithm, ngx_str_t *name, ngx_array_t *servers);
+void ngx_lua_config_crc32_key(uint32_t *crc, ngx_str_t *key,
+    ngx_str_t *value);
+
+void ngx_lua_config_values_init(ngx_lua_config_values_t *values);
+void *ngx_lua_config_intern_value(ngx_conf_t *cf,
+    ngx_lua_config_chain_t *chain, ngx_lua_config_values_t *values,
+    ngx_str_t *value, ngx_uint_t *index);
+void *ngx_lua_config_add_cmd(ngx_conf_t *cf, ngx_lua_config_chain_t *chain,
+    ngx_array_t **keys, ngx_str_t *name);
+ngx_int_t ngx_lua_config_parse_filter(ngx_str_t *arg, ngx_uint_t *negative,
+    ngx_uint_t *regex, ngx_str_t *value);
+ngx_int_t ngx_lua_config_condition(ngx_str_t *value, ngx_uint_t negative);
+ngx_int_t ngx_lua_config_eval_cmds(ngx_lua_config_chain_t *chain, void *data,
+    ngx_array_t *cmds, ngx_str_t *value, void **matched);
+void ngx_lua_config_prune_keys(ngx_conf_t *cf, ngx_lua_config_chain_t *chain,
+    ngx_array_t *keys);
+void ngx_lua_config_prune_cmds(ngx_conf_t *cf, ngx_lua_config_chain_t *chain,
+    ngx_lua_config_keyval_t *kv, ngx_uint_t nown);
+ngx_int_t ngx_lua_config_merge_keys(ngx_conf_t *cf,
+    ngx_lua_config_chain_t *chain, ngx_array_t *keys, ngx_array_t *prev);
+ngx_int_t ngx_lua_config_init_fingerprint(ngx_conf_t *cf,
+    ngx_lua_config_chain_t *chain, ngx_array_t *keys, ngx_uint_t algorithm,
+    ngx_lua_config_fingerprint_t *fp, ngx_array_t **dynamic,
+    ngx_str_t *fingerprint);
+ngx_int_t ngx_lua_config_hash_keys(ngx_lua_config_chain_t *chain, void *data,
+    ngx_array_t *keys, uint32_t *crc, ngx_lua_config_fingerprint_t *fp);
+ngx_int_t ngx_lua_config_hash_dynamic(ngx_lua_config_chain_t *chain,
+    void *data, ngx_array_t *dynamic, ngx_lua_config_fingerprint_t *fp);
+
+char *ngx_lua_config_init_config(ngx_conf_t *cf, ngx_array_t **keys);
+ngx_lua_config_init_node_t *ngx_lua_config_init_tree(ngx_conf_t *cf,
+    ngx_array_t *keys);
+
+void ngx_lua_config_push_value(struct lua_State *L, ngx_str_t *value,
+    ngx_uint_t index);
+void ngx_lua_config_push_servers(struct lua_State *L, ngx_array_t *servers);
+int ngx_lua_config_push_init_configs(struct lua_State *L, ngx_array_t *keys);
+int ngx_lua_config_push_init_config(struct lua_State *L,
+    ngx_lua_config_init_node_t *tree);
+
+ngx_int_t ngx_lua_config_encode_format(ngx_str_t *name);
+void ngx_lua_config_encoder_init(ngx_lua_config_encoder_t *enc,
+    ngx_uint_t format, u_char *buf, size_t size, ngx_pool_t *pool,
+    ngx_log_t *log);
+size_t ngx_lua_config_encode_map(ngx_lua_config_encoder_t *enc);
+void ngx_lua_config_encode_map_end(ngx_lua_config_encoder_t *enc, size_t map,
+    ngx_uint_t n);
+void ngx_lua_config_encode_array(ngx_lua_config_encoder_t *enc, ngx_uint_t n);
+void ngx_lua_config_encode_array_end(ngx_lua_config_encoder_t *enc);
+void ngx_lua_config_encode_next(ngx_lua_config_encoder_t *enc);
+void ngx_lua_config_encode_key(ngx_lua_config_encoder_t *enc, ngx_str_t *key);
+void ngx_lua_config_encode_str(ngx_lua_config_encoder_t *enc, ngx_str_t *s);
+void ngx_lua_config_encode_uint(ngx_lua_config_encoder_t *enc, ngx_uint_t n);
+void ngx_lua_config_encode_bool(ngx_lua_config_encoder_t *enc, ngx_uint_t b);
+void ngx_lua_config_encode_servers(ngx_lua_config_encoder_t *enc,
+    ngx_array_t *servers);
+
+
+#endif /* _NGX_LUA_CONFIG_COMMON_H_INCLUDED_ */
@@ -0,0 +1,381 @@
+
+/*
+ * Copyright (C) Hanada
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include "ngx_lua_config_fingerprint.h"
+
+
+/*
+ * Fingerprints are computed over a binary serialization: integers are
+ * fed as 8 bytes in little-endian order and strings are prefixed with
+ * their length, so the result does not depend on the host and adjacent
+ * fields cannot be confused.
+ */
+
+
+#define NGX_LUA_CONFIG_XXH64_PRIME1  0x9E3779B185EBCA87ULL
+#define NGX_LUA_CONFIG_XXH64_PRIME2  0xC2B2AE3D27D4EB4FULL
+#define NGX_LUA_CONFIG_XXH64_PRIME3  0x165667B19E3779F9ULL
+#define NGX_LUA_CONFIG_XXH64_PRIME4  0x85EBCA77C2B2AE63ULL
+#define NGX_LUA_CONFIG_XXH64_PRIME5  0x27D4EB2F165667C5ULL
+
+#define ngx_lua_config_rotl64(x, r)  (((x) << (r)) | ((x) >> (64 - (r))))
+
+
+#if (defined __GNUC__ && defined __x86_64__)
+#define NGX_LUA_CONFIG_HAVE_SSE42  1
+#endif
+
+
+typedef uint32_t (*ngx_lua_config_crc32c_pt)(uint32_t crc, u_char *p,
+    size_t len);
+
+
+static uint32_t ngx_lua_config_crc32c_sw(uint32_t crc, u_char *p, size_t len);
+#if (NGX_LUA_CONFIG_HAVE_SSE42)
+static uint32_t ngx_lua_config_crc32c_sse42(uint32_t crc, u_char *p,
+    size_t len);
+#endif
+
+static void ngx_lua_config_xxh64_update(ngx_lua_config_fingerprint_t *fp,
+    u_char *p, size_t len);
+static uint64_t ngx_lua_config_xxh64_final(ngx_lua_config_fingerprint_t *fp);
+
+
+ngx_conf_enum_t  ngx_lua_config_fingerprint_algorithms[] = {
+    { ngx_string("crc32"), NGX_LUA_CONFIG_FINGERPRINT_CRC32 },
+    { ngx_string("crc32c"), NGX_LUA_CONFIG_FINGERPRINT_CRC32C },
+    { ngx_string("xxh64"), NGX_LUA_CONFIG_FINGERPRINT_XXH64 },
+    { ngx_null_string, 0 }
+};
+
+
+static uint32_t                  ngx_lua_config_crc32c_table[256];
+static ngx_lua_config_crc32c_pt  ngx_lua_config_crc32c_update;
+
+
+void
+ngx_lua_config_fingerprint_init_engine(void)
+{
+    uint32_t    c;
+    ngx_uint_t  i, j;
+
+    if (ngx_lua_config_crc32c_update) {
+        return;
+    }
+
+    /* reflected Castagnoli polynomial */
+
+    for (i = 0; i < 256; i++) {
+        c = (uint32_t) i;
+
+        for (j = 0; j < 8; j++) {
+            c = (c & 1) ? (c >> 1) ^ 0x82F63B78 : (c >> 1);
+        }
+
+        ngx_lua_config_crc32c_table[i] = c;
+    }
+
+    ngx_lua_config_crc32c_update = ngx_lua_config_crc32c_sw;
+
+#if (NGX_LUA_CONFIG_HAVE_SSE42)
+
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("sse4.2")) {
+        ngx_lua_config_crc32c_update = ngx_lua_config_crc32c_sse42;
+    }
+
+#endif
+}
+
+
+static uint32_t
+ngx_lua_config_crc32c_sw(uint32_t crc, u_char *p, size_t len)
+{
+    while (len--) {
+        crc = ngx_lua_config_crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+
+    return crc;
+}
+
+
+#if (NGX_LUA_CONFIG_HAVE_SSE42)
+
+__attribute__((target("sse4.2")))
+static uint32_t
+ngx_lua_config_crc32c_sse42(uint32_t crc, u_char *p, size_t len)
+{
+    uint64_t  v, c;
+
+    c = crc;
+
+    while (len >= 8) {
+        ngx_memcpy(&v, p, 8);
+        c = __builtin_ia32_crc32di(c, v);
+        p += 8;
+        len -= 8;
+    }
+
+    crc = (uint32_t) c;
+
+    while (len--) {
+        crc = __builtin_ia32_crc32qi(crc, *p++);
+    }
+
+    return crc;
+}
+
+#endif
+
+
+void
+ngx_lua_config_fingerprint_init(ngx_lua_config_fingerprint_t *fp,
+    ngx_uint_t algorithm)
+{
+    ngx_memzero(fp, sizeof(ngx_lua_config_fingerprint_t));
+
+    fp->algorithm = algorithm;
+
+    switch (algorithm) {
+
+    case NGX_LUA_CONFIG_FINGERPRINT_XXH64:
+        fp->v[0] = NGX_LUA_CONFIG_XXH64_PRIME1 + NGX_LUA_CONFIG_XXH64_PRIME2;
+        fp->v[1] = NGX_LUA_CONFIG_XXH64_PRIME2;
+        fp->v[2] = 0;
+        fp->v[3] = 0 - NGX_LUA_CONFIG_XXH64_PRIME1;
+        break;
+
+    default: /* crc32 and crc32c */
+        fp->v[0] = 0xffffffff;
+    }
+}
+
+
+void
+ngx_lua_config_fingerprint_update(ngx_lua_config_fingerprint_t *fp,
+    u_char *data, size_t len)
+{
+    uint32_t  crc;
+
+    fp->total += len;
+
+    switch (fp->algorithm) {
+
+    case NGX_LUA_CONFIG_FINGERPRINT_CRC32:
+        crc = (uint32_t) fp->v[0];
+        ngx_crc32_update(&crc, data, len);
+        fp->v[0] = crc;
+        break;
+
+    case NGX_LUA_CONFIG_FINGERPRINT_CRC32C:
+        fp->v[0] = ngx_lua_config_crc32c_update((uint32_t) fp->v[0], data,
+                                                len);
+        break;
+
+    default: /* NGX_LUA_CONFIG_FINGERPRINT_XXH64 */
+        ngx_lua_config_xxh64_update(fp, data, len);
+    }
+}
+
+
+void
+ngx_lua_config_fingerprint_uint(ngx_lua_config_fingerprint_t *fp, uint64_t n)
+{
+    u_char      buf[8];
+    ngx_uint_t  i;
+
+    for (i = 0; i < 8; i++) {
+        buf[i] = (u_char) (n >> (i * 8));
+    }
+
+    ngx_lua_config_fingerprint_update(fp, buf, 8);
+}
+
+
+void
+ngx_lua_config_fingerprint_str(ngx_lua_config_fingerprint_t *fp,
+    ngx_str_t *s)
+{
+    ngx_lua_config_fingerprint_uint(fp, s->len);
+    ngx_lua_config_fingerprint_update(fp, s->data, s->len);
+}
+
+
+uint64_t
+ngx_lua_config_fingerprint_final(ngx_lua_config_fingerprint_t *fp)
+{
+    switch (fp->algorithm) {
+
+    case NGX_LUA_CONFIG_FINGERPRINT_XXH64:
+        return ngx_lua_config_xxh64_final(fp);
+
+    default: /* crc32 and crc32c */
+        return (uint32_t) fp->v[0] ^ 0xffffffff;
+    }
+}
+
+
+u_char *
+ngx_lua_config_fingerprint_format(u_char *buf, ngx_uint_t algorithm,
+    uint64_t value)
+{
+    switch (algorithm) {
+
+    case NGX_LUA_CONFIG_FINGERPRINT_CRC32:
+        return ngx_sprintf(buf, "crc32:%08xD", (uint32_t) value);
+
+    case NGX_LUA_CONFIG_FINGERPRINT_CRC32C:
+        return ngx_sprintf(buf, "crc32c:%08xD", (uint32_t) value);
+
+    default: /* NGX_LUA_CONFIG_FINGERPRINT_XXH64 */
+        return ngx_sprintf(buf, "xxh64:%016xL", value);
+    }
+}
+
+
+static ngx_inline uint64_t
+ngx_lua_config_read64(u_char *p)
+{
+    return (uint64_t) p[0]
+           | ((uint64_t) p[1] << 8)
+           | ((uint64_t) p[2] << 16)
+           | ((uint64_t) p[3] << 24)
+           | ((uint64_t) p[4] << 32)
+           | ((uint64_t) p[5] << 40)
+           | ((uint64_t) p[6] << 48)
+           | ((uint64_t) p[7] << 56);
+}
+
+
+static ngx_inline uint64_t
+ngx_lua_config_xxh64_round(uint64_t acc, uint64_t input)
+{
+    acc += input * NGX_LUA_CONFIG_XXH64_PRIME2;
+    acc = ngx_lua_config_rotl64(acc, 31);
+
+    return acc * NGX_LUA_CONFIG_XXH64_PRIME1;
+}
+
+
+static ngx_inline uint64_t
+ngx_lua_config_xxh64_merge(uint64_t acc, uint64_t val)
+{
+    acc ^= ngx_lua_config_xxh64_round(0, val);
+
+    return acc * NGX_LUA_CONFIG_XXH64_PRIME1 + NGX_LUA_CONFIG_XXH64_PRIME4;
+}
+
+
+static ngx_inline void
+ngx_lua_config_xxh64_stripe(ngx_lua_config_fingerprint_t *fp, u_char *p)
+{
+    fp->v[0] = ngx_lua_config_xxh64_round(fp->v[0], ngx_lua_config_read64(p));
+    fp->v[1] = ngx_lua_config_xxh64_round(fp->v[1],
+                                          ngx_lua_config_read64(p + 8));
+    fp->v[2] = ngx_lua_config_xxh64_round(fp->v[2],
+                                          ngx_lua_config_read64(p + 16));
+    fp->v[3] = ngx_lua_config_xxh64_round(fp->v[3],
+                                          ngx_lua_config_read64(p + 24));
+}
+
+
+static void
+ngx_lua_config_xxh64_update(ngx_lua_config_fingerprint_t *fp, u_char *p,
+    size_t len)
+{
+    size_t  n;
+
+    if (fp->buffered) {
+        n = ngx_min(len, 32 - fp->buffered);
+
+        ngx_memcpy(fp->buf + fp->buffered, p, n);
+        fp->buffered += n;
+        p += n;
+        len -= n;
+
+        if (fp->buffered < 32) {
+            return;
+        }
+
+        ngx_lua_config_xxh64_stripe(fp, fp->buf);
+        fp->buffered = 0;
+    }
+
+    while (len >= 32) {
+        ngx_lua_config_xxh64_stripe(fp, p);
+        p += 32;
+        len -= 32;
+    }
+
+    if (len) {
+        ngx_memcpy(fp->buf, p, len);
+        fp->buffered = len;
+    }
+}
+
+
+static uint64_t
+ngx_lua_config_xxh64_final(ngx_lua_config_fingerprint_t *fp)
+{
+    u_char    *p, *last;
+    uint32_t   k;
+    uint64_t   h;
+
+    if (fp->total >= 32) {
+        h = ngx_lua_config_rotl64(fp->v[0], 1)
+            + ngx_lua_config_rotl64(fp->v[1], 7)
+            + ngx_lua_config_rotl64(fp->v[2], 12)
+            + ngx_lua_config_rotl64(fp->v[3], 18);
+
+        h = ngx_lua_config_xxh64_merge(h, fp->v[0]);
+        h = ngx_lua_config_xxh64_merge(h, fp->v[1]);
+        h = ngx_lua_config_xxh64_merge(h, fp->v[2]);
+        h = ngx_lua_config_xxh64_merge(h, fp->v[3]);
+
+    } else {
+        h = NGX_LUA_CONFIG_XXH64_PRIME5;
+    }
+
+    h += fp->total;
+
+    p = fp->buf;
+    last = fp->buf + fp->buffered;
+
+    while (p + 8 <= last) {
+        h ^= ngx_lua_config_xxh64_round(0, ngx_lua_config_read64(p));
+        h = ngx_lua_config_rotl64(h, 27) * NGX_LUA_CONFIG_XXH64_PRIME1
+            + NGX_LUA_CONFIG_XXH64_PRIME4;
+        p += 8;
+    }
+
+    if (p + 4 <= last) {
+        k = (uint32_t) p[0]
+            | ((uint32_t) p[1] << 8)
+            | ((uint32_t) p[2] << 16)
+            | ((uint32_t) p[3] << 24);
+
+        h ^= (uint64_t) k * NGX_LUA_CONFIG_XXH64_PRIME1;
+        h = ngx_lua_config_rotl64(h, 23) * NGX_LUA_CONFIG_XXH64_PRIME2
+            + NGX_LUA_CONFIG_XXH64_PRIME3;
+        p += 4;
+    }
+
+    while (p < last) {
+        h ^= (uint64_t) *p++ * NGX_LUA_CONFIG_XXH64_PRIME5;
+        h = ngx_lua_config_rotl64(h, 11) * NGX_LUA_CONFIG_XXH64_PRIME1;
+    }
+
+    h ^= h >> 33;
+    h *= NGX_LUA_CONFIG_XXH64_PRIME2;
+    h ^= h >> 29;
+    h *= NGX_LUA_CONFIG_XXH64_PRIME3;
+    h ^= h >> 32;
+
+    return h;
+}
@@ -0,0 +1,51 @@
+
+/*
+ * Copyright (C) Hanada
+ */
+
+
+#ifndef _NGX_LUA_CONFIG_FINGERPRINT_H_INCLUDED_
+#define _NGX_LUA_CONFIG_FINGERPRINT_H_INCLUDED_
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+
+#define NGX_LUA_CONFIG_FINGERPRINT_CRC32    0
+#define NGX_LUA_CONFIG_FINGERPRINT_CRC32C   1
+#define NGX_LUA_CONFIG_FINGERPRINT_XXH64    2
+
+/* "crc32c:" followed by up to 16 hex digits */
+#define NGX_LUA_CONFIG_FINGERPRINT_LEN      (sizeof("crc32c:") - 1 + 16)
+
+
+typedef struct {
+    ngx_uint_t                  algorithm;
+    uint64_t                    total;
+    uint64_t                    v[4];      /* xxh64 lanes, crc in v[0] */
+    u_char                      buf[32];
+    size_t                      buffered;
+} ngx_lua_config_fingerprint_t;
+
+
+extern ngx_conf_enum_t  ngx_lua_config_fingerprint_algorithms[];
+
+
+void ngx_lua_config_fingerprint_init_engine(void);
+
+void ngx_lua_config_fingerprint_init(ngx_lua_config_fingerprint_t *fp,
+    ngx_uint_t algorithm);
+void ngx_lua_config_fingerprint_update(ngx_lua_config_fingerprint_t *fp,
+    u_char *data, size_t len);
+void ngx_lua_config_fingerprint_uint(ngx_lua_config_fingerprint_t *fp,
+    uint64_t n);
+void ngx_lua_config_fingerprint_str(ngx_lua_config_fingerprint_t *fp,
+    ngx_str_t *s);
+uint64_t ngx_lua_config_fingerprint_final(ngx_lua_config_fingerprint_t *fp);
+
+u_char *ngx_lua_config_fingerprint_format(u_char *buf, ngx_uint_t algorithm,
+    uint64_t value);
+
+
+#endif /* _NGX_LUA_CONFIG_FINGERPRINT_H_INCLUDED_ */
@@ -0,0 +1,1515 @@
+
+/*
+ * Copyright (C) Hanada
+ */
+
+
+#ifndef DDEBUG
+#define DDEBUG 0
+#endif
+#include "ddebug.h"
+
+
+#include <ngx_core.h>
+#include <ngx_stream.h>
+#include <lauxlib.h>
+#include "ngx_stream_lua_api.h"
+#include "ngx_lua_config_common.h"
+
+
+typedef struct {
+    ngx_stream_complex_value_t   *value;      /* complex value */
+    ngx_stream_complex_value_t   *filter;     /* filter complex value */
+    ngx_uint_t                    negative;   /* negative filter */
+    ngx_uint_t                    index;      /* interned slot, 0 if dynamic */
+} ngx_stream_lua_config_cmd_t;
+
+
+typedef ngx_lua_config_keyval_t  ngx_stream_lua_config_keyval_t;
+
+
+typedef struct {
+    ngx_str_t                     name;
+    ngx_array_t                  *servers;  /* array of
+                                               ngx_lua_config_server_t */
+    ngx_array_t                  *keys;     /* array of
+                                               ngx_stream_lua_config_keyval_t */
+    ngx_hash_t                    hash;     /* keys by name */
+
+    uint32_t                      crc_servers; /* running crc32 of name and
+                                                  servers, not finalized */
+    uint32_t                      crc;      /* final crc32 unless dynamic */
+    ngx_uint_t                    dynamic;  /* keys depend on the session */
+
+    ngx_lua_config_fingerprint_t  fp_servers; /* running fingerprint of
+                                                 name and servers */
+    uint64_t                      fingerprint; /* final value unless dynamic */
+} ngx_stream_lua_upstream_t;
+
+
+typedef struct {
+    ngx_array_t                  *keys;     /* array of ngx_keyval_t */
+    ngx_lua_config_init_node_t   *init_tree;
+    ngx_uint_t                    fingerprint_algorithm;
+    ngx_lua_config_values_t       values;
+
+    /* stream level server configuration, for the "main" scope */
+    void                         *srv_conf;
+} ngx_stream_lua_config_main_conf_t;
+
+
+typedef struct {
+    ngx_array_t                  *keys;     /* array of
+                                               ngx_stream_lua_config_keyval_t */
+    ngx_hash_t                    hash;
+
+    ngx_lua_config_fingerprint_t  fp_static; /* running fingerprint of
+                                                static keys */
+    ngx_str_t                     fingerprint; /* formatted, unless dynamic */
+    ngx_array_t                  *dynamic;  /* array of
+                                               ngx_stream_lua_config_keyval_t *
+                                               that depend on the session */
+
+    ngx_array_t                  *upstreams; /* array of
+                                                ngx_stream_lua_upstream_t */
+    ngx_hash_t                    upstreams_hash;
+} ngx_stream_lua_config_srv_conf_t;
+
+
+typedef struct {
+    ngx_stream_lua_config_srv_conf_t  *fingerprint_conf;
+    ngx_str_t                     fingerprint;
+    u_char                 fingerprint_buf[NGX_LUA_CONFIG_FINGERPRINT_LEN];
+} ngx_stream_lua_config_ctx_t;
+
+
+#define NGX_STREAM_LUA_CONFIG_SCOPE_MAIN      0
+#define NGX_STREAM_LUA_CONFIG_SCOPE_SRV       1
+
+
+static char *ngx_stream_lua_config_directive(ngx_conf_t *cf,
+    ngx_command_t *cmd, void *conf);
+static char *ngx_stream_lua_init_config_directive(ngx_conf_t *cf,
+    ngx_command_t *cmd, void *conf);
+static ngx_int_t ngx_stream_lua_config_parse_filter(ngx_conf_t *cf,
+    ngx_stream_lua_config_cmd_t *lcmd, ngx_str_t *arg);
+static ngx_stream_complex_value_t *ngx_stream_lua_config_intern_value(
+    ngx_conf_t *cf, ngx_str_t *value, ngx_uint_t *index);
+static char *ngx_stream_lua_upstream_block(ngx_conf_t *cf,
+    ngx_command_t *cmd, void *conf);
+static char *ngx_stream_lua_upstream(ngx_conf_t *cf, ngx_command_t *dummy,
+    void *conf);
+static ngx_int_t ngx_stream_lua_config_init_hash(ngx_conf_t *cf,
+    ngx_array_t *elts, size_t size, ngx_hash_t *hash, char *name);
+
+static void *ngx_stream_lua_config_create_main_conf(ngx_conf_t *cf);
+static char *ngx_stream_lua_config_init_main_conf(ngx_conf_t *cf, void *conf);
+static void *ngx_stream_lua_config_create_srv_conf(ngx_conf_t *cf);
+static char *ngx_stream_lua_config_merge_srv_conf(ngx_conf_t *cf,
+    void *parent, void *child);
+static ngx_int_t ngx_stream_lua_config_init_srv_conf(ngx_conf_t *cf,
+    ngx_stream_lua_config_srv_conf_t *lscf, ngx_uint_t algorithm);
+static void ngx_stream_lua_upstream_init_crc32(ngx_stream_lua_upstream_t *us,
+    ngx_uint_t algorithm);
+static ngx_int_t ngx_stream_lua_config_init(ngx_conf_t *cf);
+
+static ngx_int_t ngx_stream_lua_config_eval_cmds(ngx_stream_session_t *s,
+    ngx_array_t *cmds, ngx_str_t *value, ngx_stream_lua_config_cmd_t **matched);
+static void *ngx_stream_lua_config_compile(ngx_conf_t *cf, ngx_str_t *value,
+    ngx_uint_t *dynamic);
+static ngx_int_t ngx_stream_lua_config_cmd_filter(void *data, void *cmd);
+static ngx_int_t ngx_stream_lua_config_cmd_value(void *data, void *cmd,
+    ngx_str_t *value);
+static ngx_uint_t ngx_stream_lua_config_cmd_final(void *cmd);
+static void ngx_stream_lua_config_cmd_unfilter(void *cmd);
+static ngx_int_t ngx_stream_lua_config_fingerprint(ngx_stream_session_t *s,
+    ngx_stream_lua_config_srv_conf_t *lscf, ngx_str_t *value);
+static ngx_int_t ngx_stream_lua_upstream_crc32(ngx_stream_session_t *s,
+    ngx_stream_lua_upstream_t *us, uint32_t *crc);
+
+static ngx_stream_session_t *ngx_stream_lua_config_get_session(lua_State *L);
+static ngx_stream_lua_config_srv_conf_t *ngx_stream_lua_config_scope_conf(
+    lua_State *L, int idx, ngx_stream_session_t *s);
+static ngx_stream_lua_upstream_t *ngx_stream_lua_config_find_upstream(
+    ngx_stream_lua_config_srv_conf_t *lscf, u_char *name, size_t len);
+static int ngx_stream_lua_config_push_upstream(lua_State *L,
+    ngx_stream_session_t *s, ngx_stream_lua_upstream_t *us);
+
+static int ngx_stream_lua_config_create_module(lua_State *L);
+static int ngx_stream_lua_config_get_config(lua_State *L);
+static int ngx_stream_lua_config_get_fingerprint(lua_State *L);
+static int ngx_stream_lua_config_get_upstream(lua_State *L);
+static int ngx_stream_lua_config_get_upstream_crc(lua_State *L);
+static int ngx_stream_lua_config_get_upstream_if_changed(lua_State *L);
+static int ngx_stream_lua_config_get_upstream_key(lua_State *L);
+static int ngx_stream_lua_config_get_upstream_servers(lua_State *L);
+static int ngx_stream_lua_get_init_configs(lua_State *L);
+static int ngx_stream_lua_get_init_config(lua_State *L);
+
+
+static ngx_lua_config_chain_t  ngx_stream_lua_config_chain = {
+    sizeof(ngx_stream_lua_config_cmd_t),
+    ngx_stream_lua_config_compile,
+    ngx_stream_lua_config_cmd_filter,
+    ngx_stream_lua_config_cmd_value,
+    ngx_stream_lua_config_cmd_final,
+    ngx_stream_lua_config_cmd_unfilter,
+    NULL
+};
+
+
+static ngx_command_t  ngx_stream_lua_config_commands[] = {
+
+    { ngx_string("lua_config"),
+      NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_2MORE,
+      ngx_stream_lua_config_directive,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("lua_upstream"),
+      NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_BLOCK|NGX_CONF_TAKE1,
+      ngx_stream_lua_upstream_block,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("lua_init_config"),
+      NGX_STREAM_MAIN_CONF|NGX_CONF_2MORE,
+      ngx_stream_lua_init_config_directive,
+      NGX_STREAM_MAIN_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("lua_config_fingerprint_algorithm"),
+      NGX_STREAM_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_enum_slot,
+      NGX_STREAM_MAIN_CONF_OFFSET,
+      offsetof(ngx_stream_lua_config_main_conf_t, fingerprint_algorithm),
+      &ngx_lua_config_fingerprint_algorithms },
+
+      ngx_null_command
+};
+
+
+static ngx_stream_module_t  ngx_stream_lua_config_module_ctx = {
+    NULL,                                  /* preconfiguration */
+    ngx_stream_lua_config_init,            /* postconfiguration */
+    ngx_stream_lua_config_create_main_conf, /* create main configuration */
+    ngx_stream_lua_config_init_main_conf,  /* init main configuration */
+    ngx_stream_lua_config_create_srv_conf, /* create server configuration */
+    ngx_stream_lua_config_merge_srv_conf   /* merge server configuration */
+};
+
+
+ngx_module_t  ngx_stream_lua_config_module = {
+    NGX_MODULE_V1,
+    &ngx_stream_lua_config_module_ctx,     /* module context */
+    ngx_stream_lua_config_commands,        /* module directives */
+    NGX_STREAM_MODULE,                     /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    NULL,                                  /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static ngx_int_t
+ngx_stream_lua_config_init(ngx_conf_t *cf)
+{
+    if (ngx_stream_lua_add_package_preload(cf, "ngx.lua_config",
+                                           ngx_stream_lua_config_create_module)
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static char *
+ngx_stream_lua_config_directive(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+    ngx_stream_lua_config_srv_conf_t  *lscf = conf;
+
+    ngx_str_t                    *value, s;
+    ngx_uint_t                    last;
+    ngx_stream_lua_config_cmd_t  *lcmd;
+
+    value = cf->args->elts;
+
+    lcmd = ngx_lua_config_add_cmd(cf, &ngx_stream_lua_config_chain,
+                                  &lscf->keys, &value[1]);
+    if (lcmd == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    last = cf->args->nelts - 1;
+
+    switch (ngx_stream_lua_config_parse_filter(cf, lcmd, &value[last])) {
+
+    case NGX_OK:
+        last--;
+        break;
+
+    case NGX_DECLINED:
+        break;
+
+    default: /* NGX_ERROR */
+        return NGX_CONF_ERROR;
+    }
+
+    switch (ngx_lua_config_join_args(cf, value, 2, last, &s)) {
+
+    case NGX_OK:
+        break;
+
+    case NGX_DECLINED:
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "no value specified for lua_config \"%V\"",
+                           &value[1]);
+        return NGX_CONF_ERROR;
+
+    default: /* NGX_ERROR */
+        return NGX_CONF_ERROR;
+    }
+
+    lcmd->value = ngx_stream_lua_config_intern_value(cf, &s, &lcmd->index);
+    if (lcmd->value == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_stream_lua_init_config_directive(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+    ngx_stream_lua_config_main_conf_t  *lmcf = conf;
+
+    return ngx_lua_config_init_config(cf, &lmcf->keys);
+}
+
+
+static ngx_int_t
+ngx_stream_lua_config_parse_filter(ngx_conf_t *cf,
+    ngx_stream_lua_config_cmd_t *lcmd, ngx_str_t *arg)
+{
+    ngx_str_t   s;
+    ngx_uint_t  regex;
+
+    /* if=value and if!=value */
+
+    if (ngx_lua_config_parse_filter(arg, &lcmd->negative, &regex, &s)
+        != NGX_OK)
+    {
+        return NGX_DECLINED;
+    }
+
+    if (regex) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "regex conditions are not supported "
+                           "in stream: \"%V\"", arg);
+        return NGX_ERROR;
+    }
+
+    lcmd->filter = ngx_stream_lua_config_intern_value(cf, &s, NULL);
+    if (lcmd->filter == NULL) {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_stream_complex_value_t *
+ngx_stream_lua_config_intern_value(ngx_conf_t *cf, ngx_str_t *value,
+    ngx_uint_t *index)
+{
+    ngx_stream_lua_config_main_conf_t  *lmcf;
+
+    lmcf = ngx_stream_conf_get_module_main_conf(cf,
+                                                ngx_stream_lua_config_module);
+
+    return ngx_lua_config_intern_value(cf, &ngx_stream_lua_config_chain,
+                                       &lmcf->values, value, index);
+}
+
+
+static void *
+ngx_stream_lua_config_compile(ngx_conf_t *cf, ngx_str_t *value,
+    ngx_uint_t *dynamic)
+{
+    ngx_stream_complex_value_t          *cv;
+    ngx_stream_compile_complex_value_t   ccv;
+
+    cv = ngx_palloc(cf->pool, sizeof(ngx_stream_complex_value_t));
+    if (cv == NULL) {
+        return NULL;
+    }
+
+    ngx_memzero(&ccv, sizeof(ngx_stream_compile_complex_value_t));
+
+    ccv.cf = cf;
+    ccv.value = value;
+    ccv.complex_value = cv;
+
+    if (ngx_stream_compile_complex_value(&ccv) != NGX_OK) {
+        return NULL;
+    }
+
+    *dynamic = (cv->lengths != NULL);
+
+    return cv;
+}
+
+
+static char *
+ngx_stream_lua_upstream_block(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_stream_lua_config_srv_conf_t  *lscf = conf;
+
+    char                       *rv;
+    ngx_str_t                  *value;
+    ngx_uint_t                  i;
+    ngx_conf_t                  save;
+    ngx_stream_lua_upstream_t  *us;
+
+    value = cf->args->elts;
+
+    if (value[1].len == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "lua_upstream name cannot be empty");
+        return NGX_CONF_ERROR;
+    }
+
+    if (lscf->upstreams == NULL) {
+        lscf->upstreams = ngx_array_create(cf->pool, 4,
+                                           sizeof(ngx_stream_lua_upstream_t));
+        if (lscf->upstreams == NULL) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    /* check for duplicate name in current context */
+    us = lscf->upstreams->elts;
+    for (i = 0; i < lscf->upstreams->nelts; i++) {
+        if (value[1].len == us[i].name.len
+            && ngx_strcmp(value[1].data, us[i].name.data) == 0)
+        {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "duplicate lua_upstream \"%V\"", &value[1]);
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    us = ngx_array_push(lscf->upstreams);
+    if (us == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_memzero(us, sizeof(ngx_stream_lua_upstream_t));
+
+    us->name = value[1];
+
+    us->servers = ngx_array_create(cf->pool, 4,
+                                   sizeof(ngx_lua_config_server_t));
+    if (us->servers == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    us->keys = ngx_array_create(cf->pool, 4,
+                                sizeof(ngx_stream_lua_config_keyval_t));
+    if (us->keys == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    save = *cf;
+    cf->handler = ngx_stream_lua_upstream;
+    cf->handler_conf = (char *) us;
+
+    rv = ngx_conf_parse(cf, NULL);
+
+    *cf = save;
+
+    if (rv != NGX_CONF_OK) {
+        return rv;
+    }
+
+    ngx_lua_config_prune_keys(cf, &ngx_stream_lua_config_chain, us->keys);
+
+    /* keys are kept sorted, the crc32 and the fingerprint rely on it */
+
+    ngx_qsort(us->keys->elts, us->keys->nelts,
+              sizeof(ngx_stream_lua_config_keyval_t), ngx_lua_config_key_cmp);
+
+    if (ngx_stream_lua_config_init_hash(cf, us->keys,
+                                        sizeof(ngx_stream_lua_config_keyval_t),
+                                        &us->hash, "lua_upstream_keys_hash")
+        != NGX_OK)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_stream_lua_upstream(ngx_conf_t *cf, ngx_command_t *dummy, void *conf)
+{
+    ngx_stream_lua_upstream_t  *us = (ngx_stream_lua_upstream_t *) conf;
+
+    ngx_str_t                    *value, s;
+    ngx_uint_t                    last;
+    ngx_stream_lua_config_cmd_t  *lcmd;
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[0].data, "server") == 0) {
+        return ngx_lua_config_parse_server(cf, us->servers, 0);
+    }
+
+    if (cf->args->nelts < 2) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid number of the lua_upstream parameters");
+        return NGX_CONF_ERROR;
+    }
+
+    if (ngx_strcmp(value[0].data, "name") == 0
+        || ngx_strcmp(value[0].data, "crc32") == 0)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid directive name in lua_upstream");
+        return NGX_CONF_ERROR;
+    }
+
+    lcmd = ngx_lua_config_add_cmd(cf, &ngx_stream_lua_config_chain,
+                                  &us->keys, &value[0]);
+    if (lcmd == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    last = cf->args->nelts - 1;
+
+    switch (ngx_stream_lua_config_parse_filter(cf, lcmd, &value[last])) {
+
+    case NGX_OK:
+        last--;
+        break;
+
+    case NGX_DECLINED:
+        break;
+
+    default: /* NGX_ERROR */
+        return NGX_CONF_ERROR;
+    }
+
+    switch (ngx_lua_config_join_args(cf, value, 1, last, &s)) {
+
+    case NGX_OK:
+        break;
+
+    case NGX_DECLINED:
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "no value specified for lua_upstream "
+                           "config key \"%V\"", &value[0]);
+        return NGX_CONF_ERROR;
+
+    default: /* NGX_ERROR */
+        return NGX_CONF_ERROR;
+    }
+
+    lcmd->value = ngx_stream_lua_config_intern_value(cf, &s, &lcmd->index);
+    if (lcmd->value == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static ngx_int_t
+ngx_stream_lua_config_init_hash(ngx_conf_t *cf, ngx_array_t *elts,
+    size_t size, ngx_hash_t *hash, char *name)
+{
+    u_char                  *p;
+    ngx_uint_t               i;
+    ngx_hash_init_t          hinit;
+    ngx_hash_keys_arrays_t   ha;
+
+    /* the elements hashed start with their ngx_str_t name */
+
+    if (elts == NULL || elts->nelts == 0) {
+        return NGX_OK;
+    }
+
+    ngx_memzero(&ha, sizeof(ngx_hash_keys_arrays_t));
+    ha.pool = cf->pool;
+    ha.temp_pool = cf->temp_pool;
+
+    if (ngx_hash_keys_array_init(&ha, NGX_HASH_SMALL) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    p = elts->elts;
+    for (i = 0; i < elts->nelts; i++) {
+        if (ngx_hash_add_key(&ha, (ngx_str_t *) (p + i * size), p + i * size,
+                             0)
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+    }
+
+    hinit.key = ngx_hash_key;
+    hinit.max_size = 512;
+    hinit.bucket_size = ngx_align(64, ngx_cacheline_size);
+    hinit.name = name;
+    hinit.pool = cf->pool;
+    hinit.temp_pool = NULL;
+    hinit.hash = hash;
+
+    return ngx_hash_init(&hinit, ha.keys.elts, ha.keys.nelts);
+}
+
+
+static void *
+ngx_stream_lua_config_create_main_conf(ngx_conf_t *cf)
+{
+    ngx_stream_lua_config_main_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_stream_lua_config_main_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->keys = NULL;
+     *     conf->init_tree = NULL;
+     */
+
+    ngx_lua_config_values_init(&conf->values);
+
+    conf->fingerprint_algorithm = NGX_CONF_UNSET_UINT;
+
+    return conf;
+}
+
+
+static char *
+ngx_stream_lua_config_init_main_conf(ngx_conf_t *cf, void *conf)
+{
+    ngx_stream_lua_config_main_conf_t  *lmcf = conf;
+
+    ngx_stream_lua_config_srv_conf_t  *lscf;
+
+    /*
+     * the stream level is never merged, so it is prepared here once
+     * instead of lazily by the first server that inherits from it
+     */
+
+    lscf = ngx_stream_conf_get_module_srv_conf(cf,
+                                               ngx_stream_lua_config_module);
+    lmcf->srv_conf = lscf;
+
+    ngx_conf_init_uint_value(lmcf->fingerprint_algorithm,
+                             NGX_LUA_CONFIG_FINGERPRINT_XXH64);
+
+    ngx_lua_config_fingerprint_init_engine();
+
+    ngx_lua_config_prune_keys(cf, &ngx_stream_lua_config_chain, lscf->keys);
+
+    if (ngx_stream_lua_config_init_srv_conf(cf, lscf,
+                                            lmcf->fingerprint_algorithm)
+        != NGX_OK)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    if (lmcf->keys == NULL) {
+        return NGX_CONF_OK;
+    }
+
+    lmcf->init_tree = ngx_lua_config_init_tree(cf, lmcf->keys);
+    if (lmcf->init_tree == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static void *
+ngx_stream_lua_config_create_srv_conf(ngx_conf_t *cf)
+{
+    ngx_stream_lua_config_srv_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_stream_lua_config_srv_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->keys = NULL;
+     *     conf->hash = { NULL };
+     *     conf->dynamic = NULL;
+     *     conf->upstreams = NULL;
+     *     conf->upstreams_hash = { NULL };
+     */
+
+    return conf;
+}
+
+
+static char *
+ngx_stream_lua_config_merge_srv_conf(ngx_conf_t *cf, void *parent,
+    void *child)
+{
+    ngx_stream_lua_config_srv_conf_t  *prev = parent;
+    ngx_stream_lua_config_srv_conf_t  *conf = child;
+
+    ngx_uint_t                          i, j;
+    ngx_stream_lua_upstream_t          *src, *dst, *us;
+    ngx_stream_lua_config_main_conf_t  *lmcf;
+
+    /* the stream level is prepared by ngx_stream_lua_config_init_main_conf() */
+
+    if (conf->keys == NULL && conf->upstreams == NULL) {
+        *conf = *prev;
+        return NGX_CONF_OK;
+    }
+
+    /*
+     * inherited upstreams are only added when the server does not define
+     * one with the same name
+     */
+
+    if (conf->keys == NULL) {
+        conf->keys = prev->keys;
+
+    } else if (ngx_lua_config_merge_keys(cf, &ngx_stream_lua_config_chain,
+                                         conf->keys, prev->keys)
+               != NGX_OK)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    if (conf->upstreams && prev->upstreams) {
+        src = prev->upstreams->elts;
+        for (i = 0; i < prev->upstreams->nelts; i++) {
+
+            dst = conf->upstreams->elts;
+            for (j = 0; j < conf->upstreams->nelts; j++) {
+                if (src[i].name.len == dst[j].name.len
+                    && ngx_strcmp(dst[j].name.data, src[i].name.data) == 0)
+                {
+                    break;
+                }
+            }
+
+            if (j < conf->upstreams->nelts) {
+                continue;
+            }
+
+            us = ngx_array_push(conf->upstreams);
+            if (us == NULL) {
+                return NGX_CONF_ERROR;
+            }
+
+            /* inherited upstreams are already prepared */
+
+            *us = src[i];
+            us->name.data = NULL;
+        }
+
+    } else if (conf->upstreams == NULL) {
+        conf->upstreams = prev->upstreams;
+    }
+
+    lmcf = ngx_stream_conf_get_module_main_conf(cf,
+                                                ngx_stream_lua_config_module);
+
+    if (ngx_stream_lua_config_init_srv_conf(cf, conf,
+                                            lmcf->fingerprint_algorithm)
+        != NGX_OK)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static ngx_int_t
+ngx_stream_lua_config_init_srv_conf(ngx_conf_t *cf,
+    ngx_stream_lua_config_srv_conf_t *lscf, ngx_uint_t algorithm)
+{
+    ngx_uint_t                  i;
+    ngx_stream_lua_upstream_t  *us;
+
+    if (ngx_lua_config_init_fingerprint(cf, &ngx_stream_lua_config_chain,
+                                        lscf->keys, algorithm,
+                                        &lscf->fp_static, &lscf->dynamic,
+                                        &lscf->fingerprint)
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    if (ngx_stream_lua_config_init_hash(cf, lscf->keys,
+                                        sizeof(ngx_stream_lua_config_keyval_t),
+                                        &lscf->hash, "lua_config_hash")
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    if (lscf->upstreams == NULL) {
+        return NGX_OK;
+    }
+
+    us = lscf->upstreams->elts;
+    for (i = 0; i < lscf->upstreams->nelts; i++) {
+        if (us[i].name.data == NULL) {
+            /* inherited, the name is restored from the parent */
+            continue;
+        }
+
+        ngx_stream_lua_upstream_init_crc32(&us[i], algorithm);
+    }
+
+    return ngx_stream_lua_config_init_hash(cf, lscf->upstreams,
+                                           sizeof(ngx_stream_lua_upstream_t),
+                                           &lscf->upstreams_hash,
+                                           "lua_upstream_hash");
+}
+
+
+static void
+ngx_stream_lua_upstream_init_crc32(ngx_stream_lua_upstream_t *us,
+    ngx_uint_t algorithm)
+{
+    uint32_t                      crc;
+    ngx_lua_config_fingerprint_t  fp;
+
+    /*
+     * the name and servers never depend on the session, so their part
+     * of the crc32 and of the fingerprint is always precomputed; the
+     * final values are precomputed too when every key resolves statically
+     */
+
+    ngx_lua_config_servers_crc32(&us->name, us->servers, &us->crc_servers);
+    ngx_lua_config_servers_fingerprint(&us->fp_servers, algorithm, &us->name,
+                                       us->servers);
+
+    crc = us->crc_servers;
+    fp = us->fp_servers;
+
+    if (ngx_lua_config_hash_keys(&ngx_stream_lua_config_chain, NULL,
+                                 us->keys, &crc, &fp)
+        != NGX_OK)
+    {
+        us->dynamic = 1;
+        return;
+    }
+
+    ngx_crc32_final(crc);
+
+    us->crc = crc;
+    us->fingerprint = ngx_lua_config_fingerprint_final(&fp);
+    us->dynamic = 0;
+}
+
+
+static ngx_int_t
+ngx_stream_lua_config_eval_cmds(ngx_stream_session_t *s, ngx_array_t *cmds,
+    ngx_str_t *value, ngx_stream_lua_config_cmd_t **matched)
+{
+    void       *cmd;
+    ngx_int_t   rc;
+
+    rc = ngx_lua_config_eval_cmds(&ngx_stream_lua_config_chain, s, cmds,
+                                  value, &cmd);
+
+    if (rc == NGX_OK && matched) {
+        *matched = cmd;
+    }
+
+    return rc;
+}
+
+
+static ngx_int_t
+ngx_stream_lua_config_cmd_filter(void *data, void *cmd)
+{
+    ngx_stream_session_t         *s = data;
+    ngx_stream_lua_config_cmd_t  *lcmd = cmd;
+
+    ngx_str_t  value;
+
+    if (lcmd->filter == NULL) {
+        return NGX_OK;
+    }
+
+    if (lcmd->filter->lengths == NULL) {
+        return ngx_lua_config_condition(&lcmd->filter->value,
+                                        lcmd->negative);
+    }
+
+    if (s == NULL) {
+        return NGX_AGAIN;
+    }
+
+    if (ngx_stream_complex_value(s, lcmd->filter, &value) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    return ngx_lua_config_condition(&value, lcmd->negative);
+}
+
+
+static ngx_int_t
+ngx_stream_lua_config_cmd_value(void *data, void *cmd, ngx_str_t *value)
+{
+    ngx_stream_session_t         *s = data;
+    ngx_stream_lua_config_cmd_t  *lcmd = cmd;
+
+    /* static values point straight at the configuration memory */
+
+    if (lcmd->value->lengths == NULL) {
+        *value = lcmd->value->value;
+        return NGX_OK;
+    }
+
+    if (s == NULL) {
+        return NGX_AGAIN;
+    }
+
+    if (ngx_stream_complex_value(s, lcmd->value, value) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_uint_t
+ngx_stream_lua_config_cmd_final(void *cmd)
+{
+    ngx_stream_lua_config_cmd_t  *lcmd = cmd;
+
+    return (lcmd->filter == NULL);
+}
+
+
+static void
+ngx_stream_lua_config_cmd_unfilter(void *cmd)
+{
+    ngx_stream_lua_config_cmd_t  *lcmd = cmd;
+
+    lcmd->filter = NULL;
+}
+
+
+static ngx_int_t
+ngx_stream_lua_config_fingerprint(ngx_stream_session_t *s,
+    ngx_stream_lua_config_srv_conf_t *lscf, ngx_str_t *value)
+{
+    u_char                        *p;
+    ngx_lua_config_fingerprint_t   fp;
+    ngx_stream_lua_config_ctx_t   *ctx;
+
+    if (lscf->dynamic == NULL) {
+        *value = lscf->fingerprint;
+        return NGX_OK;
+    }
+
+    /* computed once per session for the last scope asked for */
+
+    ctx = ngx_stream_get_module_ctx(s, ngx_stream_lua_config_module);
+
+    if (ctx == NULL) {
+        ctx = ngx_pcalloc(s->connection->pool,
+                          sizeof(ngx_stream_lua_config_ctx_t));
+        if (ctx == NULL) {
+            return NGX_ERROR;
+        }
+
+        ngx_stream_set_ctx(s, ctx, ngx_stream_lua_config_module);
+    }
+
+    if (ctx->fingerprint_conf == lscf) {
+        *value = ctx->fingerprint;
+        return NGX_OK;
+    }
+
+    fp = lscf->fp_static;
+
+    if (ngx_lua_config_hash_dynamic(&ngx_stream_lua_config_chain, s,
+                                    lscf->dynamic, &fp)
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    p = ngx_lua_config_fingerprint_format(ctx->fingerprint_buf, fp.algorithm,
+                                     ngx_lua_config_fingerprint_final(&fp));
+
+    ctx->fingerprint_conf = lscf;
+    ctx->fingerprint.data = ctx->fingerprint_buf;
+    ctx->fingerprint.len = p - ctx->fingerprint_buf;
+
+    *value = ctx->fingerprint;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_stream_lua_upstream_crc32(ngx_stream_session_t *s,
+    ngx_stream_lua_upstream_t *us, uint32_t *crc)
+{
+    if (!us->dynamic) {
+        *crc = us->crc;
+        return NGX_OK;
+    }
+
+    *crc = us->crc_servers;
+
+    if (ngx_lua_config_hash_keys(&ngx_stream_lua_config_chain, s, us->keys,
+                                 crc, NULL)
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    ngx_crc32_final(*crc);
+
+    return NGX_OK;
+}
+
+
+static ngx_stream_session_t *
+ngx_stream_lua_config_get_session(lua_State *L)
+{
+    ngx_stream_lua_request_t  *r;
+
+    r = ngx_stream_lua_get_request(L);
+    if (r == NULL) {
+        return NULL;
+    }
+
+    return r->session;
+}
+
+
+static ngx_stream_lua_config_srv_conf_t *
+ngx_stream_lua_config_scope_conf(lua_State *L, int idx,
+    ngx_stream_session_t *s)
+{
+    u_char                             *p;
+    size_t                              len;
+    ngx_stream_lua_config_main_conf_t  *lmcf;
+
+    /* "server" by default, or "main" for the stream level */
+
+    if (lua_isnoneornil(L, idx)) {
+        return ngx_stream_get_module_srv_conf(s, ngx_stream_lua_config_module);
+    }
+
+    p = (u_char *) luaL_checklstring(L, idx, &len);
+
+    if (len == 6 && ngx_strncmp(p, "server", 6) == 0) {
+        return ngx_stream_get_module_srv_conf(s, ngx_stream_lua_config_module);
+    }
+
+    if (len == 4 && ngx_strncmp(p, "main", 4) == 0) {
+        lmcf = ngx_stream_get_module_main_conf(s,
+                                               ngx_stream_lua_config_module);
+        return lmcf->srv_conf;
+    }
+
+    luaL_argerror(L, idx, "invalid scope");
+
+    return NULL;
+}
+
+
+static ngx_stream_lua_upstream_t *
+ngx_stream_lua_config_find_upstream(ngx_stream_lua_config_srv_conf_t *lscf,
+    u_char *name, size_t len)
+{
+    if (lscf->upstreams == NULL || lscf->upstreams_hash.buckets == NULL) {
+        return NULL;
+    }
+
+    return ngx_hash_find(&lscf->upstreams_hash, ngx_hash_key(name, len),
+                         name, len);
+}
+
+
+static int
+ngx_stream_lua_config_push_upstream(lua_State *L, ngx_stream_session_t *s,
+    ngx_stream_lua_upstream_t *us)
+{
+    u_char                          *p;
+    uint32_t                         crc;
+    uint64_t                         fingerprint;
+    ngx_int_t                        rc;
+    ngx_str_t                        val;
+    ngx_uint_t                       i;
+    ngx_lua_config_fingerprint_t     fp;
+    ngx_stream_lua_config_cmd_t     *cmd;
+    ngx_stream_lua_config_keyval_t  *kv;
+    u_char                           crc_str[8];
+    u_char                           fp_str[NGX_LUA_CONFIG_FINGERPRINT_LEN];
+
+    crc = us->crc_servers;
+    fp = us->fp_servers;
+
+    lua_createtable(L, 0, 4 + us->keys->nelts);
+
+    lua_pushlstring(L, (char *) us->name.data, us->name.len);
+    lua_setfield(L, -2, "name");
+
+    ngx_lua_config_push_servers(L, us->servers);
+    lua_setfield(L, -2, "servers");
+
+    /* keys are sorted alphabetically at configuration time */
+
+    kv = us->keys->elts;
+    for (i = 0; i < us->keys->nelts; i++) {
+        rc = ngx_stream_lua_config_eval_cmds(s, kv[i].cmds, &val, &cmd);
+
+        if (rc == NGX_ERROR) {
+            return luaL_error(L, "failed to evaluate \"%s\"",
+                              kv[i].key.data);
+        }
+
+        if (rc != NGX_OK) {
+            continue;
+        }
+
+        ngx_lua_config_push_value(L, &val, cmd->index);
+
+        if (us->dynamic) {
+            ngx_lua_config_crc32_key(&crc, &kv[i].key, &val);
+            ngx_lua_config_fingerprint_str(&fp, &kv[i].key);
+            ngx_lua_config_fingerprint_str(&fp, &val);
+        }
+
+        lua_setfield(L, -2, (char *) kv[i].key.data);
+    }
+
+    if (us->dynamic) {
+        ngx_crc32_final(crc);
+        fingerprint = ngx_lua_config_fingerprint_final(&fp);
+
+    } else {
+        crc = us->crc;
+        fingerprint = us->fingerprint;
+    }
+
+    ngx_sprintf(crc_str, "%08xD", crc);
+
+    lua_pushlstring(L, (char *) crc_str, sizeof(crc_str));
+    lua_setfield(L, -2, "crc32");
+
+    p = ngx_lua_config_fingerprint_format(fp_str, us->fp_servers.algorithm,
+                                          fingerprint);
+
+    lua_pushlstring(L, (char *) fp_str, p - fp_str);
+    lua_setfield(L, -2, "fingerprint");
+
+    return 1;
+}
+
+
+static int
+ngx_stream_lua_config_get_config(lua_State *L)
+{
+    u_char                            *name;
+    size_t                             len;
+    ngx_int_t                          rc;
+    ngx_str_t                          value;
+    ngx_stream_session_t              *s;
+    ngx_stream_lua_config_cmd_t       *cmd;
+    ngx_stream_lua_config_keyval_t    *kv;
+    ngx_stream_lua_config_srv_conf_t  *lscf;
+
+    if (lua_gettop(L) < 1 || lua_gettop(L) > 2) {
+        return luaL_error(L, "expecting one or two arguments");
+    }
+
+    name = (u_char *) luaL_checklstring(L, 1, &len);
+
+    s = ngx_stream_lua_config_get_session(L);
+    if (s == NULL) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    lscf = ngx_stream_lua_config_scope_conf(L, 2, s);
+
+    if (lscf->hash.buckets == NULL) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    kv = ngx_hash_find(&lscf->hash, ngx_hash_key(name, len), name, len);
+    if (kv == NULL) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    rc = ngx_stream_lua_config_eval_cmds(s, kv->cmds, &value, &cmd);
+
+    if (rc == NGX_ERROR) {
+        return luaL_error(L, "failed to evaluate \"%s\"", kv->key.data);
+    }
+
+    if (rc != NGX_OK) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    ngx_lua_config_push_value(L, &value, cmd->index);
+
+    return 1;
+}
+
+
+static int
+ngx_stream_lua_config_get_fingerprint(lua_State *L)
+{
+    ngx_str_t                          value;
+    ngx_stream_session_t              *s;
+    ngx_stream_lua_config_srv_conf_t  *lscf;
+
+    if (lua_gettop(L) > 1) {
+        return luaL_error(L, "expecting zero or one argument");
+    }
+
+    s = ngx_stream_lua_config_get_session(L);
+    if (s == NULL) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    lscf = ngx_stream_lua_config_scope_conf(L, 1, s);
+
+    if (ngx_stream_lua_config_fingerprint(s, lscf, &value) != NGX_OK) {
+        return luaL_error(L, "failed to compute fingerprint");
+    }
+
+    lua_pushlstring(L, (char *) value.data, value.len);
+
+    return 1;
+}
+
+
+static int
+ngx_stream_lua_config_get_upstream(lua_State *L)
+{
+    u_char                     *name;
+    size_t                      len;
+    ngx_stream_session_t       *s;
+    ngx_stream_lua_upstream_t  *us;
+
+    if (lua_gettop(L) < 1 || lua_gettop(L) > 2) {
+        return luaL_error(L, "expecting one or two arguments");
+    }
+
+    name = (u_char *) luaL_checklstring(L, 1, &len);
+
+    s = ngx_stream_lua_config_get_session(L);
+    if (s == NULL) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    us = ngx_stream_lua_config_find_upstream(
+                             ngx_stream_lua_config_scope_conf(L, 2, s),
+                             name, len);
+    if (us == NULL) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    return ngx_stream_lua_config_push_upstream(L, s, us);
+}
+
+
+static int
+ngx_stream_lua_config_get_upstream_crc(lua_State *L)
+{
+    u_char                     *name;
+    size_t                      len;
+    uint32_t                    crc;
+    ngx_stream_session_t       *s;
+    ngx_stream_lua_upstream_t  *us;
+    u_char                      crc_str[8];
+
+    if (lua_gettop(L) < 1 || lua_gettop(L) > 2) {
+        return luaL_error(L, "expecting one or two arguments");
+    }
+
+    name = (u_char *) luaL_checklstring(L, 1, &len);
+
+    s = ngx_stream_lua_config_get_session(L);
+    if (s == NULL) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    us = ngx_stream_lua_config_find_upstream(
+                             ngx_stream_lua_config_scope_conf(L, 2, s),
+                             name, len);
+    if (us == NULL) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    if (ngx_stream_lua_upstream_crc32(s, us, &crc) != NGX_OK) {
+        return luaL_error(L, "failed to evaluate upstream \"%s\"",
+                          us->name.data);
+    }
+
+    ngx_sprintf(crc_str, "%08xD", crc);
+
+    lua_pushlstring(L, (char *) crc_str, sizeof(crc_str));
+
+    return 1;
+}
+
+
+static int
+ngx_stream_lua_config_get_upstream_if_changed(lua_State *L)
+{
+    u_char                     *name, *prev;
+    size_t                      len, prev_len;
+    uint32_t                    crc;
+    ngx_stream_session_t       *s;
+    ngx_stream_lua_upstream_t  *us;
+    u_char                      crc_str[8];
+
+    if (lua_gettop(L) < 2 || lua_gettop(L) > 3) {
+        return luaL_error(L, "expecting two or three arguments");
+    }
+
+    name = (u_char *) luaL_checklstring(L, 1, &len);
+
+    if (lua_isnil(L, 2)) {
+        prev = NULL;
+        prev_len = 0;
+
+    } else {
+        prev = (u_char *) luaL_checklstring(L, 2, &prev_len);
+    }
+
+    s = ngx_stream_lua_config_get_session(L);
+    if (s == NULL) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "no session found");
+        return 2;
+    }
+
+    us = ngx_stream_lua_config_find_upstream(
+                             ngx_stream_lua_config_scope_conf(L, 3, s),
+                             name, len);
+    if (us == NULL) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "not found");
+        return 2;
+    }
+
+    if (prev != NULL && prev_len == sizeof(crc_str)) {
+        if (ngx_stream_lua_upstream_crc32(s, us, &crc) != NGX_OK) {
+            return luaL_error(L, "failed to evaluate upstream \"%s\"",
+                              us->name.data);
+        }
+
+        ngx_sprintf(crc_str, "%08xD", crc);
+
+        if (ngx_strncmp(crc_str, prev, sizeof(crc_str)) == 0) {
+            lua_pushnil(L);
+            return 1;
+        }
+    }
+
+    return ngx_stream_lua_config_push_upstream(L, s, us);
+}
+
+
+static int
+ngx_stream_lua_config_get_upstream_key(lua_State *L)
+{
+    u_char                          *name, *key;
+    size_t                           len, key_len;
+    ngx_int_t                        rc;
+    ngx_str_t                        val;
+    ngx_stream_session_t            *s;
+    ngx_stream_lua_upstream_t       *us;
+    ngx_stream_lua_config_cmd_t     *cmd;
+    ngx_stream_lua_config_keyval_t  *kv;
+
+    if (lua_gettop(L) < 2 || lua_gettop(L) > 3) {
+        return luaL_error(L, "expecting two or three arguments");
+    }
+
+    name = (u_char *) luaL_checklstring(L, 1, &len);
+    key = (u_char *) luaL_checklstring(L, 2, &key_len);
+
+    s = ngx_stream_lua_config_get_session(L);
+    if (s == NULL) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    us = ngx_stream_lua_config_find_upstream(
+                             ngx_stream_lua_config_scope_conf(L, 3, s),
+                             name, len);
+    if (us == NULL || us->hash.buckets == NULL) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    kv = ngx_hash_find(&us->hash, ngx_hash_key(key, key_len), key, key_len);
+    if (kv == NULL) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    /* only the requested key is evaluated */
+
+    rc = ngx_stream_lua_config_eval_cmds(s, kv->cmds, &val, &cmd);
+
+    if (rc == NGX_ERROR) {
+        return luaL_error(L, "failed to evaluate \"%s\"", kv->key.data);
+    }
+
+    if (rc != NGX_OK) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    ngx_lua_config_push_value(L, &val, cmd->index);
+
+    return 1;
+}
+
+
+static int
+ngx_stream_lua_config_get_upstream_servers(lua_State *L)
+{
+    u_char                     *name;
+    size_t                      len;
+    ngx_stream_session_t       *s;
+    ngx_stream_lua_upstream_t  *us;
+
+    if (lua_gettop(L) < 1 || lua_gettop(L) > 2) {
+        return luaL_error(L, "expecting one or two arguments");
+    }
+
+    name = (u_char *) luaL_checklstring(L, 1, &len);
+
+    s = ngx_stream_lua_config_get_session(L);
+    if (s == NULL) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    us = ngx_stream_lua_config_find_upstream(
+                             ngx_stream_lua_config_scope_conf(L, 2, s),
+                             name, len);
+    if (us == NULL) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    ngx_lua_config_push_servers(L, us->servers);
+
+    return 1;
+}
+
+
+static int
+ngx_stream_lua_get_init_configs(lua_State *L)
+{
+    ngx_stream_lua_config_main_conf_t  *lmcf;
+
+    lmcf = ngx_stream_cycle_get_module_main_conf(ngx_cycle,
+                                                 ngx_stream_lua_config_module);
+
+    return ngx_lua_config_push_init_configs(L, lmcf ? lmcf->keys : NULL);
+}
+
+
+static int
+ngx_stream_lua_get_init_config(lua_State *L)
+{
+    ngx_stream_lua_config_main_conf_t  *lmcf;
+
+    lmcf = ngx_stream_cycle_get_module_main_conf(ngx_cycle,
+                                                 ngx_stream_lua_config_module);
+
+    return ngx_lua_config_push_init_config(L, lmcf ? lmcf->init_tree : NULL);
+}
+
+
+static int
+ngx_stream_lua_config_create_module(lua_State *L)
+{
+    /* ngx.lua_config, the same interface as in http */
+
+    lua_createtable(L, 0, 9);
+
+    /* interned static values, shared by the getters */
+    lua_newtable(L);
+
+    lua_pushvalue(L, -1);
+    lua_pushcclosure(L, ngx_stream_lua_config_get_config, 1);
+    lua_setfield(L, -3, "get");
+
+    lua_pushvalue(L, -1);
+    lua_pushcclosure(L, ngx_stream_lua_config_get_upstream, 1);
+    lua_setfield(L, -3, "get_upstream");
+
+    lua_pushvalue(L, -1);
+    lua_pushcclosure(L, ngx_stream_lua_config_get_upstream_if_changed, 1);
+    lua_setfield(L, -3, "get_upstream_if_changed");
+
+    lua_pushcclosure(L, ngx_stream_lua_config_get_upstream_key, 1);
+    lua_setfield(L, -2, "get_upstream_key");
+
+    lua_pushcfunction(L, ngx_stream_lua_config_get_upstream_servers);
+    lua_setfield(L, -2, "get_upstream_servers");
+
+    lua_pushcfunction(L, ngx_stream_lua_config_get_upstream_crc);
+    lua_setfield(L, -2, "get_upstream_crc");
+
+    lua_pushcfunction(L, ngx_stream_lua_get_init_configs);
+    lua_setfield(L, -2, "get_init_configs");
+
+    lua_pushboolean(L, 0);
+    lua_pushcclosure(L, ngx_stream_lua_get_init_config, 1);
+    lua_setfield(L, -2, "get_init_config");
+
+    lua_pushcfunction(L, ngx_stream_lua_config_get_fingerprint);
+    lua_setfield(L, -2, "fingerprint");
+
+    return 1;
+}